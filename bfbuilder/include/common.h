@@ -33,6 +33,69 @@
 
 #define COMMON_NO_HYPERVISOR bfscast(status_t, 0x8000000000000001)
 #define COMMON_CREATE_VM_FROM_BZIMAGE_FAILED bfscast(status_t, 0x8000000000000002)
+#define COMMON_CLONE_VM_FAILED bfscast(status_t, 0x8000000000000003)
+#define COMMON_SAVE_VM_FAILED bfscast(status_t, 0x8000000000000004)
+#define COMMON_RESTORE_VM_FAILED bfscast(status_t, 0x8000000000000005)
+
+/* -------------------------------------------------------------------------- */
+/* Platform Functions                                                         */
+/* -------------------------------------------------------------------------- */
+
+/**
+ * Allocate Guest RAM
+ *
+ * Allocates a virtually contiguous buffer that will be used as guest RAM.
+ * Unlike platform_alloc_rw, the platform should attempt to back this buffer
+ * with physically contiguous, 2M aligned chunks wherever the guest physical
+ * address of the buffer is 2M aligned, so that the buffer can be donated
+ * using large EPT pages. The memory returned is not zeroed.
+ *
+ * @param len the number of bytes to allocate (must be page aligned)
+ * @param gpa the guest physical address the buffer will be mapped to
+ * @return the virtual address of the buffer, or NULL on failure
+ */
+void *
+platform_alloc_ram(uint64_t len, uint64_t gpa);
+
+/**
+ * Free Guest RAM
+ *
+ * Frees memory that was allocated using platform_alloc_ram
+ *
+ * @param addr the virtual address returned by platform_alloc_ram
+ * @param len the number of bytes that were allocated
+ */
+void
+platform_free_ram(void *addr, uint64_t len);
+
+/**
+ * Copy From User
+ *
+ * Copies memory from the userspace application that issued the current
+ * IOCTL. This is used to load the bzImage and initrd straight into guest
+ * RAM, so that these files are only copied once.
+ *
+ * @param dst the kernel buffer to copy to
+ * @param src the userspace address to copy from
+ * @param num the number of bytes to copy
+ * @return SUCCESS on success, FAILURE on failure
+ */
+int64_t
+platform_copy_from_user(void *dst, const void *src, uint64_t num);
+
+/**
+ * Copy To User
+ *
+ * Copies memory to the userspace application that issued the current
+ * IOCTL. This is used to save a VM's memory straight from guest RAM.
+ *
+ * @param dst the userspace address to copy to
+ * @param src the kernel buffer to copy from
+ * @param num the number of bytes to copy
+ * @return SUCCESS on success, FAILURE on failure
+ */
+int64_t
+platform_copy_to_user(void *dst, const void *src, uint64_t num);
 
 /* -------------------------------------------------------------------------- */
 /* Functions                                                                  */
@@ -44,7 +107,8 @@
  * The following function builds a guest VM based on a provided bzImage.
  * To accomplish this, the following function will allocate RAM, load RAM
  * with the contents of the provided file, and then set up the guest's
- * memory map.
+ * memory map. Note that the bzImage and initrd in args are userspace
+ * addresses (see platform_copy_from_user), while cmdl is a kernel address.
  *
  * @param args the create_vm_from_bzimage_args arguments needed to create the VM
  * @return SUCCESS on success, negative error code on failure
@@ -52,6 +116,23 @@
 int64_t
 common_create_vm_from_bzimage(struct create_vm_from_bzimage_args *args);
 
+/**
+ * Clone VM
+ *
+ * Creates a VM that shares all of a template VM's memory copy-on-write,
+ * and whose vCPU starts from the state the template's vCPU was saved in
+ * (see hypercall_vcpu_op__save_template_vcpu). The template must have
+ * been created using common_create_vm_from_bzimage without lazy RAM and
+ * with a single vCPU, and it must never be run again once it has been
+ * saved. A template that is destroyed is not freed until all of its
+ * clones are destroyed.
+ *
+ * @param args the clone_vm_args arguments needed to clone the VM
+ * @return SUCCESS on success, negative error code on failure
+ */
+int64_t
+common_clone_vm(struct clone_vm_args *args);
+
 /**
  * Destroy VM
  *
@@ -64,4 +145,68 @@ common_create_vm_from_bzimage(struct create_vm_from_bzimage_args *args);
 int64_t
 common_destroy(uint64_t domainid);
 
+/**
+ * Save VM
+ *
+ * Saves a VM's memory image to a userspace buffer (see save_vm_args). The
+ * VM must not be running, and it cannot be lazily created or a clone.
+ *
+ * @param args the save_vm_args arguments needed to save the VM
+ * @return SUCCESS on success, negative error code on failure
+ */
+int64_t
+common_save_vm(struct save_vm_args *args);
+
+/**
+ * Restore VM
+ *
+ * Creates a VM from a memory image saved using common_save_vm. The image
+ * is a userspace address (see platform_copy_from_user). The VM's vCPUs
+ * must be restored using common_restore_vcpu before they are run.
+ *
+ * @param args the restore_vm_args arguments needed to restore the VM
+ * @return SUCCESS on success, negative error code on failure
+ */
+int64_t
+common_restore_vm(struct restore_vm_args *args);
+
+/**
+ * Save vCPU
+ *
+ * Saves the state of a killed vCPU that is no longer being run to the
+ * userspace buffers in args.
+ *
+ * @param args the vcpu_snapshot_args arguments needed to save the vCPU
+ * @return SUCCESS on success, negative error code on failure
+ */
+int64_t
+common_save_vcpu(struct vcpu_snapshot_args *args);
+
+/**
+ * Restore vCPU
+ *
+ * Restores the state of a vCPU that has been created but not run yet from
+ * the userspace buffers in args.
+ *
+ * @param args the vcpu_snapshot_args arguments needed to restore the vCPU
+ * @return SUCCESS on success, negative error code on failure
+ */
+int64_t
+common_restore_vcpu(struct vcpu_snapshot_args *args);
+
+/**
+ * Grow Pool
+ *
+ * Donates another chunk of zeroed memory to the pool the hypervisor uses
+ * to populate a lazily created VM's RAM (or to copy a clone's shared pages
+ * into). This should be called whenever a vCPU returns
+ * hypercall_enum_run_op__pool_empty.
+ *
+ * @param domainid the domain whose pool should be grown
+ * @return SUCCESS on success, negative error code on failure (including
+ *     when the domain's RAM has already been fully donated)
+ */
+int64_t
+common_grow_pool(uint64_t domainid);
+
 #endif
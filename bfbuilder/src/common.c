@@ -35,12 +35,21 @@
 #define bfalloc_buffer(a,b) \
     (a *)platform_memset(platform_alloc_rwe(b), 0, b);
 
+#define LARGE_PAGE_2M_SIZE 0x200000ULL
+
+#define POOL_CHUNK_SIZE LARGE_PAGE_2M_SIZE
+
 /* -------------------------------------------------------------------------- */
 /* VM Object                                                                  */
 /* -------------------------------------------------------------------------- */
 
 #define MAX_VMS 0x1000
 
+struct pool_chunk {
+    char *addr;
+    struct pool_chunk *next;
+};
+
 struct vm_t {
     uint64_t domainid;
 
@@ -54,6 +63,19 @@ struct vm_t {
     char *addr;
     uint64_t size;
 
+    struct pool_chunk *pool;
+    uint64_t pool_size;
+    uint64_t reserved;
+
+    uint64_t num_vcpus;
+    uint64_t uart;
+    uint64_t pt_uart;
+    uint64_t xsave;
+
+    struct vm_t *tmpl;
+    uint64_t clones;
+    int destroyed;
+
     int used;
 };
 
@@ -180,15 +202,15 @@ donate_page_rw(
 }
 
 static status_t
-donate_page_rwe(
-    struct vm_t *vm, void *gva, uint64_t domain_gpa)
+donate_range(
+    struct vm_t *vm, struct donate_range_entry *range, uint64_t num)
 {
     status_t ret = SUCCESS;
-    uint64_t gpa = (uint64_t)platform_virt_to_phys(gva);
+    uint64_t gpa = (uint64_t)platform_virt_to_phys(range);
 
-    ret = hypercall_domain_op__donate_page_rwe(vm->domainid, gpa, domain_gpa);
+    ret = hypercall_domain_op__donate_range(vm->domainid, gpa, num);
     if (ret != SUCCESS) {
-        BFDEBUG("donate_page: hypercall_domain_op__donate_page_rwe failed\n");
+        BFDEBUG("donate_range: hypercall_domain_op__donate_range failed\n");
         return ret;
     }
 
@@ -197,13 +219,161 @@ donate_page_rwe(
 
 static status_t
 donate_buffer(
-    struct vm_t *vm, void *gva, uint64_t domain_gpa, uint64_t size)
+    struct vm_t *vm, void *gva, uint64_t domain_gpa, uint64_t size, uint64_t attr)
 {
+    /**
+     * Notes:
+     *
+     * Rather than donating the buffer one page at a time (which costs a
+     * VM exit per page), the buffer is described as a list of physically
+     * contiguous runs that is handed to the hypervisor a page at a time.
+     * Each descriptor page holds DONATE_RANGE_MAX_ENTRIES runs, so even a
+     * completely fragmented buffer only needs one VM exit per
+     * DONATE_RANGE_MAX_ENTRIES pages.
+     */
+
     uint64_t i;
+    uint64_t num = 0;
     status_t ret = SUCCESS;
+    struct donate_range_entry *range = 0;
+
+    range = bfalloc_page(struct donate_range_entry);
+    if (range == 0) {
+        BFDEBUG("donate_buffer: failed to alloc range page\n");
+        return FAILURE;
+    }
 
     for (i = 0; i < size; i += BAREFLANK_PAGE_SIZE) {
-        ret = donate_page_rwe(vm, (char *)gva + i, domain_gpa + i);
+        uint64_t gpa = (uint64_t)platform_virt_to_phys((char *)gva + i);
+
+        if (num > 0) {
+            struct donate_range_entry *run = &range[num - 1];
+            uint64_t run_size = run->count * BAREFLANK_PAGE_SIZE;
+
+            if (run->gpa + run_size == gpa) {
+                run->count++;
+                continue;
+            }
+        }
+
+        if (num == DONATE_RANGE_MAX_ENTRIES) {
+            ret = donate_range(vm, range, num);
+            if (ret != SUCCESS) {
+                goto done;
+            }
+
+            num = 0;
+        }
+
+        range[num].gpa = gpa;
+        range[num].foreign_gpa = domain_gpa + i;
+        range[num].count = 1;
+        range[num].attr = attr;
+
+        num++;
+    }
+
+    if (num > 0) {
+        ret = donate_range(vm, range, num);
+    }
+
+done:
+
+    platform_free_rw(range, BAREFLANK_PAGE_SIZE);
+    return ret;
+}
+
+static int
+is_large_page(char *gva, uint64_t domain_gpa, uint64_t size, uint64_t remaining)
+{
+    uint64_t i;
+    uint64_t gpa = (uint64_t)platform_virt_to_phys(gva);
+
+    if (remaining < size) {
+        return 0;
+    }
+
+    if ((domain_gpa & (size - 1)) != 0 || (gpa & (size - 1)) != 0) {
+        return 0;
+    }
+
+    if ((uint64_t)platform_virt_to_phys(gva + size - BAREFLANK_PAGE_SIZE) !=
+        gpa + size - BAREFLANK_PAGE_SIZE) {
+        return 0;
+    }
+
+    for (i = BAREFLANK_PAGE_SIZE; i < size; i += BAREFLANK_PAGE_SIZE) {
+        if ((uint64_t)platform_virt_to_phys(gva + i) != gpa + i) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static status_t
+donate_large_page(struct vm_t *vm, void *gva, uint64_t domain_gpa)
+{
+    status_t ret = SUCCESS;
+    uint64_t gpa = (uint64_t)platform_virt_to_phys(gva);
+
+    ret = hypercall_domain_op__donate_page_2m_rwe(vm->domainid, gpa, domain_gpa);
+    if (ret != SUCCESS) {
+        BFDEBUG("donate_large_page: hypercall_domain_op__donate_page_2m_rwe failed\n");
+        return ret;
+    }
+
+    return SUCCESS;
+}
+
+static status_t
+donate_ram(
+    struct vm_t *vm, char *gva, uint64_t domain_gpa, uint64_t size)
+{
+    /**
+     * Notes:
+     *
+     * Guest RAM is donated using the largest page possible. Any part of
+     * the buffer that is both aligned and physically contiguous is donated
+     * as a 2m page, while everything in between is collected and donated
+     * as 4k pages using donate_buffer().
+     *
+     * 1g pages are not used. A driver can only get 2M chunks from the
+     * buddy allocator (the API for larger contiguous allocations is not
+     * exported to modules), and 512 of them almost never happen to line
+     * up into an aligned 1G region.
+     */
+
+    uint64_t i = 0;
+    uint64_t start = 0;
+    status_t ret = SUCCESS;
+
+    while (i < size) {
+        if (!is_large_page(gva + i, domain_gpa + i, LARGE_PAGE_2M_SIZE, size - i)) {
+            i += BAREFLANK_PAGE_SIZE;
+            continue;
+        }
+
+        if (start != i) {
+            ret = donate_buffer(
+                vm, gva + start, domain_gpa + start, i - start, DONATE_RANGE_ATTR_RWE);
+            if (ret != SUCCESS) {
+                return ret;
+            }
+        }
+
+        ret = donate_large_page(vm, gva + i, domain_gpa + i);
+        if (ret != SUCCESS) {
+            return ret;
+        }
+
+        i += LARGE_PAGE_2M_SIZE;
+        start = i;
+    }
+
+    if (start != i) {
+        ret = donate_buffer(
+            vm, gva + start, domain_gpa + start, i - start, DONATE_RANGE_ATTR_RWE);
         if (ret != SUCCESS) {
             return ret;
         }
@@ -212,6 +382,69 @@ donate_buffer(
     return SUCCESS;
 }
 
+/* -------------------------------------------------------------------------- */
+/* Lazy RAM                                                                   */
+/* -------------------------------------------------------------------------- */
+
+static status_t
+grow_pool(struct vm_t *vm)
+{
+    /**
+     * Notes:
+     *
+     * The pool is grown one chunk at a time. The chunk is linked into the
+     * VM before it is donated so that it is always freed by
+     * common_destroy(), even if the donation fails part of the way
+     * through. Pool pages must be zeroed as the hypervisor maps them into
+     * the guest as is.
+     */
+
+    struct pool_chunk *chunk = 0;
+
+    if (vm->pool_size >= vm->reserved) {
+        BFDEBUG("grow_pool: reserved RAM has already been donated\n");
+        return FAILURE;
+    }
+
+    chunk = (struct pool_chunk *)platform_alloc_rw(sizeof(struct pool_chunk));
+    if (chunk == 0) {
+        BFDEBUG("grow_pool: failed to alloc pool chunk\n");
+        return FAILURE;
+    }
+
+    chunk->addr = platform_alloc_ram(POOL_CHUNK_SIZE, 0);
+    if (chunk->addr == 0) {
+        BFDEBUG("grow_pool: failed to alloc pool memory\n");
+        platform_free_rw(chunk, sizeof(struct pool_chunk));
+        return FAILURE;
+    }
+
+    platform_memset(chunk->addr, 0, POOL_CHUNK_SIZE);
+
+    chunk->next = vm->pool;
+    vm->pool = chunk;
+    vm->pool_size += POOL_CHUNK_SIZE;
+
+    return donate_buffer(
+        vm, chunk->addr, 0, POOL_CHUNK_SIZE, DONATE_RANGE_ATTR_POOL);
+}
+
+static status_t
+setup_lazy_ram(
+    struct vm_t *vm, uint64_t domain_gpa, uint64_t size)
+{
+    status_t ret = SUCCESS;
+
+    ret = hypercall_domain_op__reserve_ram(vm->domainid, domain_gpa, size);
+    if (ret != SUCCESS) {
+        BFDEBUG("setup_lazy_ram: hypercall_domain_op__reserve_ram failed\n");
+        return ret;
+    }
+
+    vm->reserved = size;
+    return grow_pool(vm);
+}
+
 /* -------------------------------------------------------------------------- */
 /* UART                                                                       */
 /* -------------------------------------------------------------------------- */
@@ -250,6 +483,27 @@ setup_pt_uart(
     return SUCCESS;
 }
 
+/* -------------------------------------------------------------------------- */
+/* XSAVE                                                                      */
+/* -------------------------------------------------------------------------- */
+
+static status_t
+setup_xsave(
+    struct vm_t *vm, uint64_t policy)
+{
+    status_t ret = SUCCESS;
+
+    if (policy != XSAVE_POLICY_NONE) {
+        ret = hypercall_domain_op__set_xsave_policy(vm->domainid, policy);
+        if (ret != SUCCESS) {
+            BFDEBUG("setup_xsave: hypercall_domain_op__set_xsave_policy failed\n");
+            return ret;
+        }
+    }
+
+    return SUCCESS;
+}
+
 /* -------------------------------------------------------------------------- */
 /* GPA Functions                                                              */
 /* -------------------------------------------------------------------------- */
@@ -355,14 +609,25 @@ setup_kernel(struct vm_t *vm, struct create_vm_from_bzimage_args *args)
      *
      *   This code will unpack the kernel and put it into the proper place in
      *   memory. From there, it will boot the kernel.
+     * - The bzImage and initrd are userspace addresses. The kernel and the
+     *   initrd are copied from userspace straight into guest RAM, and only
+     *   the portions of guest RAM that are not written by these copies are
+     *   zeroed, so that each byte of guest RAM is only written once.
+     * - If args->lazy is set, only the RAM needed to hold the kernel and
+     *   the initrd is allocated up front. The rest of guest RAM is reserved
+     *   with the hypervisor, which populates it from a pool of donated
+     *   pages as the guest touches it (see grow_pool()). The E820 map still
+     *   reports the full amount of RAM.
      */
 
     status_t ret = SUCCESS;
-    const struct setup_header *hdr = (struct setup_header *)(args->bzimage + 0x1f1);
+    struct setup_header hdr;
 
-    const void *kernel = 0;
+    uint64_t ram_size = 0;
     uint64_t kernel_size = 0;
     uint64_t kernel_offset = 0;
+    uint64_t initrd_offset = 0;
+    uint64_t initrd_end = 0;
 
     if (args->bzimage == 0) {
         BFDEBUG("setup_kernel: bzImage is null\n");
@@ -374,35 +639,38 @@ setup_kernel(struct vm_t *vm, struct create_vm_from_bzimage_args *args)
         return FAILURE;
     }
 
+    if (args->bzimage_size < 0x1f1 + HDR_SIZE) {
+        BFDEBUG("setup_kernel: bzImage is too small\n");
+        return FAILURE;
+    }
+
     if (args->bzimage_size + args->initrd_size > args->size) {
         BFDEBUG("setup_kernel: requested RAM is too small\n");
         return FAILURE;
     }
 
-    if (hdr->header != 0x53726448) {
+    ret = platform_copy_from_user(&hdr, args->bzimage + 0x1f1, HDR_SIZE);
+    if (ret != SUCCESS) {
+        BFDEBUG("setup_kernel: failed to copy setup header\n");
+        return ret;
+    }
+
+    if (hdr.header != 0x53726448) {
         BFDEBUG("setup_kernel: bzImage does not contain magic number\n");
         return FAILURE;
     }
 
-    if (hdr->version < 0x020d) {
+    if (hdr.version < 0x020d) {
         BFDEBUG("setup_kernel: unsupported bzImage protocol\n");
         return FAILURE;
     }
 
-    if (hdr->code32_start != 0x100000) {
+    if (hdr.code32_start != 0x100000) {
         BFDEBUG("setup_kernel: unsupported bzImage start location\n");
         return FAILURE;
     }
 
-    vm->size = args->size;
-    vm->addr = bfalloc_buffer(char, vm->size);
-
-    if (vm->addr == 0) {
-        BFDEBUG("setup_kernel: failed to alloc ram\n");
-        return FAILURE;
-    }
-
-    kernel_offset = ((hdr->setup_sects + 1) * 512);
+    kernel_offset = ((hdr.setup_sects + 1) * 512);
 
     if (kernel_offset > args->bzimage_size) {
         BFDEBUG("setup_kernel: corrupt setup_sects\n");
@@ -415,32 +683,61 @@ setup_kernel(struct vm_t *vm, struct create_vm_from_bzimage_args *args)
     // to ensure that no overflows or underflows are possible
     //
 
-    kernel = args->bzimage + kernel_offset;
     kernel_size = args->bzimage_size - kernel_offset;
 
-    ret = platform_memcpy(
-        vm->addr, vm->size, kernel, kernel_size, kernel_size);
-    if (ret != SUCCESS) {
-        return ret;
+    initrd_offset = (kernel_size + 0xFFF) & ~(0xFFFULL);
+    initrd_end = initrd_offset + args->initrd_size;
+
+    ram_size = (args->size + (BAREFLANK_PAGE_SIZE - 1)) & ~(BAREFLANK_PAGE_SIZE - 1);
+
+    if (initrd_end > ram_size) {
+        BFDEBUG("setup_kernel: requested RAM is too small\n");
+        return FAILURE;
     }
 
-    if ((kernel_size & 0xFFF) != 0) {
-        kernel_size += 0x1000;
-        kernel_size &= ~(0xFFF);
+    vm->size = ram_size;
+    if (args->lazy != 0) {
+        vm->size = (initrd_end + (BAREFLANK_PAGE_SIZE - 1)) & ~(BAREFLANK_PAGE_SIZE - 1);
     }
 
-    ret = platform_memcpy(
-        vm->addr + kernel_size, vm->size - kernel_size, args->initrd, args->initrd_size, args->initrd_size);
+    vm->addr = platform_alloc_ram(vm->size, 0x100000);
+    if (vm->addr == 0) {
+        BFDEBUG("setup_kernel: failed to alloc ram\n");
+        return FAILURE;
+    }
+
+    ret = platform_copy_from_user(
+        vm->addr, args->bzimage + kernel_offset, kernel_size);
     if (ret != SUCCESS) {
+        BFDEBUG("setup_kernel: failed to copy kernel\n");
         return ret;
     }
 
-    ret = donate_buffer(vm, vm->addr, 0x100000, vm->size);
+    if (args->initrd != 0 && args->initrd_size != 0) {
+        ret = platform_copy_from_user(
+            vm->addr + initrd_offset, args->initrd, args->initrd_size);
+        if (ret != SUCCESS) {
+            BFDEBUG("setup_kernel: failed to copy initrd\n");
+            return ret;
+        }
+    }
+
+    platform_memset(vm->addr + kernel_size, 0, initrd_offset - kernel_size);
+    platform_memset(vm->addr + initrd_end, 0, vm->size - initrd_end);
+
+    ret = donate_ram(vm, vm->addr, 0x100000, vm->size);
     if (ret != SUCCESS) {
         return ret;
     }
 
-    ret = setup_boot_params(vm, args, hdr);
+    if (ram_size > vm->size) {
+        ret = setup_lazy_ram(vm, 0x100000 + vm->size, ram_size - vm->size);
+        if (ret != SUCCESS) {
+            return ret;
+        }
+    }
+
+    ret = setup_boot_params(vm, args, &hdr);
     if (ret != SUCCESS) {
         return ret;
     }
@@ -451,7 +748,7 @@ setup_kernel(struct vm_t *vm, struct create_vm_from_bzimage_args *args)
     // boundary
     //
 
-    vm->params->hdr.ramdisk_image = (uint32_t)(0x100000 + kernel_size);
+    vm->params->hdr.ramdisk_image = (uint32_t)(0x100000 + initrd_offset);
     vm->params->hdr.ramdisk_size = (uint32_t)(args->initrd_size);
 
     return SUCCESS;
@@ -468,7 +765,8 @@ setup_bios_ram(struct vm_t *vm)
         return FAILURE;
     }
 
-    ret = donate_buffer(vm, vm->bios_ram, BIOS_RAM_ADDR, BIOS_RAM_SIZE);
+    ret = donate_buffer(
+        vm, vm->bios_ram, BIOS_RAM_ADDR, BIOS_RAM_SIZE, DONATE_RANGE_ATTR_RWE);
     if (ret != SUCCESS) {
         return ret;
     }
@@ -476,6 +774,121 @@ setup_bios_ram(struct vm_t *vm)
     return SUCCESS;
 }
 
+/* -------------------------------------------------------------------------- */
+/* MP Table                                                                   */
+/* -------------------------------------------------------------------------- */
+
+/**
+ * Notes:
+ *
+ * The guest does not have ACPI, so its processors are described using an
+ * Intel MultiProcessor Specification (v1.4) table instead. The floating
+ * pointer and the configuration table are both placed in the last KB of
+ * base memory, which is one of the locations Linux scans. Each vCPU is
+ * given the APIC ID that the VMM will assign to it, which is the order in
+ * which the vCPUs are created (with the first being the BSP).
+ */
+
+#pragma pack(push, 1)
+
+struct mp_floating_pointer {
+    char signature[4];
+    uint32_t physptr;
+    uint8_t length;
+    uint8_t specrev;
+    uint8_t checksum;
+    uint8_t feature[5];
+};
+
+struct mp_config_table {
+    char signature[4];
+    uint16_t length;
+    uint8_t specrev;
+    uint8_t checksum;
+    char oem[8];
+    char productid[12];
+    uint32_t oemptr;
+    uint16_t oemsize;
+    uint16_t count;
+    uint32_t lapic;
+    uint16_t reserved[2];
+};
+
+struct mp_processor_entry {
+    uint8_t type;
+    uint8_t apicid;
+    uint8_t apicver;
+    uint8_t cpuflag;
+    uint32_t cpufeature;
+    uint32_t featureflag;
+    uint32_t reserved[2];
+};
+
+#pragma pack(pop)
+
+#define MP_TABLE_MAX_VCPUS \
+    ((MP_TABLE_SIZE - sizeof(struct mp_floating_pointer) - sizeof(struct mp_config_table)) / \
+     sizeof(struct mp_processor_entry))
+
+static uint8_t
+mp_checksum(const void *ptr, uint64_t len)
+{
+    uint64_t i;
+    uint8_t sum = 0;
+
+    for (i = 0; i < len; i++) {
+        sum += ((const uint8_t *)ptr)[i];
+    }
+
+    return (uint8_t)(0x100 - sum);
+}
+
+static status_t
+setup_mp_table(struct vm_t *vm, uint64_t num_vcpus)
+{
+    uint64_t i;
+    char *table = (char *)vm->bios_ram + MP_TABLE_GPA;
+
+    struct mp_floating_pointer *mpf = (struct mp_floating_pointer *)table;
+    struct mp_config_table *mpc = (struct mp_config_table *)(mpf + 1);
+    struct mp_processor_entry *cpu = (struct mp_processor_entry *)(mpc + 1);
+
+    if (num_vcpus == 0) {
+        num_vcpus = 1;
+    }
+
+    if (num_vcpus > MP_TABLE_MAX_VCPUS) {
+        BFDEBUG("setup_mp_table: too many vcpus\n");
+        return FAILURE;
+    }
+
+    for (i = 0; i < num_vcpus; i++) {
+        cpu[i].type = 0;
+        cpu[i].apicid = (uint8_t)i;
+        cpu[i].apicver = 0x14;
+        cpu[i].cpuflag = i == 0 ? 0x3 : 0x1;
+    }
+
+    platform_memcpy(mpc->signature, 4, "PCMP", 4, 4);
+    platform_memcpy(mpc->oem, 8, "BOXY    ", 8, 8);
+    platform_memcpy(mpc->productid, 12, "BOXY        ", 12, 12);
+
+    mpc->length = (uint16_t)(sizeof(*mpc) + (num_vcpus * sizeof(*cpu)));
+    mpc->specrev = 4;
+    mpc->count = (uint16_t)num_vcpus;
+    mpc->lapic = 0xFEE00000;
+    mpc->checksum = mp_checksum(mpc, mpc->length);
+
+    platform_memcpy(mpf->signature, 4, "_MP_", 4, 4);
+
+    mpf->physptr = (uint32_t)(MP_TABLE_GPA + sizeof(*mpf));
+    mpf->length = 1;
+    mpf->specrev = 4;
+    mpf->checksum = mp_checksum(mpf, sizeof(*mpf));
+
+    return SUCCESS;
+}
+
 /* -------------------------------------------------------------------------- */
 /* Initial Register State                                                     */
 /* -------------------------------------------------------------------------- */
@@ -530,58 +943,72 @@ setup_32bit_register_state(struct vm_t *vm)
      */
 
     status_t ret = SUCCESS;
+    struct domain_initial_state *state = 0;
 
-    ret |= hypercall_domain_op__set_rip(vm->domainid, 0x100000);
-    ret |= hypercall_domain_op__set_rsi(vm->domainid, BOOT_PARAMS_PAGE_GPA);
+    state = bfalloc_page(struct domain_initial_state);
+    if (state == 0) {
+        BFDEBUG("setup_32bit_register_state: failed to alloc state page\n");
+        return FAILURE;
+    }
+
+    state->version = DOMAIN_INITIAL_STATE_VERSION;
+
+    state->rip = 0x100000;
+    state->rsi = BOOT_PARAMS_PAGE_GPA;
 
-    ret |= hypercall_domain_op__set_gdt_base(vm->domainid, INITIAL_GDT_GPA);
-    ret |= hypercall_domain_op__set_gdt_limit(vm->domainid, 32);
+    state->gdt_base = INITIAL_GDT_GPA;
+    state->gdt_limit = 32;
 
-    ret |= hypercall_domain_op__set_cr0(vm->domainid, 0x10037);
-    ret |= hypercall_domain_op__set_cr3(vm->domainid, 0x0);
-    ret |= hypercall_domain_op__set_cr4(vm->domainid, 0x02000);
+    state->cr0 = 0x10037;
+    state->cr3 = 0x0;
+    state->cr4 = 0x02000;
 
-    ret |= hypercall_domain_op__set_es_selector(vm->domainid, 0x18);
-    ret |= hypercall_domain_op__set_es_base(vm->domainid, 0x0);
-    ret |= hypercall_domain_op__set_es_limit(vm->domainid, 0xFFFFFFFF);
-    ret |= hypercall_domain_op__set_es_access_rights(vm->domainid, 0xc093);
+    state->es_selector = 0x18;
+    state->es_base = 0x0;
+    state->es_limit = 0xFFFFFFFF;
+    state->es_access_rights = 0xc093;
 
-    ret |= hypercall_domain_op__set_cs_selector(vm->domainid, 0x10);
-    ret |= hypercall_domain_op__set_cs_base(vm->domainid, 0x0);
-    ret |= hypercall_domain_op__set_cs_limit(vm->domainid, 0xFFFFFFFF);
-    ret |= hypercall_domain_op__set_cs_access_rights(vm->domainid, 0xc09b);
+    state->cs_selector = 0x10;
+    state->cs_base = 0x0;
+    state->cs_limit = 0xFFFFFFFF;
+    state->cs_access_rights = 0xc09b;
 
-    ret |= hypercall_domain_op__set_ss_selector(vm->domainid, 0x18);
-    ret |= hypercall_domain_op__set_ss_base(vm->domainid, 0x0);
-    ret |= hypercall_domain_op__set_ss_limit(vm->domainid, 0xFFFFFFFF);
-    ret |= hypercall_domain_op__set_ss_access_rights(vm->domainid, 0xc093);
+    state->ss_selector = 0x18;
+    state->ss_base = 0x0;
+    state->ss_limit = 0xFFFFFFFF;
+    state->ss_access_rights = 0xc093;
 
-    ret |= hypercall_domain_op__set_ds_selector(vm->domainid, 0x18);
-    ret |= hypercall_domain_op__set_ds_base(vm->domainid, 0x0);
-    ret |= hypercall_domain_op__set_ds_limit(vm->domainid, 0xFFFFFFFF);
-    ret |= hypercall_domain_op__set_ds_access_rights(vm->domainid, 0xc093);
+    state->ds_selector = 0x18;
+    state->ds_base = 0x0;
+    state->ds_limit = 0xFFFFFFFF;
+    state->ds_access_rights = 0xc093;
 
-    ret |= hypercall_domain_op__set_fs_selector(vm->domainid, 0x0);
-    ret |= hypercall_domain_op__set_fs_base(vm->domainid, 0x0);
-    ret |= hypercall_domain_op__set_fs_limit(vm->domainid, 0x0);
-    ret |= hypercall_domain_op__set_fs_access_rights(vm->domainid, 0x10000);
+    state->fs_selector = 0x0;
+    state->fs_base = 0x0;
+    state->fs_limit = 0x0;
+    state->fs_access_rights = 0x10000;
 
-    ret |= hypercall_domain_op__set_gs_selector(vm->domainid, 0x0);
-    ret |= hypercall_domain_op__set_gs_base(vm->domainid, 0x0);
-    ret |= hypercall_domain_op__set_gs_limit(vm->domainid, 0x0);
-    ret |= hypercall_domain_op__set_gs_access_rights(vm->domainid, 0x10000);
+    state->gs_selector = 0x0;
+    state->gs_base = 0x0;
+    state->gs_limit = 0x0;
+    state->gs_access_rights = 0x10000;
 
-    ret |= hypercall_domain_op__set_tr_selector(vm->domainid, 0x0);
-    ret |= hypercall_domain_op__set_tr_base(vm->domainid, 0x0);
-    ret |= hypercall_domain_op__set_tr_limit(vm->domainid, 0x0);
-    ret |= hypercall_domain_op__set_tr_access_rights(vm->domainid, 0x008b);
+    state->tr_selector = 0x0;
+    state->tr_base = 0x0;
+    state->tr_limit = 0x0;
+    state->tr_access_rights = 0x008b;
 
-    ret |= hypercall_domain_op__set_ldtr_selector(vm->domainid, 0x0);
-    ret |= hypercall_domain_op__set_ldtr_base(vm->domainid, 0x0);
-    ret |= hypercall_domain_op__set_ldtr_limit(vm->domainid, 0x0);
-    ret |= hypercall_domain_op__set_ldtr_access_rights(vm->domainid, 0x10000);
+    state->ldtr_selector = 0x0;
+    state->ldtr_base = 0x0;
+    state->ldtr_limit = 0x0;
+    state->ldtr_access_rights = 0x10000;
 
-    ret |= hypercall_domain_op__set_ia32_pat(vm->domainid, 0x0606060606060606);
+    state->ia32_pat = 0x0606060606060606;
+
+    ret = hypercall_domain_op__set_initial_state(
+        vm->domainid, (uint64_t)platform_virt_to_phys(state));
+
+    platform_free_rw(state, BAREFLANK_PAGE_SIZE);
 
     if (ret != SUCCESS) {
         BFDEBUG("setup_entry: setup_32bit_register_state failed\n");
@@ -629,6 +1056,11 @@ common_create_vm_from_bzimage(
         return ret;
     }
 
+    ret = setup_mp_table(vm, args->num_vcpus);
+    if (ret != SUCCESS) {
+        return ret;
+    }
+
     ret = setup_32bit_register_state(vm);
     if (ret != SUCCESS) {
         return ret;
@@ -644,32 +1076,580 @@ common_create_vm_from_bzimage(
         return ret;
     }
 
+    ret = setup_xsave(vm, args->xsave);
+    if (ret != SUCCESS) {
+        return ret;
+    }
+
+    vm->num_vcpus = args->num_vcpus;
+    vm->uart = args->uart;
+    vm->pt_uart = args->pt_uart;
+    vm->xsave = args->xsave;
+
     args->domainid = vm->domainid;
     return SUCCESS;
 }
 
-int64_t
-common_destroy(uint64_t domainid)
+static void
+free_vm(struct vm_t *vm)
 {
-    status_t ret;
-    struct vm_t *vm = get_vm(domainid);
-
-    if (bfack() == 0) {
-        return COMMON_NO_HYPERVISOR;
-    }
-
-    ret = hypercall_domain_op__destroy_domain(vm->domainid);
-    if (ret != SUCCESS) {
-        BFDEBUG("__domain_op__destroy_domain failed\n");
-        return ret;
-    }
-
     platform_free_rw(vm->bios_ram, BIOS_RAM_SIZE);
     platform_free_rw(vm->params, BAREFLANK_PAGE_SIZE);
     platform_free_rw(vm->cmdline, BAREFLANK_PAGE_SIZE);
     platform_free_rw(vm->gdt, BAREFLANK_PAGE_SIZE);
-    platform_free_rw(vm->addr, vm->size);
+    platform_free_ram(vm->addr, vm->size);
+
+    while (vm->pool != 0) {
+        struct pool_chunk *chunk = vm->pool;
+        vm->pool = chunk->next;
+
+        platform_free_ram(chunk->addr, POOL_CHUNK_SIZE);
+        platform_free_rw(chunk, sizeof(struct pool_chunk));
+    }
 
     release_vm(vm);
-    return SUCCESS;
+}
+
+static uint64_t
+vm_image_size(uint64_t size)
+{
+    return BIOS_RAM_SIZE + (3 * BAREFLANK_PAGE_SIZE) + size;
+}
+
+static status_t
+destroy_vm(struct vm_t *vm)
+{
+    status_t ret;
+    struct vm_t *tmpl = 0;
+
+    int free_self = 0;
+    int free_tmpl = 0;
+
+    if (vm->domainid != INVALID_DOMAINID) {
+        ret = hypercall_domain_op__destroy_domain(vm->domainid);
+        if (ret != SUCCESS) {
+            BFDEBUG("__domain_op__destroy_domain failed\n");
+            return ret;
+        }
+    }
+
+    /**
+     * Notes:
+     *
+     * A template's memory is shared with its clones, so it cannot be freed
+     * until the last clone is destroyed. Until then, the template is only
+     * marked as destroyed (so that it cannot be cloned or found again), and
+     * it is freed by whichever of its clones is destroyed last.
+     */
+
+    platform_acquire_mutex();
+
+    tmpl = vm->tmpl;
+    vm->destroyed = 1;
+    vm->domainid = INVALID_DOMAINID;
+
+    free_self = vm->clones == 0;
+
+    if (tmpl != 0) {
+        tmpl->clones--;
+        free_tmpl = tmpl->destroyed != 0 && tmpl->clones == 0;
+    }
+
+    platform_release_mutex();
+
+    if (free_self != 0) {
+        free_vm(vm);
+    }
+
+    if (free_tmpl != 0) {
+        free_vm(tmpl);
+    }
+
+    return SUCCESS;
+}
+
+int64_t
+common_clone_vm(struct clone_vm_args *args)
+{
+    /**
+     * Notes:
+     *
+     * The clone shares all of the template's memory copy-on-write, which
+     * includes the BIOS RAM, the boot params, command line and GDT pages,
+     * and guest RAM. Each page the clone writes to is copied into a page
+     * from the clone's pool, so the pool only ever needs to grow to the
+     * size of the template's memory. A lazy template, or a template that is
+     * itself a clone, has pages the builder did not allocate, so these
+     * cannot be cloned. The pool is grown once up front, which also covers
+     * the pages the VMM copies when the clone's vCPU is restored from the
+     * template's (e.g., the guest's pvclock and event pages).
+     */
+
+    status_t ret;
+    struct vm_t *vm = 0;
+    struct vm_t *tmpl = get_vm(args->template_domainid);
+
+    args->domainid = INVALID_DOMAINID;
+
+    if (bfack() == 0) {
+        return COMMON_NO_HYPERVISOR;
+    }
+
+    platform_acquire_mutex();
+
+    if (tmpl->used == 0 || tmpl->destroyed != 0 ||
+        tmpl->domainid != args->template_domainid) {
+        BFDEBUG("common_clone_vm: template not found\n");
+        platform_release_mutex();
+        return COMMON_CLONE_VM_FAILED;
+    }
+
+    if (tmpl->reserved != 0 || tmpl->tmpl != 0 || tmpl->num_vcpus > 1) {
+        BFDEBUG("common_clone_vm: unsupported template\n");
+        platform_release_mutex();
+        return COMMON_CLONE_VM_FAILED;
+    }
+
+    tmpl->clones++;
+    platform_release_mutex();
+
+    vm = acquire_vm();
+    vm->tmpl = tmpl;
+
+    vm->domainid = hypercall_domain_op__create_domain();
+    if (vm->domainid == INVALID_DOMAINID) {
+        BFDEBUG("__domain_op__create_domain failed\n");
+        ret = COMMON_CLONE_VM_FAILED;
+        goto failed;
+    }
+
+    ret = hypercall_domain_op__clone_domain(vm->domainid, tmpl->domainid);
+    if (ret != SUCCESS) {
+        BFDEBUG("common_clone_vm: hypercall_domain_op__clone_domain failed\n");
+        goto failed;
+    }
+
+    ret = donate_buffer(
+        vm, tmpl->bios_ram, BIOS_RAM_ADDR, BIOS_RAM_SIZE, DONATE_RANGE_ATTR_COW);
+    if (ret != SUCCESS) {
+        goto failed;
+    }
+
+    ret = donate_buffer(
+        vm, tmpl->params, BOOT_PARAMS_PAGE_GPA, BAREFLANK_PAGE_SIZE, DONATE_RANGE_ATTR_COW);
+    if (ret != SUCCESS) {
+        goto failed;
+    }
+
+    ret = donate_buffer(
+        vm, tmpl->cmdline, COMMAND_LINE_PAGE_GPA, BAREFLANK_PAGE_SIZE, DONATE_RANGE_ATTR_COW);
+    if (ret != SUCCESS) {
+        goto failed;
+    }
+
+    ret = donate_buffer(
+        vm, tmpl->gdt, INITIAL_GDT_GPA, BAREFLANK_PAGE_SIZE, DONATE_RANGE_ATTR_COW);
+    if (ret != SUCCESS) {
+        goto failed;
+    }
+
+    ret = donate_buffer(
+        vm, tmpl->addr, 0x100000, tmpl->size, DONATE_RANGE_ATTR_COW);
+    if (ret != SUCCESS) {
+        goto failed;
+    }
+
+    vm->reserved = vm_image_size(tmpl->size);
+
+    ret = grow_pool(vm);
+    if (ret != SUCCESS) {
+        goto failed;
+    }
+
+    ret = setup_uart(vm, tmpl->uart);
+    if (ret != SUCCESS) {
+        goto failed;
+    }
+
+    ret = setup_pt_uart(vm, tmpl->pt_uart);
+    if (ret != SUCCESS) {
+        goto failed;
+    }
+
+    vm->num_vcpus = tmpl->num_vcpus;
+    vm->uart = tmpl->uart;
+    vm->pt_uart = tmpl->pt_uart;
+
+    args->domainid = vm->domainid;
+    return SUCCESS;
+
+failed:
+
+    destroy_vm(vm);
+    return ret;
+}
+
+int64_t
+common_destroy(uint64_t domainid)
+{
+    struct vm_t *vm = get_vm(domainid);
+
+    if (bfack() == 0) {
+        return COMMON_NO_HYPERVISOR;
+    }
+
+    return destroy_vm(vm);
+}
+
+/* -------------------------------------------------------------------------- */
+/* Snapshots                                                                  */
+/* -------------------------------------------------------------------------- */
+
+static status_t
+save_region(char **image, const void *src, uint64_t size)
+{
+    status_t ret = platform_copy_to_user(*image, src, size);
+    if (ret != SUCCESS) {
+        BFDEBUG("save_region: failed to copy to user\n");
+        return ret;
+    }
+
+    *image += size;
+    return SUCCESS;
+}
+
+static status_t
+restore_region(void *dst, const char **image, uint64_t size)
+{
+    status_t ret = platform_copy_from_user(dst, *image, size);
+    if (ret != SUCCESS) {
+        BFDEBUG("restore_region: failed to copy from user\n");
+        return ret;
+    }
+
+    *image += size;
+    return SUCCESS;
+}
+
+int64_t
+common_save_vm(struct save_vm_args *args)
+{
+    /**
+     * Notes:
+     *
+     * The memory image is the BIOS RAM, the boot params, command line and
+     * GDT pages, and guest RAM, in that order, which is everything the
+     * builder donates to a VM. A lazy VM or a clone has pages the builder
+     * did not allocate (i.e., from its pool), so these cannot be saved.
+     * The VM's vCPUs are saved separately using common_save_vcpu.
+     */
+
+    status_t ret;
+    char *image = (char *)args->image;
+    struct vm_t *vm = get_vm(args->domainid);
+
+    if (bfack() == 0) {
+        return COMMON_NO_HYPERVISOR;
+    }
+
+    if (vm->used == 0 || vm->destroyed != 0 || vm->domainid != args->domainid) {
+        BFDEBUG("common_save_vm: vm not found\n");
+        return COMMON_SAVE_VM_FAILED;
+    }
+
+    if (vm->reserved != 0 || vm->tmpl != 0) {
+        BFDEBUG("common_save_vm: unsupported vm\n");
+        return COMMON_SAVE_VM_FAILED;
+    }
+
+    args->size = vm->size;
+    args->num_vcpus = vm->num_vcpus;
+    args->uart = vm->uart;
+    args->pt_uart = vm->pt_uart;
+    args->xsave = vm->xsave;
+
+    if (image == 0) {
+        args->image_size = vm_image_size(vm->size);
+        return SUCCESS;
+    }
+
+    if (args->image_size != vm_image_size(vm->size)) {
+        BFDEBUG("common_save_vm: image size mismatch\n");
+        return COMMON_SAVE_VM_FAILED;
+    }
+
+    ret = save_region(&image, vm->bios_ram, BIOS_RAM_SIZE);
+    if (ret != SUCCESS) {
+        return ret;
+    }
+
+    ret = save_region(&image, vm->params, BAREFLANK_PAGE_SIZE);
+    if (ret != SUCCESS) {
+        return ret;
+    }
+
+    ret = save_region(&image, vm->cmdline, BAREFLANK_PAGE_SIZE);
+    if (ret != SUCCESS) {
+        return ret;
+    }
+
+    ret = save_region(&image, vm->gdt, BAREFLANK_PAGE_SIZE);
+    if (ret != SUCCESS) {
+        return ret;
+    }
+
+    return save_region(&image, vm->addr, vm->size);
+}
+
+int64_t
+common_restore_vm(struct restore_vm_args *args)
+{
+    /**
+     * Notes:
+     *
+     * Each region of the image is copied from userspace into freshly
+     * allocated memory with a single copy, and then donated to the VM
+     * with the same permissions common_create_vm_from_bzimage gives it.
+     * None of this memory is zeroed first as every byte is overwritten by
+     * the image. The initial register state is not set as each vCPU is
+     * restored from its own snapshot.
+     */
+
+    status_t ret;
+    struct vm_t *vm = 0;
+    const char *image = (const char *)args->image;
+    uint64_t size = (args->size + (BAREFLANK_PAGE_SIZE - 1)) & ~(BAREFLANK_PAGE_SIZE - 1);
+
+    args->domainid = INVALID_DOMAINID;
+
+    if (bfack() == 0) {
+        return COMMON_NO_HYPERVISOR;
+    }
+
+    if (image == 0 || size == 0 || args->image_size != vm_image_size(size)) {
+        BFDEBUG("common_restore_vm: invalid image\n");
+        return COMMON_RESTORE_VM_FAILED;
+    }
+
+    vm = acquire_vm();
+
+    vm->domainid = hypercall_domain_op__create_domain();
+    if (vm->domainid == INVALID_DOMAINID) {
+        BFDEBUG("__domain_op__create_domain failed\n");
+        ret = COMMON_RESTORE_VM_FAILED;
+        goto failed;
+    }
+
+    ret = COMMON_RESTORE_VM_FAILED;
+
+    vm->bios_ram = platform_alloc_rwe(BIOS_RAM_SIZE);
+    vm->params = (struct boot_params *)platform_alloc_rwe(BAREFLANK_PAGE_SIZE);
+    vm->cmdline = (char *)platform_alloc_rwe(BAREFLANK_PAGE_SIZE);
+    vm->gdt = (uint64_t *)platform_alloc_rwe(BAREFLANK_PAGE_SIZE);
+
+    if (vm->bios_ram == 0 || vm->params == 0 || vm->cmdline == 0 || vm->gdt == 0) {
+        BFDEBUG("common_restore_vm: failed to alloc vm pages\n");
+        goto failed;
+    }
+
+    vm->addr = platform_alloc_ram(size, 0x100000);
+    if (vm->addr == 0) {
+        BFDEBUG("common_restore_vm: failed to alloc ram\n");
+        goto failed;
+    }
+
+    vm->size = size;
+
+    ret = restore_region(vm->bios_ram, &image, BIOS_RAM_SIZE);
+    if (ret != SUCCESS) {
+        goto failed;
+    }
+
+    ret = restore_region(vm->params, &image, BAREFLANK_PAGE_SIZE);
+    if (ret != SUCCESS) {
+        goto failed;
+    }
+
+    ret = restore_region(vm->cmdline, &image, BAREFLANK_PAGE_SIZE);
+    if (ret != SUCCESS) {
+        goto failed;
+    }
+
+    ret = restore_region(vm->gdt, &image, BAREFLANK_PAGE_SIZE);
+    if (ret != SUCCESS) {
+        goto failed;
+    }
+
+    ret = restore_region(vm->addr, &image, vm->size);
+    if (ret != SUCCESS) {
+        goto failed;
+    }
+
+    ret = donate_buffer(
+        vm, vm->bios_ram, BIOS_RAM_ADDR, BIOS_RAM_SIZE, DONATE_RANGE_ATTR_RWE);
+    if (ret != SUCCESS) {
+        goto failed;
+    }
+
+    ret = donate_page_rw(vm, vm->params, BOOT_PARAMS_PAGE_GPA);
+    if (ret != SUCCESS) {
+        goto failed;
+    }
+
+    ret = donate_page_r(vm, vm->cmdline, COMMAND_LINE_PAGE_GPA);
+    if (ret != SUCCESS) {
+        goto failed;
+    }
+
+    ret = donate_page_r(vm, vm->gdt, INITIAL_GDT_GPA);
+    if (ret != SUCCESS) {
+        goto failed;
+    }
+
+    ret = donate_ram(vm, vm->addr, 0x100000, vm->size);
+    if (ret != SUCCESS) {
+        goto failed;
+    }
+
+    ret = setup_uart(vm, args->uart);
+    if (ret != SUCCESS) {
+        goto failed;
+    }
+
+    ret = setup_pt_uart(vm, args->pt_uart);
+    if (ret != SUCCESS) {
+        goto failed;
+    }
+
+    ret = setup_xsave(vm, args->xsave);
+    if (ret != SUCCESS) {
+        goto failed;
+    }
+
+    vm->num_vcpus = args->num_vcpus;
+    vm->uart = args->uart;
+    vm->pt_uart = args->pt_uart;
+    vm->xsave = args->xsave;
+
+    args->domainid = vm->domainid;
+    return SUCCESS;
+
+failed:
+
+    destroy_vm(vm);
+    return ret;
+}
+
+int64_t
+common_save_vcpu(struct vcpu_snapshot_args *args)
+{
+    status_t ret;
+    struct vcpu_snapshot *snapshot = 0;
+    void *xsave = 0;
+
+    if (bfack() == 0) {
+        return COMMON_NO_HYPERVISOR;
+    }
+
+    snapshot = bfalloc_page(struct vcpu_snapshot);
+    xsave = bfalloc_page(void);
+
+    if (snapshot == 0 || xsave == 0) {
+        BFDEBUG("common_save_vcpu: failed to alloc snapshot pages\n");
+        ret = FAILURE;
+        goto done;
+    }
+
+    ret = hypercall_vcpu_op__save_vcpu(
+        args->vcpuid,
+        (uint64_t)platform_virt_to_phys(snapshot),
+        (uint64_t)platform_virt_to_phys(xsave));
+    if (ret != SUCCESS) {
+        BFDEBUG("common_save_vcpu: hypercall_vcpu_op__save_vcpu failed\n");
+        goto done;
+    }
+
+    ret = platform_copy_to_user(args->snapshot, snapshot, sizeof(struct vcpu_snapshot));
+    if (ret != SUCCESS) {
+        goto done;
+    }
+
+    ret = platform_copy_to_user(args->xsave, xsave, VCPU_SNAPSHOT_XSAVE_SIZE);
+
+done:
+
+    platform_free_rw(snapshot, BAREFLANK_PAGE_SIZE);
+    platform_free_rw(xsave, BAREFLANK_PAGE_SIZE);
+
+    return ret;
+}
+
+int64_t
+common_restore_vcpu(struct vcpu_snapshot_args *args)
+{
+    status_t ret;
+    struct vcpu_snapshot *snapshot = 0;
+    void *xsave = 0;
+
+    if (bfack() == 0) {
+        return COMMON_NO_HYPERVISOR;
+    }
+
+    snapshot = bfalloc_page(struct vcpu_snapshot);
+    xsave = bfalloc_page(void);
+
+    if (snapshot == 0 || xsave == 0) {
+        BFDEBUG("common_restore_vcpu: failed to alloc snapshot pages\n");
+        ret = FAILURE;
+        goto done;
+    }
+
+    ret = platform_copy_from_user(snapshot, args->snapshot, sizeof(struct vcpu_snapshot));
+    if (ret != SUCCESS) {
+        goto done;
+    }
+
+    ret = platform_copy_from_user(xsave, args->xsave, VCPU_SNAPSHOT_XSAVE_SIZE);
+    if (ret != SUCCESS) {
+        goto done;
+    }
+
+    ret = hypercall_vcpu_op__restore_vcpu(
+        args->vcpuid,
+        (uint64_t)platform_virt_to_phys(snapshot),
+        (uint64_t)platform_virt_to_phys(xsave));
+    if (ret != SUCCESS) {
+        BFDEBUG("common_restore_vcpu: hypercall_vcpu_op__restore_vcpu failed\n");
+    }
+
+done:
+
+    platform_free_rw(snapshot, BAREFLANK_PAGE_SIZE);
+    platform_free_rw(xsave, BAREFLANK_PAGE_SIZE);
+
+    return ret;
+}
+
+int64_t
+common_grow_pool(uint64_t domainid)
+{
+    status_t ret;
+    struct vm_t *vm = get_vm(domainid);
+
+    if (bfack() == 0) {
+        return COMMON_NO_HYPERVISOR;
+    }
+
+    platform_acquire_mutex();
+
+    if (vm->used == 0 || vm->destroyed != 0 || vm->domainid != domainid) {
+        BFDEBUG("common_grow_pool: vm not found\n");
+        platform_release_mutex();
+        return FAILURE;
+    }
+
+    ret = grow_pool(vm);
+    platform_release_mutex();
+
+    return ret;
 }
@@ -21,7 +21,13 @@
  */
 
 #include <linux/fs.h>
+#include <linux/list.h>
+#include <linux/wait.h>
+#include <linux/sched.h>
 #include <linux/module.h>
+#include <linux/random.h>
+#include <linux/preempt.h>
+#include <linux/hrtimer.h>
 #include <linux/uaccess.h>
 #include <linux/miscdevice.h>
 
@@ -39,11 +45,22 @@
 
 static int
 dev_open(struct inode *inode, struct file *file)
-{ return 0; }
+{
+    file->private_data = NULL;
+    return 0;
+}
 
 static int
 dev_release(struct inode *inode, struct file *file)
-{ return 0; }
+{
+    uint64_t token = (uint64_t)(uintptr_t)file->private_data;
+
+    if (token != 0) {
+        hypercall_vmcall_op__remove_token(token);
+    }
+
+    return 0;
+}
 
 static long
 ioctl_create_vm_from_bzimage(struct create_vm_from_bzimage_args *args)
@@ -51,8 +68,6 @@ ioctl_create_vm_from_bzimage(struct create_vm_from_bzimage_args *args)
     int64_t ret;
     struct create_vm_from_bzimage_args kern_args;
 
-    void *bzimage = 0;
-    void *initrd = 0;
     void *cmdl = 0;
 
     if (args == 0) {
@@ -66,37 +81,13 @@ ioctl_create_vm_from_bzimage(struct create_vm_from_bzimage_args *args)
         return BF_IOCTL_FAILURE;
     }
 
-    if (kern_args.bzimage != 0 && kern_args.bzimage_size != 0) {
-        bzimage = platform_alloc_rw(kern_args.bzimage_size);
-        if (bzimage == NULL) {
-            BFALERT("IOCTL_CREATE_VM_FROM_BZIMAGE: failed to allocate memory for bzimage\n");
-            goto failed;
-        }
-
-        ret = copy_from_user(bzimage, kern_args.bzimage, kern_args.bzimage_size);
-        if (ret != 0) {
-            BFALERT("IOCTL_CREATE_VM_FROM_BZIMAGE: failed to copy bzimage from userspace\n");
-            goto failed;
-        }
-
-        kern_args.bzimage = bzimage;
-    }
-
-    if (kern_args.initrd != 0 && kern_args.initrd_size != 0) {
-        initrd = platform_alloc_rw(kern_args.initrd_size);
-        if (initrd == NULL) {
-            BFALERT("IOCTL_CREATE_VM_FROM_BZIMAGE: failed to allocate memory for initrd\n");
-            goto failed;
-        }
-
-        ret = copy_from_user(initrd, kern_args.initrd, kern_args.initrd_size);
-        if (ret != 0) {
-            BFALERT("IOCTL_CREATE_VM_FROM_BZIMAGE: failed to copy initrd from userspace\n");
-            goto failed;
-        }
-
-        kern_args.initrd = initrd;
-    }
+    /**
+     * Notes:
+     *
+     * The bzImage and initrd are not copied here. They can be hundreds of
+     * MB, so common_create_vm_from_bzimage() copies them from userspace
+     * straight into guest RAM (see platform_copy_from_user).
+     */
 
     if (kern_args.cmdl != 0 && kern_args.cmdl_size != 0) {
         cmdl = platform_alloc_rw(kern_args.cmdl_size);
@@ -132,8 +123,6 @@ ioctl_create_vm_from_bzimage(struct create_vm_from_bzimage_args *args)
         goto failed;
     }
 
-    platform_free_rw(bzimage, kern_args.bzimage_size);
-    platform_free_rw(initrd, kern_args.initrd_size);
     platform_free_rw(cmdl, kern_args.cmdl_size);
 
     return BF_IOCTL_SUCCESS;
@@ -144,13 +133,136 @@ failed:
     kern_args.initrd = 0;
     kern_args.cmdl = 0;
 
-    platform_free_rw(bzimage, kern_args.bzimage_size);
-    platform_free_rw(initrd, kern_args.initrd_size);
     platform_free_rw(cmdl, kern_args.cmdl_size);
 
     return BF_IOCTL_FAILURE;
 }
 
+static long
+ioctl_clone_vm(struct clone_vm_args *args)
+{
+    int64_t ret;
+    struct clone_vm_args kern_args;
+
+    ret = copy_from_user(&kern_args, args, sizeof(struct clone_vm_args));
+    if (ret != 0) {
+        BFALERT("IOCTL_CLONE_VM: failed to copy args from userspace\n");
+        return BF_IOCTL_FAILURE;
+    }
+
+    ret = common_clone_vm(&kern_args);
+    if (ret != BF_SUCCESS) {
+        BFDEBUG("common_clone_vm failed: %llx\n", ret);
+        return BF_IOCTL_FAILURE;
+    }
+
+    ret = copy_to_user(args, &kern_args, sizeof(struct clone_vm_args));
+    if (ret != 0) {
+        BFALERT("IOCTL_CLONE_VM: failed to copy args to userspace\n");
+        common_destroy(kern_args.domainid);
+        return BF_IOCTL_FAILURE;
+    }
+
+    return BF_IOCTL_SUCCESS;
+}
+
+static long
+ioctl_save_vm(struct save_vm_args *args)
+{
+    int64_t ret;
+    struct save_vm_args kern_args;
+
+    ret = copy_from_user(&kern_args, args, sizeof(struct save_vm_args));
+    if (ret != 0) {
+        BFALERT("IOCTL_SAVE_VM: failed to copy args from userspace\n");
+        return BF_IOCTL_FAILURE;
+    }
+
+    ret = common_save_vm(&kern_args);
+    if (ret != BF_SUCCESS) {
+        BFDEBUG("common_save_vm failed: %llx\n", ret);
+        return BF_IOCTL_FAILURE;
+    }
+
+    ret = copy_to_user(args, &kern_args, sizeof(struct save_vm_args));
+    if (ret != 0) {
+        BFALERT("IOCTL_SAVE_VM: failed to copy args to userspace\n");
+        return BF_IOCTL_FAILURE;
+    }
+
+    return BF_IOCTL_SUCCESS;
+}
+
+static long
+ioctl_restore_vm(struct restore_vm_args *args)
+{
+    int64_t ret;
+    struct restore_vm_args kern_args;
+
+    ret = copy_from_user(&kern_args, args, sizeof(struct restore_vm_args));
+    if (ret != 0) {
+        BFALERT("IOCTL_RESTORE_VM: failed to copy args from userspace\n");
+        return BF_IOCTL_FAILURE;
+    }
+
+    ret = common_restore_vm(&kern_args);
+    if (ret != BF_SUCCESS) {
+        BFDEBUG("common_restore_vm failed: %llx\n", ret);
+        return BF_IOCTL_FAILURE;
+    }
+
+    ret = copy_to_user(args, &kern_args, sizeof(struct restore_vm_args));
+    if (ret != 0) {
+        BFALERT("IOCTL_RESTORE_VM: failed to copy args to userspace\n");
+        common_destroy(kern_args.domainid);
+        return BF_IOCTL_FAILURE;
+    }
+
+    return BF_IOCTL_SUCCESS;
+}
+
+static long
+ioctl_save_vcpu(struct vcpu_snapshot_args *args)
+{
+    int64_t ret;
+    struct vcpu_snapshot_args kern_args;
+
+    ret = copy_from_user(&kern_args, args, sizeof(struct vcpu_snapshot_args));
+    if (ret != 0) {
+        BFALERT("IOCTL_SAVE_VCPU: failed to copy args from userspace\n");
+        return BF_IOCTL_FAILURE;
+    }
+
+    ret = common_save_vcpu(&kern_args);
+    if (ret != BF_SUCCESS) {
+        BFDEBUG("common_save_vcpu failed: %llx\n", ret);
+        return BF_IOCTL_FAILURE;
+    }
+
+    return BF_IOCTL_SUCCESS;
+}
+
+static long
+ioctl_restore_vcpu(struct vcpu_snapshot_args *args)
+{
+    int64_t ret;
+    struct vcpu_snapshot_args kern_args;
+
+    ret = copy_from_user(&kern_args, args, sizeof(struct vcpu_snapshot_args));
+    if (ret != 0) {
+        BFALERT("IOCTL_RESTORE_VCPU: failed to copy args from userspace\n");
+        return BF_IOCTL_FAILURE;
+    }
+
+    ret = common_restore_vcpu(&kern_args);
+    if (ret != BF_SUCCESS) {
+        BFDEBUG("common_restore_vcpu failed: %llx\n", ret);
+        return BF_IOCTL_FAILURE;
+    }
+
+    return BF_IOCTL_SUCCESS;
+}
+
 static long
 ioctl_destroy(domainid_t *args)
 {
@@ -172,6 +284,276 @@ ioctl_destroy(domainid_t *args)
     return BF_IOCTL_SUCCESS;
 }
 
+/**
+ * Note:
+ *
+ * A guest vCPU's VMCS has to be released (i.e., VMCLEAR) on the physical CPU
+ * that last ran it before the guest vCPU can be run on a different physical
+ * CPU. When preempt notifiers are available, the VMCS is released when the
+ * thread running the vCPU is scheduled out, which is the only time the host
+ * can migrate the thread. Otherwise, the VMCS is released after every
+ * run_op with preemption disabled, which is correct, but slower as the VMCS
+ * has to be launched every time the vCPU is run.
+ */
+
+#ifdef CONFIG_PREEMPT_NOTIFIERS
+
+struct run_vcpu_notifier {
+    struct preempt_notifier pn;
+    uint64_t vcpuid;
+};
+
+static void
+run_vcpu_sched_in(struct preempt_notifier *pn, int cpu)
+{ }
+
+static void
+run_vcpu_sched_out(struct preempt_notifier *pn, struct task_struct *next)
+{
+    struct run_vcpu_notifier *n =
+        container_of(pn, struct run_vcpu_notifier, pn);
+
+    hypercall_vcpu_op__release_vcpu(n->vcpuid);
+}
+
+static struct preempt_ops run_vcpu_preempt_ops = {
+    .sched_in = run_vcpu_sched_in,
+    .sched_out = run_vcpu_sched_out
+};
+
+#endif
+
+static uint64_t
+run_vcpu_once(uint64_t vcpuid)
+{
+    uint64_t ret;
+
+#ifdef CONFIG_PREEMPT_NOTIFIERS
+    ret = hypercall_run_op(vcpuid, 0, 0);
+#else
+    preempt_disable();
+    ret = hypercall_run_op(vcpuid, 0, 0);
+    hypercall_vcpu_op__release_vcpu(vcpuid);
+    preempt_enable();
+#endif
+
+    return ret;
+}
+
+/**
+ * Note:
+ *
+ * A vCPU that sends an IPI to another vCPU returns with kick, telling us
+ * which vCPU has to be woken up to see the IPI. Every thread that is running
+ * a vCPU registers a waiter, so that the kick can wake the thread up if it
+ * is yielding, or interrupt the physical CPU it is running on if it is
+ * executing the guest (the interrupt makes the guest return with continue,
+ * and the IPI is injected when the vCPU is resumed).
+ *
+ * The kicked flag is cleared before every run_op. A kick that arrives after
+ * the run_op has injected the pending IPIs is still seen by the yield that
+ * follows, so a yield never sleeps through an IPI.
+ */
+
+struct run_vcpu_waiter {
+    struct list_head list;
+    uint64_t vcpuid;
+    struct task_struct *task;
+    wait_queue_head_t wq;
+    atomic_t kicked;
+};
+
+static LIST_HEAD(g_run_vcpu_waiters);
+static DEFINE_SPINLOCK(g_run_vcpu_waiters_lock);
+
+static void
+run_vcpu_kick(uint64_t vcpuid)
+{
+    struct run_vcpu_waiter *waiter;
+
+    spin_lock(&g_run_vcpu_waiters_lock);
+
+    list_for_each_entry(waiter, &g_run_vcpu_waiters, list) {
+        if (waiter->vcpuid == vcpuid) {
+            atomic_set(&waiter->kicked, 1);
+            wake_up(&waiter->wq);
+            kick_process(waiter->task);
+            break;
+        }
+    }
+
+    spin_unlock(&g_run_vcpu_waiters_lock);
+}
+
+static void
+run_vcpu_yield(struct run_vcpu_waiter *waiter, uint64_t nsec)
+{
+    if (nsec == 0) {
+        yield();
+        return;
+    }
+
+    wait_event_interruptible_hrtimeout(
+        waiter->wq, atomic_read(&waiter->kicked) != 0, ns_to_ktime(nsec));
+}
+
+static long
+ioctl_run_vcpu(struct run_vcpu_args *args)
+{
+    int64_t ret;
+    struct run_vcpu_args kern_args;
+    struct run_vcpu_waiter waiter;
+
+#ifdef CONFIG_PREEMPT_NOTIFIERS
+    struct run_vcpu_notifier notifier;
+#endif
+
+    ret = copy_from_user(&kern_args, args, sizeof(struct run_vcpu_args));
+    if (ret != 0) {
+        BFALERT("IOCTL_RUN_VCPU: failed to copy args from userspace\n");
+        return BF_IOCTL_FAILURE;
+    }
+
+    waiter.vcpuid = kern_args.vcpuid;
+    waiter.task = current;
+    init_waitqueue_head(&waiter.wq);
+    atomic_set(&waiter.kicked, 0);
+
+    spin_lock(&g_run_vcpu_waiters_lock);
+    list_add(&waiter.list, &g_run_vcpu_waiters);
+    spin_unlock(&g_run_vcpu_waiters_lock);
+
+#ifdef CONFIG_PREEMPT_NOTIFIERS
+    notifier.vcpuid = kern_args.vcpuid;
+    preempt_notifier_init(&notifier.pn, &run_vcpu_preempt_ops);
+
+    preempt_disable();
+    preempt_notifier_register(&notifier.pn);
+    preempt_enable();
+#endif
+
+    /**
+     * Note:
+     *
+     * Every time the host receives an interrupt, the guest vCPU returns
+     * with continue (or yield). Handling these here instead of in userspace
+     * removes a return to userspace and a new ioctl from every interrupt.
+     * A pending signal (e.g., SIGINT used to kill the VM) still has to be
+     * delivered, in which case userspace is told to continue.
+     *
+     * A lazily created VM returns pool_empty once the hypervisor has run
+     * out of pages to populate its RAM with. The pool is grown here and the
+     * vCPU is resumed, which retries the access that faulted. If the pool
+     * cannot be grown, the pool_empty is passed to userspace.
+     *
+     * A kick is also handled here (see run_vcpu_kick), after which the vCPU
+     * that sent the IPI is resumed.
+     */
+
+    while (1) {
+        atomic_xchg(&waiter.kicked, 0);
+        kern_args.ret = run_vcpu_once(kern_args.vcpuid);
+
+        switch (run_op_ret_op(kern_args.ret)) {
+            case hypercall_enum_run_op__continue:
+                break;
+
+            case hypercall_enum_run_op__yield:
+                run_vcpu_yield(&waiter, run_op_ret_arg(kern_args.ret));
+                break;
+
+            case hypercall_enum_run_op__kick:
+                run_vcpu_kick(run_op_ret_arg(kern_args.ret));
+                break;
+
+            case hypercall_enum_run_op__pool_empty:
+                if (common_grow_pool(run_op_ret_arg(kern_args.ret)) != SUCCESS) {
+                    goto done;
+                }
+                break;
+
+            default:
+                goto done;
+        }
+
+        if (signal_pending(current)) {
+            kern_args.ret = hypercall_enum_run_op__continue;
+            goto done;
+        }
+
+        cond_resched();
+    }
+
+done:
+
+#ifdef CONFIG_PREEMPT_NOTIFIERS
+    preempt_disable();
+    preempt_notifier_unregister(&notifier.pn);
+    hypercall_vcpu_op__release_vcpu(kern_args.vcpuid);
+    preempt_enable();
+#endif
+
+    spin_lock(&g_run_vcpu_waiters_lock);
+    list_del(&waiter.list);
+    spin_unlock(&g_run_vcpu_waiters_lock);
+
+    ret = copy_to_user(args, &kern_args, sizeof(struct run_vcpu_args));
+    if (ret != 0) {
+        BFALERT("IOCTL_RUN_VCPU: failed to copy args to userspace\n");
+        return BF_IOCTL_FAILURE;
+    }
+
+    return BF_IOCTL_SUCCESS;
+}
+
+static long
+ioctl_add_vmcall_token(struct file *file, uint64_t *args)
+{
+    int64_t ret;
+    void *old_token;
+    uint64_t token = (uint64_t)(uintptr_t)READ_ONCE(file->private_data);
+
+    /**
+     * Note:
+     *
+     * The token allows the process that opened this file to execute VMCalls
+     * directly from userspace. The token is removed from the VMM when the
+     * file is released (i.e., when the process exits).
+     *
+     * More than one thread can execute this IOCTL on the same file at the
+     * same time. Only one token is stored in the file, so if another thread
+     * stored its token first, the token that was just added is removed
+     * again and the other thread's token is returned instead. Otherwise the
+     * losing token would never be removed from the VMM.
+     */
+
+    if (token == 0) {
+        do {
+            get_random_bytes(&token, sizeof(token));
+        }
+        while (token == 0);
+
+        if (hypercall_vmcall_op__add_token(token) != SUCCESS) {
+            BFALERT("IOCTL_ADD_VMCALL_TOKEN: failed to add token\n");
+            return BF_IOCTL_FAILURE;
+        }
+
+        old_token = cmpxchg(&file->private_data, NULL, (void *)(uintptr_t)token);
+        if (old_token != NULL) {
+            hypercall_vmcall_op__remove_token(token);
+            token = (uint64_t)(uintptr_t)old_token;
+        }
+    }
+
+    ret = copy_to_user(args, &token, sizeof(uint64_t));
+    if (ret != 0) {
+        BFALERT("IOCTL_ADD_VMCALL_TOKEN: failed to copy args to userspace\n");
+        return BF_IOCTL_FAILURE;
+    }
+
+    return BF_IOCTL_SUCCESS;
+}
+
 static long
 dev_unlocked_ioctl(
     struct file *file, unsigned int cmd, unsigned long arg)
@@ -183,6 +565,27 @@ dev_unlocked_ioctl(
         case IOCTL_DESTROY:
             return ioctl_destroy((domainid_t *)arg);
 
+        case IOCTL_CLONE_VM:
+            return ioctl_clone_vm((struct clone_vm_args *)arg);
+
+        case IOCTL_SAVE_VM:
+            return ioctl_save_vm((struct save_vm_args *)arg);
+
+        case IOCTL_RESTORE_VM:
+            return ioctl_restore_vm((struct restore_vm_args *)arg);
+
+        case IOCTL_SAVE_VCPU:
+            return ioctl_save_vcpu((struct vcpu_snapshot_args *)arg);
+
+        case IOCTL_RESTORE_VCPU:
+            return ioctl_restore_vcpu((struct vcpu_snapshot_args *)arg);
+
+        case IOCTL_RUN_VCPU:
+            return ioctl_run_vcpu((struct run_vcpu_args *)arg);
+
+        case IOCTL_ADD_VMCALL_TOKEN:
+            return ioctl_add_vmcall_token(file, (uint64_t *)arg);
+
         default:
             return -EINVAL;
     }
@@ -210,6 +613,10 @@ dev_init(void)
 {
     platform_init();
 
+#ifdef CONFIG_PREEMPT_NOTIFIERS
+    preempt_notifier_inc();
+#endif
+
     if (misc_register(&builder_dev) != 0) {
         BFALERT("misc_register failed\n");
         return -EPERM;
@@ -222,6 +629,11 @@ void
 dev_exit(void)
 {
     misc_deregister(&builder_dev);
+
+#ifdef CONFIG_PREEMPT_NOTIFIERS
+    preempt_notifier_dec();
+#endif
+
     return;
 }
 
@@ -22,10 +22,17 @@
 
 #include <bfdebug.h>
 #include <bfplatform.h>
+#include <common.h>
 
 #include <linux/mm.h>
+#include <linux/gfp.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
 #include <linux/vmalloc.h>
 
+#define LARGE_PAGE_ORDER 9
+#define LARGE_PAGE_PAGES (1ULL << LARGE_PAGE_ORDER)
+
 DEFINE_MUTEX(g_mutex);
 
 int64_t
@@ -74,6 +81,138 @@ void
 platform_free_rwe(void *addr, uint64_t len)
 { return platform_free_rw(addr, len); }
 
+void *
+platform_alloc_ram(uint64_t len, uint64_t gpa)
+{
+    /**
+     * Notes:
+     *
+     * The buddy allocator hands out blocks that are naturally aligned to
+     * their size, so an order 9 allocation is a 2M aligned, physically
+     * contiguous chunk. Wherever the guest physical address of the buffer
+     * lines up with a 2M boundary, we attempt to grab such a chunk, and
+     * fall back to single pages if memory is too fragmented. The pages are
+     * then stitched together into a single virtually contiguous buffer
+     * using vmap().
+     */
+
+    uint64_t i = 0;
+    uint64_t j = 0;
+    uint64_t num = len >> PAGE_SHIFT;
+
+    void *addr = nullptr;
+    struct page **pages = nullptr;
+
+    if (len == 0 || (len & ~PAGE_MASK) != 0) {
+        BFALERT("platform_alloc_ram: invalid length\n");
+        return nullptr;
+    }
+
+    pages = kvmalloc_array(num, sizeof(struct page *), GFP_KERNEL);
+    if (pages == nullptr) {
+        BFALERT("platform_alloc_ram: failed to alloc page list\n");
+        return nullptr;
+    }
+
+    while (i < num) {
+        struct page *page = nullptr;
+        uint64_t pfn = (gpa >> PAGE_SHIFT) + i;
+
+        if ((pfn & (LARGE_PAGE_PAGES - 1)) == 0 && num - i >= LARGE_PAGE_PAGES) {
+            page = alloc_pages(
+                GFP_KERNEL | __GFP_NOWARN | __GFP_NORETRY, LARGE_PAGE_ORDER);
+
+            if (page != nullptr) {
+                split_page(page, LARGE_PAGE_ORDER);
+
+                for (j = 0; j < LARGE_PAGE_PAGES; j++) {
+                    pages[i++] = page + j;
+                }
+
+                continue;
+            }
+        }
+
+        page = alloc_page(GFP_KERNEL);
+        if (page == nullptr) {
+            BFALERT("platform_alloc_ram: failed to alloc page\n");
+            goto failure;
+        }
+
+        pages[i++] = page;
+    }
+
+    addr = vmap(pages, num, VM_MAP, PAGE_KERNEL);
+    if (addr == nullptr) {
+        BFALERT("platform_alloc_ram: failed to vmap guest RAM\n");
+        goto failure;
+    }
+
+    kvfree(pages);
+    return addr;
+
+failure:
+
+    while (i > 0) {
+        __free_page(pages[--i]);
+    }
+
+    kvfree(pages);
+    return nullptr;
+}
+
+void
+platform_free_ram(void *addr, uint64_t len)
+{
+    uint64_t i;
+    uint64_t num = len >> PAGE_SHIFT;
+    struct page **pages = nullptr;
+
+    if (addr == nullptr) {
+        return;
+    }
+
+    pages = kvmalloc_array(num, sizeof(struct page *), GFP_KERNEL);
+    if (pages == nullptr) {
+        BFALERT("platform_free_ram: failed to alloc page list, leaking RAM\n");
+        return;
+    }
+
+    for (i = 0; i < num; i++) {
+        pages[i] = vmalloc_to_page((char *)addr + (i << PAGE_SHIFT));
+    }
+
+    vunmap(addr);
+
+    for (i = 0; i < num; i++) {
+        __free_page(pages[i]);
+    }
+
+    kvfree(pages);
+}
+
+int64_t
+platform_copy_from_user(void *dst, const void *src, uint64_t num)
+{
+    if (copy_from_user(dst, (const void __user *)src, num) != 0) {
+        BFALERT("platform_copy_from_user: failed to copy from userspace\n");
+        return FAILURE;
+    }
+
+    return SUCCESS;
+}
+
+int64_t
+platform_copy_to_user(void *dst, const void *src, uint64_t num)
+{
+    if (copy_to_user((void __user *)dst, src, num) != 0) {
+        BFALERT("platform_copy_to_user: failed to copy to userspace\n");
+        return FAILURE;
+    }
+
+    return SUCCESS;
+}
+
 void *
 platform_virt_to_phys(void *virt)
 {
@@ -78,6 +78,17 @@ void
 platform_free_rwe(void *addr, uint64_t len)
 { platform_free_rw(addr, len); }
 
+void *
+platform_alloc_ram(uint64_t len, uint64_t gpa)
+{
+    (void) gpa;
+    return platform_alloc_rwe(len);
+}
+
+void
+platform_free_ram(void *addr, uint64_t len)
+{ platform_free_rwe(addr, len); }
+
 void *
 platform_virt_to_phys(void *virt)
 {
@@ -79,6 +79,59 @@ copy_from_user(void *dst, const void*src, uint64_t num)
     return 0;
 }
 
+int64_t
+platform_copy_from_user(void *dst, const void *src, uint64_t num)
+{ return copy_from_user(dst, src, num) == 0 ? SUCCESS : FAILURE; }
+
+int64_t
+copy_to_user(void *dst, const void *src, uint64_t num)
+{
+    PMDL mdl = NULL;
+    PVOID buffer = NULL;
+
+    try {
+        ProbeForWrite(dst, num, sizeof(UCHAR));
+    }
+    except(EXCEPTION_EXECUTE_HANDLER) {
+        BFALERT("ProbeForWrite failed\n");
+        return -1;
+    }
+
+    mdl = IoAllocateMdl(dst, (ULONG)num, FALSE, TRUE, NULL);
+    if (!mdl) {
+        BFALERT("IoAllocateMdl failed\n");
+        return -1;
+    }
+
+    try {
+        MmProbeAndLockPages(mdl, UserMode, IoWriteAccess);
+    }
+    except(EXCEPTION_EXECUTE_HANDLER) {
+        BFALERT("MmProbeAndLockPages failed\n");
+        IoFreeMdl(mdl);
+        return -1;
+    }
+
+    buffer = MmGetSystemAddressForMdlSafe(mdl, NormalPagePriority | MdlMappingNoExecute);
+    if (!buffer) {
+        BFALERT("MmGetSystemAddressForMdlSafe failed\n");
+        MmUnlockPages(mdl);
+        IoFreeMdl(mdl);
+        return -1;
+    }
+
+    RtlCopyMemory(buffer, src, num);
+
+    MmUnlockPages(mdl);
+    IoFreeMdl(mdl);
+
+    return 0;
+}
+
+int64_t
+platform_copy_to_user(void *dst, const void *src, uint64_t num)
+{ return copy_to_user(dst, src, num) == 0 ? SUCCESS : FAILURE; }
+
 // https://github.com/Microsoft/Windows-driver-samples/blob/master/general/ioctl/wdm/sys/sioctl.c
 
 /* -------------------------------------------------------------------------- */
@@ -90,41 +143,15 @@ ioctl_create_vm_from_bzimage(struct create_vm_from_bzimage_args *args)
 {
     int64_t ret;
 
-    void *bzimage = 0;
-    void *initrd = 0;
     void *cmdl = 0;
 
-    if (args->bzimage != 0 && args->bzimage_size != 0) {
-        bzimage = platform_alloc_rw(args->bzimage_size);
-        if (bzimage == NULL) {
-            BFALERT("IOCTL_CREATE_VM_FROM_BZIMAGE: failed to allocate memory for bzimage\n");
-            goto failed;
-        }
-
-        ret = copy_from_user(bzimage, args->bzimage, args->bzimage_size);
-        if (ret != 0) {
-            BFALERT("IOCTL_CREATE_VM_FROM_BZIMAGE: failed to copy bzimage from userspace\n");
-            goto failed;
-        }
-
-        args->bzimage = bzimage;
-    }
-
-    if (args->initrd != 0 && args->initrd_size != 0) {
-        initrd = platform_alloc_rw(args->initrd_size);
-        if (initrd == NULL) {
-            BFALERT("IOCTL_CREATE_VM_FROM_BZIMAGE: failed to allocate memory for initrd\n");
-            goto failed;
-        }
-
-        ret = copy_from_user(initrd, args->initrd, args->initrd_size);
-        if (ret != 0) {
-            BFALERT("IOCTL_CREATE_VM_FROM_BZIMAGE: failed to copy initrd from userspace\n");
-            goto failed;
-        }
-
-        args->initrd = initrd;
-    }
+    /**
+     * Notes:
+     *
+     * The bzImage and initrd are not copied here. They can be hundreds of
+     * MB, so common_create_vm_from_bzimage() copies them from userspace
+     * straight into guest RAM (see platform_copy_from_user).
+     */
 
     if (args->cmdl != 0 && args->cmdl_size != 0) {
         cmdl = platform_alloc_rw(args->cmdl_size);
@@ -152,8 +179,6 @@ ioctl_create_vm_from_bzimage(struct create_vm_from_bzimage_args *args)
     args->initrd = 0;
     args->cmdl = 0;
 
-    platform_free_rw(bzimage, args->bzimage_size);
-    platform_free_rw(initrd, args->initrd_size);
     platform_free_rw(cmdl, args->cmdl_size);
 
     BFDEBUG("IOCTL_CREATE_VM_FROM_BZIMAGE: succeeded\n");
@@ -165,8 +190,6 @@ failed:
     args->initrd = 0;
     args->cmdl = 0;
 
-    platform_free_rw(bzimage, args->bzimage_size);
-    platform_free_rw(initrd, args->initrd_size);
     platform_free_rw(cmdl, args->cmdl_size);
 
     BFALERT("IOCTL_CREATE_VM_FROM_BZIMAGE: failed\n");
@@ -44,14 +44,22 @@ parse_args(int argc, char *argv[])
     ("h,help", "Print this help menu")
     ("v,verbose", "Enable verbose output")
     ("version", "Print the version")
-    ("affinity", "The host CPU to execute the VM on", value<uint64_t>(), "[core #]")
+    ("affinity", "Pin the VM to host CPUs (vCPU n is pinned to core # + n)", value<uint64_t>(), "[core #]")
+    ("vcpus", "The number of vCPUs to give the VM", value<uint64_t>(), "[#]")
     ("bzimage", "Create a VM from a bzImage file")
     ("path", "The VM's path", value<std::string>(), "[path]")
     ("size", "The VM's total RAM", value<uint64_t>(), "[bytes]")
     ("initrd", "The VM's initrd path", value<std::string>(), "[path]")
     ("cmdline", "Additional Linux command line arguments", value<std::string>(), "[text]")
     ("uart", "Give the VM an emulated UART", value<uint64_t>(), "[port #]")
-    ("pt_uart", "Pass-through a UART to VM", value<uint64_t>(), "[port #]");
+    ("pt_uart", "Pass-through a UART to VM", value<uint64_t>(), "[port #]")
+    ("xsave", "The extended state exposed to the VM (default: none)", value<std::string>(), "[none|avx|avx512]")
+    ("lazy", "Populate the VM's RAM on demand instead of up front")
+    ("template", "Boot the VM as a template, which is saved for cloning on SIGUSR1")
+    ("from-template", "Create the VM by cloning a template", value<uint64_t>(), "[domain id]")
+    ("snapshot", "Save the VM to a file when it is killed or receives SIGUSR1", value<std::string>(), "[path]")
+    ("restore", "Create the VM from a snapshot file", value<std::string>(), "[path]")
+    ("direct_vmcall", "Execute VMCalls directly instead of through the driver");
 
     auto args = options.parse(argc, argv);
 
@@ -69,8 +77,36 @@ parse_args(int argc, char *argv[])
         verbose = true;
     }
 
-    if (!args.count("bzimage")) {
-        throw std::runtime_error("must specify 'bzimage'");
+    if (args.count("bzimage") + args.count("from-template") + args.count("restore") != 1) {
+        throw std::runtime_error("must specify 'bzimage', 'from-template' or 'restore'");
+    }
+
+    if (args.count("template") && args.count("from-template")) {
+        throw std::runtime_error("a clone cannot be used as a 'template'");
+    }
+
+    if (args.count("template") && args.count("lazy")) {
+        throw std::runtime_error("a 'template' cannot use 'lazy'");
+    }
+
+    if (args.count("template") && args.count("vcpus") && args["vcpus"].as<uint64_t>() > 1) {
+        throw std::runtime_error("a 'template' can only have one vCPU");
+    }
+
+    if (args.count("from-template") && args.count("vcpus")) {
+        throw std::runtime_error("a clone has the same 'vcpus' as its template");
+    }
+
+    if (args.count("restore") && args.count("vcpus")) {
+        throw std::runtime_error("a restored VM has the same 'vcpus' as its snapshot");
+    }
+
+    if (args.count("snapshot") && (args.count("lazy") || args.count("from-template"))) {
+        throw std::runtime_error("a 'lazy' VM or a clone cannot be saved to a 'snapshot'");
+    }
+
+    if (args.count("snapshot") && args.count("template")) {
+        throw std::runtime_error("a 'template' is saved for cloning, and cannot be saved to a 'snapshot'");
     }
 
     if (args.count("uart") && args.count("pt_uart")) {
@@ -26,9 +26,28 @@
 #include <vector>
 #include <fstream>
 
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
 namespace bfn
 {
 
+// Note:
+//
+// The bzImage and initrd can be hundreds of MB, and they are only ever
+// handed to the builder, which copies them straight into guest RAM. On
+// Linux, the file is mapped read-only instead of being read into a buffer.
+// MAP_POPULATE reads the whole file in up front (so that the builder does
+// not take a page fault on each page it copies), and MADV_SEQUENTIAL lets
+// the kernel drop the pages once they have been copied. If the file cannot
+// be mapped (or on other platforms), it is read using a single read into
+// a buffer that is the size of the file.
+//
+
 class file
 {
     using pointer = const char *;
@@ -37,31 +56,118 @@ class file
 public:
 
     file(const std::string &filename) :
-        m_path{filename},
-        m_file{filename, std::ios::in | std::ios::binary},
-        m_data{std::istreambuf_iterator<char>(m_file), std::istreambuf_iterator<char>()}
-    { }
+        m_path{filename}
+    {
+#ifdef __linux__
+        if (this->map()) {
+            return;
+        }
+#endif
+
+        this->read();
+    }
 
     ~file()
-    { }
+    {
+#ifdef __linux__
+        if (m_map != nullptr) {
+            munmap(m_map, m_size);
+        }
+#endif
+    }
 
     pointer
     data() const noexcept
-    { return m_data.data(); }
+    { return m_data; }
 
     size_type
     size() const noexcept
-    { return m_data.size(); }
+    { return m_size; }
 
     const std::string &
     path() const noexcept
     { return m_path; }
 
+private:
+
+#ifdef __linux__
+
+    bool
+    map()
+    {
+        auto fd = open(m_path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            return false;
+        }
+
+        struct stat st {};
+        if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+            close(fd);
+            return false;
+        }
+
+        auto size = static_cast<size_type>(st.st_size);
+        auto addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+
+        close(fd);
+
+        if (addr == MAP_FAILED) {
+            return false;
+        }
+
+        madvise(addr, size, MADV_SEQUENTIAL);
+
+        m_map = addr;
+        m_data = static_cast<pointer>(addr);
+        m_size = size;
+
+        return true;
+    }
+
+#endif
+
+    void
+    read()
+    {
+        std::ifstream file{m_path, std::ios::in | std::ios::binary | std::ios::ate};
+        if (!file) {
+            return;
+        }
+
+        auto size = static_cast<std::streamsize>(file.tellg());
+        if (size <= 0) {
+            return;
+        }
+
+        m_buffer.resize(static_cast<size_type>(size));
+
+        file.seekg(0);
+        file.read(m_buffer.data(), size);
+
+        m_data = m_buffer.data();
+        m_size = static_cast<size_type>(file.gcount());
+    }
+
 private:
 
     std::string m_path;
-    std::fstream m_file;
-    std::vector<char> m_data;
+
+    pointer m_data{};
+    size_type m_size{};
+
+    std::vector<char> m_buffer;
+
+#ifdef __linux__
+    void *m_map{};
+#endif
+
+public:
+
+    file(file &&) = delete;
+    file &operator=(file &&) = delete;
+
+    file(const file &) = delete;
+    file &operator=(const file &) = delete;
 };
 
 }
@@ -91,6 +91,62 @@ public:
     ///
     void call_ioctl_create_vm_from_bzimage(create_vm_from_bzimage_args &args);
 
+    /// Clone VM
+    ///
+    /// Creates a virtual machine by cloning a template VM.
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @param args the args needed to clone the VM
+    ///
+    void call_ioctl_clone_vm(clone_vm_args &args);
+
+    /// Save VM
+    ///
+    /// Saves a virtual machine's memory image. If args.image is null, only
+    /// the size of the image (and the VM's configuration) is returned.
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @param args the args needed to save the VM
+    ///
+    void call_ioctl_save_vm(save_vm_args &args);
+
+    /// Restore VM
+    ///
+    /// Creates a virtual machine from a saved memory image.
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @param args the args needed to restore the VM
+    ///
+    void call_ioctl_restore_vm(restore_vm_args &args);
+
+    /// Save vCPU
+    ///
+    /// Saves the state of a killed vCPU that is no longer being run.
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @param args the args needed to save the vCPU
+    ///
+    void call_ioctl_save_vcpu(vcpu_snapshot_args &args);
+
+    /// Restore vCPU
+    ///
+    /// Restores the state of a vCPU that has not been run yet.
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @param args the args needed to restore the vCPU
+    ///
+    void call_ioctl_restore_vcpu(vcpu_snapshot_args &args);
+
     /// Destroy VM
     ///
     /// Destroys a VM given a domain ID
@@ -119,6 +175,33 @@ public:
     ///
     uint64_t call_ioctl_vmcall(uint64_t r1, uint64_t r2, uint64_t r3, uint64_t r4);
 
+    /// Run vCPU
+    ///
+    /// Runs a guest vCPU until userspace needs to handle the result. On
+    /// platforms where the builder does not support running a vCPU, this
+    /// is the same as a single run_op VMCall.
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @param vcpuid the vCPU to run
+    /// @return the run_op return value that stopped the vCPU
+    ///
+    uint64_t call_ioctl_run_vcpu(vcpuid_t vcpuid);
+
+    /// Add VMCall Token
+    ///
+    /// Asks the builder to register a token with the VMM that allows this
+    /// process to execute VMCalls directly from userspace. The token is
+    /// removed by the builder when this process exits.
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @return the token to place in rsi when executing a VMCall
+    ///
+    uint64_t call_ioctl_add_vmcall_token();
+
 private:
 
     std::unique_ptr<ioctl_private_base> m_d;
@@ -34,6 +34,36 @@
         std::cout << "   cmdline" bfcolor_yellow " | " << bfcolor_green << cmdl.data() << bfcolor_end "\n";                                 \
     }
 
+#define clone_vm_verbose()                                                                                                                  \
+    if (verbose) {                                                                                                                          \
+        std::cout << '\n';                                                                                                                  \
+        std::cout << bfcolor_cyan    "Cloned VM from template:\n" bfcolor_end;                                                              \
+        std::cout << bfcolor_magenta "--------------------------------------------------------------------------------\n" bfcolor_end;      \
+        std::cout << "  template" bfcolor_yellow " | " << bfcolor_green << ioctl_args.template_domainid << bfcolor_end "\n";               \
+        std::cout << " domain id" bfcolor_yellow " | " << bfcolor_green << ioctl_args.domainid << bfcolor_end "\n";                         \
+    }
+
+#define restore_vm_verbose()                                                                                                                \
+    if (verbose) {                                                                                                                          \
+        std::cout << '\n';                                                                                                                  \
+        std::cout << bfcolor_cyan    "Restored VM from snapshot file:\n" bfcolor_end;                                                       \
+        std::cout << bfcolor_magenta "--------------------------------------------------------------------------------\n" bfcolor_end;      \
+        std::cout << "  snapshot" bfcolor_yellow " | " << bfcolor_green << g_snapshot->path() << bfcolor_end "\n";                          \
+        std::cout << " domain id" bfcolor_yellow " | " << bfcolor_green << ioctl_args.domainid << bfcolor_end "\n";                         \
+        std::cout << "  ram size" bfcolor_yellow " | " << bfcolor_green << (ioctl_args.size / 0x100000) << "MB" << bfcolor_end "\n";        \
+        std::cout << "     vcpus" bfcolor_yellow " | " << bfcolor_green << hdr.num_vcpus << bfcolor_end "\n";                               \
+    }
+
+#define hypercall_errors_verbose()                                                                                                          \
+    if (verbose) {                                                                                                                          \
+        std::cout << '\n';                                                                                                                  \
+        std::cout << bfcolor_cyan    "Hypercall cost (cycles per call):\n" bfcolor_end;                                                     \
+        std::cout << bfcolor_magenta "--------------------------------------------------------------------------------\n" bfcolor_end;      \
+        std::cout << "    valid domain" bfcolor_yellow " | " << bfcolor_green << valid_domain << bfcolor_end "\n";                          \
+        std::cout << "  invalid domain" bfcolor_yellow " | " << bfcolor_green << invalid_domain << bfcolor_end "\n";                        \
+        std::cout << "    invalid vcpu" bfcolor_yellow " | " << bfcolor_green << invalid_vcpu << bfcolor_end "\n";                          \
+    }
+
 #define output_vm_uart_verbose()                                                                                                            \
     if (verbose) {                                                                                                                          \
         std::cout << '\n';                                                                                                                  \
@@ -27,9 +27,15 @@
 #include <bftsc.h>
 
 #include <list>
+#include <array>
+#include <atomic>
+#include <vector>
+#include <algorithm>
 #include <memory>
 #include <chrono>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
 #include <fstream>
 #include <iostream>
 
@@ -41,8 +47,12 @@
 
 using namespace std::chrono;
 
-vcpuid_t g_vcpuid;
+std::vector<vcpuid_t> g_vcpuids;
 domainid_t g_domainid;
+uint64_t g_vmcall_token{};
+std::atomic<bool> g_killed{};
+std::atomic<bool> g_save_requested{};
+std::atomic<bool> g_template_saved{};
 
 auto ctl = std::make_unique<ioctl>();
 
@@ -50,9 +60,41 @@ auto ctl = std::make_unique<ioctl>();
 // VMCall
 // -----------------------------------------------------------------------------
 
+#ifdef __linux__
+
+// Note:
+//
+// When the VMM has been given a token for this process (see --direct_vmcall),
+// VMCalls can be executed directly from userspace, which removes the
+// syscall and the copies to/from the driver. The token is passed in rsi.
+//
+
+inline uint64_t
+direct_vmcall(uint64_t r1, uint64_t r2, uint64_t r3, uint64_t r4) noexcept
+{
+    __asm__ __volatile__(
+        "vmcall"
+        : "+a"(r1), "+b"(r2), "+c"(r3), "+d"(r4)
+        : "S"(g_vmcall_token)
+        : "memory"
+    );
+
+    return r1;
+}
+
+#endif
+
 uint64_t
 _vmcall(uint64_t r1, uint64_t r2, uint64_t r3, uint64_t r4) noexcept
-{ return ctl->call_ioctl_vmcall(r1, r2, r3, r4); }
+{
+#ifdef __linux__
+    if (g_vmcall_token != 0) {
+        return direct_vmcall(r1, r2, r3, r4);
+    }
+#endif
+
+    return ctl->call_ioctl_vmcall(r1, r2, r3, r4);
+}
 
 // -----------------------------------------------------------------------------
 // RDTSC
@@ -116,7 +158,7 @@ init_tsc()
 // -----------------------------------------------------------------------------
 
 bool
-set_wallclock()
+set_wallclock(vcpuid_t vcpuid)
 {
     struct timespec ts;
     uint64_t initial_tsc = 0;
@@ -164,9 +206,9 @@ set_wallclock()
     status_t ret = 0;
 
     ret |= hypercall_vclock_op__set_host_wallclock_rtc(
-        g_vcpuid, ts.tv_sec, ts.tv_nsec);
+        vcpuid, ts.tv_sec, ts.tv_nsec);
     ret |= hypercall_vclock_op__set_host_wallclock_tsc(
-        g_vcpuid, initial_tsc + static_cast<uint64_t>(diff1 / 2));
+        vcpuid, initial_tsc + static_cast<uint64_t>(diff1 / 2));
 
     return ret == SUCCESS;
 }
@@ -176,10 +218,78 @@ set_wallclock()
 // -----------------------------------------------------------------------------
 
 void
-vcpu_thread(vcpuid_t vcpuid)
+set_vcpu_affinity(const args_type &args, uint64_t index)
+{
+    if (args.count("affinity")) {
+        set_affinity(args["affinity"].as<uint64_t>() + index);
+        return;
+    }
+
+    // TODO:
+    //
+    // The Linux builder releases the vCPU's VMCS before the host is
+    // allowed to migrate the vCPU thread (see IOCTL_RUN_VCPU), so on
+    // Linux, the host is free to schedule the VM on any core. The
+    // Windows builder does not support this yet, so each vCPU is pinned
+    // to its own core, starting at 0.
+    //
+
+#ifndef __linux__
+    set_affinity(index);
+#endif
+}
+
+// Note:
+//
+// The Linux builder handles yields and kicks itself, so a yielding vCPU is
+// woken up as soon as another vCPU sends it an IPI. Other builders pass
+// both to userspace, where a yield cannot be interrupted, so if the VM has
+// more than one vCPU, a yield is capped to bound how long an IPI can go
+// unnoticed, and a kick is ignored.
+//
+constexpr uint64_t smp_yield_cap_nsec = 1000000;
+
+// Note:
+//
+// A VM is saved while it is running by pausing all of its vCPUs (see
+// save_signal_handler). Each vCPU thread that is told that its vCPU is
+// paused waits here until the save is done (see snapshot_thread). The
+// number of vCPU threads that are still running is tracked so that a
+// thread that has stopped (e.g., an AP that was killed) is not waited on.
+//
+
+std::mutex g_pause_mutex;
+std::condition_variable g_pause_cv;
+uint64_t g_num_running{};
+uint64_t g_num_paused{};
+
+void
+wait_while_paused()
+{
+    std::unique_lock lock(g_pause_mutex);
+
+    g_num_paused++;
+    g_pause_cv.notify_all();
+
+    g_pause_cv.wait(lock, [] { return !g_save_requested; });
+    g_num_paused--;
+}
+
+void
+vcpu_thread(const args_type &args, uint64_t index)
 {
+    auto vcpuid = g_vcpuids.at(index);
+    set_vcpu_affinity(args, index);
+
+    auto ___ = gsl::finally([] {
+        std::lock_guard lock(g_pause_mutex);
+
+        g_num_running--;
+        g_pause_cv.notify_all();
+    });
+
     while (true) {
-        auto ret = hypercall_run_op(vcpuid, 0, 0);
+        auto ret = ctl->call_ioctl_run_vcpu(vcpuid);
 
         switch (run_op_ret_op(ret)) {
             case hypercall_enum_run_op__continue:
@@ -187,6 +297,10 @@ vcpu_thread(vcpuid_t vcpuid)
 
             case hypercall_enum_run_op__yield:
                 if (auto nsec = run_op_ret_arg(ret); nsec > 0) {
+                    if (g_vcpuids.size() > 1) {
+                        nsec = std::min<uint64_t>(nsec, smp_yield_cap_nsec);
+                    }
+
                     std::this_thread::sleep_for(nanoseconds(nsec));
                 }
                 else {
@@ -194,8 +308,15 @@ vcpu_thread(vcpuid_t vcpuid)
                 }
                 continue;
 
+            case hypercall_enum_run_op__kick:
+                continue;
+
+            case hypercall_enum_run_op__paused:
+                wait_while_paused();
+                continue;
+
             case hypercall_enum_run_op__set_wallclock:
-                if (!set_wallclock()) {
+                if (!set_wallclock(vcpuid)) {
                     std::cerr << "[0x" << std::hex << vcpuid << std::dec << "] ";
                     std::cerr << "set_wallclock failed\n";
                     return;
@@ -205,6 +326,11 @@ vcpu_thread(vcpuid_t vcpuid)
             case hypercall_enum_run_op__hlt:
                 return;
 
+            case hypercall_enum_run_op__pool_empty:
+                std::cerr << "[0x" << std::hex << vcpuid << std::dec << "] ";
+                std::cerr << "guest RAM exhausted\n";
+                return;
+
             case hypercall_enum_run_op__fault:
                 std::cerr << "[0x" << std::hex << vcpuid << std::dec << "] ";
                 std::cerr << "vcpu fault: " << run_op_ret_arg(ret) << '\n';
@@ -274,10 +400,13 @@ kill_signal_handler(void)
     std::cout << '\n';
     std::cout << "killing VM: " << g_domainid << '\n';
 
-    ret = hypercall_vcpu_op__kill_vcpu(g_vcpuid);
-    if (ret != SUCCESS) {
-        BFALERT("__vcpu_op__kill_vcpu failed\n");
-        return;
+    g_killed = true;
+
+    for (const auto &vcpuid : g_vcpuids) {
+        ret = hypercall_vcpu_op__kill_vcpu(vcpuid);
+        if (ret != SUCCESS) {
+            BFALERT("__vcpu_op__kill_vcpu failed\n");
+        }
     }
 
     return;
@@ -301,34 +430,388 @@ setup_kill_signal_handler(void)
 #endif
 }
 
+void
+save_signal_handler(int sig)
+{
+    bfignored(sig);
+
+    // Note:
+    //
+    // A save that is requested while another save is in progress is
+    // ignored. The vCPUs are resumed before the next save can be
+    // requested (see snapshot_thread), so a vCPU is never paused
+    // without a save to resume it.
+    //
+
+    if (g_save_requested.exchange(true)) {
+        return;
+    }
+
+    for (const auto &vcpuid : g_vcpuids) {
+        if (hypercall_vcpu_op__pause_vcpu(vcpuid) != SUCCESS) {
+            BFALERT("__vcpu_op__pause_vcpu failed\n");
+        }
+    }
+}
+
+void
+setup_save_signal_handler(void)
+{
+#ifdef SIGUSR1
+    signal(SIGUSR1, save_signal_handler);
+#endif
+}
+
+// -----------------------------------------------------------------------------
+// Snapshots
+// -----------------------------------------------------------------------------
+
+// Note:
+//
+// A snapshot file is a snapshot_header, followed by a snapshot_vcpu for each
+// vCPU (in the order they were created, i.e., by APIC ID), followed by the
+// VM's memory image (see save_vm_args). The VM is saved once it has been
+// killed and all of its vCPUs have stopped, or while it is running, once
+// all of its vCPUs have been paused (see snapshot_thread). The guest's TSC
+// continues from where it was saved, so a snapshot can only be restored on
+// a system with the same TSC frequency (and the same CPU features).
+//
+// The snapshot file is mapped (see bfn::file), and the builder copies the
+// memory image straight from the mapping into the restored VM's RAM. The
+// mapping is released as soon as the vCPUs have been restored.
+//
+
+constexpr uint64_t snapshot_magic = 0x50414E5359584F42;    // "BOXYSNAP"
+constexpr uint64_t snapshot_version = 1;
+
+struct snapshot_header {
+    uint64_t magic;
+    uint64_t version;
+    uint64_t tsc_freq_khz;
+    uint64_t image_size;
+    uint64_t size;
+    uint64_t num_vcpus;
+    uint64_t uart;
+    uint64_t pt_uart;
+    uint64_t xsave;
+};
+
+struct snapshot_vcpu {
+    struct vcpu_snapshot state;
+    std::array<char, VCPU_SNAPSHOT_XSAVE_SIZE> xsave;
+};
+
+std::unique_ptr<bfn::file> g_snapshot;
+
+static const snapshot_header &
+snapshot_hdr()
+{ return *reinterpret_cast<const snapshot_header *>(g_snapshot->data()); }
+
+static const snapshot_vcpu *
+snapshot_vcpus()
+{ return reinterpret_cast<const snapshot_vcpu *>(g_snapshot->data() + sizeof(snapshot_header)); }
+
+static void
+save_snapshot(const std::string &path)
+{
+    save_vm_args vm_args {};
+    vm_args.domainid = g_domainid;
+
+    ctl->call_ioctl_save_vm(vm_args);
+
+    std::vector<char> image(vm_args.image_size);
+    vm_args.image = image.data();
+
+    ctl->call_ioctl_save_vm(vm_args);
+
+    std::vector<snapshot_vcpu> vcpus(g_vcpuids.size());
+    for (uint64_t i = 0; i < g_vcpuids.size(); i++) {
+        vcpu_snapshot_args vcpu_args {
+            g_vcpuids.at(i), &vcpus.at(i).state, vcpus.at(i).xsave.data()
+        };
+
+        ctl->call_ioctl_save_vcpu(vcpu_args);
+    }
+
+    snapshot_header hdr {
+        snapshot_magic,
+        snapshot_version,
+        calibrate_tsc_freq_khz(),
+        vm_args.image_size,
+        vm_args.size,
+        g_vcpuids.size(),
+        vm_args.uart,
+        vm_args.pt_uart,
+        vm_args.xsave
+    };
+
+    std::ofstream file{path, std::ios::out | std::ios::binary | std::ios::trunc};
+    if (!file) {
+        throw std::runtime_error("failed to open snapshot file: " + path);
+    }
+
+    file.write(reinterpret_cast<const char *>(&hdr), sizeof(hdr));
+    file.write(
+        reinterpret_cast<const char *>(vcpus.data()),
+        gsl::narrow_cast<std::streamsize>(vcpus.size() * sizeof(snapshot_vcpu)));
+    file.write(image.data(), gsl::narrow_cast<std::streamsize>(image.size()));
+
+    if (!file) {
+        throw std::runtime_error("failed to write snapshot file: " + path);
+    }
+
+    std::cout << "saved VM " << g_domainid << " to: " << path << '\n';
+}
+
+static void
+restore_vm(const args_type &args)
+{
+    restore_vm_args ioctl_args {};
+    g_snapshot = std::make_unique<bfn::file>(args["restore"].as<std::string>());
+
+    if (g_snapshot->size() < sizeof(snapshot_header)) {
+        throw std::runtime_error("invalid snapshot file: " + g_snapshot->path());
+    }
+
+    const auto &hdr = snapshot_hdr();
+
+    if (hdr.magic != snapshot_magic || hdr.version != snapshot_version) {
+        throw std::runtime_error("invalid snapshot file: " + g_snapshot->path());
+    }
+
+    if (hdr.tsc_freq_khz != calibrate_tsc_freq_khz()) {
+        throw std::runtime_error("snapshot was saved on a system with a different TSC frequency");
+    }
+
+    auto vcpus_size = g_snapshot->size() - sizeof(snapshot_header);
+
+    if (hdr.num_vcpus == 0 || hdr.num_vcpus > vcpus_size / sizeof(snapshot_vcpu) ||
+        hdr.image_size != vcpus_size - (hdr.num_vcpus * sizeof(snapshot_vcpu))) {
+        throw std::runtime_error("corrupt snapshot file: " + g_snapshot->path());
+    }
+
+    ioctl_args.image = snapshot_vcpus() + hdr.num_vcpus;
+    ioctl_args.image_size = hdr.image_size;
+    ioctl_args.size = hdr.size;
+    ioctl_args.num_vcpus = hdr.num_vcpus;
+    ioctl_args.uart = hdr.uart;
+    ioctl_args.pt_uart = hdr.pt_uart;
+    ioctl_args.xsave = hdr.xsave;
+
+    ctl->call_ioctl_restore_vm(ioctl_args);
+    restore_vm_verbose();
+
+    g_domainid = ioctl_args.domainid;
+}
+
+static void
+restore_vcpus()
+{
+    auto vcpus = snapshot_vcpus();
+
+    for (uint64_t i = 0; i < g_vcpuids.size(); i++) {
+        vcpu_snapshot_args vcpu_args {
+            g_vcpuids.at(i),
+            const_cast<vcpu_snapshot *>(&vcpus[i].state),
+            const_cast<char *>(vcpus[i].xsave.data())
+        };
+
+        ctl->call_ioctl_restore_vcpu(vcpu_args);
+    }
+
+    g_snapshot.reset();
+}
+
+// Note:
+//
+// A template is booted like any other VM, and is saved once it receives
+// SIGUSR1 (e.g., once the guest has finished booting and is idle). Its
+// vCPU state is kept by the VMM, and its vCPUs are killed, as its RAM is
+// shared with its clones from then on. Each clone restores its vCPU from
+// the template's instead of booting from reset.
+//
+
+static void
+save_template()
+{
+    for (const auto &vcpuid : g_vcpuids) {
+        if (hypercall_vcpu_op__save_template_vcpu(vcpuid) != SUCCESS) {
+            throw std::runtime_error("__vcpu_op__save_template_vcpu failed");
+        }
+    }
+
+    for (const auto &vcpuid : g_vcpuids) {
+        hypercall_vcpu_op__kill_vcpu(vcpuid);
+    }
+
+    g_template_saved = true;
+    std::cout << "template domain id: " << g_domainid << '\n';
+}
+
+static void
+restore_template_vcpus()
+{
+    for (const auto &vcpuid : g_vcpuids) {
+        if (hypercall_vcpu_op__restore_template_vcpu(vcpuid) != SUCCESS) {
+            throw std::runtime_error("__vcpu_op__restore_template_vcpu failed");
+        }
+    }
+}
+
+void
+snapshot_thread(const args_type &args)
+{
+    while (true) {
+        std::unique_lock lock(g_pause_mutex);
+
+        g_pause_cv.wait(lock, [] {
+            return g_num_running == 0 ||
+                   (g_save_requested && g_num_paused == g_num_running);
+        });
+
+        if (g_num_running == 0) {
+            return;
+        }
+
+        lock.unlock();
+
+        try {
+            if (args.count("template")) {
+                save_template();
+            }
+            else {
+                save_snapshot(args["snapshot"].as<std::string>());
+            }
+        }
+        catch (const std::exception &e) {
+            std::cerr << "failed to save VM: " << e.what() << '\n';
+        }
+
+        for (const auto &vcpuid : g_vcpuids) {
+            if (hypercall_vcpu_op__resume_vcpu(vcpuid) != SUCCESS) {
+                std::cerr << "__vcpu_op__resume_vcpu failed\n";
+            }
+        }
+
+        lock.lock();
+
+        g_save_requested = false;
+        g_pause_cv.notify_all();
+    }
+}
+
 // -----------------------------------------------------------------------------
 // Attach to VM
 // -----------------------------------------------------------------------------
 
+static uint64_t
+num_vcpus(const args_type &args)
+{
+    if (g_snapshot) {
+        return snapshot_hdr().num_vcpus;
+    }
+
+    // Note:
+    //
+    // A template only has one vCPU (see parse_args), and so does a clone,
+    // as each clone restores its vCPU from the template's. The VMM relies
+    // on this when a clone's shared pages are copied, as only the EPT of
+    // the physical CPU that runs the clone's vCPU has to be flushed.
+    //
+
+    if (args.count("from-template")) {
+        return 1;
+    }
+
+    if (args.count("vcpus")) {
+        return std::max<uint64_t>(args["vcpus"].as<uint64_t>(), 1);
+    }
+
+    return 1;
+}
+
 static int
 attach_to_vm(const args_type &args)
 {
-    bfignored(args);
+    // Note:
+    //
+    // All of the vCPUs have to be created before any of them are run as the
+    // order in which they are created is the order of their APIC IDs (i.e.,
+    // the first vCPU is the BSP), and the guest's CPUID topology reports
+    // the total number of vCPUs.
+    //
+
+    auto __ = gsl::finally([&] {
+        for (const auto &vcpuid : g_vcpuids) {
+            if (hypercall_vcpu_op__destroy_vcpu(vcpuid) != SUCCESS) {
+                std::cerr << "__vcpu_op__destroy_vcpu failed\n";
+            }
+        }
+    });
+
+    for (uint64_t i = 0; i < num_vcpus(args); i++) {
+        auto vcpuid = hypercall_vcpu_op__create_vcpu(g_domainid);
+        if (vcpuid == INVALID_VCPUID) {
+            throw std::runtime_error("__vcpu_op__create_vcpu failed");
+        }
+
+        g_vcpuids.push_back(vcpuid);
+    }
 
-    g_vcpuid = hypercall_vcpu_op__create_vcpu(g_domainid);
-    if (g_vcpuid == INVALID_VCPUID) {
-        throw std::runtime_error("__vcpu_op__create_vcpu failed");
+    if (g_snapshot) {
+        restore_vcpus();
     }
 
-    std::thread t(vcpu_thread, g_vcpuid);
+    if (args.count("from-template")) {
+        restore_template_vcpus();
+    }
+
+    std::list<std::thread> threads;
     std::thread u;
+    std::thread s;
+
+    g_num_running = g_vcpuids.size();
+
+    for (uint64_t i = 0; i < g_vcpuids.size(); i++) {
+        threads.emplace_back(vcpu_thread, std::cref(args), i);
+    }
+
+    if (args.count("snapshot") || args.count("template")) {
+        s = std::thread(snapshot_thread, std::cref(args));
+        setup_save_signal_handler();
+    }
 
     output_vm_uart_verbose();
 
-    t.join();
+    // Note:
+    //
+    // The guest is done once the BSP stops (e.g., the guest was shut down,
+    // or killed). The APs are killed so that they stop as well, as an AP
+    // that never received a SIPI would otherwise run forever.
+    //
+
+    threads.front().join();
+    threads.pop_front();
+
+    for (const auto &vcpuid : g_vcpuids) {
+        hypercall_vcpu_op__kill_vcpu(vcpuid);
+    }
+
+    for (auto &t : threads) {
+        t.join();
+    }
+
+    if (s.joinable()) {
+        s.join();
+    }
 
     if (verbose) {
         g_process_uart = false;
         u.join();
     }
 
-    if (hypercall_vcpu_op__destroy_vcpu(g_vcpuid) != SUCCESS) {
-        std::cerr << "__vcpu_op__destroy_vcpu failed\n";
+    if (g_killed && args.count("snapshot")) {
+        save_snapshot(args["snapshot"].as<std::string>());
     }
 
     return EXIT_SUCCESS;
@@ -338,6 +821,51 @@ attach_to_vm(const args_type &args)
 // Create VM
 // -----------------------------------------------------------------------------
 
+static uint64_t
+xsave_policy(const args_type &args)
+{
+    if (!args.count("xsave")) {
+        return XSAVE_POLICY_NONE;
+    }
+
+    const auto &policy = args["xsave"].as<std::string>();
+
+    if (policy == "none") {
+        return XSAVE_POLICY_NONE;
+    }
+
+    if (policy == "avx") {
+        return XSAVE_POLICY_AVX;
+    }
+
+    if (policy == "avx512") {
+        return XSAVE_POLICY_AVX512;
+    }
+
+    throw cxxopts::OptionException("invalid --xsave policy: " + policy);
+}
+
+static uint64_t
+lazy_ram(const args_type &args)
+{
+    if (!args.count("lazy")) {
+        return 0;
+    }
+
+    // TODO:
+    //
+    // Only the Linux builder grows a VM's pool when the hypervisor runs
+    // out of pages (see IOCTL_RUN_VCPU). Until the Windows builder does
+    // the same, lazy RAM is only supported on Linux.
+    //
+
+#ifndef __linux__
+    throw cxxopts::OptionException("--lazy is only supported on Linux");
+#else
+    return 1;
+#endif
+}
+
 static void
 create_vm_from_bzimage(const args_type &args)
 {
@@ -392,7 +920,10 @@ create_vm_from_bzimage(const args_type &args)
     ioctl_args.cmdl_size = cmdl.size();
     ioctl_args.uart = uart;
     ioctl_args.pt_uart = pt_uart;
+    ioctl_args.xsave = xsave_policy(args);
+    ioctl_args.lazy = lazy_ram(args);
     ioctl_args.size = size;
+    ioctl_args.num_vcpus = num_vcpus(args);
 
     ctl->call_ioctl_create_vm_from_bzimage(ioctl_args);
     create_vm_from_bzimage_verbose();
@@ -401,33 +932,126 @@ create_vm_from_bzimage(const args_type &args)
 }
 
 // -----------------------------------------------------------------------------
-// Main Functions
+// Templates
 // -----------------------------------------------------------------------------
 
+static void
+clone_vm(const args_type &args)
+{
+    clone_vm_args ioctl_args {};
+
+    ioctl_args.template_domainid = args["from-template"].as<uint64_t>();
+
+    ctl->call_ioctl_clone_vm(ioctl_args);
+    clone_vm_verbose();
+
+    g_domainid = ioctl_args.domainid;
+}
+
 static int
-protected_main(const args_type &args)
+wait_as_template()
 {
-    if (args.count("affinity")) {
-        set_affinity(args["affinity"].as<uint64_t>());
+    // Note:
+    //
+    // Once saved, a template is never run again, as its memory is shared
+    // with its clones. It stays around until it is killed, at which point
+    // the builder frees it once the last of its clones is destroyed.
+    //
+
+    if (!g_template_saved) {
+        std::cerr << "template stopped before it was saved\n";
+        return EXIT_FAILURE;
     }
-    else {
 
-        // TODO:
-        //
-        // We need to remove the need for affinity. Right now if you don't
-        // state affinity, we default to 0 because we don't support VMCS
-        // migration, which needs to be fixed.
-        //
+    while (!g_killed) {
+        std::this_thread::sleep_for(milliseconds(250));
+    }
+
+    return EXIT_SUCCESS;
+}
+
+// -----------------------------------------------------------------------------
+// Hypercall Error Path
+// -----------------------------------------------------------------------------
+
+// Note:
+//
+// With --verbose, the cost of a failed hypercall is measured by timing a
+// domain_op on an invalid domain ID and a vcpu_op on an invalid vCPU ID,
+// next to the same domain_op on the VM that was just created. Invalid IDs
+// are rejected by the VMM with a status code instead of an exception, so
+// a failed hypercall should cost about the same as a successful one. The
+// cycles include the trip through the driver unless --direct_vmcall is
+// used.
+//
+
+constexpr uint64_t hypercall_bench_iterations = 1000;
+
+template<typename F>
+uint64_t
+measure_hypercall(F func)
+{
+    auto start = rdtsc();
+
+    for (uint64_t i = 0; i < hypercall_bench_iterations; i++) {
+        func();
+    }
+
+    return (rdtsc() - start) / hypercall_bench_iterations;
+}
+
+void
+measure_hypercall_errors()
+{
+    auto valid_domain = measure_hypercall([] {
+        hypercall_domain_op__rax(g_domainid);
+    });
+
+    auto invalid_domain = measure_hypercall([] {
+        hypercall_domain_op__rax(INVALID_DOMAINID);
+    });
+
+    auto invalid_vcpu = measure_hypercall([] {
+        hypercall_vcpu_op__kill_vcpu(INVALID_VCPUID);
+    });
 
-        set_affinity(0);
+    hypercall_errors_verbose();
+}
+
+// -----------------------------------------------------------------------------
+// Main Functions
+// -----------------------------------------------------------------------------
+
+static int
+protected_main(const args_type &args)
+{
+    if (args.count("direct_vmcall")) {
+        g_vmcall_token = ctl->call_ioctl_add_vmcall_token();
     }
 
-    create_vm_from_bzimage(args);
+    if (args.count("from-template")) {
+        clone_vm(args);
+    }
+    else if (args.count("restore")) {
+        restore_vm(args);
+    }
+    else {
+        create_vm_from_bzimage(args);
+    }
 
     auto __ = gsl::finally([&] {
         ctl->call_ioctl_destroy(g_domainid);
     });
 
+    if (verbose) {
+        measure_hypercall_errors();
+    }
+
+    if (args.count("template")) {
+        attach_to_vm(args);
+        return wait_as_template();
+    }
+
     return attach_to_vm(args);
 }
 
@@ -34,6 +34,41 @@ ioctl::call_ioctl_create_vm_from_bzimage(
     d->call_ioctl_create_vm_from_bzimage(args);
 }
 
+void
+ioctl::call_ioctl_clone_vm(clone_vm_args &args)
+{
+    auto d = static_cast<ioctl_private *>(m_d.get());
+    d->call_ioctl_clone_vm(args);
+}
+
+void
+ioctl::call_ioctl_save_vm(save_vm_args &args)
+{
+    auto d = static_cast<ioctl_private *>(m_d.get());
+    d->call_ioctl_save_vm(args);
+}
+
+void
+ioctl::call_ioctl_restore_vm(restore_vm_args &args)
+{
+    auto d = static_cast<ioctl_private *>(m_d.get());
+    d->call_ioctl_restore_vm(args);
+}
+
+void
+ioctl::call_ioctl_save_vcpu(vcpu_snapshot_args &args)
+{
+    auto d = static_cast<ioctl_private *>(m_d.get());
+    d->call_ioctl_save_vcpu(args);
+}
+
+void
+ioctl::call_ioctl_restore_vcpu(vcpu_snapshot_args &args)
+{
+    auto d = static_cast<ioctl_private *>(m_d.get());
+    d->call_ioctl_restore_vcpu(args);
+}
+
 void
 ioctl::call_ioctl_destroy(domainid_t domainid) noexcept
 {
@@ -47,3 +82,17 @@ ioctl::call_ioctl_vmcall(uint64_t r1, uint64_t r2, uint64_t r3, uint64_t r4)
     auto d = static_cast<ioctl_private *>(m_d.get());
     return d->call_ioctl_vmcall(r1, r2, r3, r4);
 }
+
+uint64_t
+ioctl::call_ioctl_run_vcpu(vcpuid_t vcpuid)
+{
+    auto d = static_cast<ioctl_private *>(m_d.get());
+    return d->call_ioctl_run_vcpu(vcpuid);
+}
+
+uint64_t
+ioctl::call_ioctl_add_vmcall_token()
+{
+    auto d = static_cast<ioctl_private *>(m_d.get());
+    return d->call_ioctl_add_vmcall_token();
+}
@@ -90,6 +90,46 @@ ioctl_private::call_ioctl_create_vm_from_bzimage(
     }
 }
 
+void
+ioctl_private::call_ioctl_clone_vm(clone_vm_args &args)
+{
+    if (bfm_write_read_ioctl(fd2, IOCTL_CLONE_VM, &args) < 0) {
+        throw std::runtime_error("ioctl failed: IOCTL_CLONE_VM");
+    }
+}
+
+void
+ioctl_private::call_ioctl_save_vm(save_vm_args &args)
+{
+    if (bfm_write_read_ioctl(fd2, IOCTL_SAVE_VM, &args) < 0) {
+        throw std::runtime_error("ioctl failed: IOCTL_SAVE_VM");
+    }
+}
+
+void
+ioctl_private::call_ioctl_restore_vm(restore_vm_args &args)
+{
+    if (bfm_write_read_ioctl(fd2, IOCTL_RESTORE_VM, &args) < 0) {
+        throw std::runtime_error("ioctl failed: IOCTL_RESTORE_VM");
+    }
+}
+
+void
+ioctl_private::call_ioctl_save_vcpu(vcpu_snapshot_args &args)
+{
+    if (bfm_write_ioctl(fd2, IOCTL_SAVE_VCPU, &args) < 0) {
+        throw std::runtime_error("ioctl failed: IOCTL_SAVE_VCPU");
+    }
+}
+
+void
+ioctl_private::call_ioctl_restore_vcpu(vcpu_snapshot_args &args)
+{
+    if (bfm_write_ioctl(fd2, IOCTL_RESTORE_VCPU, &args) < 0) {
+        throw std::runtime_error("ioctl failed: IOCTL_RESTORE_VCPU");
+    }
+}
+
 void
 ioctl_private::call_ioctl_destroy(domainid_t domainid) noexcept
 {
@@ -109,3 +149,27 @@ ioctl_private::call_ioctl_vmcall(uint64_t r1, uint64_t r2, uint64_t r3, uint64_t
 
     return args.reg1;
 }
+
+uint64_t
+ioctl_private::call_ioctl_run_vcpu(vcpuid_t vcpuid)
+{
+    struct run_vcpu_args args = {vcpuid, 0};
+
+    if (bfm_write_read_ioctl(fd2, IOCTL_RUN_VCPU, &args) < 0) {
+        throw std::runtime_error("ioctl failed: IOCTL_RUN_VCPU");
+    }
+
+    return args.ret;
+}
+
+uint64_t
+ioctl_private::call_ioctl_add_vmcall_token()
+{
+    uint64_t token = 0;
+
+    if (bfm_write_read_ioctl(fd2, IOCTL_ADD_VMCALL_TOKEN, &token) < 0) {
+        throw std::runtime_error("ioctl failed: IOCTL_ADD_VMCALL_TOKEN");
+    }
+
+    return token;
+}
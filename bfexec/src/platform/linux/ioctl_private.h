@@ -32,8 +32,15 @@ public:
     ~ioctl_private() override;
 
     void call_ioctl_create_vm_from_bzimage(create_vm_from_bzimage_args &args);
+    void call_ioctl_clone_vm(clone_vm_args &args);
+    void call_ioctl_save_vm(save_vm_args &args);
+    void call_ioctl_restore_vm(restore_vm_args &args);
+    void call_ioctl_save_vcpu(vcpu_snapshot_args &args);
+    void call_ioctl_restore_vcpu(vcpu_snapshot_args &args);
     void call_ioctl_destroy(domainid_t domainid) noexcept;
     uint64_t call_ioctl_vmcall(uint64_t r1, uint64_t r2, uint64_t r3, uint64_t r4);
+    uint64_t call_ioctl_run_vcpu(vcpuid_t vcpuid);
+    uint64_t call_ioctl_add_vmcall_token();
 
 private:
 
@@ -33,6 +33,41 @@ ioctl::call_ioctl_create_vm_from_bzimage(create_vm_from_bzimage_args &args)
     d->call_ioctl_create_vm_from_bzimage(args);
 }
 
+void
+ioctl::call_ioctl_clone_vm(clone_vm_args &args)
+{
+    bfignored(args);
+    throw std::runtime_error("cloning a VM is not supported on Windows");
+}
+
+void
+ioctl::call_ioctl_save_vm(save_vm_args &args)
+{
+    bfignored(args);
+    throw std::runtime_error("saving a VM is not supported on Windows");
+}
+
+void
+ioctl::call_ioctl_restore_vm(restore_vm_args &args)
+{
+    bfignored(args);
+    throw std::runtime_error("restoring a VM is not supported on Windows");
+}
+
+void
+ioctl::call_ioctl_save_vcpu(vcpu_snapshot_args &args)
+{
+    bfignored(args);
+    throw std::runtime_error("saving a vCPU is not supported on Windows");
+}
+
+void
+ioctl::call_ioctl_restore_vcpu(vcpu_snapshot_args &args)
+{
+    bfignored(args);
+    throw std::runtime_error("restoring a vCPU is not supported on Windows");
+}
+
 void
 ioctl::call_ioctl_destroy(domainid_t domainid) noexcept
 {
@@ -46,3 +81,19 @@ ioctl::call_ioctl_vmcall(uint64_t r1, uint64_t r2, uint64_t r3, uint64_t r4)
     auto d = static_cast<ioctl_private *>(m_d.get());
     return d->call_ioctl_vmcall(r1, r2, r3, r4);
 }
+
+uint64_t
+ioctl::call_ioctl_run_vcpu(vcpuid_t vcpuid)
+{
+    // Note:
+    //
+    // The Windows builder does not support running a vCPU yet, so the
+    // run_op is executed through the Bareflank driver instead.
+    //
+
+    return hypercall_run_op(vcpuid, 0, 0);
+}
+
+uint64_t
+ioctl::call_ioctl_add_vmcall_token()
+{ throw std::runtime_error("direct vmcalls are not supported on Windows"); }
@@ -48,6 +48,13 @@ extern "C" {
 
 #define IOCTL_CREATE_VM_FROM_BZIMAGE_CMD 0x901
 #define IOCTL_DESTROY_CMD 0x902
+#define IOCTL_RUN_VCPU_CMD 0x903
+#define IOCTL_ADD_VMCALL_TOKEN_CMD 0x904
+#define IOCTL_CLONE_VM_CMD 0x905
+#define IOCTL_SAVE_VM_CMD 0x906
+#define IOCTL_RESTORE_VM_CMD 0x907
+#define IOCTL_SAVE_VCPU_CMD 0x908
+#define IOCTL_RESTORE_VCPU_CMD 0x909
 
 /**
  * @struct create_vm_from_bzimage_args
@@ -74,8 +81,18 @@ extern "C" {
  * @var create_vm_from_bzimage_args::pt_uart
  *     defaults to 0 (optional). If non zero, the hypervisor will be told to
  *     pass-through the provided uart.
+ * @var create_vm_from_bzimage_args::xsave
+ *     the XSAVE policy (XSAVE_POLICY_xxx) that determines which extended
+ *     state components (e.g. AVX, AVX-512) are exposed to the VM.
+ * @var create_vm_from_bzimage_args::lazy
+ *     if non-zero, only the kernel and initrd are loaded into RAM up front,
+ *     and the rest of the VM's RAM is populated on demand.
  * @var create_vm_from_bzimage_args::size
  *     the amount of RAM to give to the domain
+ * @var create_vm_from_bzimage_args::num_vcpus
+ *     defaults to 1 if 0. The number of vCPUs that will be created for the
+ *     domain. This is used to describe the domain's processors to the guest
+ *     (i.e., the MP table).
  * @var create_vm_from_bzimage_args::domainid
  *     (out) the domain ID of the VM that was created
  */
@@ -91,11 +108,155 @@ struct create_vm_from_bzimage_args {
 
     uint64_t uart;
     uint64_t pt_uart;
+    uint64_t xsave;
+    uint64_t lazy;
 
     uint64_t size;
+    uint64_t num_vcpus;
     uint64_t domainid;
 };
 
+/**
+ * @struct clone_vm_args
+ *
+ * This structure is used to create a VM by cloning a template VM. The clone
+ * shares the template's RAM copy-on-write, and its vCPU starts from the
+ * state the template's vCPU was saved in. The template must never be run
+ * again once it has been saved (see hypercall_vcpu_op__save_template_vcpu),
+ * and it is not freed until all of its clones are destroyed.
+ *
+ * @var clone_vm_args::template_domainid
+ *     the domain ID of the template to clone
+ * @var clone_vm_args::domainid
+ *     (out) the domain ID of the VM that was created
+ */
+struct clone_vm_args {
+    uint64_t template_domainid;
+    uint64_t domainid;
+};
+
+/**
+ * @struct run_vcpu_args
+ *
+ * This structure is used to run a vCPU from the builder. Instead of
+ * returning to userspace every time the vCPU stops executing, the builder
+ * handles the continue, yield and kick cases itself, and only returns when
+ * userspace needs to act on the result (hlt, fault, set_wallclock), or when
+ * a signal is pending.
+ *
+ * @var run_vcpu_args::vcpuid
+ *     the vCPU to run
+ * @var run_vcpu_args::ret
+ *     (out) the run_op return value that stopped the vCPU. If a signal is
+ *     pending, this is hypercall_enum_run_op__continue, and userspace should
+ *     run the vCPU again once the signal is handled.
+ */
+struct run_vcpu_args {
+    uint64_t vcpuid;
+    uint64_t ret;
+};
+
+/**
+ * @struct save_vm_args
+ *
+ * This structure is used to save a VM's memory (and the information needed
+ * to recreate the VM) so that the VM can later be restored using
+ * restore_vm_args. The memory image contains the BIOS RAM, the boot params,
+ * command line and GDT pages, and guest RAM, in that order. The VM must not
+ * be running while it is saved (i.e., all of its vCPUs have been killed and
+ * have stopped), and it cannot be lazily created or a clone.
+ *
+ * @var save_vm_args::domainid
+ *     the domain ID of the VM to save
+ * @var save_vm_args::image
+ *     the buffer to save the memory image to. If 0, nothing is saved and
+ *     only the out fields are filled in (i.e., to query image_size).
+ * @var save_vm_args::image_size
+ *     (in/out) the size of the image buffer, which must match the size of
+ *     the VM's memory image
+ * @var save_vm_args::size
+ *     (out) the amount of RAM given to the domain
+ * @var save_vm_args::num_vcpus
+ *     (out) the number of vCPUs the domain was created with
+ * @var save_vm_args::uart
+ *     (out) the uart the hypervisor emulates for the domain
+ * @var save_vm_args::pt_uart
+ *     (out) the uart the hypervisor passes through to the domain
+ * @var save_vm_args::xsave
+ *     (out) the XSAVE policy of the domain
+ */
+struct save_vm_args {
+    uint64_t domainid;
+
+    void *image;
+    uint64_t image_size;
+
+    uint64_t size;
+    uint64_t num_vcpus;
+    uint64_t uart;
+    uint64_t pt_uart;
+    uint64_t xsave;
+};
+
+/**
+ * @struct restore_vm_args
+ *
+ * This structure is used to create a VM from a memory image saved using
+ * save_vm_args. The VM's vCPUs must then be created and each one restored
+ * (see vcpu_snapshot_args) before they are run.
+ *
+ * @var restore_vm_args::image
+ *     the memory image to restore
+ * @var restore_vm_args::image_size
+ *     the size of the memory image
+ * @var restore_vm_args::size
+ *     the amount of RAM given to the saved domain
+ * @var restore_vm_args::num_vcpus
+ *     the number of vCPUs the saved domain was created with
+ * @var restore_vm_args::uart
+ *     the uart the hypervisor emulated for the saved domain
+ * @var restore_vm_args::pt_uart
+ *     the uart the hypervisor passed through to the saved domain
+ * @var restore_vm_args::xsave
+ *     the XSAVE policy of the saved domain
+ * @var restore_vm_args::domainid
+ *     (out) the domain ID of the VM that was created
+ */
+struct restore_vm_args {
+    const void *image;
+    uint64_t image_size;
+
+    uint64_t size;
+    uint64_t num_vcpus;
+    uint64_t uart;
+    uint64_t pt_uart;
+    uint64_t xsave;
+
+    uint64_t domainid;
+};
+
+/**
+ * @struct vcpu_snapshot_args
+ *
+ * This structure is used to save a killed vCPU that is no longer being run,
+ * or to restore a vCPU that has been created but not run yet (see
+ * hypercall_vcpu_op__save_vcpu and hypercall_vcpu_op__restore_vcpu).
+ *
+ * @var vcpu_snapshot_args::vcpuid
+ *     the vCPU to save or restore
+ * @var vcpu_snapshot_args::snapshot
+ *     the buffer (sizeof(struct vcpu_snapshot) bytes) to save the vCPU's
+ *     state to, or to restore it from
+ * @var vcpu_snapshot_args::xsave
+ *     the buffer (VCPU_SNAPSHOT_XSAVE_SIZE bytes) to save the vCPU's XSAVE
+ *     area to, or to restore it from
+ */
+struct vcpu_snapshot_args {
+    uint64_t vcpuid;
+    void *snapshot;
+    void *xsave;
+};
+
 /* -------------------------------------------------------------------------- */
 /* Linux Interfaces                                                           */
 /* -------------------------------------------------------------------------- */
@@ -104,6 +265,13 @@ struct create_vm_from_bzimage_args {
 
 #define IOCTL_CREATE_VM_FROM_BZIMAGE _IOWR(BUILDER_MAJOR, IOCTL_CREATE_VM_FROM_BZIMAGE_CMD, struct create_vm_from_bzimage_args *)
 #define IOCTL_DESTROY _IOW(BUILDER_MAJOR, IOCTL_DESTROY_CMD, domainid_t *)
+#define IOCTL_RUN_VCPU _IOWR(BUILDER_MAJOR, IOCTL_RUN_VCPU_CMD, struct run_vcpu_args *)
+#define IOCTL_ADD_VMCALL_TOKEN _IOR(BUILDER_MAJOR, IOCTL_ADD_VMCALL_TOKEN_CMD, uint64_t *)
+#define IOCTL_CLONE_VM _IOWR(BUILDER_MAJOR, IOCTL_CLONE_VM_CMD, struct clone_vm_args *)
+#define IOCTL_SAVE_VM _IOWR(BUILDER_MAJOR, IOCTL_SAVE_VM_CMD, struct save_vm_args *)
+#define IOCTL_RESTORE_VM _IOWR(BUILDER_MAJOR, IOCTL_RESTORE_VM_CMD, struct restore_vm_args *)
+#define IOCTL_SAVE_VCPU _IOW(BUILDER_MAJOR, IOCTL_SAVE_VCPU_CMD, struct vcpu_snapshot_args *)
+#define IOCTL_RESTORE_VCPU _IOW(BUILDER_MAJOR, IOCTL_RESTORE_VCPU_CMD, struct vcpu_snapshot_args *)
 
 #endif
 
@@ -43,6 +43,10 @@ enum e820_type {
  *
  *           0x0 +----------------------+ ---
  *               | RAM                  |  | RAM (BIOS RAM)
+ *       0x9FC00 +----------------------+  |
+ *               | MP Table             |  |
+ *       0xA0000 +----------------------+  |
+ *               | RAM                  |  |
  *       0xE8000 +----------------------+ ---
  *               | Boot Params          |  | Reserved
  *       0xE9000 +----------------------+  |
@@ -112,6 +116,9 @@ setup_e820_map(void *vm, uint64_t size)
 #define BIOS_RAM_ADDR           0x0
 #define BIOS_RAM_SIZE           0xE8000
 
+#define MP_TABLE_GPA            0x9FC00
+#define MP_TABLE_SIZE           0x400
+
 #define BOOT_PARAMS_PAGE_GPA    0xE8000
 #define COMMAND_LINE_PAGE_GPA   0xE9000
 #define INITIAL_GDT_GPA         0xEA000
@@ -70,6 +70,7 @@ uint64_t _vmcall4(void *r1, void *r2, void *r3, void *r4) NOEXCEPT;
 #define hypercall_enum_domain_op 0x02
 #define hypercall_enum_vcpu_op 0x03
 #define hypercall_enum_uart_op 0x04
+#define hypercall_enum_vmcall_op 0x05
 #define hypercall_enum_virq_op 0x10
 #define hypercall_enum_vclock_op 0x11
 
@@ -84,6 +85,9 @@ uint64_t _vmcall4(void *r1, void *r2, void *r3, void *r4) NOEXCEPT;
 #define hypercall_enum_run_op__continue 3
 #define hypercall_enum_run_op__yield 4
 #define hypercall_enum_run_op__set_wallclock 5
+#define hypercall_enum_run_op__kick 6
+#define hypercall_enum_run_op__pool_empty 7
+#define hypercall_enum_run_op__paused 8
 
 #define run_op_ret_op(a) ((0x000000000000000FULL & a) >> 0)
 #define run_op_ret_arg(a) ((0xFFFFFFFFFFFFFFF0ULL & a) >> 4)
@@ -134,17 +138,30 @@ hypercall_uart_ndec_op(uint16_t port, uint64_t val)
 
 #define hypercall_enum_domain_op__create_domain 0xBF02000000000100
 #define hypercall_enum_domain_op__destroy_domain 0xBF02000000000101
+#define hypercall_enum_domain_op__clone_domain 0xBF02000000000102
 
 #define hypercall_enum_domain_op__set_uart 0xBF02000000000200
 #define hypercall_enum_domain_op__set_pt_uart 0xBF02000000000201
 #define hypercall_enum_domain_op__dump_uart 0xBF02000000000202
 
+#define hypercall_enum_domain_op__set_xsave_policy 0xBF02000000000210
+
+#define XSAVE_POLICY_NONE 0
+#define XSAVE_POLICY_AVX 1
+#define XSAVE_POLICY_AVX512 2
+
 #define hypercall_enum_domain_op__share_page_r 0xBF02000000000300
 #define hypercall_enum_domain_op__share_page_rw 0xBF02000000000301
 #define hypercall_enum_domain_op__share_page_rwe 0xBF02000000000303
 #define hypercall_enum_domain_op__donate_page_r 0xBF02000000000310
 #define hypercall_enum_domain_op__donate_page_rw 0xBF02000000000311
 #define hypercall_enum_domain_op__donate_page_rwe 0xBF02000000000313
+#define hypercall_enum_domain_op__donate_range 0xBF02000000000320
+#define hypercall_enum_domain_op__donate_page_2m_rwe 0xBF02000000000333
+#define hypercall_enum_domain_op__reserve_ram 0xBF02000000000350
+
+#define hypercall_enum_domain_op__initial_state 0xBF02000000000400
+#define hypercall_enum_domain_op__set_initial_state 0xBF02000000000401
 
 #define hypercall_enum_domain_op__rax 0xBF02000000010000
 #define hypercall_enum_domain_op__set_rax 0xBF02000000010001
@@ -266,6 +283,45 @@ hypercall_uart_ndec_op(uint16_t port, uint64_t val)
 
 #define UART_MAX_BUFFER 0x4000
 
+#define DONATE_RANGE_ATTR_R 0x1
+#define DONATE_RANGE_ATTR_RW 0x3
+#define DONATE_RANGE_ATTR_RWE 0x7
+#define DONATE_RANGE_ATTR_POOL 0x10
+#define DONATE_RANGE_ATTR_COW 0x20
+
+/**
+ * @struct donate_range_entry
+ *
+ * Describes a run of physically contiguous pages that is donated to a
+ * foreign domain using hypercall_domain_op__donate_range. The entries are
+ * stored in a single page whose GPA is handed to the hypervisor, allowing
+ * an entire buffer to be donated with a single VM exit.
+ *
+ * @var donate_range_entry::gpa
+ *      the (page aligned) GPA of the first page in the caller's domain
+ * @var donate_range_entry::foreign_gpa
+ *      the (page aligned) GPA of the first page in the foreign domain
+ * @var donate_range_entry::count
+ *      the number of 4k pages in the run
+ * @var donate_range_entry::attr
+ *      the access rights of the run (DONATE_RANGE_ATTR_xxx). If this is
+ *      DONATE_RANGE_ATTR_POOL, the (zeroed) pages are added to the foreign
+ *      domain's pool, which is used to populate RAM reserved using
+ *      hypercall_domain_op__reserve_ram, and foreign_gpa is ignored. If
+ *      this is DONATE_RANGE_ATTR_COW, the pages are shared with the foreign
+ *      domain read/execute only, and the first write to a page replaces it
+ *      with a private copy taken from the foreign domain's pool.
+ */
+struct donate_range_entry {
+    uint64_t gpa;
+    uint64_t foreign_gpa;
+    uint64_t count;
+    uint64_t attr;
+};
+
+#define DONATE_RANGE_MAX_ENTRIES \
+    (BAREFLANK_PAGE_SIZE / sizeof(struct donate_range_entry))
+
 static inline domainid_t
 hypercall_domain_op__create_domain(void)
 {
@@ -290,6 +346,20 @@ hypercall_domain_op__destroy_domain(domainid_t foreign_domainid)
     return ret == 0 ? SUCCESS : FAILURE;
 }
 
+static inline status_t
+hypercall_domain_op__clone_domain(
+    domainid_t foreign_domainid, domainid_t template_domainid)
+{
+    status_t ret = _vmcall(
+        hypercall_enum_domain_op__clone_domain,
+        foreign_domainid,
+        template_domainid,
+        0
+    );
+
+    return ret == 0 ? SUCCESS : FAILURE;
+}
+
 static inline status_t
 hypercall_domain_op__set_uart(domainid_t foreign_domainid, uint64_t uart)
 {
@@ -327,6 +397,19 @@ hypercall_domain_op__dump_uart(domainid_t domainid, char *buffer)
     );
 }
 
+static inline status_t
+hypercall_domain_op__set_xsave_policy(domainid_t foreign_domainid, uint64_t policy)
+{
+    status_t ret = _vmcall(
+        hypercall_enum_domain_op__set_xsave_policy,
+        foreign_domainid,
+        policy,
+        0
+    );
+
+    return ret == 0 ? SUCCESS : FAILURE;
+}
+
 static inline status_t
 hypercall_domain_op__share_page_r(
     domainid_t foreign_domainid, uint64_t gpa, uint64_t foreign_gpa)
@@ -411,6 +494,151 @@ hypercall_domain_op__donate_page_rwe(
     return ret == 0 ? SUCCESS : FAILURE;
 }
 
+static inline status_t
+hypercall_domain_op__donate_range(
+    domainid_t foreign_domainid, uint64_t range_gpa, uint64_t num_entries)
+{
+    status_t ret = _vmcall(
+        hypercall_enum_domain_op__donate_range,
+        foreign_domainid,
+        range_gpa,
+        num_entries
+    );
+
+    return ret == 0 ? SUCCESS : FAILURE;
+}
+
+static inline status_t
+hypercall_domain_op__donate_page_2m_rwe(
+    domainid_t foreign_domainid, uint64_t gpa, uint64_t foreign_gpa)
+{
+    status_t ret = _vmcall(
+        hypercall_enum_domain_op__donate_page_2m_rwe,
+        foreign_domainid,
+        gpa,
+        foreign_gpa
+    );
+
+    return ret == 0 ? SUCCESS : FAILURE;
+}
+
+static inline status_t
+hypercall_domain_op__reserve_ram(
+    domainid_t foreign_domainid, uint64_t foreign_gpa, uint64_t size)
+{
+    status_t ret = _vmcall(
+        hypercall_enum_domain_op__reserve_ram,
+        foreign_domainid,
+        foreign_gpa,
+        size
+    );
+
+    return ret == 0 ? SUCCESS : FAILURE;
+}
+
+#define DOMAIN_INITIAL_STATE_VERSION 1
+
+/**
+ * @struct domain_initial_state
+ *
+ * The initial register state of a domain's vCPUs. This structure mirrors
+ * the individual domain registers (see hypercall_domain_op__set_xxx) and
+ * allows all of them to be read or written with a single VM exit. The
+ * structure must fit in a single page, and the version field must be set
+ * to DOMAIN_INITIAL_STATE_VERSION.
+ */
+struct domain_initial_state {
+    uint64_t version;
+
+    uint64_t rax;
+    uint64_t rbx;
+    uint64_t rcx;
+    uint64_t rdx;
+    uint64_t rbp;
+    uint64_t rsi;
+    uint64_t rdi;
+    uint64_t r08;
+    uint64_t r09;
+    uint64_t r10;
+    uint64_t r11;
+    uint64_t r12;
+    uint64_t r13;
+    uint64_t r14;
+    uint64_t r15;
+    uint64_t rip;
+    uint64_t rsp;
+    uint64_t gdt_base;
+    uint64_t gdt_limit;
+    uint64_t idt_base;
+    uint64_t idt_limit;
+    uint64_t cr0;
+    uint64_t cr3;
+    uint64_t cr4;
+    uint64_t ia32_efer;
+    uint64_t ia32_pat;
+
+    uint64_t es_selector;
+    uint64_t es_base;
+    uint64_t es_limit;
+    uint64_t es_access_rights;
+    uint64_t cs_selector;
+    uint64_t cs_base;
+    uint64_t cs_limit;
+    uint64_t cs_access_rights;
+    uint64_t ss_selector;
+    uint64_t ss_base;
+    uint64_t ss_limit;
+    uint64_t ss_access_rights;
+    uint64_t ds_selector;
+    uint64_t ds_base;
+    uint64_t ds_limit;
+    uint64_t ds_access_rights;
+    uint64_t fs_selector;
+    uint64_t fs_base;
+    uint64_t fs_limit;
+    uint64_t fs_access_rights;
+    uint64_t gs_selector;
+    uint64_t gs_base;
+    uint64_t gs_limit;
+    uint64_t gs_access_rights;
+    uint64_t tr_selector;
+    uint64_t tr_base;
+    uint64_t tr_limit;
+    uint64_t tr_access_rights;
+    uint64_t ldtr_selector;
+    uint64_t ldtr_base;
+    uint64_t ldtr_limit;
+    uint64_t ldtr_access_rights;
+};
+
+static inline status_t
+hypercall_domain_op__initial_state(
+    domainid_t foreign_domainid, uint64_t state_gpa)
+{
+    status_t ret = _vmcall(
+        hypercall_enum_domain_op__initial_state,
+        foreign_domainid,
+        state_gpa,
+        0
+    );
+
+    return ret == 0 ? SUCCESS : FAILURE;
+}
+
+static inline status_t
+hypercall_domain_op__set_initial_state(
+    domainid_t foreign_domainid, uint64_t state_gpa)
+{
+    status_t ret = _vmcall(
+        hypercall_enum_domain_op__set_initial_state,
+        foreign_domainid,
+        state_gpa,
+        0
+    );
+
+    return ret == 0 ? SUCCESS : FAILURE;
+}
+
 #define hypercall_domain_op__reg(reg)                                           \
     static inline uint64_t                                                      \
     hypercall_domain_op__ ## reg(domainid_t domainid)                           \
@@ -562,6 +790,7 @@ hypercall_domain_op__set_reg(ldtr_access_rights)
 #define hypercall_enum_vcpu_op__create_vcpu 0xBF03000000000100
 #define hypercall_enum_vcpu_op__kill_vcpu 0xBF03000000000101
 #define hypercall_enum_vcpu_op__destroy_vcpu 0xBF03000000000102
+#define hypercall_enum_vcpu_op__release_vcpu 0xBF03000000000103
 
 static inline vcpuid_t
 hypercall_vcpu_op__create_vcpu(domainid_t domainid)
@@ -596,14 +825,392 @@ hypercall_vcpu_op__destroy_vcpu(vcpuid_t vcpuid)
     );
 }
 
+/**
+ * Release vCPU
+ *
+ * Releases the VMCS of a guest vCPU from the physical CPU that this
+ * hypercall is executed on (i.e., VMCLEAR). This must be executed on the
+ * physical CPU that last ran the guest vCPU before the guest vCPU can be
+ * run on a different physical CPU. If the guest vCPU was last run on a
+ * different physical CPU, this hypercall does nothing.
+ *
+ * @param vcpuid the guest vCPU to release
+ * @return SUCCESS on success, FAILURE otherwise
+ */
+static inline status_t
+hypercall_vcpu_op__release_vcpu(vcpuid_t vcpuid)
+{
+    return _vmcall(
+        hypercall_enum_vcpu_op__release_vcpu,
+        vcpuid,
+        0,
+        0
+    );
+}
+
+#define hypercall_enum_vcpu_op__save_vcpu 0xBF03000000000104
+#define hypercall_enum_vcpu_op__restore_vcpu 0xBF03000000000105
+#define hypercall_enum_vcpu_op__pause_vcpu 0xBF03000000000106
+#define hypercall_enum_vcpu_op__resume_vcpu 0xBF03000000000107
+#define hypercall_enum_vcpu_op__save_template_vcpu 0xBF03000000000108
+#define hypercall_enum_vcpu_op__restore_template_vcpu 0xBF03000000000109
+
+#define VCPU_SNAPSHOT_VERSION 2
+#define VCPU_SNAPSHOT_MAX_VIRQS 64
+#define VCPU_SNAPSHOT_XSAVE_SIZE 0x1000
+
+/**
+ * @struct vcpu_snapshot
+ *
+ * The complete state of a guest vCPU, as needed to resume the vCPU in a
+ * new VM whose RAM is a copy of the original VM's RAM. This includes the
+ * registers (including CR2) and VMCS guest state, the isolated MSRs, the
+ * emulated x2APIC (including any interrupt that is queued but has not been
+ * injected yet), the vclock and any vIRQs that have not been delivered
+ * yet. The XSAVE area (standard format) is stored in a separate page of
+ * VCPU_SNAPSHOT_XSAVE_SIZE bytes.
+ *
+ * All TSC values are guest TSC values (i.e., host TSC + TSC offset). When
+ * the vCPU is restored, the TSC offset is chosen so that the guest's TSC
+ * continues from the tsc field, which means that from the guest's point
+ * of view, no time passes while the vCPU is saved. A TSC value of 0 means
+ * the value is not set (e.g., the timer is disarmed).
+ *
+ * This structure must fit in a single page, and the version field must be
+ * set to VCPU_SNAPSHOT_VERSION.
+ */
+struct vcpu_snapshot {
+    uint64_t version;
+
+    uint64_t rax;
+    uint64_t rbx;
+    uint64_t rcx;
+    uint64_t rdx;
+    uint64_t rbp;
+    uint64_t rsi;
+    uint64_t rdi;
+    uint64_t r08;
+    uint64_t r09;
+    uint64_t r10;
+    uint64_t r11;
+    uint64_t r12;
+    uint64_t r13;
+    uint64_t r14;
+    uint64_t r15;
+    uint64_t rip;
+    uint64_t rsp;
+    uint64_t rflags;
+
+    uint64_t cr0;
+    uint64_t cr0_read_shadow;
+    uint64_t cr2;
+    uint64_t cr3;
+    uint64_t cr4;
+    uint64_t cr4_read_shadow;
+    uint64_t dr7;
+    uint64_t ia32_efer;
+    uint64_t ia32_pat;
+    uint64_t ia32_debugctl;
+    uint64_t ia32_sysenter_cs;
+    uint64_t ia32_sysenter_esp;
+    uint64_t ia32_sysenter_eip;
+
+    uint64_t gdt_base;
+    uint64_t gdt_limit;
+    uint64_t idt_base;
+    uint64_t idt_limit;
+
+    uint64_t es_selector;
+    uint64_t es_base;
+    uint64_t es_limit;
+    uint64_t es_access_rights;
+    uint64_t cs_selector;
+    uint64_t cs_base;
+    uint64_t cs_limit;
+    uint64_t cs_access_rights;
+    uint64_t ss_selector;
+    uint64_t ss_base;
+    uint64_t ss_limit;
+    uint64_t ss_access_rights;
+    uint64_t ds_selector;
+    uint64_t ds_base;
+    uint64_t ds_limit;
+    uint64_t ds_access_rights;
+    uint64_t fs_selector;
+    uint64_t fs_base;
+    uint64_t fs_limit;
+    uint64_t fs_access_rights;
+    uint64_t gs_selector;
+    uint64_t gs_base;
+    uint64_t gs_limit;
+    uint64_t gs_access_rights;
+    uint64_t tr_selector;
+    uint64_t tr_base;
+    uint64_t tr_limit;
+    uint64_t tr_access_rights;
+    uint64_t ldtr_selector;
+    uint64_t ldtr_base;
+    uint64_t ldtr_limit;
+    uint64_t ldtr_access_rights;
+
+    uint64_t interruptibility_state;
+    uint64_t activity_state;
+    uint64_t pending_debug_exceptions;
+    uint64_t entry_interruption_information;
+    uint64_t entry_exception_error_code;
+    uint64_t entry_instruction_length;
+
+    uint64_t star;
+    uint64_t lstar;
+    uint64_t cstar;
+    uint64_t fmask;
+    uint64_t kernel_gs_base;
+    uint64_t xcr0;
+
+    uint64_t apic_base;
+    uint64_t apic_svr;
+    uint64_t apic_esr;
+    uint64_t apic_icr;
+    uint64_t apic_lvt_timer;
+    uint64_t apic_lvt_lint0;
+    uint64_t apic_lvt_lint1;
+    uint64_t apic_lvt_error;
+    uint64_t apic_tpr;
+    uint64_t apic_isr[8];
+    uint64_t apic_irr[8];
+    uint64_t apic_interrupt_status;
+    uint64_t apic_pending_ipis[4];
+    uint64_t apic_sipi_state;
+    uint64_t apic_sipi_vector;
+
+    uint64_t tsc;
+    uint64_t next_event_tsc;
+    uint64_t tsc_deadline;
+    uint64_t tsc_deadline_vector;
+    uint64_t guest_wc_tsc;
+    uint64_t guest_wc_sec;
+    uint64_t guest_wc_nsec;
+    uint64_t pvclock_gpa;
+
+    uint64_t hypervisor_callback_vector;
+    uint64_t event_page_gpa;
+    uint64_t num_virqs;
+    uint64_t virqs[VCPU_SNAPSHOT_MAX_VIRQS];
+};
+
+/**
+ * Save vCPU
+ *
+ * Saves the state of a guest vCPU that has been killed (see
+ * hypercall_vcpu_op__kill_vcpu) or paused (see hypercall_vcpu_op__pause_vcpu),
+ * and that is no longer being run (i.e., its thread has stopped or is
+ * waiting for the vCPU to be resumed, and it has been released).
+ *
+ * @param vcpuid the guest vCPU to save
+ * @param snapshot_gpa the address of a page to store the vcpu_snapshot in
+ * @param xsave_gpa the address of a page to store the XSAVE area in
+ * @return SUCCESS on success, FAILURE otherwise
+ */
+static inline status_t
+hypercall_vcpu_op__save_vcpu(
+    vcpuid_t vcpuid, uint64_t snapshot_gpa, uint64_t xsave_gpa)
+{
+    return _vmcall(
+        hypercall_enum_vcpu_op__save_vcpu,
+        vcpuid,
+        snapshot_gpa,
+        xsave_gpa
+    );
+}
+
+/**
+ * Restore vCPU
+ *
+ * Restores the state of a guest vCPU that was saved using
+ * hypercall_vcpu_op__save_vcpu. The guest vCPU must have been created,
+ * but never run, and must be the vCPU with the same APIC ID in the new VM.
+ *
+ * @param vcpuid the guest vCPU to restore
+ * @param snapshot_gpa the address of a page containing the vcpu_snapshot
+ * @param xsave_gpa the address of a page containing the XSAVE area
+ * @return SUCCESS on success, FAILURE otherwise
+ */
+static inline status_t
+hypercall_vcpu_op__restore_vcpu(
+    vcpuid_t vcpuid, uint64_t snapshot_gpa, uint64_t xsave_gpa)
+{
+    return _vmcall(
+        hypercall_enum_vcpu_op__restore_vcpu,
+        vcpuid,
+        snapshot_gpa,
+        xsave_gpa
+    );
+}
+
+/**
+ * Pause vCPU
+ *
+ * Tells a guest vCPU to stop executing the guest until it is resumed (see
+ * hypercall_vcpu_op__resume_vcpu). The guest keeps running until its next
+ * return to the host, after which each attempt to run the vCPU returns
+ * hypercall_enum_run_op__paused. Only then is the vCPU paused, at which
+ * point it can be saved (see hypercall_vcpu_op__save_vcpu).
+ *
+ * @param vcpuid the guest vCPU to pause
+ * @return SUCCESS on success, FAILURE otherwise
+ */
+static inline status_t
+hypercall_vcpu_op__pause_vcpu(vcpuid_t vcpuid)
+{
+    return _vmcall(
+        hypercall_enum_vcpu_op__pause_vcpu,
+        vcpuid,
+        0,
+        0
+    );
+}
+
+/**
+ * Resume vCPU
+ *
+ * Allows a guest vCPU that was paused (see hypercall_vcpu_op__pause_vcpu)
+ * to execute the guest again the next time it is run.
+ *
+ * @param vcpuid the guest vCPU to resume
+ * @return SUCCESS on success, FAILURE otherwise
+ */
+static inline status_t
+hypercall_vcpu_op__resume_vcpu(vcpuid_t vcpuid)
+{
+    return _vmcall(
+        hypercall_enum_vcpu_op__resume_vcpu,
+        vcpuid,
+        0,
+        0
+    );
+}
+
+/**
+ * Save Template vCPU
+ *
+ * Saves the state of a template's only vCPU in the template's domain, so
+ * that clones of the template start from this state (see
+ * hypercall_vcpu_op__restore_template_vcpu). The vCPU must be killed or
+ * paused, and no longer being run (see hypercall_vcpu_op__save_vcpu), and
+ * it must never be run again. A template can only be cloned once its vCPU
+ * has been saved.
+ *
+ * @param vcpuid the template's vCPU
+ * @return SUCCESS on success, FAILURE otherwise
+ */
+static inline status_t
+hypercall_vcpu_op__save_template_vcpu(vcpuid_t vcpuid)
+{
+    return _vmcall(
+        hypercall_enum_vcpu_op__save_template_vcpu,
+        vcpuid,
+        0,
+        0
+    );
+}
+
+/**
+ * Restore Template vCPU
+ *
+ * Restores a clone's vCPU from the state its template's vCPU was saved in
+ * (see hypercall_vcpu_op__save_template_vcpu). The vCPU must not have been
+ * run yet.
+ *
+ * @param vcpuid the clone's vCPU
+ * @return SUCCESS on success, FAILURE otherwise
+ */
+static inline status_t
+hypercall_vcpu_op__restore_template_vcpu(vcpuid_t vcpuid)
+{
+    return _vmcall(
+        hypercall_enum_vcpu_op__restore_template_vcpu,
+        vcpuid,
+        0,
+        0
+    );
+}
+
+// -----------------------------------------------------------------------------
+// VMCall Operations
+// -----------------------------------------------------------------------------
+
+// Note:
+//
+// By default, the VMM only accepts VMCalls from CPL0. A dom0 kernel driver
+// can register a token that allows a userspace (CPL3) process to execute
+// VMCalls directly. When executing a VMCall from CPL3, the token must be
+// placed in rsi. The token operations themselves are only accepted from
+// CPL0.
+//
+
+#define hypercall_enum_vmcall_op__add_token 0xBF05000000000100
+#define hypercall_enum_vmcall_op__remove_token 0xBF05000000000101
+
+static inline status_t
+hypercall_vmcall_op__add_token(uint64_t token)
+{
+    return _vmcall(
+        hypercall_enum_vmcall_op__add_token,
+        token,
+        0,
+        0
+    );
+}
+
+static inline status_t
+hypercall_vmcall_op__remove_token(uint64_t token)
+{
+    return _vmcall(
+        hypercall_enum_vmcall_op__remove_token,
+        token,
+        0,
+        0
+    );
+}
+
 /* -------------------------------------------------------------------------- */
 /* Virtual IRQs                                                               */
 /* -------------------------------------------------------------------------- */
 
+#define boxy_virq__base 0xBF00000000000000
 #define boxy_virq__vclock_event_handler 0xBF00000000000201
 
 #define hypercall_enum_virq_op__set_hypervisor_callback_vector 0xBF10000000000100
 #define hypercall_enum_virq_op__get_next_virq 0xBF10000000000101
+#define hypercall_enum_virq_op__set_event_page 0xBF10000000000102
+
+#define VIRQ_EVENT_PAGE_NUM_VIRQS 4096
+#define VIRQ_EVENT_PAGE_NUM_WORDS (VIRQ_EVENT_PAGE_NUM_VIRQS / 64)
+
+/**
+ * @struct virq_event_page
+ *
+ * The per-vCPU event page shared between the VMM and a guest (see
+ * hypercall_virq_op__set_event_page). Each vIRQ owns a single bit in the
+ * pending and mask bitmaps, given by (virq - boxy_virq__base). When a vIRQ
+ * is raised, the VMM atomically sets its pending bit, and if the vIRQ is
+ * not masked, sets upcall_pending. The hypervisor callback vector is only
+ * delivered when upcall_pending goes from 0 to 1.
+ *
+ * The guest's callback should clear upcall_pending, and then atomically
+ * exchange each pending word with 0, handling every unmasked bit that was
+ * set, until upcall_pending remains 0. No VMCalls are needed to drain the
+ * vIRQs. If the guest unmasks a vIRQ, it must check the vIRQ's pending
+ * bit itself, as the VMM will not deliver the callback vector for a vIRQ
+ * that was already pending.
+ */
+struct virq_event_page {
+    uint64_t upcall_pending;
+    uint64_t reserved;
+
+    uint64_t pending[VIRQ_EVENT_PAGE_NUM_WORDS];
+    uint64_t mask[VIRQ_EVENT_PAGE_NUM_WORDS];
+};
 
 static inline uint64_t
 hypercall_virq_op__set_hypervisor_callback_vector(uint64_t vector)
@@ -619,6 +1226,24 @@ hypercall_virq_op__get_next_virq(void)
         hypercall_enum_virq_op__get_next_virq, 0, 0, 0);
 }
 
+/**
+ * Set Event Page
+ *
+ * Registers the calling vCPU's event page (see virq_event_page). Once
+ * registered, vIRQs are reported using the page instead of
+ * hypercall_virq_op__get_next_virq. The page must be page aligned, and each
+ * vCPU must register its own page. Passing 0 unregisters the current page.
+ *
+ * @param gpa the guest physical address of the page
+ * @return SUCCESS on success, FAILURE otherwise
+ */
+static inline status_t
+hypercall_virq_op__set_event_page(uint64_t gpa)
+{
+    return _vmcall(
+        hypercall_enum_virq_op__set_event_page, gpa, 0, 0);
+}
+
 /* -------------------------------------------------------------------------- */
 /* Virtual Clock                                                              */
 /* -------------------------------------------------------------------------- */
@@ -631,6 +1256,8 @@ hypercall_virq_op__get_next_virq(void)
 #define hypercall_enum_vclock_op__set_guest_wallclock_rtc 0xBF11000000000106
 #define hypercall_enum_vclock_op__set_guest_wallclock_tsc 0xBF11000000000107
 #define hypercall_enum_vclock_op__get_guest_wallclock 0xBF11000000000108
+#define hypercall_enum_vclock_op__get_tsc_to_nsec_mult_shift 0xBF11000000000109
+#define hypercall_enum_vclock_op__set_pvclock_page 0xBF1100000000010A
 
 static inline uint64_t
 hypercall_vclock_op__get_tsc_freq_khz(void)
@@ -708,6 +1335,84 @@ hypercall_vclock_op__get_guest_wallclock(
         &op, sec, nsec, tsc);
 }
 
+/**
+ * Get TSC to Nanoseconds Mult/Shift
+ *
+ * Returns the fixed-point constants the VMM uses to convert TSC ticks to
+ * nanoseconds, which are:
+ *
+ * nsec = (tsc * mult) >> shift
+ *
+ * where the multiply is performed using 128bit math. A guest that uses the
+ * same constants (and the TSC returned by get_guest_wallclock as its base)
+ * computes the same time as the VMM.
+ *
+ * @param mult (out) the multiplier
+ * @param shift (out) the shift
+ * @return SUCCESS on success, FAILURE otherwise
+ */
+static inline uint64_t
+hypercall_vclock_op__get_tsc_to_nsec_mult_shift(
+    uint64_t *mult, uint64_t *shift)
+{
+    uint64_t op = hypercall_enum_vclock_op__get_tsc_to_nsec_mult_shift;
+    uint64_t unused = 0;
+
+    if (mult == 0 || shift == 0) {
+        return FAILURE;
+    }
+
+    return _vmcall4(
+        &op, mult, shift, &unused);
+}
+
+/**
+ * @struct vclock_pvclock_info
+ *
+ * The per-vCPU time info page shared between the VMM and a guest (see
+ * hypercall_vclock_op__set_pvclock_page). The VMM updates this page when
+ * the guest's wallclock is set and when it moves the wallclock's base
+ * forward, which allows the guest to compute the current time without a
+ * VM exit:
+ *
+ * nsec = sec/nsec + (((rdtsc - tsc) * tsc_to_nsec_mult) >> tsc_to_nsec_shift)
+ *
+ * The version field works like a seqlock. It is odd while the VMM is
+ * updating the page, so the guest must read the version, read the
+ * remaining fields, and then reread the version, retrying if the version
+ * was odd or has changed. A tsc of 0 means the guest's wallclock has not
+ * been set yet.
+ */
+struct vclock_pvclock_info {
+    uint32_t version;
+    uint32_t reserved;
+
+    uint64_t tsc;
+    int64_t sec;
+    int64_t nsec;
+
+    uint64_t tsc_to_nsec_mult;
+    uint64_t tsc_to_nsec_shift;
+};
+
+/**
+ * Set pvclock Page
+ *
+ * Registers the calling vCPU's time info page (see vclock_pvclock_info).
+ * The page must be page aligned, and each vCPU must register its own page.
+ * Passing 0 unregisters the current page.
+ *
+ * @param gpa the guest physical address of the page
+ * @return SUCCESS on success, FAILURE otherwise
+ */
+static inline status_t
+hypercall_vclock_op__set_pvclock_page(uint64_t gpa)
+{
+    return _vmcall(
+        hypercall_enum_vclock_op__set_pvclock_page, gpa, 0, 0
+    );
+}
+
 #pragma pack(pop)
 
 #endif
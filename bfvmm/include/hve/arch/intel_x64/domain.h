@@ -22,13 +22,16 @@
 #ifndef DOMAIN_INTEL_X64_BOXY_H
 #define DOMAIN_INTEL_X64_BOXY_H
 
+#include <mutex>
 #include <vector>
 #include <memory>
+#include <unordered_map>
 
 #include "uart.h"
 #include "../../../domain/domain.h"
 #include "../../../domain/domain_manager.h"
 
+#include <bfhypercall.h>
 #include <bfvmm/hve/arch/intel_x64/vcpu.h>
 
 // -----------------------------------------------------------------------------
@@ -65,7 +68,8 @@ public:
     /// Map 1g GPA to HPA (Read-Only)
     ///
     /// Maps a 1g guest physical address to a 1g host physical address
-    /// using EPT
+    /// using EPT. If the CPU does not support 1g EPT pages, the range is
+    /// mapped using 2m pages instead.
     ///
     /// @expects
     /// @ensures
@@ -104,7 +108,8 @@ public:
     /// Map 1g GPA to HPA (Read/Wrtie)
     ///
     /// Maps a 1g guest physical address to a 1g host physical address
-    /// using EPT
+    /// using EPT. If the CPU does not support 1g EPT pages, the range is
+    /// mapped using 2m pages instead.
     ///
     /// @expects
     /// @ensures
@@ -143,7 +148,8 @@ public:
     /// Map 1g GPA to HPA (Read/Write/Execute)
     ///
     /// Maps a 1g guest physical address to a 1g host physical address
-    /// using EPT
+    /// using EPT. If the CPU does not support 1g EPT pages, the range is
+    /// mapped using 2m pages instead.
     ///
     /// @expects
     /// @ensures
@@ -181,7 +187,8 @@ public:
 
     /// Unmap GPA
     ///
-    /// Unmaps a guest physical address
+    /// Unmaps a guest physical address. dom0 is identity mapped using large
+    /// pages, which are not split, so pages cannot be unmapped from dom0.
     ///
     /// @expects
     /// @ensures
@@ -257,6 +264,302 @@ public:
     ///
     uint64_t dump_uart(const gsl::span<char> &buffer);
 
+public:
+
+    /// Add vCPU
+    ///
+    /// Adds a vCPU to the domain and assigns it an APIC ID. APIC IDs are
+    /// handed out in the order that vCPUs are added, which means that the
+    /// first vCPU that is added to a domain is the bootstrap processor
+    /// (i.e., APIC ID 0) and all other vCPUs are application processors.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param vcpu the vCPU to add
+    /// @return the APIC ID assigned to the vCPU
+    ///
+    uint32_t add_vcpu(gsl::not_null<vcpu *> vcpu);
+
+    /// Remove vCPU
+    ///
+    /// Removes a vCPU from the domain. The APIC ID that was assigned to the
+    /// vCPU is not reused.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param vcpu the vCPU to remove
+    ///
+    void remove_vcpu(gsl::not_null<vcpu *> vcpu) noexcept;
+
+    /// Deliver IPI
+    ///
+    /// Marks a fixed IPI as pending on the vCPU with the provided APIC ID.
+    /// The vCPU is looked up and the IPI is delivered while holding the
+    /// domain's vCPU lock, which ensures the vCPU cannot be removed (and
+    /// destroyed) in between. If no such vCPU exists, the IPI is dropped.
+    ///
+    /// If the vCPU has to be woken up to see the IPI, its vcpuid is
+    /// returned, in which case the caller has to kick the vCPU (see
+    /// vcpu::return_kick).
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param apic_id the APIC ID of the vCPU to deliver the IPI to
+    /// @param vector the vector of the IPI
+    /// @return the vcpuid of the vCPU to kick, or INVALID_VCPUID if no kick
+    ///     is needed
+    ///
+    vcpuid_t deliver_ipi(uint32_t apic_id, uint64_t vector) noexcept;
+
+    /// Deliver INIT
+    ///
+    /// Same as deliver_ipi, but puts the vCPU into the wait-for-SIPI state.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param apic_id the APIC ID of the vCPU to deliver the INIT to
+    ///
+    void deliver_init(uint32_t apic_id) noexcept;
+
+    /// Deliver SIPI
+    ///
+    /// Same as deliver_ipi, but starts a vCPU that is waiting for a SIPI.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param apic_id the APIC ID of the vCPU to deliver the SIPI to
+    /// @param vector the start up vector of the SIPI
+    /// @return the vcpuid of the vCPU to kick, or INVALID_VCPUID if no kick
+    ///     is needed
+    ///
+    vcpuid_t deliver_sipi(uint32_t apic_id, uint64_t vector) noexcept;
+
+    /// Number of vCPUs
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the number of APIC IDs that have been handed out by this
+    ///     domain (i.e., the number of vCPUs the guest can see)
+    ///
+    uint32_t num_vcpus() const noexcept;
+
+public:
+
+    /// CPUID Entry
+    ///
+    /// The guest's view of a single CPUID leaf/subleaf
+    ///
+    struct cpuid_entry {
+        uint32_t leaf;
+        uint32_t subleaf;
+
+        uint64_t rax;
+        uint64_t rbx;
+        uint64_t rcx;
+        uint64_t rdx;
+    };
+
+    /// Find CPUID
+    ///
+    /// Returns the guest's view of a CPUID leaf/subleaf. These are computed
+    /// once when the domain is created (i.e., the host's CPUID with any
+    /// features the guest should not see masked off), so that a CPUID exit
+    /// does not need to execute CPUID. Anything that is specific to a vCPU
+    /// (e.g., the APIC ID) is not included (see cpuid_handler). Leaves that
+    /// do not take a subleaf are stored as subleaf 0.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param leaf the CPUID leaf (i.e., EAX)
+    /// @param subleaf the CPUID subleaf (i.e., ECX)
+    /// @return the entry for the leaf/subleaf, or a nullptr if the guest
+    ///     should see all zeros for this leaf/subleaf
+    ///
+    const cpuid_entry *find_cpuid(uint32_t leaf, uint32_t subleaf) const noexcept;
+
+    /// Set XSAVE Policy
+    ///
+    /// Sets which extended state components (see XSAVE_POLICY_xxx) the
+    /// guest is allowed to enable in XCR0, and rebuilds the guest's CPUID
+    /// so that XSAVE and the features that depend on these components
+    /// (e.g., AVX) are reported. This must be called before any vCPUs are
+    /// added to the domain.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param policy the XSAVE policy (XSAVE_POLICY_xxx)
+    ///
+    void set_xsave_policy(uint64_t policy);
+
+    /// XCR0 Mask
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the XCR0 bits the guest is allowed to set (other
+    ///     than x87 and SSE), or 0 if XSAVE is not exposed to the guest
+    ///
+    uint64_t xcr0_mask() const noexcept;
+
+    /// XSAVE Size
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param xcr0 the XCR0 value to get the size of the XSAVE area for
+    /// @return returns the size (in bytes) of the XSAVE area (standard
+    ///     format) needed by the state components enabled in xcr0
+    ///
+    uint32_t xsave_size(uint64_t xcr0) const noexcept;
+
+public:
+
+    /// Reserve RAM
+    ///
+    /// Reserves a range of the guest's physical address space as RAM that
+    /// is populated on demand. Nothing is mapped into this range up front.
+    /// Instead, the first time the guest touches a page in this range, a
+    /// page is taken from the domain's pool and mapped in its place (see
+    /// populate_ram). A domain can only reserve one range of RAM.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param gpa the guest physical address of the range (page aligned)
+    /// @param size the size of the range in bytes (page aligned)
+    ///
+    void reserve_ram(uintptr_t gpa, uint64_t size);
+
+    /// Add Pool Page
+    ///
+    /// Adds a zeroed page to the pool used to populate reserved RAM.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param hpa the host physical address of the page
+    ///
+    void add_pool_page(uintptr_t hpa);
+
+    /// Is Reserved RAM
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param gpa the guest physical address to check
+    /// @return returns true if gpa is in the domain's reserved RAM
+    ///
+    bool is_reserved_ram(uintptr_t gpa) const noexcept;
+
+    /// Populate RAM
+    ///
+    /// Maps a page from the pool at the page containing gpa. If the page
+    /// has already been populated (e.g., by another vCPU that faulted on
+    /// the same page), nothing is done.
+    ///
+    /// @expects gpa is in the domain's reserved RAM
+    /// @ensures
+    ///
+    /// @param gpa the guest physical address to populate
+    /// @return returns false if the pool is empty, true otherwise
+    ///
+    bool populate_ram(uintptr_t gpa);
+
+public:
+
+    /// Clone
+    ///
+    /// Makes this domain a clone of the provided template by copying the
+    /// template's domain registers, CPUID (which includes the XSAVE
+    /// policy) and the state of the template's vCPU (see
+    /// save_template_vcpu). The template's RAM is shared with the clone
+    /// separately (see map_4k_cow). This must be called before any vCPUs
+    /// are added to the domain, and a clone can only have one vCPU.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param tmpl the domain to clone
+    ///
+    void clone(const domain &tmpl);
+
+    /// Save Template vCPU
+    ///
+    /// Saves the state of this domain's only vCPU (see vcpu::save_snapshot)
+    /// so that clones of this domain start from where the vCPU was saved
+    /// instead of from reset (see restore_template_vcpu). The vCPU must be
+    /// loaded, and it must never be run again, as its RAM is shared with
+    /// the clones from then on. A domain can only be cloned once this has
+    /// been done.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param vcpu the template's vCPU
+    ///
+    void save_template_vcpu(gsl::not_null<vcpu *> vcpu);
+
+    /// Restore Template vCPU
+    ///
+    /// Restores a clone's vCPU from the state of the template's vCPU that
+    /// was copied when this domain was cloned (see vcpu::restore_snapshot).
+    /// The vCPU must be loaded, and must not have been run yet.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param vcpu the clone's vCPU
+    ///
+    void restore_template_vcpu(gsl::not_null<vcpu *> vcpu);
+
+    /// Map 4k GPA to HPA (Copy on Write)
+    ///
+    /// Shares a 4k page with this domain as read/execute. The first time
+    /// the guest writes to the page, the page is replaced with a private
+    /// copy taken from the domain's pool (see copy_on_write).
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param gpa the guest physical address
+    /// @param hpa the host physical address of the shared page
+    ///
+    void map_4k_cow(uintptr_t gpa, uintptr_t hpa);
+
+    /// Is Copy on Write Page
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param gpa the guest physical address to check
+    /// @return returns true if gpa is in a page that is still shared
+    ///
+    bool is_cow_page(uintptr_t gpa) const;
+
+    /// Copy on Write
+    ///
+    /// Copies the shared page containing gpa into a page taken from the
+    /// pool, and maps the copy in place of the shared page. If the page has
+    /// already been copied, nothing is done. Since an existing mapping is
+    /// changed, the caller must flush the EPT once this returns true.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param vcpu the vCPU used to map the pages that are copied
+    /// @param gpa the guest physical address that was written to
+    /// @return returns false if the pool is empty, true otherwise
+    ///
+    bool copy_on_write(gsl::not_null<vcpu *> vcpu, uintptr_t gpa);
+
 public:
 
     /// Domain Registers
@@ -389,6 +692,30 @@ public:
 
     /// @endcond
 
+    /// Initial State
+    ///
+    /// Copies all of the domain registers into the provided state in one
+    /// go (i.e., the bulk version of each of the register getters above).
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param state the state to fill in
+    ///
+    void initial_state(struct domain_initial_state &state) const noexcept;
+
+    /// Set Initial State
+    ///
+    /// Sets all of the domain registers from the provided state in one
+    /// go (i.e., the bulk version of each of the register setters above).
+    ///
+    /// @expects state.version == DOMAIN_INITIAL_STATE_VERSION
+    /// @ensures
+    ///
+    /// @param state the state to copy from
+    ///
+    void set_initial_state(const struct domain_initial_state &state);
+
 public:
 
     bfvmm::intel_x64::ept::mmap &ept()
@@ -402,12 +729,33 @@ private:
 
     void setup_dom0();
     void setup_domU();
+    void setup_cpuid();
+
+    void map_1g(
+        uintptr_t gpa, uintptr_t hpa, bfvmm::intel_x64::ept::mmap::attr_type attr);
 
 private:
 
     bfvmm::intel_x64::ept::mmap m_ept_map;
     bfvmm::intel_x64::vcpu_global_state_t m_vcpu_global_state;
 
+    std::vector<vcpu *> m_vcpus;
+    mutable std::mutex m_vcpus_mutex;
+
+    std::vector<cpuid_entry> m_cpuid;
+    uint64_t m_xcr0_mask{};
+
+    uintptr_t m_ram_gpa{};
+    uint64_t m_ram_size{};
+    std::vector<bool> m_ram_populated;
+    std::vector<uintptr_t> m_pool;
+    std::unordered_map<uintptr_t, uintptr_t> m_cow;
+    mutable std::mutex m_pool_mutex;
+
+    bool m_clone{};
+    page_ptr<struct vcpu_snapshot> m_template_vcpu{};
+    page_ptr<uint8_t> m_template_xsave{};
+
     uart::port_type m_uart_port{};
     uart::port_type m_pt_uart_port{};
     uart m_uart_3F8{0x3F8};
@@ -504,4 +852,18 @@ public:
 #define get_domain(a) \
     g_dm->get<boxy::intel_x64::domain *>(a, "invalid domainid: " __FILE__)
 
+/// Try Get Domain
+///
+/// Same as get_domain, but returns a nullptr instead of throwing if the
+/// domain does not exist. Hypercall handlers should use this so that an
+/// invalid domain id does not result in unwinding through the VMM.
+///
+/// @expects
+/// @ensures
+///
+/// @return returns a pointer to the domain being queried or a nullptr
+///
+#define try_get_domain(a) \
+    g_dm->get<boxy::intel_x64::domain *>(a, nullptr)
+
 #endif
@@ -82,6 +82,10 @@ public:
 
     /// @endcond
 
+private:
+
+    void load_cpuid(vcpu_t *vcpu, uint32_t leaf, uint32_t subleaf);
+
 private:
 
     vcpu *m_vcpu;
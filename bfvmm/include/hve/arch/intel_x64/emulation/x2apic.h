@@ -22,6 +22,12 @@
 #ifndef EMULATION_X2APIC_INTEL_X64_BOXY_H
 #define EMULATION_X2APIC_INTEL_X64_BOXY_H
 
+#include <array>
+#include <atomic>
+#include <vector>
+
+#include <bfhypercall.h>
+
 #include <bfvmm/hve/arch/intel_x64/vcpu.h>
 #include <bfvmm/hve/arch/intel_x64/vmexit/rdmsr.h>
 #include <bfvmm/hve/arch/intel_x64/vmexit/wrmsr.h>
@@ -56,6 +62,157 @@ public:
     ///
     ~x2apic_handler() = default;
 
+public:
+
+    /// Queue Guest Interrupt
+    ///
+    /// Queues an interrupt into the guest. If APICv is enabled (see
+    /// is_apicv_enabled), the interrupt is marked pending in the
+    /// virtual-APIC page and the CPU delivers it on VM entry once the
+    /// guest is able to accept it. Otherwise the interrupt is queued using
+    /// the vCPU's interrupt queue, and marked pending in the emulated IRR
+    /// until it is injected. This must be executed with the vCPU loaded.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param vector the vector to queue
+    ///
+    void queue_guest_interrupt(uint64_t vector);
+
+    /// Inject Guest Interrupt
+    ///
+    /// Same as queue_guest_interrupt, except that if APICv is disabled,
+    /// the interrupt is injected on the next VM entry instead of being
+    /// queued. When APICv is enabled the two are the same, as a pending
+    /// virtual interrupt is delivered on the next VM entry anyways (if
+    /// the guest can accept it).
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param vector the vector to inject
+    ///
+    void inject_guest_interrupt(uint64_t vector);
+
+    /// Is APICv Enabled
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns true if the virtual-APIC page, TPR shadow, APIC
+    ///     register virtualization and virtual-interrupt delivery are
+    ///     being used for this vCPU, false if the x2APIC is emulated
+    ///
+    bool is_apicv_enabled() const noexcept;
+
+    /// Deliver IPI
+    ///
+    /// Marks a fixed IPI as pending. The IPI is not injected until the
+    /// vCPU is run again (see inject_pending_ipis), which means that this
+    /// function is safe to call from any physical CPU (i.e., it is how
+    /// vCPUs of the same domain send IPIs to each other).
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param vector the vector of the IPI
+    /// @return returns true if the vCPU has to be kicked to see the IPI,
+    ///     false if a kick is already on its way (i.e., an IPI that shares
+    ///     the same pending word has not been injected yet)
+    ///
+    bool deliver_ipi(uint64_t vector) noexcept;
+
+    /// Deliver INIT
+    ///
+    /// Puts the vCPU into the wait-for-SIPI state. Like deliver_ipi, this
+    /// is safe to call from any physical CPU. Note that INIT is only
+    /// supported for application processors (i.e., it is used to start
+    /// the vCPU, and not to reset it).
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void deliver_init() noexcept;
+
+    /// Deliver SIPI
+    ///
+    /// If the vCPU is in the wait-for-SIPI state, records the SIPI vector
+    /// so that the vCPU is started in real mode at vector * 0x1000 the
+    /// next time it is run. Otherwise the SIPI is ignored (Linux sends two).
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param vector the start up vector of the SIPI
+    /// @return returns true if the vCPU has to be kicked to start, false
+    ///     if the SIPI was ignored
+    ///
+    bool deliver_sipi(uint64_t vector) noexcept;
+
+    /// Is Waiting For SIPI
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns true if the vCPU cannot be run because it is waiting
+    ///     for a SIPI, false otherwise
+    ///
+    bool is_waiting_for_sipi() const noexcept;
+
+    /// Inject Pending IPIs
+    ///
+    /// Starts the vCPU if a SIPI was received, and queues any pending IPIs
+    /// into the vCPU. This must be executed with the vCPU loaded, right
+    /// before the vCPU is run.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void inject_pending_ipis();
+
+    /// Next Kick
+    ///
+    /// Sending an IPI to another vCPU returns to the parent with a kick for
+    /// each vCPU that has to be woken up, so that the host can interrupt
+    /// the vCPU if it is running, or wake it up if it is yielding. Only one
+    /// kick can be returned at a time, so if an IPI is sent to more than
+    /// one vCPU, the remaining kicks are returned by the run_op handler
+    /// before the vCPU is resumed.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the vcpuid of the next vCPU to kick, or INVALID_VCPUID if
+    ///     there are no kicks left
+    ///
+    vcpuid_t next_kick() noexcept;
+
+    /// Save Snapshot
+    ///
+    /// Stores the emulated x2APIC registers, the virtual-APIC page (if
+    /// APICv is enabled), and any pending IPIs and SIPI in the provided
+    /// snapshot. This must be executed with the vCPU loaded.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param snapshot the snapshot to fill in
+    ///
+    void save_snapshot(struct vcpu_snapshot &snapshot) const;
+
+    /// Restore Snapshot
+    ///
+    /// Loads the x2APIC's state from the provided snapshot. This must be
+    /// executed with the vCPU loaded.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param snapshot the snapshot to restore from
+    ///
+    void restore_snapshot(const struct vcpu_snapshot &snapshot);
+
 public:
 
     /// @cond
@@ -64,6 +221,10 @@ public:
         vcpu_t *vcpu, bfvmm::intel_x64::rdmsr_handler::info_t &info);
     bool handle_wrmsr_0x0000001B(
         vcpu_t *vcpu, bfvmm::intel_x64::wrmsr_handler::info_t &info);
+    bool handle_rdmsr_0x000006E0(
+        vcpu_t *vcpu, bfvmm::intel_x64::rdmsr_handler::info_t &info);
+    bool handle_wrmsr_0x000006E0(
+        vcpu_t *vcpu, bfvmm::intel_x64::wrmsr_handler::info_t &info);
 
     bool handle_rdmsr_0x00000802(
         vcpu_t *vcpu, bfvmm::intel_x64::rdmsr_handler::info_t &info);
@@ -77,6 +238,14 @@ public:
         vcpu_t *vcpu, bfvmm::intel_x64::rdmsr_handler::info_t &info);
     bool handle_wrmsr_0x00000808(
         vcpu_t *vcpu, bfvmm::intel_x64::wrmsr_handler::info_t &info);
+    bool handle_rdmsr_0x0000080B(
+        vcpu_t *vcpu, bfvmm::intel_x64::rdmsr_handler::info_t &info);
+    bool handle_wrmsr_0x0000080B(
+        vcpu_t *vcpu, bfvmm::intel_x64::wrmsr_handler::info_t &info);
+    bool handle_rdmsr_0x0000080D(
+        vcpu_t *vcpu, bfvmm::intel_x64::rdmsr_handler::info_t &info);
+    bool handle_wrmsr_0x0000080D(
+        vcpu_t *vcpu, bfvmm::intel_x64::wrmsr_handler::info_t &info);
     bool handle_rdmsr_0x0000080F(
         vcpu_t *vcpu, bfvmm::intel_x64::rdmsr_handler::info_t &info);
     bool handle_wrmsr_0x0000080F(
@@ -152,6 +321,15 @@ public:
     bool handle_wrmsr_0x00000827(
         vcpu_t *vcpu, bfvmm::intel_x64::wrmsr_handler::info_t &info);
 
+    bool handle_rdmsr_0x00000830(
+        vcpu_t *vcpu, bfvmm::intel_x64::rdmsr_handler::info_t &info);
+    bool handle_wrmsr_0x00000830(
+        vcpu_t *vcpu, bfvmm::intel_x64::wrmsr_handler::info_t &info);
+
+    bool handle_rdmsr_0x00000832(
+        vcpu_t *vcpu, bfvmm::intel_x64::rdmsr_handler::info_t &info);
+    bool handle_wrmsr_0x00000832(
+        vcpu_t *vcpu, bfvmm::intel_x64::wrmsr_handler::info_t &info);
     bool handle_rdmsr_0x00000835(
         vcpu_t *vcpu, bfvmm::intel_x64::rdmsr_handler::info_t &info);
     bool handle_wrmsr_0x00000835(
@@ -165,11 +343,38 @@ public:
     bool handle_wrmsr_0x00000837(
         vcpu_t *vcpu, bfvmm::intel_x64::wrmsr_handler::info_t &info);
 
+    bool handle_rdmsr_0x00000838(
+        vcpu_t *vcpu, bfvmm::intel_x64::rdmsr_handler::info_t &info);
+    bool handle_wrmsr_0x00000838(
+        vcpu_t *vcpu, bfvmm::intel_x64::wrmsr_handler::info_t &info);
+
     /// @endcond
 
+private:
+
+    bool enable_apicv();
+    void post_interrupt(uint64_t vector);
+
+    uint64_t &irr(uint64_t vector);
+    uint64_t injected_vector() const;
+    void resume_delegate(vcpu_t *vcpu);
+
+    bool is_tsc_deadline_mode() const noexcept;
+    uint64_t tsc_deadline_vector() const noexcept;
+
+    void send_ipi(uint32_t apic_id, uint64_t icr);
+    void start_ap(uint64_t vector);
+
 private:
 
     vcpu *m_vcpu;
+    page_ptr<uint32_t> m_virtual_apic_page{};
+
+    std::array<std::atomic<uint64_t>, 4> m_pending_ipis{};
+    std::atomic<uint64_t> m_sipi_state{};
+    std::atomic<uint64_t> m_sipi_vector{};
+
+    std::vector<vcpuid_t> m_kicks{};
 
     uint64_t m_0x0000001B{0xFEE00D00};
 
@@ -194,6 +399,9 @@ private:
     uint64_t m_0x00000826{0};
     uint64_t m_0x00000827{0};
 
+    uint64_t m_0x00000830{0};
+
+    uint64_t m_0x00000832{1U << 16U};
     uint64_t m_0x00000835{1U << 16U};
     uint64_t m_0x00000836{1U << 16U};
     uint64_t m_0x00000837{1U << 16U};
@@ -28,12 +28,14 @@
 
 #include "domain.h"
 
+#include "vmexit/exit_stats.h"
 #include "vmexit/external_interrupt.h"
 #include "vmexit/hlt.h"
 #include "vmexit/io_instruction.h"
 #include "vmexit/msr.h"
 #include "vmexit/preemption_timer.h"
 #include "vmexit/vmcall.h"
+#include "vmexit/xstate.h"
 
 #include "vmcall/domain_op.h"
 #include "vmcall/run_op.h"
@@ -112,6 +114,25 @@ public:
     ///
     VIRTUAL domain::domainid_type domid() const noexcept;
 
+    /// Domain
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the domain this vCPU belongs to
+    ///
+    VIRTUAL domain *dom() const noexcept;
+
+    /// APIC ID
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the vCPU's (x2)APIC ID. The bootstrap processor of a domain
+    ///     is always 0. dom0 vCPUs do not have an APIC ID (i.e., 0).
+    ///
+    VIRTUAL uint32_t apic_id() const noexcept;
+
     //--------------------------------------------------------------------------
     // VMCall
     //--------------------------------------------------------------------------
@@ -121,9 +142,11 @@ public:
     /// @expects
     /// @ensures
     ///
+    /// @param opcode the hypercall opcode (hypercall_enum_xxx) to handle
     /// @param d the delegate to call when a vmcall exit occurs
     ///
-    VIRTUAL void add_vmcall_handler(const handler_delegate_t &d);
+    VIRTUAL void add_vmcall_handler(
+        uint64_t opcode, const handler_delegate_t &d);
 
     //--------------------------------------------------------------------------
     // Hlt
@@ -192,6 +215,45 @@ public:
     ///
     VIRTUAL vcpu *parent_vcpu() const noexcept;
 
+    /// Get Loaded MSRs
+    ///
+    /// Returns the isolated MSR state that is currently loaded into hardware
+    /// on the physical CPU this vCPU is executing on. See msr_handler for
+    /// more information.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the isolated MSR state loaded on this physical CPU
+    ///
+    VIRTUAL msr_handler::loaded_msrs_t &loaded_msrs() noexcept;
+
+    /// Get Loaded Extended State
+    ///
+    /// Returns the extended state (i.e., XSAVE state) that is currently
+    /// loaded into hardware on the physical CPU this vCPU is executing on.
+    /// See xstate_handler for more information.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the extended state loaded on this physical CPU
+    ///
+    VIRTUAL xstate_handler::loaded_xstate_t &loaded_xstate() noexcept;
+
+    /// Get Pending Exit
+    ///
+    /// Returns the exit that is currently being handled on the physical CPU
+    /// this vCPU is executing on. See exit_stats_handler for more
+    /// information.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the exit being handled on this physical CPU
+    ///
+    VIRTUAL exit_stats_handler::pending_exit_t &pending_exit() noexcept;
+
     /// Prepare For World Switch
     ///
     /// Prepares the vCPU for a world switch. This ensures that portions of
@@ -244,6 +306,32 @@ public:
     ///
     VIRTUAL void return_set_wallclock();
 
+    /// Return (Pool Empty)
+    ///
+    /// Return to the parent vCPU (i.e. resume the parent), and tell the parent
+    /// to donate more pages to the domain's pool and then resume back to the
+    /// guest
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param domainid the domain whose pool is empty
+    ///
+    VIRTUAL void return_pool_empty(uint64_t domainid);
+
+    /// Return (Kick)
+    ///
+    /// Return to the parent vCPU (i.e. resume the parent), and tell the parent
+    /// to wake up the provided vCPU (which was sent an IPI), and then resume
+    /// back to the guest
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param vcpuid the vCPU to kick
+    ///
+    VIRTUAL void return_kick(uint64_t vcpuid);
+
     //--------------------------------------------------------------------------
     // Control
     //--------------------------------------------------------------------------
@@ -275,6 +363,62 @@ public:
     ///
     VIRTUAL bool is_killed() const noexcept;
 
+    /// Stop
+    ///
+    /// Tells the vCPU that it has stopped executing the guest after it was
+    /// killed. This is called by the parent each time it is asked to run a
+    /// killed vCPU, the first of which marks the point in time that the
+    /// guest's TSC is saved from (see save_snapshot()).
+    ///
+    /// @expects is_killed() == true
+    /// @ensures
+    ///
+    VIRTUAL void stop() noexcept;
+
+    /// Pause
+    ///
+    /// Tells the vCPU to stop executing the guest until unpause() is
+    /// called. The vCPU is not paused (see is_paused()) until its parent
+    /// acknowledges the pause (see acknowledge_pause()).
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    VIRTUAL void pause() noexcept;
+
+    /// Unpause
+    ///
+    /// Allows the vCPU to execute the guest again.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    VIRTUAL void unpause() noexcept;
+
+    /// Is Paused
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns true if the vCPU has been paused and its parent has
+    ///     acknowledged the pause (i.e., the vCPU is not executing the
+    ///     guest), false otherwise
+    ///
+    VIRTUAL bool is_paused() const noexcept;
+
+    /// Acknowledge Pause
+    ///
+    /// This is called by the parent each time it is asked to run the vCPU.
+    /// If a pause has been requested, the vCPU is marked as paused, and the
+    /// parent must not run the vCPU.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns true if the vCPU is paused, false otherwise
+    ///
+    VIRTUAL bool acknowledge_pause() noexcept;
+
     //--------------------------------------------------------------------------
     // Virtual IRQs
     //--------------------------------------------------------------------------
@@ -305,6 +449,104 @@ public:
     ///
     VIRTUAL void inject_virtual_interrupt(uint64_t vector);
 
+    //--------------------------------------------------------------------------
+    // Interrupts
+    //--------------------------------------------------------------------------
+
+    /// Queue Guest Interrupt
+    ///
+    /// Queues an interrupt into the guest, using the virtual-APIC page if
+    /// APICv is enabled, and the vCPU's interrupt queue otherwise. This
+    /// must be executed with the vCPU loaded.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param vector the vector to queue
+    ///
+    VIRTUAL void queue_guest_interrupt(uint64_t vector);
+
+    /// Inject Guest Interrupt
+    ///
+    /// Injects an interrupt into the guest, using the virtual-APIC page if
+    /// APICv is enabled. This must be executed with the vCPU loaded.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param vector the vector to inject
+    ///
+    VIRTUAL void inject_guest_interrupt(uint64_t vector);
+
+    //--------------------------------------------------------------------------
+    // IPIs
+    //--------------------------------------------------------------------------
+
+    /// Deliver IPI
+    ///
+    /// Marks a fixed IPI as pending. Pending IPIs are injected the next
+    /// time the vCPU is run, so this can be called from any physical CPU.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param vector the vector of the IPI
+    /// @return returns true if the vCPU has to be kicked to see the IPI
+    ///
+    VIRTUAL bool deliver_ipi(uint64_t vector) noexcept;
+
+    /// Deliver INIT
+    ///
+    /// Puts an application processor into the wait-for-SIPI state.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    VIRTUAL void deliver_init() noexcept;
+
+    /// Deliver SIPI
+    ///
+    /// Starts an application processor that is waiting for a SIPI the
+    /// next time the vCPU is run.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param vector the start up vector of the SIPI
+    /// @return returns true if the vCPU has to be kicked to start
+    ///
+    VIRTUAL bool deliver_sipi(uint64_t vector) noexcept;
+
+    /// Is Waiting For SIPI
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns true if the vCPU cannot be run yet because it is an
+    ///     application processor that has not received a SIPI
+    ///
+    VIRTUAL bool is_waiting_for_sipi() const noexcept;
+
+    /// Inject Pending IPIs
+    ///
+    /// Handles any pending SIPI and queues any pending IPIs. This must be
+    /// executed with the vCPU loaded, right before the vCPU is run.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    VIRTUAL void inject_pending_ipis();
+
+    /// Next Kick
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the vcpuid of the next vCPU this vCPU has sent an IPI to that
+    ///     still has to be kicked, or INVALID_VCPUID if there are none
+    ///
+    VIRTUAL uint64_t next_kick() noexcept;
+
     //--------------------------------------------------------------------------
     // Virtual Clock
     //--------------------------------------------------------------------------
@@ -360,7 +602,101 @@ public:
     ///
     /// @return returns the host's Wall Clock from epoch
     ///
-    VIRTUAL std::pair<struct timespec, uint64_t> get_host_wallclock() const;
+    VIRTUAL std::pair<struct timespec, uint64_t> get_host_wallclock();
+
+    /// Set TSC Deadline
+    ///
+    /// Arms (or disarms) the vCPU's TSC deadline timer (see
+    /// vclock_handler::set_tsc_deadline).
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param tsc the absolute (host) TSC of the deadline, or 0 to disarm
+    /// @param vector the vector to queue once the deadline is reached, or
+    ///     0 if the timer is masked
+    ///
+    VIRTUAL void set_tsc_deadline(uint64_t tsc, uint64_t vector) noexcept;
+
+    /// TSC Deadline
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the absolute (host) TSC of the armed TSC deadline,
+    ///     or 0 if the timer is not armed
+    ///
+    VIRTUAL uint64_t tsc_deadline() const noexcept;
+
+    //--------------------------------------------------------------------------
+    // Copy on Write
+    //--------------------------------------------------------------------------
+
+    /// Copy on Write
+    ///
+    /// If gpa is in a page that this vCPU's domain still shares with its
+    /// template (see domain::map_4k_cow), the page is copied, and the EPT
+    /// is flushed. This must be executed with the vCPU loaded before the
+    /// VMM writes to guest memory on behalf of a clone (e.g., before the
+    /// page is mapped using map_gpa_4k), as the VMM's own mapping does not
+    /// go through the EPT, and would otherwise write to the shared page.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param gpa the guest physical address to write to
+    /// @return returns false if the domain's pool is empty, true otherwise
+    ///
+    VIRTUAL bool copy_on_write(uintptr_t gpa);
+
+    /// Retry VMCall (Pool Empty)
+    ///
+    /// Rewinds RIP to the VMCall that is being handled, and returns to the
+    /// parent vCPU to grow the domain's pool (see return_pool_empty). The
+    /// guest executes the VMCall again once the parent runs this vCPU
+    /// again. This does not return.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    VIRTUAL void retry_vmcall_on_pool_empty();
+
+    //--------------------------------------------------------------------------
+    // Snapshot
+    //--------------------------------------------------------------------------
+
+    /// Save Snapshot
+    ///
+    /// Saves the complete state of this vCPU (see struct vcpu_snapshot).
+    /// This must be executed with the vCPU loaded, once the vCPU has
+    /// stopped running (i.e., it has been killed or paused, and released),
+    /// as only then is the lazily switched state (i.e., the isolated MSRs
+    /// and the extended state) stored in the vCPU and not in hardware.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param snapshot the snapshot to fill in
+    /// @param xsave the page (VCPU_SNAPSHOT_XSAVE_SIZE) to store the XSAVE
+    ///     area in
+    ///
+    VIRTUAL void save_snapshot(struct vcpu_snapshot &snapshot, uint8_t *xsave);
+
+    /// Restore Snapshot
+    ///
+    /// Restores the complete state of this vCPU from a snapshot taken
+    /// using save_snapshot. This must be executed with the vCPU loaded,
+    /// before the vCPU is run for the first time, and after the domain's
+    /// RAM has been restored.
+    ///
+    /// @expects snapshot.version == VCPU_SNAPSHOT_VERSION
+    /// @ensures
+    ///
+    /// @param snapshot the snapshot to restore from
+    /// @param xsave the XSAVE area (VCPU_SNAPSHOT_XSAVE_SIZE) to restore
+    ///
+    VIRTUAL void restore_snapshot(
+        const struct vcpu_snapshot &snapshot, const uint8_t *xsave);
 
     //--------------------------------------------------------------------------
     // Fault
@@ -388,8 +724,11 @@ private:
 private:
 
     domain *m_domain{};
+    uint32_t m_apic_id{};
 
     bool m_killed{};
+    bool m_pause_requested{};
+    bool m_paused{};
     vcpu *m_parent_vcpu{};
 
 private:
@@ -400,6 +739,7 @@ private:
     msr_handler m_msr_handler;
     preemption_timer_handler m_preemption_timer_handler;
     vmcall_handler m_vmcall_handler;
+    xstate_handler m_xstate_handler;
 
     run_op_handler m_run_op_handler;
     domain_op_handler m_domain_op_handler;
@@ -411,6 +751,8 @@ private:
 
     vclock_handler m_vclock_handler;
     virq_handler m_virq_handler;
+
+    exit_stats_handler m_exit_stats_handler;
 };
 
 }
@@ -431,6 +773,10 @@ private:
 #undef get_vcpu
 #endif
 
+#ifdef try_get_vcpu
+#undef try_get_vcpu
+#endif
+
 #ifdef vcpu_cast
 #undef vcpu_cast
 #endif
@@ -448,6 +794,19 @@ private:
 #define get_vcpu(a) \
     g_vcm->get<boxy::intel_x64::vcpu *>(a, __FILE__ ": invalid boxy vcpuid")
 
+/// Try Get Guest vCPU
+///
+/// Same as get_vcpu, but returns a nullptr instead of throwing if the
+/// vCPU does not exist.
+///
+/// @expects
+/// @ensures
+///
+/// @return returns a pointer to the vCPU being queried or a nullptr
+///
+#define try_get_vcpu(a) \
+    g_vcm->get<boxy::intel_x64::vcpu *>(a, nullptr)
+
 /// Boxy vCPU Cast
 ///
 /// To keeps things simple, this is a Boxy specific vCPU cast so that we can
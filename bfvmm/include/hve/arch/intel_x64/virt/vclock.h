@@ -95,14 +95,15 @@ public:
     ///
     /// Returns the host's Wall Clock from epoch. This function will throw
     /// if the set_host_wallclock_rtc and set_host_wallclock_tsc functions
-    /// have not yet been called.
+    /// have not yet been called. The cached base is moved forward once it
+    /// is old (see rebase_wallclock()), which is why this is not const.
     ///
     /// @expects
     /// @ensures
     ///
     /// @return returns the host's Wall Clock from epoch
     ///
-    VIRTUAL std::pair<struct timespec, uint64_t> get_host_wallclock() const;
+    VIRTUAL std::pair<struct timespec, uint64_t> get_host_wallclock();
 
     //--------------------------------------------------------------------------
     // Guest Time
@@ -130,14 +131,89 @@ public:
     ///
     /// Returns the guest's Wall Clock from epoch. This function will throw
     /// if the set_guest_wallclock_rtc and set_guest_wallclock_tsc functions
-    /// have not yet been called.
+    /// have not yet been called. The cached base is moved forward once it
+    /// is old (see rebase_wallclock()), which is why this is not const.
     ///
     /// @expects
     /// @ensures
     ///
     /// @return returns the guest's Wall Clock from epoch
     ///
-    VIRTUAL std::pair<struct timespec, uint64_t> get_guest_wallclock() const;
+    VIRTUAL std::pair<struct timespec, uint64_t> get_guest_wallclock() noexcept;
+
+    //--------------------------------------------------------------------------
+    // TSC Deadline
+    //--------------------------------------------------------------------------
+
+    /// Set TSC Deadline
+    ///
+    /// Arms the TSC deadline timer, which is used to emulate the x2APIC's
+    /// TSC-deadline mode (see x2apic_handler). This uses the same absolute
+    /// TSC scheme as the clock event device (i.e., the preemption timer is
+    /// set on each VMResume), and once the deadline is reached, the
+    /// provided vector is queued into the guest and the timer is disarmed.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param tsc the absolute (host) TSC of the deadline, or 0 to disarm
+    /// @param vector the vector to queue once the deadline is reached, or
+    ///     0 if the timer is masked
+    ///
+    VIRTUAL void set_tsc_deadline(uint64_t tsc, uint64_t vector) noexcept;
+
+    /// TSC Deadline
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the absolute (host) TSC of the armed TSC deadline,
+    ///     or 0 if the timer is not armed
+    ///
+    VIRTUAL uint64_t tsc_deadline() const noexcept;
+
+    //--------------------------------------------------------------------------
+    // Snapshot
+    //--------------------------------------------------------------------------
+
+    /// Stop
+    ///
+    /// Records the TSC at which the vCPU stopped executing the guest (i.e.,
+    /// once it has been killed). Only the first call has an effect.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void stop() noexcept;
+
+    /// Save Snapshot
+    ///
+    /// Stores the guest's TSC at the time the vCPU stopped (see stop()),
+    /// the clock event and TSC deadline timers, and the guest's wall clock
+    /// base in the provided snapshot. All TSC values are converted to guest
+    /// TSC values.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param snapshot the snapshot to fill in
+    ///
+    VIRTUAL void save_snapshot(struct vcpu_snapshot &snapshot) const noexcept;
+
+    /// Restore Snapshot
+    ///
+    /// Sets the TSC offset so that the guest's TSC continues from where it
+    /// was saved, and rebases the timers and the guest's wall clock onto
+    /// the new offset. If the guest registered a pvclock page, the page is
+    /// mapped again and updated. This must be executed with the vCPU
+    /// loaded.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param snapshot the snapshot to restore from
+    ///
+    VIRTUAL void restore_snapshot(const struct vcpu_snapshot &snapshot);
 
     //--------------------------------------------------------------------------
     // Time Helpers
@@ -156,9 +232,9 @@ public:
     ///
     /// Note:
     ///
-    /// This function will perform the conversions without fear of overflow.
-    /// For this reason, if large number conversions are needed, this is
-    /// the function that you should use.
+    /// This function will perform the conversions without fear of overflow
+    /// using fixed-point math (i.e., a 128bit multiply and a shift), which
+    /// means that there is no divide.
     ///
     /// @expects
     /// @ensures
@@ -172,9 +248,9 @@ public:
     ///
     /// Note:
     ///
-    /// This function will perform the conversions without fear of overflow.
-    /// For this reason, if large number conversions are needed, this is
-    /// the function that you should use.
+    /// This function will perform the conversions without fear of overflow
+    /// using fixed-point math (i.e., a 128bit multiply and a shift), which
+    /// means that there is no divide.
     ///
     /// @expects
     /// @ensures
@@ -184,6 +260,24 @@ public:
     ///
     VIRTUAL uint64_t nsec_to_tsc(uint64_t nsec) const noexcept;
 
+    /// TSC to Nanoseconds Multiplier
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the fixed-point multiplier used by tsc_to_nsec
+    ///
+    VIRTUAL uint64_t tsc_to_nsec_mult() const noexcept;
+
+    /// TSC to Nanoseconds Shift
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the fixed-point shift used by tsc_to_nsec
+    ///
+    VIRTUAL uint64_t tsc_to_nsec_shift() const noexcept;
+
 public:
 
     /// @cond
@@ -191,14 +285,16 @@ public:
     bool handle_yield(vcpu *vcpu);
     bool handle_preemption_timer(vcpu *vcpu);
 
-    void vclock_op__get_tsc_freq_khz(vcpu *vcpu);
-    void vclock_op__set_next_event(vcpu *vcpu);
-    void vclock_op__reset_host_wallclock(vcpu *vcpu);
-    void vclock_op__set_host_wallclock_rtc(vcpu *vcpu);
-    void vclock_op__set_host_wallclock_tsc(vcpu *vcpu);
-    void vclock_op__set_guest_wallclock_rtc(vcpu *vcpu);
-    void vclock_op__set_guest_wallclock_tsc(vcpu *vcpu);
-    void vclock_op__get_guest_wallclock(vcpu *vcpu);
+    void vclock_op__get_tsc_freq_khz(vcpu *vcpu) noexcept;
+    void vclock_op__set_next_event(vcpu *vcpu) noexcept;
+    void vclock_op__reset_host_wallclock(vcpu *vcpu) noexcept;
+    void vclock_op__set_host_wallclock_rtc(vcpu *vcpu) noexcept;
+    void vclock_op__set_host_wallclock_tsc(vcpu *vcpu) noexcept;
+    void vclock_op__set_guest_wallclock_rtc(vcpu *vcpu) noexcept;
+    void vclock_op__set_guest_wallclock_tsc(vcpu *vcpu) noexcept;
+    void vclock_op__get_guest_wallclock(vcpu *vcpu) noexcept;
+    void vclock_op__get_tsc_to_nsec_mult_shift(vcpu *vcpu) noexcept;
+    void vclock_op__set_pvclock_page(vcpu *vcpu) noexcept;
 
     bool dispatch_dom0(vcpu *vcpu);
     bool dispatch_domU(vcpu *vcpu);
@@ -212,22 +308,41 @@ private:
     void setup_dom0();
     void setup_domU();
 
+    bool rebase_wallclock(
+        struct timespec &rtc, uint64_t &base_tsc, uint64_t tsc) noexcept;
+
+    void update_pvclock() const noexcept;
+
+    uint64_t next_event_tsc() const noexcept;
+    void queue_expired_events();
+
     void queue_vclock_event();
     void inject_vclock_event();
+    void queue_tsc_deadline_event();
+    void inject_tsc_deadline_event();
 
 private:
 
     vcpu *m_vcpu;
 
     uint64_t m_tsc_freq_khz{};
+    uint64_t m_tsc_to_nsec_mult{};
+    uint64_t m_nsec_to_tsc_mult{};
     uint64_t m_pet_decrement{};
     uint64_t m_next_event_tsc{};
+    uint64_t m_tsc_deadline{};
+    uint64_t m_tsc_deadline_vector{};
+    uint64_t m_tsc_offset{};
+    uint64_t m_stop_tsc{};
 
     uint64_t m_host_wc_tsc{};
     struct timespec m_host_wc_rtc{};
     uint64_t m_guest_wc_tsc{};
     struct timespec m_guest_wc_rtc{};
 
+    uint64_t m_pvclock_gpa{};
+    bfvmm::x64::unique_map<struct vclock_pvclock_info> m_pvclock{};
+
 public:
 
     /// @cond
@@ -0,0 +1,124 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef VIRT_VCLOCK_MATH_INTEL_X64_BOXY_H
+#define VIRT_VCLOCK_MATH_INTEL_X64_BOXY_H
+
+#include <cstdint>
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+// Note:
+//
+// The TSC <-> nanosecond conversions used by the vclock (see the notes in
+// vclock.cpp). These do not depend on the VMM, so that they can also be
+// tested and benchmarked on the host (see bfvmm/tests).
+//
+
+namespace boxy::intel_x64::vclock_math
+{
+
+/// Mult Shift
+///
+/// The number of fractional bits in the fixed-point multipliers
+///
+constexpr const uint64_t mult_shift = 32;
+
+/// Mul Div
+///
+/// Returns (x * n) / d without overflowing for any x, as long as the result
+/// and (d * n) fit in 64 bits. This is the exact (but slow) conversion.
+///
+/// @expects d != 0
+/// @ensures
+///
+/// @param x the value to convert
+/// @param n the numerator
+/// @param d the denominator
+/// @return returns (x * n) / d
+///
+constexpr uint64_t
+mul_div(uint64_t x, uint64_t n, uint64_t d) noexcept
+{ return ((x / d) * n) + (((x % d) * n) / d); }
+
+/// Mul Shift
+///
+/// Returns (x * mult) >> mult_shift using a 128bit multiply. This is the
+/// fast conversion.
+///
+/// @expects
+/// @ensures
+///
+/// @param x the value to convert
+/// @param mult the fixed-point multiplier
+/// @return returns (x * mult) >> mult_shift
+///
+constexpr uint64_t
+mul_shift(uint64_t x, uint64_t mult) noexcept
+{
+    using uint128_t = unsigned __int128;
+    return static_cast<uint64_t>((uint128_t{x} * mult) >> mult_shift);
+}
+
+/// Div Round
+///
+/// @expects d != 0
+/// @ensures
+///
+/// @param n the numerator
+/// @param d the denominator
+/// @return returns n / d rounded to the nearest integer
+///
+constexpr uint64_t
+div_round(uint64_t n, uint64_t d) noexcept
+{ return (n + (d / 2)) / d; }
+
+/// TSC to Nanoseconds Multiplier
+///
+/// @expects tsc_freq_khz != 0
+/// @ensures
+///
+/// @param tsc_freq_khz the TSC frequency in kHz
+/// @return returns the multiplier given to mul_shift() to convert TSC ticks
+///     to nanoseconds
+///
+constexpr uint64_t
+tsc_to_nsec_mult(uint64_t tsc_freq_khz) noexcept
+{ return div_round(1000000ULL << mult_shift, tsc_freq_khz); }
+
+/// Nanoseconds to TSC Multiplier
+///
+/// @expects
+/// @ensures
+///
+/// @param tsc_freq_khz the TSC frequency in kHz
+/// @return returns the multiplier given to mul_shift() to convert
+///     nanoseconds to TSC ticks
+///
+constexpr uint64_t
+nsec_to_tsc_mult(uint64_t tsc_freq_khz) noexcept
+{ return div_round(tsc_freq_khz << mult_shift, 1000000ULL); }
+
+}
+
+#endif
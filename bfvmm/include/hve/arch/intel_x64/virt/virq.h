@@ -65,6 +65,10 @@ public:
     /// vIRQ vector. Also note that all vIRQs are essentially vMSIs so once
     /// the vIRQ is dequeued, it is gone.
     ///
+    /// If the guest has registered an event page, the vIRQ is marked
+    /// pending in the page instead, and the Hypervisor Callback Vector IRQ
+    /// is only queued if the guest does not already have an upcall pending.
+    ///
     /// @expects
     /// @ensures
     ///
@@ -78,22 +82,56 @@ public:
     /// vIRQ vector. Also note that all vIRQs are essentially vMSIs so once
     /// the vIRQ is dequeued, it is gone.
     ///
+    /// If the guest has registered an event page, the vIRQ is marked
+    /// pending in the page instead, and the Hypervisor Callback Vector IRQ
+    /// is only injected if the guest does not already have an upcall pending.
+    ///
     /// @expects
     /// @ensures
     ///
     void inject_virtual_interrupt(uint64_t vector);
 
+    /// Save Snapshot
+    ///
+    /// Stores the Hypervisor Callback Vector, the event page and any vIRQs
+    /// that the guest has not dequeued yet in the provided snapshot.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param snapshot the snapshot to fill in
+    ///
+    void save_snapshot(struct vcpu_snapshot &snapshot);
+
+    /// Restore Snapshot
+    ///
+    /// Loads the vIRQ state from the provided snapshot. If any vIRQs are
+    /// pending, the Hypervisor Callback Vector IRQ is queued again. This
+    /// must be executed with the vCPU loaded.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param snapshot the snapshot to restore from
+    ///
+    void restore_snapshot(const struct vcpu_snapshot &snapshot);
+
 public:
 
     /// @cond
 
     void virq_op__set_hypervisor_callback_vector(vcpu *vcpu);
     void virq_op__get_next_virq(vcpu *vcpu);
+    void virq_op__set_event_page(vcpu *vcpu);
 
     bool dispatch(vcpu *vcpu);
 
     /// @endcond
 
+private:
+
+    bool set_event_pending(uint64_t vector);
+
 private:
 
     vcpu *m_vcpu;
@@ -101,6 +139,9 @@ private:
     uint64_t m_hypervisor_callback_vector{};
     bfvmm::intel_x64::interrupt_queue m_interrupt_queue;
 
+    uint64_t m_event_page_gpa{};
+    bfvmm::x64::unique_map<struct virq_event_page> m_event_page{};
+
 public:
 
     /// @cond
@@ -54,137 +54,146 @@ public:
 
 private:
 
-    void domain_op__create_domain(vcpu *vcpu);
-    void domain_op__destroy_domain(vcpu *vcpu);
-
-    void domain_op__set_uart(vcpu *vcpu);
-    void domain_op__set_pt_uart(vcpu *vcpu);
-    void domain_op__dump_uart(vcpu *vcpu);
-
-    void domain_op__share_page_r(vcpu *vcpu);
-    void domain_op__share_page_rw(vcpu *vcpu);
-    void domain_op__share_page_rwe(vcpu *vcpu);
-    void domain_op__donate_page_r(vcpu *vcpu);
-    void domain_op__donate_page_rw(vcpu *vcpu);
-    void domain_op__donate_page_rwe(vcpu *vcpu);
-
-    void domain_op__rax(vcpu *vcpu);
-    void domain_op__set_rax(vcpu *vcpu);
-    void domain_op__rbx(vcpu *vcpu);
-    void domain_op__set_rbx(vcpu *vcpu);
-    void domain_op__rcx(vcpu *vcpu);
-    void domain_op__set_rcx(vcpu *vcpu);
-    void domain_op__rdx(vcpu *vcpu);
-    void domain_op__set_rdx(vcpu *vcpu);
-    void domain_op__rbp(vcpu *vcpu);
-    void domain_op__set_rbp(vcpu *vcpu);
-    void domain_op__rsi(vcpu *vcpu);
-    void domain_op__set_rsi(vcpu *vcpu);
-    void domain_op__rdi(vcpu *vcpu);
-    void domain_op__set_rdi(vcpu *vcpu);
-    void domain_op__r08(vcpu *vcpu);
-    void domain_op__set_r08(vcpu *vcpu);
-    void domain_op__r09(vcpu *vcpu);
-    void domain_op__set_r09(vcpu *vcpu);
-    void domain_op__r10(vcpu *vcpu);
-    void domain_op__set_r10(vcpu *vcpu);
-    void domain_op__r11(vcpu *vcpu);
-    void domain_op__set_r11(vcpu *vcpu);
-    void domain_op__r12(vcpu *vcpu);
-    void domain_op__set_r12(vcpu *vcpu);
-    void domain_op__r13(vcpu *vcpu);
-    void domain_op__set_r13(vcpu *vcpu);
-    void domain_op__r14(vcpu *vcpu);
-    void domain_op__set_r14(vcpu *vcpu);
-    void domain_op__r15(vcpu *vcpu);
-    void domain_op__set_r15(vcpu *vcpu);
-    void domain_op__rip(vcpu *vcpu);
-    void domain_op__set_rip(vcpu *vcpu);
-    void domain_op__rsp(vcpu *vcpu);
-    void domain_op__set_rsp(vcpu *vcpu);
-    void domain_op__gdt_base(vcpu *vcpu);
-    void domain_op__set_gdt_base(vcpu *vcpu);
-    void domain_op__gdt_limit(vcpu *vcpu);
-    void domain_op__set_gdt_limit(vcpu *vcpu);
-    void domain_op__idt_base(vcpu *vcpu);
-    void domain_op__set_idt_base(vcpu *vcpu);
-    void domain_op__idt_limit(vcpu *vcpu);
-    void domain_op__set_idt_limit(vcpu *vcpu);
-    void domain_op__cr0(vcpu *vcpu);
-    void domain_op__set_cr0(vcpu *vcpu);
-    void domain_op__cr3(vcpu *vcpu);
-    void domain_op__set_cr3(vcpu *vcpu);
-    void domain_op__cr4(vcpu *vcpu);
-    void domain_op__set_cr4(vcpu *vcpu);
-    void domain_op__ia32_efer(vcpu *vcpu);
-    void domain_op__set_ia32_efer(vcpu *vcpu);
-    void domain_op__ia32_pat(vcpu *vcpu);
-    void domain_op__set_ia32_pat(vcpu *vcpu);
-
-    void domain_op__es_selector(vcpu *vcpu);
-    void domain_op__set_es_selector(vcpu *vcpu);
-    void domain_op__es_base(vcpu *vcpu);
-    void domain_op__set_es_base(vcpu *vcpu);
-    void domain_op__es_limit(vcpu *vcpu);
-    void domain_op__set_es_limit(vcpu *vcpu);
-    void domain_op__es_access_rights(vcpu *vcpu);
-    void domain_op__set_es_access_rights(vcpu *vcpu);
-    void domain_op__cs_selector(vcpu *vcpu);
-    void domain_op__set_cs_selector(vcpu *vcpu);
-    void domain_op__cs_base(vcpu *vcpu);
-    void domain_op__set_cs_base(vcpu *vcpu);
-    void domain_op__cs_limit(vcpu *vcpu);
-    void domain_op__set_cs_limit(vcpu *vcpu);
-    void domain_op__cs_access_rights(vcpu *vcpu);
-    void domain_op__set_cs_access_rights(vcpu *vcpu);
-    void domain_op__ss_selector(vcpu *vcpu);
-    void domain_op__set_ss_selector(vcpu *vcpu);
-    void domain_op__ss_base(vcpu *vcpu);
-    void domain_op__set_ss_base(vcpu *vcpu);
-    void domain_op__ss_limit(vcpu *vcpu);
-    void domain_op__set_ss_limit(vcpu *vcpu);
-    void domain_op__ss_access_rights(vcpu *vcpu);
-    void domain_op__set_ss_access_rights(vcpu *vcpu);
-    void domain_op__ds_selector(vcpu *vcpu);
-    void domain_op__set_ds_selector(vcpu *vcpu);
-    void domain_op__ds_base(vcpu *vcpu);
-    void domain_op__set_ds_base(vcpu *vcpu);
-    void domain_op__ds_limit(vcpu *vcpu);
-    void domain_op__set_ds_limit(vcpu *vcpu);
-    void domain_op__ds_access_rights(vcpu *vcpu);
-    void domain_op__set_ds_access_rights(vcpu *vcpu);
-    void domain_op__fs_selector(vcpu *vcpu);
-    void domain_op__set_fs_selector(vcpu *vcpu);
-    void domain_op__fs_base(vcpu *vcpu);
-    void domain_op__set_fs_base(vcpu *vcpu);
-    void domain_op__fs_limit(vcpu *vcpu);
-    void domain_op__set_fs_limit(vcpu *vcpu);
-    void domain_op__fs_access_rights(vcpu *vcpu);
-    void domain_op__set_fs_access_rights(vcpu *vcpu);
-    void domain_op__gs_selector(vcpu *vcpu);
-    void domain_op__set_gs_selector(vcpu *vcpu);
-    void domain_op__gs_base(vcpu *vcpu);
-    void domain_op__set_gs_base(vcpu *vcpu);
-    void domain_op__gs_limit(vcpu *vcpu);
-    void domain_op__set_gs_limit(vcpu *vcpu);
-    void domain_op__gs_access_rights(vcpu *vcpu);
-    void domain_op__set_gs_access_rights(vcpu *vcpu);
-    void domain_op__tr_selector(vcpu *vcpu);
-    void domain_op__set_tr_selector(vcpu *vcpu);
-    void domain_op__tr_base(vcpu *vcpu);
-    void domain_op__set_tr_base(vcpu *vcpu);
-    void domain_op__tr_limit(vcpu *vcpu);
-    void domain_op__set_tr_limit(vcpu *vcpu);
-    void domain_op__tr_access_rights(vcpu *vcpu);
-    void domain_op__set_tr_access_rights(vcpu *vcpu);
-    void domain_op__ldtr_selector(vcpu *vcpu);
-    void domain_op__set_ldtr_selector(vcpu *vcpu);
-    void domain_op__ldtr_base(vcpu *vcpu);
-    void domain_op__set_ldtr_base(vcpu *vcpu);
-    void domain_op__ldtr_limit(vcpu *vcpu);
-    void domain_op__set_ldtr_limit(vcpu *vcpu);
-    void domain_op__ldtr_access_rights(vcpu *vcpu);
-    void domain_op__set_ldtr_access_rights(vcpu *vcpu);
+    void domain_op__create_domain(vcpu *vcpu) noexcept;
+    void domain_op__destroy_domain(vcpu *vcpu) noexcept;
+    void domain_op__clone_domain(vcpu *vcpu) noexcept;
+
+    void domain_op__set_uart(vcpu *vcpu) noexcept;
+    void domain_op__set_pt_uart(vcpu *vcpu) noexcept;
+    void domain_op__dump_uart(vcpu *vcpu) noexcept;
+
+    void domain_op__set_xsave_policy(vcpu *vcpu) noexcept;
+
+    void domain_op__share_page_r(vcpu *vcpu) noexcept;
+    void domain_op__share_page_rw(vcpu *vcpu) noexcept;
+    void domain_op__share_page_rwe(vcpu *vcpu) noexcept;
+    void domain_op__donate_page_r(vcpu *vcpu) noexcept;
+    void domain_op__donate_page_rw(vcpu *vcpu) noexcept;
+    void domain_op__donate_page_rwe(vcpu *vcpu) noexcept;
+    void domain_op__donate_range(vcpu *vcpu) noexcept;
+    void domain_op__donate_page_2m_rwe(vcpu *vcpu) noexcept;
+    void domain_op__reserve_ram(vcpu *vcpu) noexcept;
+
+    void domain_op__initial_state(vcpu *vcpu) noexcept;
+    void domain_op__set_initial_state(vcpu *vcpu) noexcept;
+
+    void domain_op__rax(vcpu *vcpu) noexcept;
+    void domain_op__set_rax(vcpu *vcpu) noexcept;
+    void domain_op__rbx(vcpu *vcpu) noexcept;
+    void domain_op__set_rbx(vcpu *vcpu) noexcept;
+    void domain_op__rcx(vcpu *vcpu) noexcept;
+    void domain_op__set_rcx(vcpu *vcpu) noexcept;
+    void domain_op__rdx(vcpu *vcpu) noexcept;
+    void domain_op__set_rdx(vcpu *vcpu) noexcept;
+    void domain_op__rbp(vcpu *vcpu) noexcept;
+    void domain_op__set_rbp(vcpu *vcpu) noexcept;
+    void domain_op__rsi(vcpu *vcpu) noexcept;
+    void domain_op__set_rsi(vcpu *vcpu) noexcept;
+    void domain_op__rdi(vcpu *vcpu) noexcept;
+    void domain_op__set_rdi(vcpu *vcpu) noexcept;
+    void domain_op__r08(vcpu *vcpu) noexcept;
+    void domain_op__set_r08(vcpu *vcpu) noexcept;
+    void domain_op__r09(vcpu *vcpu) noexcept;
+    void domain_op__set_r09(vcpu *vcpu) noexcept;
+    void domain_op__r10(vcpu *vcpu) noexcept;
+    void domain_op__set_r10(vcpu *vcpu) noexcept;
+    void domain_op__r11(vcpu *vcpu) noexcept;
+    void domain_op__set_r11(vcpu *vcpu) noexcept;
+    void domain_op__r12(vcpu *vcpu) noexcept;
+    void domain_op__set_r12(vcpu *vcpu) noexcept;
+    void domain_op__r13(vcpu *vcpu) noexcept;
+    void domain_op__set_r13(vcpu *vcpu) noexcept;
+    void domain_op__r14(vcpu *vcpu) noexcept;
+    void domain_op__set_r14(vcpu *vcpu) noexcept;
+    void domain_op__r15(vcpu *vcpu) noexcept;
+    void domain_op__set_r15(vcpu *vcpu) noexcept;
+    void domain_op__rip(vcpu *vcpu) noexcept;
+    void domain_op__set_rip(vcpu *vcpu) noexcept;
+    void domain_op__rsp(vcpu *vcpu) noexcept;
+    void domain_op__set_rsp(vcpu *vcpu) noexcept;
+    void domain_op__gdt_base(vcpu *vcpu) noexcept;
+    void domain_op__set_gdt_base(vcpu *vcpu) noexcept;
+    void domain_op__gdt_limit(vcpu *vcpu) noexcept;
+    void domain_op__set_gdt_limit(vcpu *vcpu) noexcept;
+    void domain_op__idt_base(vcpu *vcpu) noexcept;
+    void domain_op__set_idt_base(vcpu *vcpu) noexcept;
+    void domain_op__idt_limit(vcpu *vcpu) noexcept;
+    void domain_op__set_idt_limit(vcpu *vcpu) noexcept;
+    void domain_op__cr0(vcpu *vcpu) noexcept;
+    void domain_op__set_cr0(vcpu *vcpu) noexcept;
+    void domain_op__cr3(vcpu *vcpu) noexcept;
+    void domain_op__set_cr3(vcpu *vcpu) noexcept;
+    void domain_op__cr4(vcpu *vcpu) noexcept;
+    void domain_op__set_cr4(vcpu *vcpu) noexcept;
+    void domain_op__ia32_efer(vcpu *vcpu) noexcept;
+    void domain_op__set_ia32_efer(vcpu *vcpu) noexcept;
+    void domain_op__ia32_pat(vcpu *vcpu) noexcept;
+    void domain_op__set_ia32_pat(vcpu *vcpu) noexcept;
+
+    void domain_op__es_selector(vcpu *vcpu) noexcept;
+    void domain_op__set_es_selector(vcpu *vcpu) noexcept;
+    void domain_op__es_base(vcpu *vcpu) noexcept;
+    void domain_op__set_es_base(vcpu *vcpu) noexcept;
+    void domain_op__es_limit(vcpu *vcpu) noexcept;
+    void domain_op__set_es_limit(vcpu *vcpu) noexcept;
+    void domain_op__es_access_rights(vcpu *vcpu) noexcept;
+    void domain_op__set_es_access_rights(vcpu *vcpu) noexcept;
+    void domain_op__cs_selector(vcpu *vcpu) noexcept;
+    void domain_op__set_cs_selector(vcpu *vcpu) noexcept;
+    void domain_op__cs_base(vcpu *vcpu) noexcept;
+    void domain_op__set_cs_base(vcpu *vcpu) noexcept;
+    void domain_op__cs_limit(vcpu *vcpu) noexcept;
+    void domain_op__set_cs_limit(vcpu *vcpu) noexcept;
+    void domain_op__cs_access_rights(vcpu *vcpu) noexcept;
+    void domain_op__set_cs_access_rights(vcpu *vcpu) noexcept;
+    void domain_op__ss_selector(vcpu *vcpu) noexcept;
+    void domain_op__set_ss_selector(vcpu *vcpu) noexcept;
+    void domain_op__ss_base(vcpu *vcpu) noexcept;
+    void domain_op__set_ss_base(vcpu *vcpu) noexcept;
+    void domain_op__ss_limit(vcpu *vcpu) noexcept;
+    void domain_op__set_ss_limit(vcpu *vcpu) noexcept;
+    void domain_op__ss_access_rights(vcpu *vcpu) noexcept;
+    void domain_op__set_ss_access_rights(vcpu *vcpu) noexcept;
+    void domain_op__ds_selector(vcpu *vcpu) noexcept;
+    void domain_op__set_ds_selector(vcpu *vcpu) noexcept;
+    void domain_op__ds_base(vcpu *vcpu) noexcept;
+    void domain_op__set_ds_base(vcpu *vcpu) noexcept;
+    void domain_op__ds_limit(vcpu *vcpu) noexcept;
+    void domain_op__set_ds_limit(vcpu *vcpu) noexcept;
+    void domain_op__ds_access_rights(vcpu *vcpu) noexcept;
+    void domain_op__set_ds_access_rights(vcpu *vcpu) noexcept;
+    void domain_op__fs_selector(vcpu *vcpu) noexcept;
+    void domain_op__set_fs_selector(vcpu *vcpu) noexcept;
+    void domain_op__fs_base(vcpu *vcpu) noexcept;
+    void domain_op__set_fs_base(vcpu *vcpu) noexcept;
+    void domain_op__fs_limit(vcpu *vcpu) noexcept;
+    void domain_op__set_fs_limit(vcpu *vcpu) noexcept;
+    void domain_op__fs_access_rights(vcpu *vcpu) noexcept;
+    void domain_op__set_fs_access_rights(vcpu *vcpu) noexcept;
+    void domain_op__gs_selector(vcpu *vcpu) noexcept;
+    void domain_op__set_gs_selector(vcpu *vcpu) noexcept;
+    void domain_op__gs_base(vcpu *vcpu) noexcept;
+    void domain_op__set_gs_base(vcpu *vcpu) noexcept;
+    void domain_op__gs_limit(vcpu *vcpu) noexcept;
+    void domain_op__set_gs_limit(vcpu *vcpu) noexcept;
+    void domain_op__gs_access_rights(vcpu *vcpu) noexcept;
+    void domain_op__set_gs_access_rights(vcpu *vcpu) noexcept;
+    void domain_op__tr_selector(vcpu *vcpu) noexcept;
+    void domain_op__set_tr_selector(vcpu *vcpu) noexcept;
+    void domain_op__tr_base(vcpu *vcpu) noexcept;
+    void domain_op__set_tr_base(vcpu *vcpu) noexcept;
+    void domain_op__tr_limit(vcpu *vcpu) noexcept;
+    void domain_op__set_tr_limit(vcpu *vcpu) noexcept;
+    void domain_op__tr_access_rights(vcpu *vcpu) noexcept;
+    void domain_op__set_tr_access_rights(vcpu *vcpu) noexcept;
+    void domain_op__ldtr_selector(vcpu *vcpu) noexcept;
+    void domain_op__set_ldtr_selector(vcpu *vcpu) noexcept;
+    void domain_op__ldtr_base(vcpu *vcpu) noexcept;
+    void domain_op__set_ldtr_base(vcpu *vcpu) noexcept;
+    void domain_op__ldtr_limit(vcpu *vcpu) noexcept;
+    void domain_op__set_ldtr_limit(vcpu *vcpu) noexcept;
+    void domain_op__ldtr_access_rights(vcpu *vcpu) noexcept;
+    void domain_op__set_ldtr_access_rights(vcpu *vcpu) noexcept;
 
     bool dispatch(vcpu *vcpu);
 
@@ -55,6 +55,7 @@ public:
 
 private:
 
+    void migrate_child(vcpu *vcpu);
     bool dispatch(vcpu *vcpu);
 
 private:
@@ -54,9 +54,16 @@ public:
 
 private:
 
-    void vcpu_op__create_vcpu(vcpu *vcpu);
-    void vcpu_op__kill_vcpu(vcpu *vcpu);
-    void vcpu_op__destroy_vcpu(vcpu *vcpu);
+    void vcpu_op__create_vcpu(vcpu *vcpu) noexcept;
+    void vcpu_op__kill_vcpu(vcpu *vcpu) noexcept;
+    void vcpu_op__destroy_vcpu(vcpu *vcpu) noexcept;
+    void vcpu_op__release_vcpu(vcpu *vcpu) noexcept;
+    void vcpu_op__save_vcpu(vcpu *vcpu) noexcept;
+    void vcpu_op__restore_vcpu(vcpu *vcpu) noexcept;
+    void vcpu_op__pause_vcpu(vcpu *vcpu) noexcept;
+    void vcpu_op__resume_vcpu(vcpu *vcpu) noexcept;
+    void vcpu_op__save_template_vcpu(vcpu *vcpu) noexcept;
+    void vcpu_op__restore_template_vcpu(vcpu *vcpu) noexcept;
 
     bool dispatch(vcpu *vcpu);
 
@@ -0,0 +1,140 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef VMEXIT_EXIT_STATS_INTEL_X64_BOXY_H
+#define VMEXIT_EXIT_STATS_INTEL_X64_BOXY_H
+
+#include <bfvmm/hve/arch/intel_x64/vcpu.h>
+
+#include <array>
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+namespace boxy::intel_x64
+{
+
+class vcpu;
+
+class exit_stats_handler
+{
+public:
+
+    /// Number of Exit Reasons
+    ///
+    /// The number of basic exit reasons that are tracked. Exits with a
+    /// larger basic exit reason are not counted.
+    ///
+    static constexpr const std::size_t num_exit_reasons = 128;
+
+    /// Pending Exit
+    ///
+    /// The exit that is currently being handled on a physical CPU. An exit
+    /// is not always finished on the vCPU that took it (e.g., a child vCPU
+    /// that returns to its parent), so, like the loaded MSRs (see
+    /// msr_handler), this state lives in the dom0 vCPU's exit_stats_handler
+    /// and each domU vCPU uses the state of its current parent.
+    ///
+    struct pending_exit_t {
+        exit_stats_handler *owner{};
+        uint64_t reason{};
+        uint64_t tsc{};
+    };
+
+    /// Constructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param vcpu the vcpu object for this handler
+    ///
+    exit_stats_handler(
+        gsl::not_null<vcpu *> vcpu);
+
+    /// Destructor
+    ///
+    /// Dumps the exit statistics for this vCPU.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    ~exit_stats_handler();
+
+public:
+
+    /// Get Pending Exit
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the exit that is being handled on the physical CPU
+    ///     this vCPU is currently executing on.
+    ///
+    pending_exit_t &pending_exit() noexcept;
+
+    /// Dump
+    ///
+    /// Outputs the number of exits and the average number of TSC ticks
+    /// spent in the VMM for each exit reason this vCPU has seen.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void dump() const;
+
+public:
+
+    /// @cond
+
+    bool exit_stats__on_exit(vcpu_t *vcpu);
+    void exit_stats__on_world_switch(vcpu_t *vcpu);
+
+    /// @endcond
+
+private:
+
+    struct stats_t {
+        uint64_t count{};
+        uint64_t ticks{};
+    };
+
+    vcpu *m_vcpu;
+
+    pending_exit_t m_pending{};
+    std::array<stats_t, num_exit_reasons> m_stats{};
+
+public:
+
+    /// @cond
+
+    exit_stats_handler(exit_stats_handler &&) = default;
+    exit_stats_handler &operator=(exit_stats_handler &&) = default;
+
+    exit_stats_handler(const exit_stats_handler &) = delete;
+    exit_stats_handler &operator=(const exit_stats_handler &) = delete;
+
+    /// @endcond
+};
+
+}
+
+#endif
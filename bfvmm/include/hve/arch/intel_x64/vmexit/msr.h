@@ -26,7 +26,7 @@
 #include <bfvmm/hve/arch/intel_x64/vmexit/rdmsr.h>
 #include <bfvmm/hve/arch/intel_x64/vmexit/wrmsr.h>
 
-#include <unordered_map>
+#include <array>
 
 // -----------------------------------------------------------------------------
 // Definitions
@@ -60,12 +60,69 @@ public:
 
 public:
 
-    /// @cond
+    /// Number of Isolated MSRs
+    ///
+    /// Isolated MSRs are stored in fixed slots. See msr.cpp for the list of
+    /// MSRs and the slot each MSR is stored in.
+    ///
+    static constexpr const std::size_t num_isolated_msrs = 5;
+
+    /// Loaded MSRs
+    ///
+    /// Isolated MSRs are lazily loaded on world switches. To prevent writing
+    /// MSRs that already contain the proper value, each physical CPU keeps
+    /// track of which msr_handler owns the values currently loaded into
+    /// hardware, and what those values are. Since each dom0 vCPU is tied to
+    /// a physical CPU, this state lives in the dom0 vCPU's msr_handler and
+    /// each domU vCPU uses the state of its current parent.
+    ///
+    struct loaded_msrs_t {
+        msr_handler *owner{};
+        std::array<uint64_t, num_isolated_msrs> val{};
+    };
+
+    /// Get Loaded MSRs
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the isolated MSR state that is loaded into hardware on
+    ///     the physical CPU this vCPU is currently executing on.
+    ///
+    loaded_msrs_t &loaded_msrs() noexcept;
+
+    /// Save Snapshot
+    ///
+    /// Stores the isolated MSRs in the provided snapshot. Since the
+    /// kernel_gs_base is saved from hardware when another vCPU takes
+    /// ownership of the hardware, this is only accurate once this vCPU
+    /// has stopped running.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param snapshot the snapshot to fill in
+    ///
+    void save_snapshot(struct vcpu_snapshot &snapshot) const noexcept;
 
-    void isolate_msr(uint32_t msr);
+    /// Restore Snapshot
+    ///
+    /// Loads the isolated MSRs from the provided snapshot. The MSRs are
+    /// written to hardware the next time this vCPU takes ownership of the
+    /// hardware.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param snapshot the snapshot to restore from
+    ///
+    void restore_snapshot(const struct vcpu_snapshot &snapshot) noexcept;
+
+public:
+
+    /// @cond
 
     void isolate_msr__on_world_switch(vcpu_t *vcpu);
-    bool isolate_msr__on_exit(vcpu_t *vcpu);
     bool isolate_msr__on_write(
         vcpu_t *vcpu, bfvmm::intel_x64::wrmsr_handler::info_t &info);
 
@@ -99,7 +156,10 @@ private:
     vcpu *m_vcpu;
 
     uint64_t m_0xC0000103{0};
-    std::unordered_map<uint32_t, uint64_t> m_msrs;
+
+    uint64_t m_dirty{};
+    loaded_msrs_t m_loaded{};
+    std::array<uint64_t, num_isolated_msrs> m_msrs{};
 
 public:
 
@@ -22,6 +22,7 @@
 #ifndef VMEXIT_VMCALL_INTEL_X64_BOXY_H
 #define VMEXIT_VMCALL_INTEL_X64_BOXY_H
 
+#include <array>
 #include <bfvmm/hve/arch/intel_x64/vcpu.h>
 
 // -----------------------------------------------------------------------------
@@ -59,12 +60,17 @@ public:
 
     /// Add Handler
     ///
+    /// Handlers are indexed by the opcode byte of the hypercall (i.e.,
+    /// bfopcode(rax)), so a VMCALL exit only ever calls the handlers that
+    /// were registered for its opcode.
+    ///
     /// @expects
     /// @ensures
     ///
+    /// @param opcode the opcode (hypercall_enum_xxx) the handler services
     /// @param d the handler to call when an exit occurs
     ///
-    void add_handler(const handler_delegate_t &d);
+    void add_handler(uint64_t opcode, const handler_delegate_t &d);
 
 public:
 
@@ -74,10 +80,19 @@ public:
 
     /// @endcond
 
+private:
+
+    bool is_authorized(vcpu *vcpu) const noexcept;
+
+    void vmcall_op__add_token(vcpu *vcpu) noexcept;
+    void vmcall_op__remove_token(vcpu *vcpu) noexcept;
+
+    bool dispatch(vcpu *vcpu);
+
 private:
 
     vcpu *m_vcpu;
-    std::list<handler_delegate_t> m_handlers;
+    std::array<std::list<handler_delegate_t>, 0x100> m_handlers;
 
 public:
 
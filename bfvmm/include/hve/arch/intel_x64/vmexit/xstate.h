@@ -0,0 +1,175 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef VMEXIT_XSTATE_INTEL_X64_BOXY_H
+#define VMEXIT_XSTATE_INTEL_X64_BOXY_H
+
+#include <bfvmm/hve/arch/intel_x64/vcpu.h>
+#include <bfvmm/hve/arch/intel_x64/vmexit/xsetbv.h>
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+namespace boxy::intel_x64
+{
+
+class vcpu;
+
+class xstate_handler
+{
+public:
+
+    /// Constructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param vcpu the vcpu object for this handler
+    ///
+    xstate_handler(
+        gsl::not_null<vcpu *> vcpu);
+
+    /// Destructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    ~xstate_handler() = default;
+
+public:
+
+    /// Managed State Components
+    ///
+    /// The XCR0 bits (x87, SSE, AVX, opmask, ZMM_Hi256 and Hi16_ZMM) that
+    /// are switched between vCPUs. These are the only state components a
+    /// guest can be given (see domain::set_xsave_policy).
+    ///
+    static constexpr const uint64_t managed_xcr0 = 0xE7;
+
+    /// Is Supported
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns true if the extended state of each vCPU can be
+    ///     switched on this CPU (i.e., XSAVE is enabled and XSAVEOPT is
+    ///     supported), false otherwise
+    ///
+    static bool is_supported() noexcept;
+
+    /// Loaded Extended State
+    ///
+    /// Like the isolated MSRs (see msr_handler), extended state is lazily
+    /// switched on world switches. Each physical CPU keeps track of which
+    /// xstate_handler owns the state currently loaded into hardware, and
+    /// the value of XCR0. Since each dom0 vCPU is tied to a physical CPU,
+    /// this state lives in the dom0 vCPU's xstate_handler and each domU
+    /// vCPU uses the state of its current parent.
+    ///
+    struct loaded_xstate_t {
+        xstate_handler *owner{};
+        uint64_t xcr0{};
+    };
+
+    /// Get Loaded Extended State
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the extended state that is loaded into hardware on
+    ///     the physical CPU this vCPU is currently executing on.
+    ///
+    loaded_xstate_t &loaded_xstate() noexcept;
+
+    /// Save Snapshot
+    ///
+    /// Stores XCR0 in the provided snapshot, and copies the XSAVE area to
+    /// the provided page. Since the extended state is saved from hardware
+    /// when another vCPU takes ownership of the hardware, this is only
+    /// accurate once this vCPU has stopped running.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param snapshot the snapshot to fill in
+    /// @param xsave the page (VCPU_SNAPSHOT_XSAVE_SIZE) to copy the XSAVE
+    ///     area to
+    ///
+    void save_snapshot(struct vcpu_snapshot &snapshot, uint8_t *xsave) const;
+
+    /// Restore Snapshot
+    ///
+    /// Loads XCR0 and the XSAVE area from the provided snapshot. The state
+    /// is loaded into hardware the next time this vCPU takes ownership of
+    /// the hardware.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param snapshot the snapshot to restore from
+    /// @param xsave the XSAVE area (VCPU_SNAPSHOT_XSAVE_SIZE) to restore
+    ///
+    void restore_snapshot(
+        const struct vcpu_snapshot &snapshot, const uint8_t *xsave);
+
+public:
+
+    /// @cond
+
+    void isolate_xstate__on_world_switch(vcpu_t *vcpu);
+
+    bool handle_xsetbv(
+        vcpu_t *vcpu, bfvmm::intel_x64::xsetbv_handler::info_t &info);
+
+    /// @endcond
+
+private:
+
+    void save() noexcept;
+    void restore() noexcept;
+
+private:
+
+    vcpu *m_vcpu;
+
+    uint64_t m_xcr0{};
+    uint64_t m_xcr0_mask{};
+
+    loaded_xstate_t m_loaded{};
+    page_ptr<uint8_t> m_area{};
+
+public:
+
+    /// @cond
+
+    xstate_handler(xstate_handler &&) = default;
+    xstate_handler &operator=(xstate_handler &&) = default;
+
+    xstate_handler(const xstate_handler &) = delete;
+    xstate_handler &operator=(const xstate_handler &) = delete;
+
+    /// @endcond
+};
+
+}
+
+#endif
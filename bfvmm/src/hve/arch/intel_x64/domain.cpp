@@ -19,13 +19,39 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
+#include <tuple>
+#include <cstring>
+#include <algorithm>
+
 #include <bfdebug.h>
 #include <bfgpalayout.h>
 
+#include <hve/arch/intel_x64/vcpu.h>
 #include <hve/arch/intel_x64/domain.h>
+#include <hve/arch/intel_x64/vmexit/xstate.h>
 
 using namespace bfvmm::intel_x64;
 
+// -----------------------------------------------------------------------------
+// Helpers
+// -----------------------------------------------------------------------------
+
+// Note:
+//
+// Support for 1g EPT pages is reported by bit 17 of IA32_VMX_EPT_VPID_CAP
+// (see the Intel SDM, Vol. 3, Appendix A.10). Most CPUs support them, but
+// some virtual CPUs (e.g., when nested) do not.
+//
+
+static bool
+ept_1g_pages_supported()
+{
+    static const auto supported =
+        (::intel_x64::msrs::ia32_vmx_ept_vpid_cap::get() & (1ULL << 17)) != 0;
+
+    return supported;
+}
+
 // -----------------------------------------------------------------------------
 // Implementation
 // -----------------------------------------------------------------------------
@@ -47,30 +73,193 @@ domain::domain(domainid_type domainid) :
 void
 domain::setup_dom0()
 {
-    // TODO:
+    // Note:
     //
-    // This should be changes to fix a couple of issues:
-    // - We should calculate the max physical address range using CPUID
-    //   and fill in EPT all the way to the end of addressable memory.
-    // - We should fill in EPT using 1 gig pages and then when we donate memory
-    //   the logic for doing this should be able to handle 1 gig pages.
-    // - 1 gig pages should be used because VMWare is not supported anways,
-    //   so we should assume that 1 gig page support is required. Once again,
-    //   legacy support is not a focus of this project
+    // dom0 is identity mapped using 1g pages all the way up to the end of
+    // addressable memory as reported by CPUID. 4-level EPT can only
+    // address 48 bits, so the map stops there even if CPUID reports a
+    // larger physical address width.
+    //
+    // If 1g EPT pages are not supported, every 1g page has to be mapped
+    // using 512 2m pages (see map_1g()), which at 48 bits would need more
+    // EPT tables than the VMM's heap can hold. In this case, the map stops
+    // at MAX_PHYS_ADDR instead, which is what dom0 was mapped up to before
+    // 1g pages were used.
+    //
+    // The large pages are never split, which means that pages cannot be
+    // removed from dom0 (see unmap()). Donated pages are not removed from
+    // dom0 either (see the TODOs in domain_op), so nothing needs to.
     //
 
-    ept::identity_map(
-        m_ept_map, MAX_PHYS_ADDR
-    );
+    auto end = 1ULL << std::min<uint64_t>(::intel_x64::cpuid::addr_size::phys::get(), 48);
+
+    if (!ept_1g_pages_supported()) {
+        bfalert_info(0, "1g EPT pages not supported, dom0 is mapped up to MAX_PHYS_ADDR");
+        end = std::min<uint64_t>(end, MAX_PHYS_ADDR);
+    }
+
+    for (uintptr_t gpa = 0; gpa < end; gpa += ::x64::pdpt::page_size) {
+        this->map_1g(gpa, gpa, ept::mmap::attr_type::read_write_execute);
+    }
 }
 
 void
 domain::setup_domU()
-{ }
+{
+    // Note:
+    //
+    // Application processors are started in real mode (see
+    // x2apic_handler::start_ap), which needs unrestricted guest support
+    // (see vcpu::setup_default_controls). Some CPUs (e.g., virtual CPUs
+    // when nested) do not support it, in which case the domain is not
+    // created instead of failing the first VM entry of each vCPU.
+    //
+
+    using namespace vmcs_n::secondary_processor_based_vm_execution_controls;
+
+    if (!unrestricted_guest::is_allowed1()) {
+        throw std::runtime_error("unrestricted guest not supported. domU not supported");
+    }
+
+    this->setup_cpuid();
+}
+
+void
+domain::setup_cpuid()
+{
+    // Note:
+    //
+    // CPUID is slow when executed from the VMM (and it serializes), so
+    // instead of executing CPUID on every CPUID exit, the guest's view of
+    // each whitelisted leaf is computed here, once, by masking the host's
+    // CPUID. Any leaf that is not in this table (including the subleaves of
+    // leaf 0x7 other than subleaf 0) reads as all zeros.
+    //
+
+    auto add = [this](
+        uint32_t leaf, uint32_t subleaf,
+        uint32_t eax_mask, uint32_t ebx_mask,
+        uint32_t ecx_mask, uint32_t edx_mask) -> cpuid_entry &
+    {
+        auto [eax, ebx, ecx, edx] = ::x64::cpuid::get(leaf, 0, subleaf, 0);
+
+        m_cpuid.push_back({
+            leaf, subleaf,
+            eax & eax_mask, ebx & ebx_mask, ecx & ecx_mask, edx & edx_mask
+        });
+
+        return m_cpuid.back();
+    };
+
+    add(0x00000000, 0, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF);
+    add(0x00000002, 0, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF);
+
+    // Note:
+    //
+    // XSAVE, and the features that need the state components that XSAVE
+    // manages, are only reported if the domain's XSAVE policy allows them
+    // (see set_xsave_policy).
+    //
+
+    auto xsave = m_xcr0_mask != 0;
+    auto avx = (m_xcr0_mask & 0x04) != 0;
+    auto avx512 = (m_xcr0_mask & 0xE0) != 0;
+
+    // Note:
+    //
+    // PCID and INVPCID are only reported if INVPCID can be enabled for the
+    // guest (see vcpu::setup_default_controls), and if each vCPU can be
+    // given its own VPID. Without a VPID, every VM entry and exit flushes
+    // the guest's translations, in which case PCIDs do not buy the guest
+    // anything.
+    //
+
+    using namespace vmcs_n::secondary_processor_based_vm_execution_controls;
+    auto pcid = enable_invpcid::is_allowed1() && enable_vpid::is_allowed1();
+
+    // Note:
+    //
+    // The APIC ID and the logical processor count in EBX, and OSXSAVE in
+    // ECX, are filled in per vCPU. Bit 31 of ECX tells Linux that it is in
+    // a VM.
+    //
+
+    add(0x00000001, 0, 0xFFFFFFFF, 0x0000FFFF,
+        0x61FC3203 | (pcid ? 0x00020000 : 0) | (xsave ? 0x04000000 : 0) | (avx ? 0x10000000 : 0),
+        0x1FCBFBFB).rcx |= 0x80000000;
+
+    // Note:
+    //
+    // Leaf 0x4 has a subleaf per cache, terminated by a subleaf with a
+    // cache type of 0 (which is also added so that it reads the same as
+    // the host). The core and sharing counts in EAX are filled in per vCPU.
+    //
+
+    for (uint32_t subleaf = 0; subleaf < 16; subleaf++) {
+        if ((add(0x00000004, subleaf, 0x000003FF, 0xFFFFFFFF, 0xFFFFFFFF, 0x00000007).rax & 0x1F) == 0) {
+            break;
+        }
+    }
+
+    add(0x00000007, 0, 0x00000000,
+        0x019C23D9 | (pcid ? 0x00000400 : 0) | (avx ? 0x00000020 : 0) | (avx512 ? 0xD0230000 : 0),
+        0x00000000, 0x00000000);
+
+    add(0x0000000A, 0, 0x00000000, 0x0000007F, 0x00000000, 0x00000000);
+
+    // Note:
+    //
+    // Subleaf 0 reports the state components the guest can enable, and the
+    // size of the XSAVE area for all of them (the size for the guest's
+    // current XCR0 is filled in per vCPU). Subleaf 1 reports XSAVEOPT,
+    // XSAVEC and XGETBV with ECX = 1, but not XSAVES as the guest is not
+    // allowed to execute XSAVES/XRSTORS. Each enabled state component has a
+    // subleaf with its size and offset.
+    //
+
+    if (xsave) {
+        uint64_t size = 576;
+
+        for (uint32_t subleaf = 2; subleaf < 8; subleaf++) {
+            if ((m_xcr0_mask & (1ULL << subleaf)) != 0) {
+                auto &entry = add(0x0000000D, subleaf, 0xFFFFFFFF, 0xFFFFFFFF, 0x00000002, 0x00000000);
+                size = std::max(size, entry.rax + entry.rbx);
+            }
+        }
+
+        add(0x0000000D, 0, gsl::narrow_cast<uint32_t>(m_xcr0_mask | 0x3), 0x00000000, 0x00000000, 0x00000000).rcx = size;
+        add(0x0000000D, 1, 0x00000007, 0x00000000, 0x00000000, 0x00000000);
+    }
+
+    add(0x80000000, 0, 0xFFFFFFFF, 0x00000000, 0x00000000, 0x00000000);
+    add(0x80000001, 0, 0x00000000, 0x00000000, 0x00000121, 0x24100800);
+    add(0x80000002, 0, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF);
+    add(0x80000003, 0, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF);
+    add(0x80000004, 0, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF);
+    add(0x80000007, 0, 0x00000000, 0x00000000, 0x00000000, 0xFFFFFFFF);
+    add(0x80000008, 0, 0x0000FFFF, 0x00000000, 0x00000000, 0x00000000);
+
+    std::sort(m_cpuid.begin(), m_cpuid.end(), [](const auto &lhs, const auto &rhs) {
+        return std::tie(lhs.leaf, lhs.subleaf) < std::tie(rhs.leaf, rhs.subleaf);
+    });
+}
+
+void
+domain::map_1g(uintptr_t gpa, uintptr_t hpa, ept::mmap::attr_type attr)
+{
+    if (ept_1g_pages_supported()) {
+        m_ept_map.map_1g(gpa, hpa, attr);
+        return;
+    }
+
+    for (uintptr_t off = 0; off < ::x64::pdpt::page_size; off += ::x64::pd::page_size) {
+        m_ept_map.map_2m(gpa + off, hpa + off, attr);
+    }
+}
 
 void
 domain::map_1g_r(uintptr_t gpa, uintptr_t hpa)
-{ m_ept_map.map_1g(gpa, hpa, ept::mmap::attr_type::read_only); }
+{ this->map_1g(gpa, hpa, ept::mmap::attr_type::read_only); }
 
 void
 domain::map_2m_r(uintptr_t gpa, uintptr_t hpa)
@@ -82,7 +271,7 @@ domain::map_4k_r(uintptr_t gpa, uintptr_t hpa)
 
 void
 domain::map_1g_rw(uintptr_t gpa, uintptr_t hpa)
-{ m_ept_map.map_1g(gpa, hpa, ept::mmap::attr_type::read_write); }
+{ this->map_1g(gpa, hpa, ept::mmap::attr_type::read_write); }
 
 void
 domain::map_2m_rw(uintptr_t gpa, uintptr_t hpa)
@@ -94,7 +283,7 @@ domain::map_4k_rw(uintptr_t gpa, uintptr_t hpa)
 
 void
 domain::map_1g_rwe(uintptr_t gpa, uintptr_t hpa)
-{ m_ept_map.map_1g(gpa, hpa, ept::mmap::attr_type::read_write_execute); }
+{ this->map_1g(gpa, hpa, ept::mmap::attr_type::read_write_execute); }
 
 void
 domain::map_2m_rwe(uintptr_t gpa, uintptr_t hpa)
@@ -106,7 +295,13 @@ domain::map_4k_rwe(uintptr_t gpa, uintptr_t hpa)
 
 void
 domain::unmap(uintptr_t gpa)
-{ m_ept_map.unmap(gpa); }
+{
+    if (this->id() == 0) {
+        throw std::runtime_error("unmap: dom0 is mapped using large pages");
+    }
+
+    m_ept_map.unmap(gpa);
+}
 
 void
 domain::release(uintptr_t gpa)
@@ -173,6 +368,487 @@ domain::dump_uart(const gsl::span<char> &buffer)
     return 0;
 }
 
+uint32_t
+domain::add_vcpu(gsl::not_null<vcpu *> vcpu)
+{
+    std::lock_guard lock(m_vcpus_mutex);
+
+    if (m_clone && !m_vcpus.empty()) {
+        throw std::runtime_error("add_vcpu: a clone can only have one vCPU");
+    }
+
+    m_vcpus.push_back(vcpu);
+    return gsl::narrow_cast<uint32_t>(m_vcpus.size() - 1);
+}
+
+void
+domain::remove_vcpu(gsl::not_null<vcpu *> vcpu) noexcept
+{
+    std::lock_guard lock(m_vcpus_mutex);
+
+    for (auto &elem : m_vcpus) {
+        if (elem == vcpu) {
+            elem = nullptr;
+        }
+    }
+}
+
+vcpuid_t
+domain::deliver_ipi(uint32_t apic_id, uint64_t vector) noexcept
+{
+    std::lock_guard lock(m_vcpus_mutex);
+
+    if (apic_id < m_vcpus.size() && m_vcpus[apic_id] != nullptr) {
+        if (m_vcpus[apic_id]->deliver_ipi(vector)) {
+            return m_vcpus[apic_id]->id();
+        }
+    }
+
+    return INVALID_VCPUID;
+}
+
+void
+domain::deliver_init(uint32_t apic_id) noexcept
+{
+    std::lock_guard lock(m_vcpus_mutex);
+
+    if (apic_id < m_vcpus.size() && m_vcpus[apic_id] != nullptr) {
+        m_vcpus[apic_id]->deliver_init();
+    }
+}
+
+vcpuid_t
+domain::deliver_sipi(uint32_t apic_id, uint64_t vector) noexcept
+{
+    std::lock_guard lock(m_vcpus_mutex);
+
+    if (apic_id < m_vcpus.size() && m_vcpus[apic_id] != nullptr) {
+        if (m_vcpus[apic_id]->deliver_sipi(vector)) {
+            return m_vcpus[apic_id]->id();
+        }
+    }
+
+    return INVALID_VCPUID;
+}
+
+uint32_t
+domain::num_vcpus() const noexcept
+{
+    std::lock_guard lock(m_vcpus_mutex);
+    return gsl::narrow_cast<uint32_t>(m_vcpus.size());
+}
+
+const domain::cpuid_entry *
+domain::find_cpuid(uint32_t leaf, uint32_t subleaf) const noexcept
+{
+    auto iter = std::lower_bound(m_cpuid.begin(), m_cpuid.end(), std::tie(leaf, subleaf),
+    [](const auto &entry, const auto &key) {
+        return std::tie(entry.leaf, entry.subleaf) < key;
+    });
+
+    if (iter == m_cpuid.end() || iter->leaf != leaf || iter->subleaf != subleaf) {
+        return nullptr;
+    }
+
+    return &*iter;
+}
+
+void
+domain::set_xsave_policy(uint64_t policy)
+{
+    uint64_t mask = 0;
+
+    switch (policy) {
+        case XSAVE_POLICY_NONE:
+            break;
+
+        case XSAVE_POLICY_AVX:
+            mask = 0x04;
+            break;
+
+        case XSAVE_POLICY_AVX512:
+            mask = 0xE4;
+            break;
+
+        default:
+            throw std::runtime_error("set_xsave_policy: unknown policy");
+    };
+
+    if (this->num_vcpus() != 0) {
+        throw std::runtime_error("set_xsave_policy: vCPUs already added");
+    }
+
+    if (mask != 0) {
+        if (!xstate_handler::is_supported()) {
+            throw std::runtime_error("set_xsave_policy: XSAVE is not supported");
+        }
+
+        auto [eax, ebx, ecx, edx] = ::x64::cpuid::get(0x0000000D, 0, 0, 0);
+
+        bfignored(ebx);
+        bfignored(ecx);
+        bfignored(edx);
+
+        if ((eax & mask) != mask) {
+            throw std::runtime_error("set_xsave_policy: policy is not supported");
+        }
+    }
+
+    m_xcr0_mask = mask;
+
+    m_cpuid.clear();
+    this->setup_cpuid();
+}
+
+uint64_t
+domain::xcr0_mask() const noexcept
+{ return m_xcr0_mask; }
+
+uint32_t
+domain::xsave_size(uint64_t xcr0) const noexcept
+{
+    uint64_t size = 576;
+
+    for (uint32_t subleaf = 2; subleaf < 8; subleaf++) {
+        if ((xcr0 & (1ULL << subleaf)) != 0) {
+            if (auto entry = this->find_cpuid(0x0000000D, subleaf)) {
+                size = std::max(size, entry->rax + entry->rbx);
+            }
+        }
+    }
+
+    return gsl::narrow_cast<uint32_t>(size);
+}
+
+void
+domain::reserve_ram(uintptr_t gpa, uint64_t size)
+{
+    std::lock_guard lock(m_pool_mutex);
+
+    if (m_ram_size != 0) {
+        throw std::runtime_error("reserve_ram: RAM already reserved");
+    }
+
+    auto mask = ::x64::pt::page_size - 1;
+
+    if (size == 0 || (gpa & mask) != 0 || (size & mask) != 0) {
+        throw std::runtime_error("reserve_ram: gpa and size must be page aligned");
+    }
+
+    if (gpa + size < gpa) {
+        throw std::runtime_error("reserve_ram: range overflows");
+    }
+
+    m_ram_gpa = gpa;
+    m_ram_size = size;
+    m_ram_populated.resize(size / ::x64::pt::page_size, false);
+}
+
+void
+domain::add_pool_page(uintptr_t hpa)
+{
+    std::lock_guard lock(m_pool_mutex);
+    m_pool.push_back(hpa);
+}
+
+bool
+domain::is_reserved_ram(uintptr_t gpa) const noexcept
+{ return gpa >= m_ram_gpa && gpa - m_ram_gpa < m_ram_size; }
+
+bool
+domain::populate_ram(uintptr_t gpa)
+{
+    // Note:
+    //
+    // Each page is tracked so that two vCPUs that fault on the same page
+    // at the same time do not both map a page from the pool (which would
+    // leak the first page and hand the guest a second, zeroed copy of
+    // memory it may have already written to). The new mapping goes from
+    // not present to present, which the hardware never caches, so no
+    // INVEPT is needed.
+    //
+
+    std::lock_guard lock(m_pool_mutex);
+
+    if (!this->is_reserved_ram(gpa)) {
+        throw std::runtime_error("populate_ram: gpa is not reserved RAM");
+    }
+
+    auto index = (gpa - m_ram_gpa) / ::x64::pt::page_size;
+    if (m_ram_populated[index]) {
+        return true;
+    }
+
+    if (m_pool.empty()) {
+        return false;
+    }
+
+    m_ept_map.map_4k(
+        gpa & ~(::x64::pt::page_size - 1), m_pool.back(), ept::mmap::attr_type::read_write_execute
+    );
+
+    m_pool.pop_back();
+    m_ram_populated[index] = true;
+
+    return true;
+}
+
+void
+domain::clone(const domain &tmpl)
+{
+    struct domain_initial_state state{};
+
+    if (this->num_vcpus() != 0) {
+        throw std::runtime_error("clone: vCPUs already added");
+    }
+
+    if (!tmpl.m_template_vcpu) {
+        throw std::runtime_error("clone: template vCPU has not been saved");
+    }
+
+    tmpl.initial_state(state);
+    this->set_initial_state(state);
+
+    m_cpuid = tmpl.m_cpuid;
+    m_xcr0_mask = tmpl.m_xcr0_mask;
+
+    // Note:
+    //
+    // The template's vCPU state is copied instead of shared, as the
+    // template can be destroyed before its clones are.
+    //
+
+    m_template_vcpu = make_page<struct vcpu_snapshot>();
+    m_template_xsave = make_page<uint8_t>();
+
+    std::memcpy(
+        m_template_vcpu.get(), tmpl.m_template_vcpu.get(), sizeof(struct vcpu_snapshot));
+    std::memcpy(
+        m_template_xsave.get(), tmpl.m_template_xsave.get(), VCPU_SNAPSHOT_XSAVE_SIZE);
+
+    m_clone = true;
+}
+
+void
+domain::save_template_vcpu(gsl::not_null<vcpu *> vcpu)
+{
+    if (m_clone || this->num_vcpus() != 1) {
+        throw std::runtime_error("save_template_vcpu: unsupported template");
+    }
+
+    if (m_template_vcpu) {
+        throw std::runtime_error("save_template_vcpu: already saved");
+    }
+
+    auto snapshot = make_page<struct vcpu_snapshot>();
+    auto xsave = make_page<uint8_t>();
+
+    vcpu->save_snapshot(*snapshot.get(), xsave.get());
+
+    m_template_xsave = std::move(xsave);
+    m_template_vcpu = std::move(snapshot);
+}
+
+void
+domain::restore_template_vcpu(gsl::not_null<vcpu *> vcpu)
+{
+    if (!m_clone) {
+        throw std::runtime_error("restore_template_vcpu: domain is not a clone");
+    }
+
+    vcpu->restore_snapshot(*m_template_vcpu.get(), m_template_xsave.get());
+}
+
+void
+domain::map_4k_cow(uintptr_t gpa, uintptr_t hpa)
+{
+    std::lock_guard lock(m_pool_mutex);
+
+    m_ept_map.map_4k(gpa, hpa, ept::mmap::attr_type::read_execute);
+    m_cow[gpa] = hpa;
+}
+
+bool
+domain::is_cow_page(uintptr_t gpa) const
+{
+    std::lock_guard lock(m_pool_mutex);
+    return m_cow.count(gpa & ~(::x64::pt::page_size - 1)) != 0;
+}
+
+bool
+domain::copy_on_write(gsl::not_null<vcpu *> vcpu, uintptr_t gpa)
+{
+    // Note:
+    //
+    // The lock is held while the page is copied so that two vCPUs that
+    // write to the same shared page at the same time do not both copy it.
+    // The vCPU that loses sees that the page is no longer shared, and
+    // simply retries the write using the copy.
+    //
+
+    std::lock_guard lock(m_pool_mutex);
+
+    auto page_gpa = gpa & ~(::x64::pt::page_size - 1);
+
+    auto iter = m_cow.find(page_gpa);
+    if (iter == m_cow.end()) {
+        return true;
+    }
+
+    if (m_pool.empty()) {
+        return false;
+    }
+
+    auto src = vcpu->map_hpa_4k<uint8_t>(iter->second, BAREFLANK_PAGE_SIZE);
+    auto dst = vcpu->map_hpa_4k<uint8_t>(m_pool.back(), BAREFLANK_PAGE_SIZE);
+
+    std::memcpy(dst.get(), src.get(), BAREFLANK_PAGE_SIZE);
+
+    m_ept_map.unmap(page_gpa);
+    m_ept_map.map_4k(
+        page_gpa, m_pool.back(), ept::mmap::attr_type::read_write_execute
+    );
+
+    m_pool.pop_back();
+    m_cow.erase(iter);
+
+    return true;
+}
+
+void
+domain::initial_state(struct domain_initial_state &state) const noexcept
+{
+    state.version = DOMAIN_INITIAL_STATE_VERSION;
+
+    state.rax = m_rax;
+    state.rbx = m_rbx;
+    state.rcx = m_rcx;
+    state.rdx = m_rdx;
+    state.rbp = m_rbp;
+    state.rsi = m_rsi;
+    state.rdi = m_rdi;
+    state.r08 = m_r08;
+    state.r09 = m_r09;
+    state.r10 = m_r10;
+    state.r11 = m_r11;
+    state.r12 = m_r12;
+    state.r13 = m_r13;
+    state.r14 = m_r14;
+    state.r15 = m_r15;
+    state.rip = m_rip;
+    state.rsp = m_rsp;
+    state.gdt_base = m_gdt_base;
+    state.gdt_limit = m_gdt_limit;
+    state.idt_base = m_idt_base;
+    state.idt_limit = m_idt_limit;
+    state.cr0 = m_cr0;
+    state.cr3 = m_cr3;
+    state.cr4 = m_cr4;
+    state.ia32_efer = m_ia32_efer;
+    state.ia32_pat = m_ia32_pat;
+
+    state.es_selector = m_es_selector;
+    state.es_base = m_es_base;
+    state.es_limit = m_es_limit;
+    state.es_access_rights = m_es_access_rights;
+    state.cs_selector = m_cs_selector;
+    state.cs_base = m_cs_base;
+    state.cs_limit = m_cs_limit;
+    state.cs_access_rights = m_cs_access_rights;
+    state.ss_selector = m_ss_selector;
+    state.ss_base = m_ss_base;
+    state.ss_limit = m_ss_limit;
+    state.ss_access_rights = m_ss_access_rights;
+    state.ds_selector = m_ds_selector;
+    state.ds_base = m_ds_base;
+    state.ds_limit = m_ds_limit;
+    state.ds_access_rights = m_ds_access_rights;
+    state.fs_selector = m_fs_selector;
+    state.fs_base = m_fs_base;
+    state.fs_limit = m_fs_limit;
+    state.fs_access_rights = m_fs_access_rights;
+    state.gs_selector = m_gs_selector;
+    state.gs_base = m_gs_base;
+    state.gs_limit = m_gs_limit;
+    state.gs_access_rights = m_gs_access_rights;
+    state.tr_selector = m_tr_selector;
+    state.tr_base = m_tr_base;
+    state.tr_limit = m_tr_limit;
+    state.tr_access_rights = m_tr_access_rights;
+    state.ldtr_selector = m_ldtr_selector;
+    state.ldtr_base = m_ldtr_base;
+    state.ldtr_limit = m_ldtr_limit;
+    state.ldtr_access_rights = m_ldtr_access_rights;
+}
+
+void
+domain::set_initial_state(const struct domain_initial_state &state)
+{
+    if (state.version != DOMAIN_INITIAL_STATE_VERSION) {
+        throw std::runtime_error("set_initial_state: unsupported version");
+    }
+
+    m_rax = state.rax;
+    m_rbx = state.rbx;
+    m_rcx = state.rcx;
+    m_rdx = state.rdx;
+    m_rbp = state.rbp;
+    m_rsi = state.rsi;
+    m_rdi = state.rdi;
+    m_r08 = state.r08;
+    m_r09 = state.r09;
+    m_r10 = state.r10;
+    m_r11 = state.r11;
+    m_r12 = state.r12;
+    m_r13 = state.r13;
+    m_r14 = state.r14;
+    m_r15 = state.r15;
+    m_rip = state.rip;
+    m_rsp = state.rsp;
+    m_gdt_base = state.gdt_base;
+    m_gdt_limit = state.gdt_limit;
+    m_idt_base = state.idt_base;
+    m_idt_limit = state.idt_limit;
+    m_cr0 = state.cr0;
+    m_cr3 = state.cr3;
+    m_cr4 = state.cr4;
+    m_ia32_efer = state.ia32_efer;
+    m_ia32_pat = state.ia32_pat;
+
+    m_es_selector = state.es_selector;
+    m_es_base = state.es_base;
+    m_es_limit = state.es_limit;
+    m_es_access_rights = state.es_access_rights;
+    m_cs_selector = state.cs_selector;
+    m_cs_base = state.cs_base;
+    m_cs_limit = state.cs_limit;
+    m_cs_access_rights = state.cs_access_rights;
+    m_ss_selector = state.ss_selector;
+    m_ss_base = state.ss_base;
+    m_ss_limit = state.ss_limit;
+    m_ss_access_rights = state.ss_access_rights;
+    m_ds_selector = state.ds_selector;
+    m_ds_base = state.ds_base;
+    m_ds_limit = state.ds_limit;
+    m_ds_access_rights = state.ds_access_rights;
+    m_fs_selector = state.fs_selector;
+    m_fs_base = state.fs_base;
+    m_fs_limit = state.fs_limit;
+    m_fs_access_rights = state.fs_access_rights;
+    m_gs_selector = state.gs_selector;
+    m_gs_base = state.gs_base;
+    m_gs_limit = state.gs_limit;
+    m_gs_access_rights = state.gs_access_rights;
+    m_tr_selector = state.tr_selector;
+    m_tr_base = state.tr_base;
+    m_tr_limit = state.tr_limit;
+    m_tr_access_rights = state.tr_access_rights;
+    m_ldtr_selector = state.ldtr_selector;
+    m_ldtr_base = state.ldtr_base;
+    m_ldtr_limit = state.ldtr_limit;
+    m_ldtr_access_rights = state.ldtr_access_rights;
+}
+
 #define domain_reg(reg)                                                         \
     uint64_t                                                                    \
     domain::reg() const noexcept                                                \
@@ -19,6 +19,8 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
+#include <algorithm>
+
 #include <hve/arch/intel_x64/vcpu.h>
 #include <hve/arch/intel_x64/emulation/cpuid.h>
 
@@ -67,6 +69,28 @@ cpuid_handler::cpuid_handler(
     EMULATE_CPUID(0x40000000, handle_0x40000000);
 }
 
+// -----------------------------------------------------------------------------
+// Helpers
+// -----------------------------------------------------------------------------
+
+void
+cpuid_handler::load_cpuid(vcpu_t *vcpu, uint32_t leaf, uint32_t subleaf)
+{
+    if (auto entry = m_vcpu->dom()->find_cpuid(leaf, subleaf)) {
+        vcpu->set_rax(entry->rax);
+        vcpu->set_rbx(entry->rbx);
+        vcpu->set_rcx(entry->rcx);
+        vcpu->set_rdx(entry->rdx);
+
+        return;
+    }
+
+    vcpu->set_rax(0);
+    vcpu->set_rbx(0);
+    vcpu->set_rcx(0);
+    vcpu->set_rdx(0);
+}
+
 // -----------------------------------------------------------------------------
 // Handlers
 // -----------------------------------------------------------------------------
@@ -74,24 +98,33 @@ cpuid_handler::cpuid_handler(
 bool
 cpuid_handler::handle_0x00000000(vcpu_t *vcpu)
 {
-    vcpu->execute_cpuid();
+    this->load_cpuid(vcpu, 0x00000000, 0);
     return vcpu->advance();
 }
 
 bool
 cpuid_handler::handle_0x00000001(vcpu_t *vcpu)
 {
-    vcpu->execute_cpuid();
+    this->load_cpuid(vcpu, 0x00000001, 0);
+
+    // Note:
+    //
+    // Fill in the guest's APIC ID and logical processor count (see
+    // handle_0x0000000B), which are masked off in the domain's table.
+    //
 
-    vcpu->set_rcx(vcpu->rcx() & 0x61FC3203);
-    vcpu->set_rdx(vcpu->rdx() & 0x1FCBFBFB);
+    vcpu->set_rbx(vcpu->rbx() | (uint64_t{m_vcpu->dom()->num_vcpus()} << 16));
+    vcpu->set_rbx(vcpu->rbx() | (uint64_t{m_vcpu->apic_id()} << 24));
 
     // Note:
     //
-    // The following tells Linux that it is in a VM.
+    // OSXSAVE mirrors the guest's CR4.OSXSAVE, which is only meaningful if
+    // XSAVE is exposed to the guest (see domain::set_xsave_policy).
     //
 
-    vcpu->set_rcx(vcpu->rcx() | 0x80000000);
+    if ((vcpu->rcx() & 0x04000000) != 0 && vmcs_n::guest_cr4::osxsave::is_enabled()) {
+        vcpu->set_rcx(vcpu->rcx() | 0x08000000);
+    }
 
     return vcpu->advance();
 }
@@ -99,18 +132,27 @@ cpuid_handler::handle_0x00000001(vcpu_t *vcpu)
 bool
 cpuid_handler::handle_0x00000002(vcpu_t *vcpu)
 {
-    vcpu->execute_cpuid();
+    this->load_cpuid(vcpu, 0x00000002, 0);
     return vcpu->advance();
 }
 
 bool
 cpuid_handler::handle_0x00000004(vcpu_t *vcpu)
 {
-    vcpu->execute_cpuid();
+    this->load_cpuid(vcpu, 0x00000004, gsl::narrow_cast<uint32_t>(vcpu->gr2()));
+
+    // Note:
+    //
+    // Each vCPU is reported as a core with a single thread. The last level
+    // cache is reported as being shared by all of the vCPUs.
+    //
 
-    vcpu->set_rax(vcpu->rax() & 0x000003FF);
-    vcpu->set_rax(vcpu->rax() | 0x04004000);
-    vcpu->set_rdx(vcpu->rdx() & 0x00000007);
+    uint64_t num_vcpus = m_vcpu->dom()->num_vcpus();
+    auto cores = std::min<uint64_t>(num_vcpus, 64) - 1;
+    auto shared = ((vcpu->rax() & 0xE0) >> 5) == 3 ? num_vcpus - 1 : 0;
+
+    vcpu->set_rax(vcpu->rax() | (cores << 26));
+    vcpu->set_rax(vcpu->rax() | ((shared & 0xFFF) << 14));
 
     return vcpu->advance();
 }
@@ -129,51 +171,77 @@ cpuid_handler::handle_0x00000006(vcpu_t *vcpu)
 bool
 cpuid_handler::handle_0x00000007(vcpu_t *vcpu)
 {
-    if (vcpu->gr2() != 0) {
-        return vcpu->advance();
-    }
-
-    vcpu->execute_cpuid();
-
-    vcpu->set_rax(0);
-    vcpu->set_rbx(vcpu->rbx() & 0x019C23D9);
-    vcpu->set_rcx(0);
-    vcpu->set_rdx(0);
-
+    this->load_cpuid(vcpu, 0x00000007, gsl::narrow_cast<uint32_t>(vcpu->gr2()));
     return vcpu->advance();
 }
 
 bool
 cpuid_handler::handle_0x0000000A(vcpu_t *vcpu)
 {
-    vcpu->execute_cpuid();
-
-    vcpu->set_rax(0);
-    vcpu->set_rbx(vcpu->rbx() & 0x0000007F);
-    vcpu->set_rcx(0);
-    vcpu->set_rdx(0);
-
+    this->load_cpuid(vcpu, 0x0000000A, 0);
     return vcpu->advance();
 }
 
 bool
 cpuid_handler::handle_0x0000000B(vcpu_t *vcpu)
 {
-    vcpu->set_rax(0);
-    vcpu->set_rbx(0);
-    vcpu->set_rcx(0);
-    vcpu->set_rdx(0);
+    // Note:
+    //
+    // The guest's topology is a single package with one core per vCPU, and
+    // one thread per core, which means that the SMT level has a width of 0
+    // and the core level is wide enough to hold all of the APIC IDs. The
+    // x2APIC ID is returned in EDX for all sub-leaves.
+    //
+
+    uint64_t num_vcpus = m_vcpu->dom()->num_vcpus();
+    uint64_t core_shift = 0;
 
+    while ((1ULL << core_shift) < num_vcpus) {
+        core_shift++;
+    }
+
+    auto level = vcpu->gr2() & 0xFF;
+
+    switch (level) {
+        case 0:
+            vcpu->set_rax(0);
+            vcpu->set_rbx(1);
+            vcpu->set_rcx((1ULL << 8) | level);
+            break;
+
+        case 1:
+            vcpu->set_rax(core_shift);
+            vcpu->set_rbx(num_vcpus);
+            vcpu->set_rcx((2ULL << 8) | level);
+            break;
+
+        default:
+            vcpu->set_rax(0);
+            vcpu->set_rbx(0);
+            vcpu->set_rcx(level);
+            break;
+    };
+
+    vcpu->set_rdx(m_vcpu->apic_id());
     return vcpu->advance();
 }
 
 bool
 cpuid_handler::handle_0x0000000D(vcpu_t *vcpu)
 {
-    vcpu->set_rax(0);
-    vcpu->set_rbx(0);
-    vcpu->set_rcx(0);
-    vcpu->set_rdx(0);
+    auto subleaf = gsl::narrow_cast<uint32_t>(vcpu->gr2());
+    this->load_cpuid(vcpu, 0x0000000D, subleaf);
+
+    // Note:
+    //
+    // EBX of subleaf 0 is the size of the XSAVE area for the guest's
+    // current XCR0. The guest owns the extended state while its VM exits
+    // are handled (see xstate_handler), so hardware has the guest's XCR0.
+    //
+
+    if (subleaf == 0 && m_vcpu->dom()->xcr0_mask() != 0) {
+        vcpu->set_rbx(m_vcpu->dom()->xsave_size(::intel_x64::xcr0::get()));
+    }
 
     return vcpu->advance();
 }
@@ -203,71 +271,49 @@ cpuid_handler::handle_0x00000010(vcpu_t *vcpu)
 bool
 cpuid_handler::handle_0x80000000(vcpu_t *vcpu)
 {
-    vcpu->execute_cpuid();
-
-    vcpu->set_rbx(0);
-    vcpu->set_rcx(0);
-    vcpu->set_rdx(0);
-
+    this->load_cpuid(vcpu, 0x80000000, 0);
     return vcpu->advance();
 }
 
 bool
 cpuid_handler::handle_0x80000001(vcpu_t *vcpu)
 {
-    vcpu->execute_cpuid();
-
-    vcpu->set_rbx(0);
-    vcpu->set_rcx(vcpu->rcx() & 0x00000121);
-    vcpu->set_rdx(vcpu->rdx() & 0x24100800);
-
+    this->load_cpuid(vcpu, 0x80000001, 0);
     return vcpu->advance();
 }
 
 bool
 cpuid_handler::handle_0x80000002(vcpu_t *vcpu)
 {
-    vcpu->execute_cpuid();
+    this->load_cpuid(vcpu, 0x80000002, 0);
     return vcpu->advance();
 }
 
 bool
 cpuid_handler::handle_0x80000003(vcpu_t *vcpu)
 {
-    vcpu->execute_cpuid();
+    this->load_cpuid(vcpu, 0x80000003, 0);
     return vcpu->advance();
 }
 
 bool
 cpuid_handler::handle_0x80000004(vcpu_t *vcpu)
 {
-    vcpu->execute_cpuid();
+    this->load_cpuid(vcpu, 0x80000004, 0);
     return vcpu->advance();
 }
 
 bool
 cpuid_handler::handle_0x80000007(vcpu_t *vcpu)
 {
-    vcpu->execute_cpuid();
-
-    vcpu->set_rax(0);
-    vcpu->set_rbx(0);
-    vcpu->set_rcx(0);
-    vcpu->set_rcx(0);
-
+    this->load_cpuid(vcpu, 0x80000007, 0);
     return vcpu->advance();
 }
 
 bool
 cpuid_handler::handle_0x80000008(vcpu_t *vcpu)
 {
-    vcpu->execute_cpuid();
-
-    vcpu->set_rax(vcpu->rax() & 0x0000FFFF);
-    vcpu->set_rbx(0);
-    vcpu->set_rcx(0);
-    vcpu->set_rdx(0);
-
+    this->load_cpuid(vcpu, 0x80000008, 0);
     return vcpu->advance();
 }
 
@@ -28,6 +28,27 @@
     m_vcpu->emulate_rdmsr(a, {&x2apic_handler::r, this});                      \
     m_vcpu->emulate_wrmsr(a, {&x2apic_handler::w, this});
 
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+constexpr const uint64_t sipi_state_running = 0;
+constexpr const uint64_t sipi_state_wait_for_sipi = 1;
+constexpr const uint64_t sipi_state_sipi_received = 2;
+
+constexpr const uint64_t no_injected_vector = 0x100;
+
+constexpr const uint64_t icr_delivery_mode_fixed = 0;
+constexpr const uint64_t icr_delivery_mode_init = 5;
+constexpr const uint64_t icr_delivery_mode_startup = 6;
+
+constexpr const uint64_t icr_shorthand_none = 0;
+constexpr const uint64_t icr_shorthand_self = 1;
+constexpr const uint64_t icr_shorthand_all_including_self = 2;
+constexpr const uint64_t icr_shorthand_all_excluding_self = 3;
+
+constexpr const uint64_t lvt_timer_mode_tsc_deadline = 2;
+
 // -----------------------------------------------------------------------------
 // Implementation
 // -----------------------------------------------------------------------------
@@ -47,13 +68,51 @@ x2apic_handler::x2apic_handler(
     }
 
     EMULATE_MSR(0x0000001B, handle_rdmsr_0x0000001B, handle_wrmsr_0x0000001B);
+    EMULATE_MSR(0x000006E0, handle_rdmsr_0x000006E0, handle_wrmsr_0x000006E0);
 
     EMULATE_MSR(0x00000802, handle_rdmsr_0x00000802, handle_wrmsr_0x00000802);
     EMULATE_MSR(0x00000803, handle_rdmsr_0x00000803, handle_wrmsr_0x00000803);
-    EMULATE_MSR(0x00000808, handle_rdmsr_0x00000808, handle_wrmsr_0x00000808);
+    EMULATE_MSR(0x0000080D, handle_rdmsr_0x0000080D, handle_wrmsr_0x0000080D);
     EMULATE_MSR(0x0000080F, handle_rdmsr_0x0000080F, handle_wrmsr_0x0000080F);
     EMULATE_MSR(0x00000828, handle_rdmsr_0x00000828, handle_wrmsr_0x00000828);
 
+    EMULATE_MSR(0x00000830, handle_rdmsr_0x00000830, handle_wrmsr_0x00000830);
+
+    EMULATE_MSR(0x00000832, handle_rdmsr_0x00000832, handle_wrmsr_0x00000832);
+    EMULATE_MSR(0x00000835, handle_rdmsr_0x00000835, handle_wrmsr_0x00000835);
+    EMULATE_MSR(0x00000836, handle_rdmsr_0x00000836, handle_wrmsr_0x00000836);
+    EMULATE_MSR(0x00000837, handle_rdmsr_0x00000837, handle_wrmsr_0x00000837);
+    EMULATE_MSR(0x00000838, handle_rdmsr_0x00000838, handle_wrmsr_0x00000838);
+
+    // Note:
+    //
+    // With APICv, the TPR, EOI, ISR and IRR live in the virtual-APIC page,
+    // which the CPU reads and writes on behalf of the guest, so these
+    // accesses are passed through instead of trapped. Reads of the EOI are
+    // still trapped, as are writes to the ISR and IRR, since passing those
+    // through would not be virtualized. The rest of the x2APIC is still
+    // emulated either way.
+    //
+
+    if (this->enable_apicv()) {
+        m_vcpu->pass_through_msr_access(0x00000808);
+        m_vcpu->emulate_rdmsr(0x0000080B, {&x2apic_handler::handle_rdmsr_0x0000080B, this});
+        m_vcpu->pass_through_wrmsr_access(0x0000080B);
+
+        for (uint32_t msr = 0x00000810; msr <= 0x00000817; msr++) {
+            m_vcpu->pass_through_rdmsr_access(msr);
+        }
+
+        for (uint32_t msr = 0x00000820; msr <= 0x00000827; msr++) {
+            m_vcpu->pass_through_rdmsr_access(msr);
+        }
+
+        return;
+    }
+
+    EMULATE_MSR(0x00000808, handle_rdmsr_0x00000808, handle_wrmsr_0x00000808);
+    EMULATE_MSR(0x0000080B, handle_rdmsr_0x0000080B, handle_wrmsr_0x0000080B);
+
     EMULATE_MSR(0x00000810, handle_rdmsr_0x00000810, handle_wrmsr_0x00000810);
     EMULATE_MSR(0x00000811, handle_rdmsr_0x00000811, handle_wrmsr_0x00000811);
     EMULATE_MSR(0x00000812, handle_rdmsr_0x00000812, handle_wrmsr_0x00000812);
@@ -72,9 +131,479 @@ x2apic_handler::x2apic_handler(
     EMULATE_MSR(0x00000826, handle_rdmsr_0x00000826, handle_wrmsr_0x00000826);
     EMULATE_MSR(0x00000827, handle_rdmsr_0x00000827, handle_wrmsr_0x00000827);
 
-    EMULATE_MSR(0x00000835, handle_rdmsr_0x00000835, handle_wrmsr_0x00000835);
-    EMULATE_MSR(0x00000836, handle_rdmsr_0x00000836, handle_wrmsr_0x00000836);
-    EMULATE_MSR(0x00000837, handle_rdmsr_0x00000837, handle_wrmsr_0x00000837);
+    m_vcpu->add_resume_delegate(
+        {&x2apic_handler::resume_delegate, this}
+    );
+}
+
+// -----------------------------------------------------------------------------
+// Interrupts
+// -----------------------------------------------------------------------------
+
+void
+x2apic_handler::queue_guest_interrupt(uint64_t vector)
+{
+    if (m_virtual_apic_page) {
+        this->post_interrupt(vector);
+        return;
+    }
+
+    // Note:
+    //
+    // Without APICv, the vCPU's interrupt queue is internal to the vCPU, so
+    // the emulated IRR is used to keep track of which interrupts are still
+    // queued, which is what allows them to be saved (see save_snapshot). If
+    // the interrupt is injected right away, it is in the VM-entry
+    // interruption information instead, and it is not marked pending.
+    // Queued interrupts are taken out of the IRR once they are injected
+    // (see resume_delegate).
+    //
+
+    auto injected = this->injected_vector();
+    m_vcpu->queue_external_interrupt(vector);
+
+    if (injected == no_injected_vector && this->injected_vector() == (vector & 0xFF)) {
+        return;
+    }
+
+    this->irr(vector) |= 1ULL << (vector & 0x1F);
+}
+
+void
+x2apic_handler::inject_guest_interrupt(uint64_t vector)
+{
+    if (m_virtual_apic_page) {
+        this->post_interrupt(vector);
+        return;
+    }
+
+    m_vcpu->inject_external_interrupt(vector);
+}
+
+bool
+x2apic_handler::is_apicv_enabled() const noexcept
+{ return static_cast<bool>(m_virtual_apic_page); }
+
+bool
+x2apic_handler::enable_apicv()
+{
+    using namespace vmcs_n;
+    using namespace primary_processor_based_vm_execution_controls;
+    using namespace secondary_processor_based_vm_execution_controls;
+
+    if (!use_tpr_shadow::is_allowed1() ||
+        !virtualize_x2apic_mode::is_allowed1() ||
+        !apic_register_virtualization::is_allowed1() ||
+        !virtual_interrupt_delivery::is_allowed1()) {
+        return false;
+    }
+
+    // Note:
+    //
+    // The EOI exit bitmaps are cleared so that EOIs never exit. This is
+    // safe because there is no emulated IOAPIC (i.e., nothing is level
+    // triggered), which is also why the emulated EOI is a no-op. The TPR
+    // threshold is not used with virtual-interrupt delivery, as changes to
+    // the TPR cause the CPU to evaluate pending virtual interrupts itself.
+    //
+
+    m_virtual_apic_page = make_page<uint32_t>();
+
+    virtual_apic_address::set(
+        g_mm->virtptr_to_physint(m_virtual_apic_page.get())
+    );
+
+    tpr_threshold::set(0);
+    guest_interrupt_status::set(0);
+
+    eoi_exit_bitmap_0::set(0);
+    eoi_exit_bitmap_1::set(0);
+    eoi_exit_bitmap_2::set(0);
+    eoi_exit_bitmap_3::set(0);
+
+    use_tpr_shadow::enable();
+    virtualize_x2apic_mode::enable();
+    apic_register_virtualization::enable();
+    virtual_interrupt_delivery::enable();
+
+    return true;
+}
+
+void
+x2apic_handler::post_interrupt(uint64_t vector)
+{
+    using namespace vmcs_n;
+
+    // Note:
+    //
+    // The vIRR is eight 32bit registers starting at offset 0x200 of the
+    // virtual-APIC page, each of which is 16 byte aligned. RVI (bits 7:0 of
+    // the guest interrupt status) is the highest vector in the vIRR, which
+    // is what the CPU uses on VM entry to decide if a virtual interrupt
+    // should be delivered. The vCPU is loaded, so the guest cannot be
+    // changing the vIRR while it is updated here.
+    //
+
+    vector &= 0xFF;
+    m_virtual_apic_page.get()[0x80 + ((vector >> 5) << 2)] |= 1U << (vector & 0x1F);
+
+    if (auto status = guest_interrupt_status::get(); (status & 0xFF) < vector) {
+        guest_interrupt_status::set((status & 0xFF00) | vector);
+    }
+}
+
+uint64_t &
+x2apic_handler::irr(uint64_t vector)
+{
+    switch ((vector & 0xFF) >> 5) {
+        case 0: return m_0x00000820;
+        case 1: return m_0x00000821;
+        case 2: return m_0x00000822;
+        case 3: return m_0x00000823;
+        case 4: return m_0x00000824;
+        case 5: return m_0x00000825;
+        case 6: return m_0x00000826;
+        default: return m_0x00000827;
+    };
+}
+
+uint64_t
+x2apic_handler::injected_vector() const
+{
+    using namespace vmcs_n::vm_entry_interruption_information;
+
+    auto info = get();
+    if (!valid_bit::is_enabled(info) ||
+        interruption_type::get(info) != interruption_type::external_interrupt) {
+        return no_injected_vector;
+    }
+
+    return vector::get(info);
+}
+
+void
+x2apic_handler::resume_delegate(vcpu_t *vcpu)
+{
+    bfignored(vcpu);
+
+    // Note:
+    //
+    // A queued interrupt is injected from the vCPU's interrupt queue once
+    // the guest opens its interrupt window, at which point it shows up in
+    // the VM-entry interruption information, and is no longer pending.
+    // This is just a read and compare unless an interrupt is being
+    // injected.
+    //
+
+    if (auto vec = this->injected_vector(); vec != no_injected_vector) {
+        this->irr(vec) &= ~(1ULL << (vec & 0x1F));
+    }
+}
+
+// -----------------------------------------------------------------------------
+// IPIs
+// -----------------------------------------------------------------------------
+
+bool
+x2apic_handler::deliver_ipi(uint64_t vector) noexcept
+{
+    auto &pending = m_pending_ipis.at((vector & 0xFF) >> 6);
+    return pending.fetch_or(1ULL << (vector & 0x3F)) == 0;
+}
+
+void
+x2apic_handler::deliver_init() noexcept
+{
+    if (m_vcpu->apic_id() != 0) {
+        m_sipi_state = sipi_state_wait_for_sipi;
+    }
+}
+
+bool
+x2apic_handler::deliver_sipi(uint64_t vector) noexcept
+{
+    m_sipi_vector = vector & 0xFF;
+
+    auto expected = sipi_state_wait_for_sipi;
+    return m_sipi_state.compare_exchange_strong(expected, sipi_state_sipi_received);
+}
+
+bool
+x2apic_handler::is_waiting_for_sipi() const noexcept
+{ return m_sipi_state == sipi_state_wait_for_sipi; }
+
+void
+x2apic_handler::inject_pending_ipis()
+{
+    if (m_sipi_state == sipi_state_sipi_received) {
+        this->start_ap(m_sipi_vector);
+        m_sipi_state = sipi_state_running;
+    }
+
+    for (uint64_t i = 0; i < m_pending_ipis.size(); i++) {
+        if (m_pending_ipis.at(i).load(std::memory_order_relaxed) == 0) {
+            continue;
+        }
+
+        auto pending = m_pending_ipis.at(i).exchange(0);
+        while (pending != 0) {
+            auto bit = static_cast<uint64_t>(__builtin_ctzll(pending));
+            pending &= pending - 1;
+
+            this->queue_guest_interrupt((i << 6) | bit);
+        }
+    }
+}
+
+vcpuid_t
+x2apic_handler::next_kick() noexcept
+{
+    if (m_kicks.empty()) {
+        return INVALID_VCPUID;
+    }
+
+    auto vcpuid = m_kicks.back();
+    m_kicks.pop_back();
+
+    return vcpuid;
+}
+
+void
+x2apic_handler::send_ipi(uint32_t apic_id, uint64_t icr)
+{
+    auto dom = m_vcpu->dom();
+    vcpuid_t kick = INVALID_VCPUID;
+
+    switch ((icr & 0x700) >> 8) {
+        case icr_delivery_mode_fixed:
+            if (apic_id == m_vcpu->apic_id()) {
+                this->queue_guest_interrupt(icr & 0xFF);
+            }
+            else {
+                kick = dom->deliver_ipi(apic_id, icr & 0xFF);
+            }
+            break;
+
+        case icr_delivery_mode_init:
+            if ((icr & 0x4000) != 0) {
+                dom->deliver_init(apic_id);
+            }
+            break;
+
+        case icr_delivery_mode_startup:
+            kick = dom->deliver_sipi(apic_id, icr & 0xFF);
+            break;
+
+        default:
+            m_vcpu->halt("unsupported IPI delivery mode");
+    };
+
+    if (kick != INVALID_VCPUID) {
+        m_kicks.push_back(kick);
+    }
+}
+
+void
+x2apic_handler::start_ap(uint64_t vector)
+{
+    using namespace vmcs_n;
+
+    // Note:
+    //
+    // Once an AP receives a SIPI, it starts executing in real mode at
+    // vector * 0x1000 with everything else in its INIT state. Real mode
+    // (i.e., CR0.PE and CR0.PG are 0) requires unrestricted guest support,
+    // which is enabled for all guest vCPUs (see setup_default_controls). The
+    // fixed bits of CR0 and CR4 are still needed for VM entry, so the read
+    // shadows are used to hide them from the guest.
+    //
+
+    auto cr0_fixed0 = ::intel_x64::msrs::ia32_vmx_cr0_fixed0::get();
+    cr0_fixed0 &= ~::intel_x64::cr0::protection_enable::mask;
+    cr0_fixed0 &= ~::intel_x64::cr0::paging::mask;
+
+    guest_cr0::set(cr0_fixed0 | ::intel_x64::cr0::extension_type::mask);
+    cr0_read_shadow::set(::intel_x64::cr0::extension_type::mask);
+    guest_cr4::set(::intel_x64::msrs::ia32_vmx_cr4_fixed0::get());
+    cr4_read_shadow::set(0);
+
+    m_vcpu->set_cr3(0);
+    m_vcpu->set_ia32_efer(0);
+    vm_entry_controls::ia_32e_mode_guest::disable();
+
+    m_vcpu->set_rip(0);
+    m_vcpu->set_rsp(0);
+    guest_rflags::set(2);
+
+    m_vcpu->set_gdt_base(0);
+    m_vcpu->set_gdt_limit(0xFFFF);
+    m_vcpu->set_idt_base(0);
+    m_vcpu->set_idt_limit(0xFFFF);
+
+    m_vcpu->set_cs_selector(vector << 8);
+    m_vcpu->set_cs_base(vector << 12);
+    m_vcpu->set_cs_limit(0xFFFF);
+    m_vcpu->set_cs_access_rights(0x9B);
+
+    m_vcpu->set_es_selector(0);
+    m_vcpu->set_es_base(0);
+    m_vcpu->set_es_limit(0xFFFF);
+    m_vcpu->set_es_access_rights(0x93);
+    m_vcpu->set_ss_selector(0);
+    m_vcpu->set_ss_base(0);
+    m_vcpu->set_ss_limit(0xFFFF);
+    m_vcpu->set_ss_access_rights(0x93);
+    m_vcpu->set_ds_selector(0);
+    m_vcpu->set_ds_base(0);
+    m_vcpu->set_ds_limit(0xFFFF);
+    m_vcpu->set_ds_access_rights(0x93);
+    m_vcpu->set_fs_selector(0);
+    m_vcpu->set_fs_base(0);
+    m_vcpu->set_fs_limit(0xFFFF);
+    m_vcpu->set_fs_access_rights(0x93);
+    m_vcpu->set_gs_selector(0);
+    m_vcpu->set_gs_base(0);
+    m_vcpu->set_gs_limit(0xFFFF);
+    m_vcpu->set_gs_access_rights(0x93);
+
+    m_vcpu->set_tr_selector(0);
+    m_vcpu->set_tr_base(0);
+    m_vcpu->set_tr_limit(0xFFFF);
+    m_vcpu->set_tr_access_rights(0x8B);
+    m_vcpu->set_ldtr_selector(0);
+    m_vcpu->set_ldtr_base(0);
+    m_vcpu->set_ldtr_limit(0xFFFF);
+    m_vcpu->set_ldtr_access_rights(0x82);
+}
+
+// -----------------------------------------------------------------------------
+// Snapshot
+// -----------------------------------------------------------------------------
+
+void
+x2apic_handler::save_snapshot(struct vcpu_snapshot &snapshot) const
+{
+    snapshot.apic_base = m_0x0000001B;
+    snapshot.apic_svr = m_0x0000080F;
+    snapshot.apic_esr = m_0x00000828;
+    snapshot.apic_icr = m_0x00000830;
+    snapshot.apic_lvt_timer = m_0x00000832;
+    snapshot.apic_lvt_lint0 = m_0x00000835;
+    snapshot.apic_lvt_lint1 = m_0x00000836;
+    snapshot.apic_lvt_error = m_0x00000837;
+
+    if (m_virtual_apic_page) {
+        auto page = m_virtual_apic_page.get();
+
+        snapshot.apic_tpr = page[0x20];
+        for (std::size_t i = 0; i < 8; i++) {
+            snapshot.apic_isr[i] = page[0x40 + (i << 2)];
+            snapshot.apic_irr[i] = page[0x80 + (i << 2)];
+        }
+
+        snapshot.apic_interrupt_status = vmcs_n::guest_interrupt_status::get();
+    }
+    else {
+        snapshot.apic_tpr = 0;
+        snapshot.apic_isr[0] = m_0x00000810;
+        snapshot.apic_isr[1] = m_0x00000811;
+        snapshot.apic_isr[2] = m_0x00000812;
+        snapshot.apic_isr[3] = m_0x00000813;
+        snapshot.apic_isr[4] = m_0x00000814;
+        snapshot.apic_isr[5] = m_0x00000815;
+        snapshot.apic_isr[6] = m_0x00000816;
+        snapshot.apic_isr[7] = m_0x00000817;
+        snapshot.apic_irr[0] = m_0x00000820;
+        snapshot.apic_irr[1] = m_0x00000821;
+        snapshot.apic_irr[2] = m_0x00000822;
+        snapshot.apic_irr[3] = m_0x00000823;
+        snapshot.apic_irr[4] = m_0x00000824;
+        snapshot.apic_irr[5] = m_0x00000825;
+        snapshot.apic_irr[6] = m_0x00000826;
+        snapshot.apic_irr[7] = m_0x00000827;
+        snapshot.apic_interrupt_status = 0;
+
+        // Note:
+        //
+        // An interrupt that has been injected but that the vCPU has not
+        // been resumed with yet is still in the IRR (see resume_delegate).
+        // It is restored from the VM-entry interruption information, so it
+        // is left out of the IRR to keep it from being delivered twice.
+        //
+
+        if (auto vec = this->injected_vector(); vec != no_injected_vector) {
+            snapshot.apic_irr[vec >> 5] &= ~(1ULL << (vec & 0x1F));
+        }
+    }
+
+    for (std::size_t i = 0; i < m_pending_ipis.size(); i++) {
+        snapshot.apic_pending_ipis[i] = m_pending_ipis.at(i).load();
+    }
+
+    snapshot.apic_sipi_state = m_sipi_state;
+    snapshot.apic_sipi_vector = m_sipi_vector;
+}
+
+void
+x2apic_handler::restore_snapshot(const struct vcpu_snapshot &snapshot)
+{
+    m_0x0000001B = snapshot.apic_base;
+    m_0x0000080F = snapshot.apic_svr;
+    m_0x00000828 = snapshot.apic_esr;
+    m_0x00000830 = snapshot.apic_icr;
+    m_0x00000832 = snapshot.apic_lvt_timer;
+    m_0x00000835 = snapshot.apic_lvt_lint0;
+    m_0x00000836 = snapshot.apic_lvt_lint1;
+    m_0x00000837 = snapshot.apic_lvt_error;
+
+    // Note:
+    //
+    // Without APICv, the ISR is not emulated (see handle_wrmsr_0x0000080B)
+    // and interrupts are queued using the vCPU's interrupt queue, so any
+    // interrupt that was pending in the snapshot's IRR is queued again
+    // (which also puts it back in the IRR). With APICv, RVI is raised to
+    // the highest pending vector, as a snapshot taken without APICv has no
+    // interrupt status. Either way, a snapshot can be restored on a CPU
+    // with or without APICv.
+    //
+
+    if (m_virtual_apic_page) {
+        auto page = m_virtual_apic_page.get();
+        auto status = snapshot.apic_interrupt_status;
+
+        page[0x20] = gsl::narrow_cast<uint32_t>(snapshot.apic_tpr);
+        for (uint64_t i = 0; i < 8; i++) {
+            page[0x40 + (i << 2)] = gsl::narrow_cast<uint32_t>(snapshot.apic_isr[i]);
+            page[0x80 + (i << 2)] = gsl::narrow_cast<uint32_t>(snapshot.apic_irr[i]);
+
+            if (auto pending = snapshot.apic_irr[i] & 0xFFFFFFFF; pending != 0) {
+                auto vec = (i << 5) | static_cast<uint64_t>(63 - __builtin_clzll(pending));
+                if ((status & 0xFF) < vec) {
+                    status = (status & 0xFF00) | vec;
+                }
+            }
+        }
+
+        vmcs_n::guest_interrupt_status::set(status);
+    }
+    else {
+        for (uint64_t i = 0; i < 8; i++) {
+            auto pending = snapshot.apic_irr[i] & 0xFFFFFFFF;
+            while (pending != 0) {
+                auto bit = static_cast<uint64_t>(__builtin_ctzll(pending));
+                pending &= pending - 1;
+
+                this->queue_guest_interrupt((i << 5) | bit);
+            }
+        }
+    }
+
+    for (std::size_t i = 0; i < m_pending_ipis.size(); i++) {
+        m_pending_ipis.at(i) = snapshot.apic_pending_ipis[i];
+    }
+
+    m_sipi_state = snapshot.apic_sipi_state;
+    m_sipi_vector = snapshot.apic_sipi_vector;
 }
 
 // -----------------------------------------------------------------------------
@@ -103,6 +632,50 @@ x2apic_handler::handle_wrmsr_0x0000001B(
     return true;
 }
 
+bool
+x2apic_handler::handle_rdmsr_0x000006E0(
+    vcpu_t *vcpu, bfvmm::intel_x64::rdmsr_handler::info_t &info)
+{
+    bfignored(vcpu);
+
+    // Note:
+    //
+    // The deadline is stored as a host TSC (see vclock_handler), so the
+    // TSC offset is used to convert it back to the guest's TSC. Once the
+    // deadline is reached, the timer is disarmed and this reads as 0.
+    //
+
+    if (auto tsc = m_vcpu->tsc_deadline(); tsc != 0) {
+        info.val = tsc + vmcs_n::tsc_offset::get();
+        return true;
+    }
+
+    info.val = 0;
+    return true;
+}
+
+bool
+x2apic_handler::handle_wrmsr_0x000006E0(
+    vcpu_t *vcpu, bfvmm::intel_x64::wrmsr_handler::info_t &info)
+{
+    bfignored(vcpu);
+
+    if (!this->is_tsc_deadline_mode()) {
+        return true;
+    }
+
+    if (info.val == 0) {
+        m_vcpu->set_tsc_deadline(0, 0);
+        return true;
+    }
+
+    m_vcpu->set_tsc_deadline(
+        info.val - vmcs_n::tsc_offset::get(), this->tsc_deadline_vector()
+    );
+
+    return true;
+}
+
 // -----------------------------------------------------------------------------
 // General Purpose Registers
 // -----------------------------------------------------------------------------
@@ -113,7 +686,7 @@ x2apic_handler::handle_rdmsr_0x00000802(
 {
     bfignored(vcpu);
 
-    info.val = 0;
+    info.val = m_vcpu->apic_id();
     return true;
 }
 
@@ -168,6 +741,54 @@ x2apic_handler::handle_wrmsr_0x00000808(
     return true;
 }
 
+bool
+x2apic_handler::handle_rdmsr_0x0000080B(
+    vcpu_t *vcpu, bfvmm::intel_x64::rdmsr_handler::info_t &info)
+{
+    bfignored(info);
+
+    vcpu->halt("reading the EOI is unsupported");
+    return true;
+}
+
+bool
+x2apic_handler::handle_wrmsr_0x0000080B(
+    vcpu_t *vcpu, bfvmm::intel_x64::wrmsr_handler::info_t &info)
+{
+    bfignored(vcpu);
+    bfignored(info);
+
+    // Note:
+    //
+    // Interrupts are injected directly into the guest (i.e., the ISR is
+    // not emulated), so there is nothing to acknowledge.
+    //
+
+    return true;
+}
+
+bool
+x2apic_handler::handle_rdmsr_0x0000080D(
+    vcpu_t *vcpu, bfvmm::intel_x64::rdmsr_handler::info_t &info)
+{
+    bfignored(vcpu);
+
+    auto apic_id = m_vcpu->apic_id();
+    info.val = ((apic_id >> 4) << 16) | (1U << (apic_id & 0xF));
+
+    return true;
+}
+
+bool
+x2apic_handler::handle_wrmsr_0x0000080D(
+    vcpu_t *vcpu, bfvmm::intel_x64::wrmsr_handler::info_t &info)
+{
+    bfignored(info);
+
+    vcpu->halt("writing to the LDR is unsupported");
+    return true;
+}
+
 bool
 x2apic_handler::handle_rdmsr_0x0000080F(
     vcpu_t *vcpu, bfvmm::intel_x64::rdmsr_handler::info_t &info)
@@ -536,10 +1157,151 @@ x2apic_handler::handle_wrmsr_0x00000827(
     return true;
 }
 
+// -----------------------------------------------------------------------------
+// ICR
+// -----------------------------------------------------------------------------
+
+bool
+x2apic_handler::handle_rdmsr_0x00000830(
+    vcpu_t *vcpu, bfvmm::intel_x64::rdmsr_handler::info_t &info)
+{
+    bfignored(vcpu);
+
+    info.val = m_0x00000830;
+    return true;
+}
+
+bool
+x2apic_handler::handle_wrmsr_0x00000830(
+    vcpu_t *vcpu, bfvmm::intel_x64::wrmsr_handler::info_t &info)
+{
+    bfignored(vcpu);
+
+    auto dest = gsl::narrow_cast<uint32_t>(info.val >> 32);
+    auto num_vcpus = m_vcpu->dom()->num_vcpus();
+
+    m_0x00000830 = info.val;
+
+    switch ((info.val & 0xC0000) >> 18) {
+        case icr_shorthand_none:
+
+            // Note:
+            //
+            // In logical destination mode, x2APIC IDs are grouped into
+            // clusters of 16 (see the LDR), with the cluster in bits 31:16
+            // of the destination, and a bitmap of the IDs in the cluster
+            // in bits 15:0.
+            //
+
+            if ((info.val & 0x800) == 0) {
+                this->send_ipi(dest, info.val);
+                break;
+            }
+
+            for (uint32_t i = 0; i < 16; i++) {
+                if ((dest & (1U << i)) != 0) {
+                    this->send_ipi(((dest >> 16) << 4) | i, info.val);
+                }
+            }
+            break;
+
+        case icr_shorthand_self:
+            this->send_ipi(m_vcpu->apic_id(), info.val);
+            break;
+
+        case icr_shorthand_all_including_self:
+            for (uint32_t i = 0; i < num_vcpus; i++) {
+                this->send_ipi(i, info.val);
+            }
+            break;
+
+        case icr_shorthand_all_excluding_self:
+            for (uint32_t i = 0; i < num_vcpus; i++) {
+                if (i != m_vcpu->apic_id()) {
+                    this->send_ipi(i, info.val);
+                }
+            }
+            break;
+
+        default:
+            break;
+    };
+
+    // Note:
+    //
+    // A pending IPI is only injected when the target vCPU is run again, so
+    // a target that is executing the guest, or yielding on a HLT, has to
+    // be kicked by the host (see next_kick). The WRMSR is completed here
+    // as control does not return to the WRMSR handler.
+    //
+
+    if (auto vcpuid = this->next_kick(); vcpuid != INVALID_VCPUID) {
+        m_vcpu->advance();
+
+        m_vcpu->parent_vcpu()->load();
+        m_vcpu->parent_vcpu()->return_kick(vcpuid);
+    }
+
+    return true;
+}
+
 // -----------------------------------------------------------------------------
 // LVT
 // -----------------------------------------------------------------------------
 
+bool
+x2apic_handler::is_tsc_deadline_mode() const noexcept
+{ return ((m_0x00000832 & 0x60000) >> 17) == lvt_timer_mode_tsc_deadline; }
+
+uint64_t
+x2apic_handler::tsc_deadline_vector() const noexcept
+{
+    if ((m_0x00000832 & 0x10000) != 0) {
+        return 0;
+    }
+
+    return m_0x00000832 & 0xFF;
+}
+
+bool
+x2apic_handler::handle_rdmsr_0x00000832(
+    vcpu_t *vcpu, bfvmm::intel_x64::rdmsr_handler::info_t &info)
+{
+    bfignored(vcpu);
+
+    info.val = m_0x00000832 & 0xFFFFFFFF;
+    return true;
+}
+
+bool
+x2apic_handler::handle_wrmsr_0x00000832(
+    vcpu_t *vcpu, bfvmm::intel_x64::wrmsr_handler::info_t &info)
+{
+    bfignored(vcpu);
+
+    m_0x00000832 = info.val & 0xFFFFFFFF;
+
+    // Note:
+    //
+    // Only TSC-deadline mode is supported (one-shot and periodic mode need
+    // the initial count register, see handle_wrmsr_0x00000838). Leaving
+    // TSC-deadline mode disarms the timer. Otherwise an armed timer is
+    // updated so that a change to the mask or vector takes effect when the
+    // deadline is reached.
+    //
+
+    if (!this->is_tsc_deadline_mode()) {
+        m_vcpu->set_tsc_deadline(0, 0);
+        return true;
+    }
+
+    if (auto tsc = m_vcpu->tsc_deadline(); tsc != 0) {
+        m_vcpu->set_tsc_deadline(tsc, this->tsc_deadline_vector());
+    }
+
+    return true;
+}
+
 bool
 x2apic_handler::handle_rdmsr_0x00000835(
     vcpu_t *vcpu, bfvmm::intel_x64::rdmsr_handler::info_t &info)
@@ -604,4 +1366,36 @@ x2apic_handler::handle_wrmsr_0x00000837(
     return true;
 }
 
+// -----------------------------------------------------------------------------
+// Timer
+// -----------------------------------------------------------------------------
+
+bool
+x2apic_handler::handle_rdmsr_0x00000838(
+    vcpu_t *vcpu, bfvmm::intel_x64::rdmsr_handler::info_t &info)
+{
+    bfignored(vcpu);
+
+    info.val = 0;
+    return true;
+}
+
+bool
+x2apic_handler::handle_wrmsr_0x00000838(
+    vcpu_t *vcpu, bfvmm::intel_x64::wrmsr_handler::info_t &info)
+{
+    // Note:
+    //
+    // Linux writes 0 to the initial count register when it shuts down the
+    // timer, even in TSC-deadline mode, so only non-zero writes (i.e., an
+    // attempt to use one-shot or periodic mode) are unsupported.
+    //
+
+    if (info.val != 0) {
+        vcpu->halt("APIC timer one-shot and periodic modes are unsupported");
+    }
+
+    return true;
+}
+
 }
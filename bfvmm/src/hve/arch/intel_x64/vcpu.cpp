@@ -59,7 +59,55 @@ io_instruction_handler(vcpu_t *vcpu)
 static bool
 ept_violation_handler(vcpu_t *vcpu)
 {
-    vcpu->halt("ept_violation_handler executed. unsupported!!!");
+    // Note:
+    //
+    // If the guest touches RAM that was reserved to be populated on
+    // demand, a page is mapped from the domain's pool, and if the guest
+    // writes to a page that is shared copy-on-write, the page is copied
+    // into a page from the pool. Either way, the faulting instruction is
+    // executed again (i.e., RIP is not advanced). If the exit happened
+    // while an event was being delivered (e.g., the guest's stack was not
+    // populated when an interrupt was pushed onto it), the event is
+    // re-injected, otherwise it would be lost. If the pool is empty, the
+    // parent is asked to grow the pool, and the instruction is retried
+    // once the parent runs this vCPU again.
+    //
+
+    auto gpa = vmcs_n::guest_physical_address::get();
+    auto dom = _v(vcpu)->dom();
+
+    auto cow = dom->is_cow_page(gpa);
+    if (!cow && !dom->is_reserved_ram(gpa)) {
+        vcpu->halt("ept_violation_handler executed. unsupported!!!");
+
+        // Unreachable
+        return true;
+    }
+
+    if (vmcs_n::idt_vectoring_information::valid_bit::is_enabled()) {
+        vmcs_n::vm_entry_interruption_information::set(
+            vmcs_n::idt_vectoring_information::get());
+        vmcs_n::vm_entry_exception_error_code::set(
+            vmcs_n::idt_vectoring_error_code::get());
+        vmcs_n::vm_entry_instruction_length::set(
+            vmcs_n::vm_exit_instruction_length::get());
+    }
+
+    if (cow) {
+        if (_v(vcpu)->copy_on_write(gpa)) {
+            return true;
+        }
+    }
+    else {
+        if (dom->populate_ram(gpa)) {
+            return true;
+        }
+    }
+
+    auto parent_vcpu = _v(vcpu)->parent_vcpu();
+
+    parent_vcpu->load();
+    parent_vcpu->return_pool_empty(dom->id());
 
     // Unreachable
     return true;
@@ -91,6 +139,7 @@ vcpu::vcpu(
     m_msr_handler{this},
     m_preemption_timer_handler{this},
     m_vmcall_handler{this},
+    m_xstate_handler{this},
 
     m_run_op_handler{this},
     m_domain_op_handler{this},
@@ -101,7 +150,9 @@ vcpu::vcpu(
     m_x2apic_handler{this},
 
     m_vclock_handler{this},
-    m_virq_handler{this}
+    m_virq_handler{this},
+
+    m_exit_stats_handler{this}
 {
     this->set_eptp(domain->ept());
 
@@ -111,11 +162,20 @@ vcpu::vcpu(
     else {
         g_domU_vcpus.insert(this);
         this->write_domU_guest_state(domain);
+
+        m_apic_id = domain->add_vcpu(this);
+        if (m_apic_id != 0) {
+            m_x2apic_handler.deliver_init();
+        }
     }
 }
 
 vcpu::~vcpu()
 {
+    if (this->is_domU()) {
+        m_domain->remove_vcpu(this);
+    }
+
     if (this->is_bootstrap_vcpu()) {
         for (const auto &vcpu : g_domU_vcpus) {
             vcpu->clear();
@@ -140,13 +200,22 @@ domain::domainid_type
 vcpu::domid() const noexcept
 { return m_domain->id(); }
 
+domain *
+vcpu::dom() const noexcept
+{ return m_domain; }
+
+uint32_t
+vcpu::apic_id() const noexcept
+{ return m_apic_id; }
+
 //------------------------------------------------------------------------------
 // VMCall
 //------------------------------------------------------------------------------
 
 void
-vcpu::add_vmcall_handler(const handler_delegate_t &d)
-{ m_vmcall_handler.add_handler(std::move(d)); }
+vcpu::add_vmcall_handler(
+    uint64_t opcode, const handler_delegate_t &d)
+{ m_vmcall_handler.add_handler(opcode, std::move(d)); }
 
 //------------------------------------------------------------------------------
 // Hlt
@@ -180,9 +249,25 @@ vcpu *
 vcpu::parent_vcpu() const noexcept
 { return m_parent_vcpu; }
 
+msr_handler::loaded_msrs_t &
+vcpu::loaded_msrs() noexcept
+{ return m_msr_handler.loaded_msrs(); }
+
+xstate_handler::loaded_xstate_t &
+vcpu::loaded_xstate() noexcept
+{ return m_xstate_handler.loaded_xstate(); }
+
+exit_stats_handler::pending_exit_t &
+vcpu::pending_exit() noexcept
+{ return m_exit_stats_handler.pending_exit(); }
+
 void
 vcpu::prepare_for_world_switch()
-{ m_msr_handler.isolate_msr__on_world_switch(this); }
+{
+    m_msr_handler.isolate_msr__on_world_switch(this);
+    m_xstate_handler.isolate_xstate__on_world_switch(this);
+    m_exit_stats_handler.exit_stats__on_world_switch(this);
+}
 
 void
 vcpu::return_fault(uint64_t error)
@@ -216,6 +301,22 @@ vcpu::return_set_wallclock()
     this->run();
 }
 
+void
+vcpu::return_pool_empty(uint64_t domainid)
+{
+    this->set_rax((domainid << 4) | hypercall_enum_run_op__pool_empty);
+    this->prepare_for_world_switch();
+    this->run();
+}
+
+void
+vcpu::return_kick(uint64_t vcpuid)
+{
+    this->set_rax((vcpuid << 4) | hypercall_enum_run_op__kick);
+    this->prepare_for_world_switch();
+    this->run();
+}
+
 //------------------------------------------------------------------------------
 // Control
 //------------------------------------------------------------------------------
@@ -232,6 +333,35 @@ bool
 vcpu::is_killed() const noexcept
 { return m_killed; }
 
+void
+vcpu::stop() noexcept
+{ m_vclock_handler.stop(); }
+
+void
+vcpu::pause() noexcept
+{ m_pause_requested = true; }
+
+void
+vcpu::unpause() noexcept
+{
+    m_pause_requested = false;
+    m_paused = false;
+}
+
+bool
+vcpu::is_paused() const noexcept
+{ return m_paused; }
+
+bool
+vcpu::acknowledge_pause() noexcept
+{
+    if (m_pause_requested) {
+        m_paused = true;
+    }
+
+    return m_paused;
+}
+
 //------------------------------------------------------------------------------
 // Virtual IRQs
 //------------------------------------------------------------------------------
@@ -244,6 +374,46 @@ void
 vcpu::inject_virtual_interrupt(uint64_t vector)
 { m_virq_handler.inject_virtual_interrupt(vector); }
 
+//------------------------------------------------------------------------------
+// Interrupts
+//------------------------------------------------------------------------------
+
+void
+vcpu::queue_guest_interrupt(uint64_t vector)
+{ m_x2apic_handler.queue_guest_interrupt(vector); }
+
+void
+vcpu::inject_guest_interrupt(uint64_t vector)
+{ m_x2apic_handler.inject_guest_interrupt(vector); }
+
+//------------------------------------------------------------------------------
+// IPIs
+//------------------------------------------------------------------------------
+
+bool
+vcpu::deliver_ipi(uint64_t vector) noexcept
+{ return m_x2apic_handler.deliver_ipi(vector); }
+
+void
+vcpu::deliver_init() noexcept
+{ m_x2apic_handler.deliver_init(); }
+
+bool
+vcpu::deliver_sipi(uint64_t vector) noexcept
+{ return m_x2apic_handler.deliver_sipi(vector); }
+
+bool
+vcpu::is_waiting_for_sipi() const noexcept
+{ return m_x2apic_handler.is_waiting_for_sipi(); }
+
+void
+vcpu::inject_pending_ipis()
+{ m_x2apic_handler.inject_pending_ipis(); }
+
+uint64_t
+vcpu::next_kick() noexcept
+{ return m_x2apic_handler.next_kick(); }
+
 //------------------------------------------------------------------------------
 // Virtual Clock
 //------------------------------------------------------------------------------
@@ -261,9 +431,261 @@ vcpu::reset_host_wallclock(void) noexcept
 { m_vclock_handler.reset_host_wallclock(); }
 
 std::pair<struct timespec, uint64_t>
-vcpu::get_host_wallclock() const
+vcpu::get_host_wallclock()
 { return m_vclock_handler.get_host_wallclock(); }
 
+void
+vcpu::set_tsc_deadline(uint64_t tsc, uint64_t vector) noexcept
+{ m_vclock_handler.set_tsc_deadline(tsc, vector); }
+
+uint64_t
+vcpu::tsc_deadline() const noexcept
+{ return m_vclock_handler.tsc_deadline(); }
+
+//------------------------------------------------------------------------------
+// Copy on Write
+//------------------------------------------------------------------------------
+
+bool
+vcpu::copy_on_write(uintptr_t gpa)
+{
+    // Note:
+    //
+    // A clone only ever has one vCPU (see domain::clone), and migrating a
+    // vCPU flushes the EPT on the physical CPU it moves to (see
+    // run_op_handler::migrate_child), so flushing the EPT on this physical
+    // CPU is enough for no physical CPU to be left with the shared page.
+    //
+
+    if (!m_domain->is_cow_page(gpa)) {
+        return true;
+    }
+
+    if (!m_domain->copy_on_write(this, gpa)) {
+        return false;
+    }
+
+    ::intel_x64::vmx::invept_single_context(vmcs_n::ept_pointer::get());
+    return true;
+}
+
+void
+vcpu::retry_vmcall_on_pool_empty()
+{
+    this->set_rip(this->rip() - vmcs_n::vm_exit_instruction_length::get());
+
+    auto parent_vcpu = this->parent_vcpu();
+
+    parent_vcpu->load();
+    parent_vcpu->return_pool_empty(m_domain->id());
+}
+
+//------------------------------------------------------------------------------
+// Snapshot
+//------------------------------------------------------------------------------
+
+void
+vcpu::save_snapshot(struct vcpu_snapshot &snapshot, uint8_t *xsave)
+{
+    using namespace vmcs_n;
+
+    snapshot.version = VCPU_SNAPSHOT_VERSION;
+
+    snapshot.rax = this->rax();
+    snapshot.rbx = this->rbx();
+    snapshot.rcx = this->rcx();
+    snapshot.rdx = this->rdx();
+    snapshot.rbp = this->rbp();
+    snapshot.rsi = this->rsi();
+    snapshot.rdi = this->rdi();
+    snapshot.r08 = this->r08();
+    snapshot.r09 = this->r09();
+    snapshot.r10 = this->r10();
+    snapshot.r11 = this->r11();
+    snapshot.r12 = this->r12();
+    snapshot.r13 = this->r13();
+    snapshot.r14 = this->r14();
+    snapshot.r15 = this->r15();
+    snapshot.rip = this->rip();
+    snapshot.rsp = this->rsp();
+    snapshot.rflags = guest_rflags::get();
+
+    snapshot.cr0 = guest_cr0::get();
+    snapshot.cr0_read_shadow = cr0_read_shadow::get();
+    snapshot.cr2 = this->cr2();
+    snapshot.cr3 = this->cr3();
+    snapshot.cr4 = guest_cr4::get();
+    snapshot.cr4_read_shadow = cr4_read_shadow::get();
+    snapshot.dr7 = guest_dr7::get();
+    snapshot.ia32_efer = this->ia32_efer();
+    snapshot.ia32_pat = this->ia32_pat();
+    snapshot.ia32_debugctl = guest_ia32_debugctl::get();
+    snapshot.ia32_sysenter_cs = guest_ia32_sysenter_cs::get();
+    snapshot.ia32_sysenter_esp = guest_ia32_sysenter_esp::get();
+    snapshot.ia32_sysenter_eip = guest_ia32_sysenter_eip::get();
+
+    snapshot.gdt_base = this->gdt_base();
+    snapshot.gdt_limit = this->gdt_limit();
+    snapshot.idt_base = this->idt_base();
+    snapshot.idt_limit = this->idt_limit();
+
+    snapshot.es_selector = this->es_selector();
+    snapshot.es_base = this->es_base();
+    snapshot.es_limit = this->es_limit();
+    snapshot.es_access_rights = this->es_access_rights();
+    snapshot.cs_selector = this->cs_selector();
+    snapshot.cs_base = this->cs_base();
+    snapshot.cs_limit = this->cs_limit();
+    snapshot.cs_access_rights = this->cs_access_rights();
+    snapshot.ss_selector = this->ss_selector();
+    snapshot.ss_base = this->ss_base();
+    snapshot.ss_limit = this->ss_limit();
+    snapshot.ss_access_rights = this->ss_access_rights();
+    snapshot.ds_selector = this->ds_selector();
+    snapshot.ds_base = this->ds_base();
+    snapshot.ds_limit = this->ds_limit();
+    snapshot.ds_access_rights = this->ds_access_rights();
+    snapshot.fs_selector = this->fs_selector();
+    snapshot.fs_base = this->fs_base();
+    snapshot.fs_limit = this->fs_limit();
+    snapshot.fs_access_rights = this->fs_access_rights();
+    snapshot.gs_selector = this->gs_selector();
+    snapshot.gs_base = this->gs_base();
+    snapshot.gs_limit = this->gs_limit();
+    snapshot.gs_access_rights = this->gs_access_rights();
+    snapshot.tr_selector = this->tr_selector();
+    snapshot.tr_base = this->tr_base();
+    snapshot.tr_limit = this->tr_limit();
+    snapshot.tr_access_rights = this->tr_access_rights();
+    snapshot.ldtr_selector = this->ldtr_selector();
+    snapshot.ldtr_base = this->ldtr_base();
+    snapshot.ldtr_limit = this->ldtr_limit();
+    snapshot.ldtr_access_rights = this->ldtr_access_rights();
+
+    snapshot.interruptibility_state = guest_interruptibility_state::get();
+    snapshot.activity_state = guest_activity_state::get();
+    snapshot.pending_debug_exceptions = guest_pending_debug_exceptions::get();
+    snapshot.entry_interruption_information = vm_entry_interruption_information::get();
+    snapshot.entry_exception_error_code = vm_entry_exception_error_code::get();
+    snapshot.entry_instruction_length = vm_entry_instruction_length::get();
+
+    m_msr_handler.save_snapshot(snapshot);
+    m_xstate_handler.save_snapshot(snapshot, xsave);
+    m_x2apic_handler.save_snapshot(snapshot);
+    m_vclock_handler.save_snapshot(snapshot);
+    m_virq_handler.save_snapshot(snapshot);
+}
+
+void
+vcpu::restore_snapshot(
+    const struct vcpu_snapshot &snapshot, const uint8_t *xsave)
+{
+    using namespace vmcs_n;
+
+    if (snapshot.version != VCPU_SNAPSHOT_VERSION) {
+        throw std::runtime_error("restore_snapshot: unsupported version");
+    }
+
+    this->set_rax(snapshot.rax);
+    this->set_rbx(snapshot.rbx);
+    this->set_rcx(snapshot.rcx);
+    this->set_rdx(snapshot.rdx);
+    this->set_rbp(snapshot.rbp);
+    this->set_rsi(snapshot.rsi);
+    this->set_rdi(snapshot.rdi);
+    this->set_r08(snapshot.r08);
+    this->set_r09(snapshot.r09);
+    this->set_r10(snapshot.r10);
+    this->set_r11(snapshot.r11);
+    this->set_r12(snapshot.r12);
+    this->set_r13(snapshot.r13);
+    this->set_r14(snapshot.r14);
+    this->set_r15(snapshot.r15);
+    this->set_rip(snapshot.rip);
+    this->set_rsp(snapshot.rsp);
+    guest_rflags::set(snapshot.rflags);
+
+    // Note:
+    //
+    // CR0 and CR4 are restored as is (i.e., including the bits that are
+    // fixed for VMX operation), along with the read shadows that hide
+    // these bits from the guest (see x2apic_handler::start_ap). Whether or
+    // not the guest is in long mode is taken from EFER.LMA.
+    //
+
+    guest_cr0::set(snapshot.cr0);
+    cr0_read_shadow::set(snapshot.cr0_read_shadow);
+    this->set_cr2(snapshot.cr2);
+    this->set_cr3(snapshot.cr3);
+    guest_cr4::set(snapshot.cr4);
+    cr4_read_shadow::set(snapshot.cr4_read_shadow);
+    guest_dr7::set(snapshot.dr7);
+    this->set_ia32_efer(snapshot.ia32_efer);
+    this->set_ia32_pat(snapshot.ia32_pat);
+    guest_ia32_debugctl::set(snapshot.ia32_debugctl);
+    guest_ia32_sysenter_cs::set(snapshot.ia32_sysenter_cs);
+    guest_ia32_sysenter_esp::set(snapshot.ia32_sysenter_esp);
+    guest_ia32_sysenter_eip::set(snapshot.ia32_sysenter_eip);
+
+    if (guest_ia32_efer::lma::is_enabled()) {
+        vm_entry_controls::ia_32e_mode_guest::enable();
+    }
+    else {
+        vm_entry_controls::ia_32e_mode_guest::disable();
+    }
+
+    this->set_gdt_base(snapshot.gdt_base);
+    this->set_gdt_limit(snapshot.gdt_limit);
+    this->set_idt_base(snapshot.idt_base);
+    this->set_idt_limit(snapshot.idt_limit);
+
+    this->set_es_selector(snapshot.es_selector);
+    this->set_es_base(snapshot.es_base);
+    this->set_es_limit(snapshot.es_limit);
+    this->set_es_access_rights(snapshot.es_access_rights);
+    this->set_cs_selector(snapshot.cs_selector);
+    this->set_cs_base(snapshot.cs_base);
+    this->set_cs_limit(snapshot.cs_limit);
+    this->set_cs_access_rights(snapshot.cs_access_rights);
+    this->set_ss_selector(snapshot.ss_selector);
+    this->set_ss_base(snapshot.ss_base);
+    this->set_ss_limit(snapshot.ss_limit);
+    this->set_ss_access_rights(snapshot.ss_access_rights);
+    this->set_ds_selector(snapshot.ds_selector);
+    this->set_ds_base(snapshot.ds_base);
+    this->set_ds_limit(snapshot.ds_limit);
+    this->set_ds_access_rights(snapshot.ds_access_rights);
+    this->set_fs_selector(snapshot.fs_selector);
+    this->set_fs_base(snapshot.fs_base);
+    this->set_fs_limit(snapshot.fs_limit);
+    this->set_fs_access_rights(snapshot.fs_access_rights);
+    this->set_gs_selector(snapshot.gs_selector);
+    this->set_gs_base(snapshot.gs_base);
+    this->set_gs_limit(snapshot.gs_limit);
+    this->set_gs_access_rights(snapshot.gs_access_rights);
+    this->set_tr_selector(snapshot.tr_selector);
+    this->set_tr_base(snapshot.tr_base);
+    this->set_tr_limit(snapshot.tr_limit);
+    this->set_tr_access_rights(snapshot.tr_access_rights);
+    this->set_ldtr_selector(snapshot.ldtr_selector);
+    this->set_ldtr_base(snapshot.ldtr_base);
+    this->set_ldtr_limit(snapshot.ldtr_limit);
+    this->set_ldtr_access_rights(snapshot.ldtr_access_rights);
+
+    guest_interruptibility_state::set(snapshot.interruptibility_state);
+    guest_activity_state::set(snapshot.activity_state);
+    guest_pending_debug_exceptions::set(snapshot.pending_debug_exceptions);
+    vm_entry_interruption_information::set(snapshot.entry_interruption_information);
+    vm_entry_exception_error_code::set(snapshot.entry_exception_error_code);
+    vm_entry_instruction_length::set(snapshot.entry_instruction_length);
+
+    m_msr_handler.restore_snapshot(snapshot);
+    m_xstate_handler.restore_snapshot(snapshot, xsave);
+    m_x2apic_handler.restore_snapshot(snapshot);
+    m_vclock_handler.restore_snapshot(snapshot);
+    m_virq_handler.restore_snapshot(snapshot);
+}
+
 //------------------------------------------------------------------------------
 // Fault
 //------------------------------------------------------------------------------
@@ -398,8 +820,32 @@ vcpu::setup_default_controls()
     use_tsc_offsetting::enable();
 
     using namespace secondary_processor_based_vm_execution_controls;
-    enable_invpcid::disable();
     enable_xsaves_xrstors::disable();
+
+    // Note:
+    //
+    // INVPCID is reported to the guest whenever it can be enabled (see
+    // domain::setup_cpuid), as a guest that uses PCIDs (e.g., Linux with
+    // KPTI) needs INVPCID to flush a single PCID without flushing them all.
+    //
+
+    if (enable_invpcid::is_allowed1()) {
+        enable_invpcid::enable();
+    }
+    else {
+        enable_invpcid::disable();
+    }
+
+    // Note:
+    //
+    // Application processors are started in real mode (see
+    // x2apic_handler::start_ap), which needs unrestricted guest support.
+    // A domU cannot be created on a CPU that does not support it (see
+    // domain::setup_domU), and EPT is always enabled for guest vCPUs, so
+    // this is always allowed here.
+    //
+
+    unrestricted_guest::enable();
 }
 
 void
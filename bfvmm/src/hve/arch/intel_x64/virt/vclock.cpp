@@ -21,8 +21,11 @@
 
 #include <hve/arch/intel_x64/vcpu.h>
 #include <hve/arch/intel_x64/virt/vclock.h>
+#include <hve/arch/intel_x64/virt/vclock_math.h>
 #include <bftsc.h>
 
+#include <atomic>
+
 #define NSEC_PER_SEC 1000000000L
 
 // -----------------------------------------------------------------------------
@@ -52,6 +55,13 @@
 // in the guest when a world switch occurs loses time, but that is up to the
 // guest OS to sort out.
 //
+// The x2APIC's TSC-deadline mode is emulated the same way (see
+// set_tsc_deadline). The only difference is that once the deadline is reached,
+// the vector from the guest's LVT timer is queued instead of the vclock vIRQ,
+// which means that an unmodified guest gets a one-shot timer without needing
+// the set_next_event VMCall. Both events share the preemption timer, which is
+// always set using whichever event is next.
+//
 
 // -----------------------------------------------------------------------------
 // Notes about TSC <-> Nanonsecond Conversions
@@ -235,14 +245,53 @@
 //   calculate how many nanoseconds have passed. Once we have that we can
 //   determine the current time.
 //
+// - The Quotient Remainder approach above costs two divides and a modulo
+//   per conversion, and conversions happen on every yield, every preemption
+//   timer resume and every wallclock read. Instead, Formulas #1 and #2 are
+//   performed using fixed-point math, with constants that are calculated
+//   once (per TSC frequency) when the vclock is created:
+//
+//   tsc_to_nsec_mult = (1,000,000 << shift) / tsc_freq_khz
+//   nsec_to_tsc_mult = (tsc_freq_khz << shift) / 1,000,000
+//
+//   nanoseconds = (tsc ticks * tsc_to_nsec_mult) >> shift
+//   tsc ticks = (nanoseconds * nsec_to_tsc_mult) >> shift
+//
+//   The multiply is done using 128bit math (i.e., a single mul on x64), so
+//   overflow is not an issue. The cost is a small amount of error in the
+//   multiplier (less than 1 part in 2^31 for any real TSC frequency), which
+//   would turn into drift if Formula #3 were used over a long period of
+//   time. To prevent this, the cached wallclock is periodically moved
+//   forward (see rebase_wallclock()) by a whole number of milliseconds.
+//   Since tsc_freq_khz is the number of ticks in a millisecond, this move
+//   is exact, so the error is never larger than the error of converting
+//   the time since the last rebase. The same constants are given to the
+//   guest (see get_tsc_to_nsec_mult_shift) so that the guest and the VMM
+//   compute the same time.
+//
+// - A guest can also register a time info page per vCPU (see
+//   set_pvclock_page), in which case the guest's wallclock base and the
+//   constants above are written to the page whenever they change. The
+//   guest can then compute the time from the page and rdtsc without a
+//   VMCall. The page is updated using a seqlock (i.e., the version is odd
+//   while the page is being written). Since the base is only changed by
+//   the guest's own vCPU (either from a VMCall, or right before the vCPU
+//   is resumed), the guest never sees an odd version unless it reads the
+//   page of another vCPU.
+//
+// - The VMM stores every TSC in host TSC values, while the guest sees the
+//   host TSC plus the TSC offset. The offset is 0 unless the vCPU was
+//   restored from a snapshot (see restore_snapshot), in which case the
+//   offset is chosen so that the guest's TSC continues from where it was
+//   saved. Any TSC that is given to the guest (i.e., the wallclock base)
+//   has the offset added to it.
+//
 
 // -----------------------------------------------------------------------------
 // Helpers
 // -----------------------------------------------------------------------------
 
-static uint64_t
-mul_div(uint64_t x, uint64_t n, uint64_t d)
-{ return ((x / d) * n) + (((x % d) * n) / d); }
+constexpr const uint64_t s_rebase_msec = 1000;
 
 static struct timespec
 inc_timespec(const struct timespec &ts, uint64_t nsec)
@@ -282,6 +331,11 @@ vclock_handler::vclock_handler(
     m_vcpu{vcpu},
     m_tsc_freq_khz{calibrate_tsc_freq_khz()}
 {
+    if (m_tsc_freq_khz != 0) {
+        m_tsc_to_nsec_mult = vclock_math::tsc_to_nsec_mult(m_tsc_freq_khz);
+        m_nsec_to_tsc_mult = vclock_math::nsec_to_tsc_mult(m_tsc_freq_khz);
+    }
+
     if (vcpu->is_dom0()) {
         this->setup_dom0();
     }
@@ -314,9 +368,14 @@ vclock_handler::reset_host_wallclock(void) noexcept
 }
 
 std::pair<struct timespec, uint64_t>
-vclock_handler::get_host_wallclock() const
+vclock_handler::get_host_wallclock()
 {
     auto tsc = ::x64::tsc::get();
+
+    if (m_host_wc_tsc != 0) {
+        this->rebase_wallclock(m_host_wc_rtc, m_host_wc_tsc, tsc);
+    }
+
     auto elapsed_nsec = this->tsc_to_nsec(tsc - m_host_wc_tsc);
 
     return {inc_timespec(m_host_wc_rtc, elapsed_nsec), tsc};
@@ -328,21 +387,140 @@ vclock_handler::get_host_wallclock() const
 
 void
 vclock_handler::set_guest_wallclock_rtc(void) noexcept
-{ m_guest_wc_rtc = m_host_wc_rtc; }
+{
+    m_guest_wc_rtc = m_host_wc_rtc;
+    this->update_pvclock();
+}
 
 void
 vclock_handler::set_guest_wallclock_tsc(void) noexcept
-{ m_guest_wc_tsc = m_host_wc_tsc; }
+{
+    m_guest_wc_tsc = m_host_wc_tsc;
+    this->update_pvclock();
+}
 
 std::pair<struct timespec, uint64_t>
-vclock_handler::get_guest_wallclock() const
+vclock_handler::get_guest_wallclock() noexcept
 {
     auto tsc = ::x64::tsc::get();
+
+    if (m_guest_wc_tsc != 0) {
+        if (this->rebase_wallclock(m_guest_wc_rtc, m_guest_wc_tsc, tsc)) {
+            this->update_pvclock();
+        }
+    }
+
     auto elapsed_nsec = this->tsc_to_nsec(tsc - m_guest_wc_tsc);
 
     return {inc_timespec(m_guest_wc_rtc, elapsed_nsec), tsc};
 }
 
+//------------------------------------------------------------------------------
+// TSC Deadline
+//------------------------------------------------------------------------------
+
+void
+vclock_handler::set_tsc_deadline(uint64_t tsc, uint64_t vector) noexcept
+{
+    m_tsc_deadline = tsc;
+    m_tsc_deadline_vector = vector;
+}
+
+uint64_t
+vclock_handler::tsc_deadline() const noexcept
+{ return m_tsc_deadline; }
+
+//------------------------------------------------------------------------------
+// Snapshot
+//------------------------------------------------------------------------------
+
+void
+vclock_handler::stop() noexcept
+{
+    if (m_stop_tsc == 0) {
+        m_stop_tsc = ::x64::tsc::get();
+    }
+}
+
+void
+vclock_handler::save_snapshot(struct vcpu_snapshot &snapshot) const noexcept
+{
+    // Note:
+    //
+    // The guest's TSC is saved as of when the vCPU stopped, and not as of
+    // the save, so that the guest does not see the time between the two
+    // once it is restored. A vCPU that was never run after it was killed
+    // (e.g., its thread stopped on a fault) has no stop TSC, in which case
+    // the current TSC is the best that is known.
+    //
+
+    auto to_guest = [&](uint64_t tsc) -> uint64_t {
+        return tsc != 0 ? tsc + m_tsc_offset : 0;
+    };
+
+    auto stop_tsc = m_stop_tsc != 0 ? m_stop_tsc : ::x64::tsc::get();
+
+    snapshot.tsc = stop_tsc + m_tsc_offset;
+    snapshot.next_event_tsc = to_guest(m_next_event_tsc);
+    snapshot.tsc_deadline = to_guest(m_tsc_deadline);
+    snapshot.tsc_deadline_vector = m_tsc_deadline_vector;
+
+    snapshot.guest_wc_tsc = to_guest(m_guest_wc_tsc);
+    snapshot.guest_wc_sec = static_cast<uint64_t>(m_guest_wc_rtc.tv_sec);
+    snapshot.guest_wc_nsec = static_cast<uint64_t>(m_guest_wc_rtc.tv_nsec);
+
+    snapshot.pvclock_gpa = m_pvclock_gpa;
+}
+
+void
+vclock_handler::restore_snapshot(const struct vcpu_snapshot &snapshot)
+{
+    // Note:
+    //
+    // The guest's TSC does not move while the vCPU is saved, which means
+    // that the guest's wall clock is behind by however long the vCPU was
+    // saved for (just like a paused VM). The guest can ask for the host's
+    // wall clock again (see vclock_op__reset_host_wallclock) to catch up.
+    // Timers that expired while the vCPU was saved fire once it is resumed.
+    //
+
+    m_tsc_offset = snapshot.tsc - ::x64::tsc::get();
+    vmcs_n::tsc_offset::set(m_tsc_offset);
+
+    auto to_host = [&](uint64_t tsc) -> uint64_t {
+        return tsc != 0 ? tsc - m_tsc_offset : 0;
+    };
+
+    m_next_event_tsc = to_host(snapshot.next_event_tsc);
+    m_tsc_deadline = to_host(snapshot.tsc_deadline);
+    m_tsc_deadline_vector = snapshot.tsc_deadline_vector;
+
+    m_guest_wc_tsc = to_host(snapshot.guest_wc_tsc);
+    m_guest_wc_rtc.tv_sec = gsl::narrow_cast<int64_t>(snapshot.guest_wc_sec);
+    m_guest_wc_rtc.tv_nsec = gsl::narrow_cast<long>(snapshot.guest_wc_nsec);
+
+    m_pvclock = {};
+    m_pvclock_gpa = 0;
+
+    if (snapshot.pvclock_gpa != 0) {
+        if ((snapshot.pvclock_gpa & (BAREFLANK_PAGE_SIZE - 1)) != 0) {
+            throw std::runtime_error("pvclock page is not page aligned");
+        }
+
+        if (!m_vcpu->copy_on_write(snapshot.pvclock_gpa)) {
+            throw std::runtime_error("pvclock page: pool empty");
+        }
+
+        m_pvclock =
+            m_vcpu->map_gpa_4k<struct vclock_pvclock_info>(
+                snapshot.pvclock_gpa, sizeof(struct vclock_pvclock_info)
+            );
+
+        m_pvclock_gpa = snapshot.pvclock_gpa;
+        this->update_pvclock();
+    }
+}
+
 //------------------------------------------------------------------------------
 // Time Helpers
 //------------------------------------------------------------------------------
@@ -353,11 +531,19 @@ vclock_handler::tsc_freq_khz() const noexcept
 
 uint64_t
 vclock_handler::tsc_to_nsec(uint64_t tsc) const noexcept
-{ return mul_div(tsc, 1000000, m_tsc_freq_khz); }
+{ return vclock_math::mul_shift(tsc, m_tsc_to_nsec_mult); }
 
 uint64_t
 vclock_handler::nsec_to_tsc(uint64_t nsec) const noexcept
-{ return mul_div(nsec, m_tsc_freq_khz, 1000000); }
+{ return vclock_math::mul_shift(nsec, m_nsec_to_tsc_mult); }
+
+uint64_t
+vclock_handler::tsc_to_nsec_mult() const noexcept
+{ return m_tsc_to_nsec_mult; }
+
+uint64_t
+vclock_handler::tsc_to_nsec_shift() const noexcept
+{ return vclock_math::mult_shift; }
 
 // -----------------------------------------------------------------------------
 // Handlers
@@ -369,7 +555,14 @@ vclock_handler::handle_yield(vcpu *vcpu)
     auto next_event = m_next_event_tsc;
 
     vcpu->advance();
-    this->inject_vclock_event();
+
+    if (m_tsc_deadline != 0 && (next_event == 0 || m_tsc_deadline <= next_event)) {
+        next_event = m_tsc_deadline;
+        this->inject_tsc_deadline_event();
+    }
+    else {
+        this->inject_vclock_event();
+    }
 
     if (auto tsc = ::x64::tsc::get(); tsc < next_event) {
         auto nsec = this->tsc_to_nsec(next_event - tsc);
@@ -386,35 +579,23 @@ vclock_handler::handle_preemption_timer(vcpu *vcpu)
 {
     bfignored(vcpu);
 
-    this->queue_vclock_event();
+    this->queue_expired_events();
     return true;
 }
 
 void
-vclock_handler::vclock_op__get_tsc_freq_khz(vcpu *vcpu)
-{
-    try {
-        vcpu->set_rax(this->tsc_freq_khz());
-    }
-    catchall({
-        vcpu->set_rax(FAILURE);
-    })
-}
+vclock_handler::vclock_op__get_tsc_freq_khz(vcpu *vcpu) noexcept
+{ vcpu->set_rax(this->tsc_freq_khz()); }
 
 void
-vclock_handler::vclock_op__set_next_event(vcpu *vcpu)
+vclock_handler::vclock_op__set_next_event(vcpu *vcpu) noexcept
 {
-    try {
-        m_next_event_tsc = ::x64::tsc::get() + vcpu->rbx();
-        vcpu->set_rax(SUCCESS);
-    }
-    catchall({
-        vcpu->set_rax(FAILURE);
-    })
+    m_next_event_tsc = ::x64::tsc::get() + vcpu->rbx();
+    vcpu->set_rax(SUCCESS);
 }
 
 void
-vclock_handler::vclock_op__reset_host_wallclock(vcpu *vcpu)
+vclock_handler::vclock_op__reset_host_wallclock(vcpu *vcpu) noexcept
 {
     try {
         vcpu->set_rax(SUCCESS);
@@ -428,81 +609,114 @@ vclock_handler::vclock_op__reset_host_wallclock(vcpu *vcpu)
 }
 
 void
-vclock_handler::vclock_op__set_host_wallclock_rtc(vcpu *vcpu)
+vclock_handler::vclock_op__set_host_wallclock_rtc(vcpu *vcpu) noexcept
 {
-    try {
-        auto child_vcpu = get_vcpu(vcpu->rbx());
-        child_vcpu->set_host_wallclock_rtc(vcpu->rcx(), vcpu->rdx());
-
-        vcpu->set_rax(SUCCESS);
+    auto child_vcpu = try_get_vcpu(vcpu->rbx());
+    if (child_vcpu == nullptr) {
+        vcpu->set_rax(FAILURE);
+        return;
     }
-    catchall({
+
+    child_vcpu->set_host_wallclock_rtc(vcpu->rcx(), vcpu->rdx());
+    vcpu->set_rax(SUCCESS);
+}
+
+void
+vclock_handler::vclock_op__set_host_wallclock_tsc(vcpu *vcpu) noexcept
+{
+    auto child_vcpu = try_get_vcpu(vcpu->rbx());
+    if (child_vcpu == nullptr) {
         vcpu->set_rax(FAILURE);
-    })
+        return;
+    }
+
+    child_vcpu->set_host_wallclock_tsc(vcpu->rcx());
+    vcpu->set_rax(SUCCESS);
 }
 
 void
-vclock_handler::vclock_op__set_host_wallclock_tsc(vcpu *vcpu)
+vclock_handler::vclock_op__set_guest_wallclock_rtc(vcpu *vcpu) noexcept
 {
-    try {
-        auto child_vcpu = get_vcpu(vcpu->rbx());
-        child_vcpu->set_host_wallclock_tsc(vcpu->rcx());
+    this->set_guest_wallclock_rtc();
+    vcpu->set_rax(SUCCESS);
+}
 
-        vcpu->set_rax(SUCCESS);
-    }
-    catchall({
-        vcpu->set_rax(FAILURE);
-    })
+void
+vclock_handler::vclock_op__set_guest_wallclock_tsc(vcpu *vcpu) noexcept
+{
+    this->set_guest_wallclock_tsc();
+    vcpu->set_rax(SUCCESS);
 }
 
 void
-vclock_handler::vclock_op__set_guest_wallclock_rtc(vcpu *vcpu)
+vclock_handler::vclock_op__get_tsc_to_nsec_mult_shift(vcpu *vcpu) noexcept
 {
-    try {
-        this->set_guest_wallclock_rtc();
-        vcpu->set_rax(SUCCESS);
-    }
-    catchall({
-        vcpu->set_rax(FAILURE);
-    })
+    vcpu->set_rbx(this->tsc_to_nsec_mult());
+    vcpu->set_rcx(this->tsc_to_nsec_shift());
+
+    vcpu->set_rax(SUCCESS);
 }
 
 void
-vclock_handler::vclock_op__set_guest_wallclock_tsc(vcpu *vcpu)
+vclock_handler::vclock_op__set_pvclock_page(vcpu *vcpu) noexcept
 {
+    if (vcpu->rbx() == 0) {
+        m_pvclock = {};
+        m_pvclock_gpa = 0;
+        vcpu->set_rax(SUCCESS);
+
+        return;
+    }
+
     try {
-        this->set_guest_wallclock_tsc();
+        if ((vcpu->rbx() & (BAREFLANK_PAGE_SIZE - 1)) != 0) {
+            throw std::runtime_error("pvclock page is not page aligned");
+        }
+
+        // Note:
+        //
+        // The VMM writes to the pvclock page directly, so in a clone, the
+        // page has to be copied before it is mapped. If the pool is empty,
+        // the VMCall is executed again once the pool has been grown.
+        //
+
+        if (!vcpu->copy_on_write(vcpu->rbx())) {
+            vcpu->retry_vmcall_on_pool_empty();
+        }
+
+        m_pvclock =
+            vcpu->map_gpa_4k<struct vclock_pvclock_info>(
+                vcpu->rbx(), sizeof(struct vclock_pvclock_info)
+            );
+
+        m_pvclock_gpa = vcpu->rbx();
+        m_pvclock->version = 0;
+        this->update_pvclock();
+
         vcpu->set_rax(SUCCESS);
     }
     catchall({
+        m_pvclock = {};
+        m_pvclock_gpa = 0;
         vcpu->set_rax(FAILURE);
     })
 }
 
 void
-vclock_handler::vclock_op__get_guest_wallclock(vcpu *vcpu)
+vclock_handler::vclock_op__get_guest_wallclock(vcpu *vcpu) noexcept
 {
-    try {
-        auto wallclock = this->get_guest_wallclock();
+    auto wallclock = this->get_guest_wallclock();
 
-        vcpu->set_rbx(static_cast<uint64_t>(wallclock.first.tv_sec));
-        vcpu->set_rcx(static_cast<uint64_t>(wallclock.first.tv_nsec));
-        vcpu->set_rdx(wallclock.second);
+    vcpu->set_rbx(static_cast<uint64_t>(wallclock.first.tv_sec));
+    vcpu->set_rcx(static_cast<uint64_t>(wallclock.first.tv_nsec));
+    vcpu->set_rdx(wallclock.second + m_tsc_offset);
 
-        vcpu->set_rax(SUCCESS);
-    }
-    catchall({
-        vcpu->set_rax(FAILURE);
-    })
+    vcpu->set_rax(SUCCESS);
 }
 
 bool
 vclock_handler::dispatch_dom0(vcpu *vcpu)
 {
-    if (bfopcode(vcpu->rax()) != hypercall_enum_vclock_op) {
-        return false;
-    }
-
     switch (vcpu->rax()) {
         case hypercall_enum_vclock_op__get_tsc_freq_khz:
             vclock_op__get_tsc_freq_khz(vcpu);
@@ -517,7 +731,7 @@ vclock_handler::dispatch_dom0(vcpu *vcpu)
             break;
 
         default:
-            vcpu->halt("unknown dom0 vclock op");
+            return false;
     };
 
     return true;
@@ -526,10 +740,6 @@ vclock_handler::dispatch_dom0(vcpu *vcpu)
 bool
 vclock_handler::dispatch_domU(vcpu *vcpu)
 {
-    if (bfopcode(vcpu->rax()) != hypercall_enum_vclock_op) {
-        return false;
-    }
-
     switch (vcpu->rax()) {
         case hypercall_enum_vclock_op__get_tsc_freq_khz:
             vclock_op__get_tsc_freq_khz(vcpu);
@@ -555,8 +765,16 @@ vclock_handler::dispatch_domU(vcpu *vcpu)
             vclock_op__get_guest_wallclock(vcpu);
             break;
 
+        case hypercall_enum_vclock_op__get_tsc_to_nsec_mult_shift:
+            vclock_op__get_tsc_to_nsec_mult_shift(vcpu);
+            break;
+
+        case hypercall_enum_vclock_op__set_pvclock_page:
+            vclock_op__set_pvclock_page(vcpu);
+            break;
+
         default:
-            vcpu->halt("unknown domU vclock op");
+            return false;
     };
 
     return true;
@@ -565,19 +783,34 @@ vclock_handler::dispatch_domU(vcpu *vcpu)
 void
 vclock_handler::resume_delegate(vcpu_t *vcpu)
 {
-    if (m_next_event_tsc == 0 || m_guest_wc_tsc == 0) {
+    // Note:
+    //
+    // If the guest is reading the time from its pvclock page, the base has
+    // to be kept fresh without waiting for the guest to make a VMCall, so
+    // the base is checked on every world switch. This is just a subtract
+    // and compare unless the base actually needs to move.
+    //
+
+    if (m_pvclock && m_guest_wc_tsc != 0) {
+        if (this->rebase_wallclock(m_guest_wc_rtc, m_guest_wc_tsc, ::x64::tsc::get())) {
+            this->update_pvclock();
+        }
+    }
+
+    auto next_event = this->next_event_tsc();
+    if (next_event == 0) {
         return;
     }
 
-    if (auto tsc = ::x64::tsc::get(); tsc < m_next_event_tsc) {
+    if (auto tsc = ::x64::tsc::get(); tsc < next_event) {
         vcpu->set_preemption_timer(
-            ((m_next_event_tsc - tsc) >> m_pet_decrement) + 1
+            ((next_event - tsc) >> m_pet_decrement) + 1
         );
 
         return;
     }
 
-    this->queue_vclock_event();
+    this->queue_expired_events();
 }
 
 // -----------------------------------------------------------------------------
@@ -588,7 +821,7 @@ void
 vclock_handler::setup_dom0()
 {
     m_vcpu->add_vmcall_handler(
-        {&vclock_handler::dispatch_dom0, this}
+        hypercall_enum_vclock_op, {&vclock_handler::dispatch_dom0, this}
     );
 }
 
@@ -603,7 +836,7 @@ vclock_handler::setup_domU()
     }
 
     m_vcpu->add_vmcall_handler(
-        {&vclock_handler::dispatch_domU, this}
+        hypercall_enum_vclock_op, {&vclock_handler::dispatch_domU, this}
     );
 
     m_vcpu->add_resume_delegate(
@@ -619,6 +852,94 @@ vclock_handler::setup_domU()
     );
 }
 
+bool
+vclock_handler::rebase_wallclock(
+    struct timespec &rtc, uint64_t &base_tsc, uint64_t tsc) noexcept
+{
+    // Note:
+    //
+    // tsc_freq_khz is the number of TSC ticks in a millisecond, so moving
+    // the base forward by a whole number of milliseconds does not lose any
+    // precision. This is only done once the base is s_rebase_msec old so
+    // that the divide is rare.
+    //
+
+    if (tsc - base_tsc < m_tsc_freq_khz * s_rebase_msec) {
+        return false;
+    }
+
+    auto msec = (tsc - base_tsc) / m_tsc_freq_khz;
+
+    base_tsc += msec * m_tsc_freq_khz;
+    rtc = inc_timespec(rtc, msec * 1000000);
+
+    return true;
+}
+
+void
+vclock_handler::update_pvclock() const noexcept
+{
+    if (!m_pvclock) {
+        return;
+    }
+
+    auto info = m_pvclock.get();
+
+    info->version++;
+    std::atomic_thread_fence(std::memory_order_release);
+
+    info->tsc = m_guest_wc_tsc + m_tsc_offset;
+    info->sec = m_guest_wc_rtc.tv_sec;
+    info->nsec = m_guest_wc_rtc.tv_nsec;
+    info->tsc_to_nsec_mult = m_tsc_to_nsec_mult;
+    info->tsc_to_nsec_shift = vclock_math::mult_shift;
+
+    std::atomic_thread_fence(std::memory_order_release);
+    info->version++;
+}
+
+uint64_t
+vclock_handler::next_event_tsc() const noexcept
+{
+    // Note:
+    //
+    // The clock event device is only used once the guest's wallclock has
+    // been set, while the TSC deadline timer can be used at any time, as
+    // an unmodified guest never sets the wallclock.
+    //
+
+    auto next_event = m_guest_wc_tsc != 0 ? m_next_event_tsc : 0;
+
+    if (m_tsc_deadline != 0 && (next_event == 0 || m_tsc_deadline < next_event)) {
+        next_event = m_tsc_deadline;
+    }
+
+    return next_event;
+}
+
+void
+vclock_handler::queue_expired_events()
+{
+    auto tsc = ::x64::tsc::get();
+
+    // Note:
+    //
+    // The preemption timer is shared, so it is always disabled here, even
+    // if an event has not expired yet. In that case, the timer is set again
+    // the next time the vCPU is resumed (see resume_delegate).
+    //
+
+    m_vcpu->disable_preemption_timer();
+
+    if (m_guest_wc_tsc != 0 && m_next_event_tsc != 0 && tsc >= m_next_event_tsc) {
+        this->queue_vclock_event();
+    }
+
+    if (m_tsc_deadline != 0 && tsc >= m_tsc_deadline) {
+        this->queue_tsc_deadline_event();
+    }
+}
+
 void
 vclock_handler::queue_vclock_event()
 {
@@ -637,6 +958,30 @@ vclock_handler::inject_vclock_event()
     m_next_event_tsc = 0;
 }
 
+void
+vclock_handler::queue_tsc_deadline_event()
+{
+    m_vcpu->disable_preemption_timer();
+
+    if (m_tsc_deadline_vector != 0) {
+        m_vcpu->queue_guest_interrupt(m_tsc_deadline_vector);
+    }
+
+    m_tsc_deadline = 0;
+}
+
+void
+vclock_handler::inject_tsc_deadline_event()
+{
+    m_vcpu->disable_preemption_timer();
+
+    if (m_tsc_deadline_vector != 0) {
+        m_vcpu->inject_guest_interrupt(m_tsc_deadline_vector);
+    }
+
+    m_tsc_deadline = 0;
+}
+
 }
 
 
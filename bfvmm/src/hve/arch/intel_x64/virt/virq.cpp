@@ -39,7 +39,7 @@ virq_handler::virq_handler(
     }
 
     m_vcpu->add_vmcall_handler(
-        {&virq_handler::dispatch, this}
+        hypercall_enum_virq_op, {&virq_handler::dispatch, this}
     );
 }
 
@@ -50,15 +50,155 @@ virq_handler::virq_handler(
 void
 virq_handler::queue_virtual_interrupt(uint64_t vector)
 {
+    if (m_event_page) {
+        if (this->set_event_pending(vector)) {
+            m_vcpu->queue_guest_interrupt(m_hypervisor_callback_vector);
+        }
+
+        return;
+    }
+
     m_interrupt_queue.push(vector);
-    m_vcpu->queue_external_interrupt(m_hypervisor_callback_vector);
+    m_vcpu->queue_guest_interrupt(m_hypervisor_callback_vector);
 }
 
 void
 virq_handler::inject_virtual_interrupt(uint64_t vector)
 {
+    if (m_event_page) {
+        if (this->set_event_pending(vector)) {
+            m_vcpu->inject_guest_interrupt(m_hypervisor_callback_vector);
+        }
+
+        return;
+    }
+
     m_interrupt_queue.push(vector);
-    m_vcpu->inject_external_interrupt(m_hypervisor_callback_vector);
+    m_vcpu->inject_guest_interrupt(m_hypervisor_callback_vector);
+}
+
+bool
+virq_handler::set_event_pending(uint64_t vector)
+{
+    // Note:
+    //
+    // The event page is shared with the guest, which clears pending bits
+    // (and upcall_pending) while it is running, so everything here has to
+    // be atomic. The Hypervisor Callback Vector only has to be delivered
+    // if this vIRQ was not already pending, is not masked, and the guest
+    // does not already have an upcall pending, as in any of those cases
+    // the guest's callback will see this vIRQ while it drains the page.
+    //
+
+    if (vector < boxy_virq__base) {
+        throw std::runtime_error("invalid virq");
+    }
+
+    auto bit = vector - boxy_virq__base;
+    if (bit >= VIRQ_EVENT_PAGE_NUM_VIRQS) {
+        throw std::runtime_error("invalid virq");
+    }
+
+    auto page = m_event_page.get();
+    auto word = bit / 64;
+    auto mask = 1ULL << (bit % 64);
+
+    if ((__atomic_fetch_or(&page->pending[word], mask, __ATOMIC_SEQ_CST) & mask) != 0) {
+        return false;
+    }
+
+    if ((__atomic_load_n(&page->mask[word], __ATOMIC_SEQ_CST) & mask) != 0) {
+        return false;
+    }
+
+    return __atomic_exchange_n(&page->upcall_pending, 1ULL, __ATOMIC_SEQ_CST) == 0;
+}
+
+// -----------------------------------------------------------------------------
+// Snapshot
+// -----------------------------------------------------------------------------
+
+void
+virq_handler::save_snapshot(struct vcpu_snapshot &snapshot)
+{
+    snapshot.hypervisor_callback_vector = m_hypervisor_callback_vector;
+    snapshot.event_page_gpa = m_event_page_gpa;
+    snapshot.num_virqs = 0;
+
+    // Note:
+    //
+    // The interrupt queue can only be read by dequeuing it, so the queue
+    // is drained into the snapshot and then filled again. The queue is
+    // filled again even if the save fails because the snapshot is full, so
+    // that no vIRQs are lost.
+    //
+
+    auto ___ = gsl::finally([&] {
+        for (uint64_t i = 0; i < snapshot.num_virqs; i++) {
+            m_interrupt_queue.push(snapshot.virqs[i]);
+        }
+    });
+
+    while (!m_interrupt_queue.empty()) {
+        if (snapshot.num_virqs == VCPU_SNAPSHOT_MAX_VIRQS) {
+            throw std::runtime_error("too many pending virqs");
+        }
+
+        snapshot.virqs[snapshot.num_virqs++] = m_interrupt_queue.pop();
+    }
+}
+
+void
+virq_handler::restore_snapshot(const struct vcpu_snapshot &snapshot)
+{
+    if (snapshot.num_virqs > VCPU_SNAPSHOT_MAX_VIRQS) {
+        throw std::runtime_error("too many pending virqs");
+    }
+
+    m_hypervisor_callback_vector = snapshot.hypervisor_callback_vector;
+
+    m_event_page = {};
+    m_event_page_gpa = 0;
+
+    if (snapshot.event_page_gpa != 0) {
+        if ((snapshot.event_page_gpa & (BAREFLANK_PAGE_SIZE - 1)) != 0) {
+            throw std::runtime_error("event page is not page aligned");
+        }
+
+        if (!m_vcpu->copy_on_write(snapshot.event_page_gpa)) {
+            throw std::runtime_error("event page: pool empty");
+        }
+
+        m_event_page =
+            m_vcpu->map_gpa_4k<struct virq_event_page>(
+                snapshot.event_page_gpa, sizeof(struct virq_event_page)
+            );
+
+        m_event_page_gpa = snapshot.event_page_gpa;
+    }
+
+    for (uint64_t i = 0; i < snapshot.num_virqs; i++) {
+        m_interrupt_queue.push(snapshot.virqs[i]);
+    }
+
+    // Note:
+    //
+    // With APICv, a pending Hypervisor Callback Vector IRQ is restored with
+    // the vIRR, in which case queuing it again does nothing. Without APICv,
+    // it was in the vCPU's interrupt queue, which is not part of the
+    // snapshot, so it is queued again here. If the guest had already taken
+    // the IRQ, it sees one extra callback with nothing to do.
+    //
+
+    auto pending = snapshot.num_virqs != 0;
+    if (m_event_page) {
+        pending = pending ||
+            __atomic_load_n(&m_event_page->upcall_pending, __ATOMIC_SEQ_CST) != 0;
+    }
+
+    if (pending && m_hypervisor_callback_vector != 0) {
+        m_vcpu->queue_guest_interrupt(m_hypervisor_callback_vector);
+    }
 }
 
 // -----------------------------------------------------------------------------
@@ -93,13 +233,63 @@ virq_handler::virq_op__get_next_virq(vcpu *vcpu)
     })
 }
 
-bool
-virq_handler::dispatch(vcpu *vcpu)
+void
+virq_handler::virq_op__set_event_page(vcpu *vcpu)
 {
-    if (bfopcode(vcpu->rax()) != hypercall_enum_virq_op) {
-        return false;
+    if (vcpu->rbx() == 0) {
+        m_event_page = {};
+        m_event_page_gpa = 0;
+        vcpu->set_rax(SUCCESS);
+
+        return;
     }
 
+    try {
+        if ((vcpu->rbx() & (BAREFLANK_PAGE_SIZE - 1)) != 0) {
+            throw std::runtime_error("event page is not page aligned");
+        }
+
+        // Note:
+        //
+        // The VMM writes to the event page directly, so in a clone, the page
+        // has to be copied before it is mapped. If the pool is empty, the
+        // VMCall is executed again once the pool has been grown.
+        //
+
+        if (!vcpu->copy_on_write(vcpu->rbx())) {
+            vcpu->retry_vmcall_on_pool_empty();
+        }
+
+        m_event_page =
+            vcpu->map_gpa_4k<struct virq_event_page>(
+                vcpu->rbx(), sizeof(struct virq_event_page)
+            );
+
+        m_event_page_gpa = vcpu->rbx();
+
+        // Note:
+        //
+        // Anything still in the queue was raised before the page existed,
+        // so it is moved to the page. The guest is expected to drain the
+        // page once this VMCall returns.
+        //
+
+        while (!m_interrupt_queue.empty()) {
+            this->set_event_pending(m_interrupt_queue.pop());
+        }
+
+        vcpu->set_rax(SUCCESS);
+    }
+    catchall({
+        m_event_page = {};
+        m_event_page_gpa = 0;
+        vcpu->set_rax(FAILURE);
+    })
+}
+
+bool
+virq_handler::dispatch(vcpu *vcpu)
+{
     switch (vcpu->rax()) {
         case hypercall_enum_virq_op__set_hypervisor_callback_vector:
             virq_op__set_hypervisor_callback_vector(vcpu);
@@ -109,6 +299,10 @@ virq_handler::dispatch(vcpu *vcpu)
             virq_op__get_next_virq(vcpu);
             break;
 
+        case hypercall_enum_virq_op__set_event_page:
+            virq_op__set_event_page(vcpu);
+            break;
+
         default:
             vcpu->halt("unknown virq op");
     };
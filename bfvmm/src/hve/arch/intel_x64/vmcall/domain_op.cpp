@@ -19,6 +19,8 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
+#include <unordered_map>
+
 #include <hve/arch/intel_x64/vcpu.h>
 #include <hve/arch/intel_x64/domain.h>
 #include <hve/arch/intel_x64/vmcall/domain_op.h>
@@ -35,11 +37,31 @@ domain_op_handler::domain_op_handler(
         return;
     }
 
-    vcpu->add_vmcall_handler({&domain_op_handler::dispatch, this});
+    vcpu->add_vmcall_handler(
+        hypercall_enum_domain_op, {&domain_op_handler::dispatch, this}
+    );
+}
+
+// Note:
+//
+// Most domain ops target a domain other than the caller. Invalid or
+// self-referencing domain ids are common on a bad or racing hypercall, so
+// they are rejected here without throwing. Only operations that can still
+// fail for other reasons (e.g., EPT allocations) need a try/catch.
+//
+
+static domain *
+foreign_domain(vcpu *vcpu) noexcept
+{
+    if (vcpu->rbx() == self || vcpu->rbx() == vcpu->domid()) {
+        return nullptr;
+    }
+
+    return try_get_domain(vcpu->rbx());
 }
 
 void
-domain_op_handler::domain_op__create_domain(vcpu *vcpu)
+domain_op_handler::domain_op__create_domain(vcpu *vcpu) noexcept
 {
     try {
         vcpu->set_rax(domain::generate_domainid());
@@ -51,14 +73,14 @@ domain_op_handler::domain_op__create_domain(vcpu *vcpu)
 }
 
 void
-domain_op_handler::domain_op__destroy_domain(vcpu *vcpu)
+domain_op_handler::domain_op__destroy_domain(vcpu *vcpu) noexcept
 {
-    try {
-        if (vcpu->rbx() == self || vcpu->rbx() == vcpu->domid()) {
-            throw std::runtime_error(
-                "domain_op__destroy_domain: self not supported");
-        }
+    if (foreign_domain(vcpu) == nullptr) {
+        vcpu->set_rax(FAILURE);
+        return;
+    }
 
+    try {
         g_dm->destroy(vcpu->rbx());
         vcpu->set_rax(SUCCESS);
     }
@@ -68,18 +90,22 @@ domain_op_handler::domain_op__destroy_domain(vcpu *vcpu)
 }
 
 void
-domain_op_handler::domain_op__set_uart(vcpu *vcpu)
+domain_op_handler::domain_op__clone_domain(vcpu *vcpu) noexcept
 {
-    try {
-        if (vcpu->rbx() == self || vcpu->rbx() == vcpu->domid()) {
-            throw std::runtime_error(
-                "domain_op__set_uart: self not supported");
-        }
+    auto dom = foreign_domain(vcpu);
+    if (dom == nullptr || vcpu->rcx() == vcpu->rbx() || vcpu->rcx() == vcpu->domid()) {
+        vcpu->set_rax(FAILURE);
+        return;
+    }
 
-        get_domain(vcpu->rbx())->set_uart(
-            gsl::narrow_cast<uart::port_type>(vcpu->rcx())
-        );
+    auto tmpl = try_get_domain(vcpu->rcx());
+    if (tmpl == nullptr) {
+        vcpu->set_rax(FAILURE);
+        return;
+    }
 
+    try {
+        dom->clone(*tmpl);
         vcpu->set_rax(SUCCESS);
     }
     catchall({
@@ -88,34 +114,46 @@ domain_op_handler::domain_op__set_uart(vcpu *vcpu)
 }
 
 void
-domain_op_handler::domain_op__set_pt_uart(vcpu *vcpu)
+domain_op_handler::domain_op__set_uart(vcpu *vcpu) noexcept
 {
-    try {
-        if (vcpu->rbx() == self || vcpu->rbx() == vcpu->domid()) {
-            throw std::runtime_error(
-                "domain_op__set_pt_uart: self not supported");
-        }
+    auto dom = foreign_domain(vcpu);
+    if (dom == nullptr) {
+        vcpu->set_rax(FAILURE);
+        return;
+    }
 
-        get_domain(vcpu->rbx())->set_pt_uart(
-            gsl::narrow_cast<uart::port_type>(vcpu->rcx())
-        );
+    dom->set_uart(gsl::narrow_cast<uart::port_type>(vcpu->rcx()));
+    vcpu->set_rax(SUCCESS);
+}
 
-        vcpu->set_rax(SUCCESS);
-    }
-    catchall({
+void
+domain_op_handler::domain_op__set_pt_uart(vcpu *vcpu) noexcept
+{
+    auto dom = foreign_domain(vcpu);
+    if (dom == nullptr) {
         vcpu->set_rax(FAILURE);
-    })
+        return;
+    }
+
+    dom->set_pt_uart(gsl::narrow_cast<uart::port_type>(vcpu->rcx()));
+    vcpu->set_rax(SUCCESS);
 }
 
 void
-domain_op_handler::domain_op__dump_uart(vcpu *vcpu)
+domain_op_handler::domain_op__dump_uart(vcpu *vcpu) noexcept
 {
+    auto dom = try_get_domain(vcpu->rbx());
+    if (dom == nullptr) {
+        vcpu->set_rax(0);
+        return;
+    }
+
     try {
         auto buffer =
             vcpu->map_gva_4k<char>(vcpu->rcx(), UART_MAX_BUFFER);
 
         auto bytes_transferred =
-            get_domain(vcpu->rbx())->dump_uart(
+            dom->dump_uart(
                 gsl::span(buffer.get(), UART_MAX_BUFFER)
             );
 
@@ -127,18 +165,37 @@ domain_op_handler::domain_op__dump_uart(vcpu *vcpu)
 }
 
 void
-domain_op_handler::domain_op__share_page_r(vcpu *vcpu)
+domain_op_handler::domain_op__set_xsave_policy(vcpu *vcpu) noexcept
 {
+    auto dom = foreign_domain(vcpu);
+    if (dom == nullptr) {
+        vcpu->set_rax(FAILURE);
+        return;
+    }
+
     try {
-        if (vcpu->rbx() == self || vcpu->rbx() == vcpu->domid()) {
-            throw std::runtime_error(
-                "domain_op__share_page: self not supported");
-        }
+        dom->set_xsave_policy(vcpu->rcx());
+        vcpu->set_rax(SUCCESS);
+    }
+    catchall({
+        vcpu->set_rax(FAILURE);
+    })
+}
+
+void
+domain_op_handler::domain_op__share_page_r(vcpu *vcpu) noexcept
+{
+    auto dom = foreign_domain(vcpu);
+    if (dom == nullptr) {
+        vcpu->set_rax(FAILURE);
+        return;
+    }
 
+    try {
         auto [hpa, unused] =
             vcpu->gpa_to_hpa(vcpu->rcx());
 
-        get_domain(vcpu->rbx())->map_4k_r(vcpu->rdx(), hpa);
+        dom->map_4k_r(vcpu->rdx(), hpa);
         vcpu->set_rax(SUCCESS);
     }
     catchall({
@@ -147,18 +204,19 @@ domain_op_handler::domain_op__share_page_r(vcpu *vcpu)
 }
 
 void
-domain_op_handler::domain_op__share_page_rw(vcpu *vcpu)
+domain_op_handler::domain_op__share_page_rw(vcpu *vcpu) noexcept
 {
-    try {
-        if (vcpu->rbx() == self || vcpu->rbx() == vcpu->domid()) {
-            throw std::runtime_error(
-                "domain_op__share_page: self not supported");
-        }
+    auto dom = foreign_domain(vcpu);
+    if (dom == nullptr) {
+        vcpu->set_rax(FAILURE);
+        return;
+    }
 
+    try {
         auto [hpa, unused] =
             vcpu->gpa_to_hpa(vcpu->rcx());
 
-        get_domain(vcpu->rbx())->map_4k_rw(vcpu->rdx(), hpa);
+        dom->map_4k_rw(vcpu->rdx(), hpa);
         vcpu->set_rax(SUCCESS);
     }
     catchall({
@@ -167,18 +225,19 @@ domain_op_handler::domain_op__share_page_rw(vcpu *vcpu)
 }
 
 void
-domain_op_handler::domain_op__share_page_rwe(vcpu *vcpu)
+domain_op_handler::domain_op__share_page_rwe(vcpu *vcpu) noexcept
 {
-    try {
-        if (vcpu->rbx() == self || vcpu->rbx() == vcpu->domid()) {
-            throw std::runtime_error(
-                "domain_op__share_page: self not supported");
-        }
+    auto dom = foreign_domain(vcpu);
+    if (dom == nullptr) {
+        vcpu->set_rax(FAILURE);
+        return;
+    }
 
+    try {
         auto [hpa, unused] =
             vcpu->gpa_to_hpa(vcpu->rcx());
 
-        get_domain(vcpu->rbx())->map_4k_rwe(vcpu->rdx(), hpa);
+        dom->map_4k_rwe(vcpu->rdx(), hpa);
         vcpu->set_rax(SUCCESS);
     }
     catchall({
@@ -187,7 +246,7 @@ domain_op_handler::domain_op__share_page_rwe(vcpu *vcpu)
 }
 
 void
-domain_op_handler::domain_op__donate_page_r(vcpu *vcpu)
+domain_op_handler::domain_op__donate_page_r(vcpu *vcpu) noexcept
 {
     // TODO:
     //
@@ -196,16 +255,17 @@ domain_op_handler::domain_op__donate_page_r(vcpu *vcpu)
     // sharing as both domains have access to the backing page.
     //
 
-    try {
-        if (vcpu->rbx() == self || vcpu->rbx() == vcpu->domid()) {
-            throw std::runtime_error(
-                "domain_op__donate_page: self not supported");
-        }
+    auto dom = foreign_domain(vcpu);
+    if (dom == nullptr) {
+        vcpu->set_rax(FAILURE);
+        return;
+    }
 
+    try {
         auto [hpa, unused] =
             vcpu->gpa_to_hpa(vcpu->rcx());
 
-        get_domain(vcpu->rbx())->map_4k_r(vcpu->rdx(), hpa);
+        dom->map_4k_r(vcpu->rdx(), hpa);
         vcpu->set_rax(SUCCESS);
     }
     catchall({
@@ -214,7 +274,7 @@ domain_op_handler::domain_op__donate_page_r(vcpu *vcpu)
 }
 
 void
-domain_op_handler::domain_op__donate_page_rw(vcpu *vcpu)
+domain_op_handler::domain_op__donate_page_rw(vcpu *vcpu) noexcept
 {
     // TODO:
     //
@@ -223,16 +283,17 @@ domain_op_handler::domain_op__donate_page_rw(vcpu *vcpu)
     // sharing as both domains have access to the backing page.
     //
 
-    try {
-        if (vcpu->rbx() == self || vcpu->rbx() == vcpu->domid()) {
-            throw std::runtime_error(
-                "domain_op__donate_page: self not supported");
-        }
+    auto dom = foreign_domain(vcpu);
+    if (dom == nullptr) {
+        vcpu->set_rax(FAILURE);
+        return;
+    }
 
+    try {
         auto [hpa, unused] =
             vcpu->gpa_to_hpa(vcpu->rcx());
 
-        get_domain(vcpu->rbx())->map_4k_rw(vcpu->rdx(), hpa);
+        dom->map_4k_rw(vcpu->rdx(), hpa);
         vcpu->set_rax(SUCCESS);
     }
     catchall({
@@ -241,7 +302,7 @@ domain_op_handler::domain_op__donate_page_rw(vcpu *vcpu)
 }
 
 void
-domain_op_handler::domain_op__donate_page_rwe(vcpu *vcpu)
+domain_op_handler::domain_op__donate_page_rwe(vcpu *vcpu) noexcept
 {
     // TODO:
     //
@@ -250,17 +311,229 @@ domain_op_handler::domain_op__donate_page_rwe(vcpu *vcpu)
     // sharing as both domains have access to the backing page.
     //
 
+    auto dom = foreign_domain(vcpu);
+    if (dom == nullptr) {
+        vcpu->set_rax(FAILURE);
+        return;
+    }
+
     try {
+        auto [hpa, unused] =
+            vcpu->gpa_to_hpa(vcpu->rcx());
+
+        dom->map_4k_rwe(vcpu->rdx(), hpa);
+        vcpu->set_rax(SUCCESS);
+    }
+    catchall({
+        vcpu->set_rax(FAILURE);
+    })
+}
+
+static void
+donate_run(
+    vcpu *vcpu, domain *dom, const struct donate_range_entry &entry)
+{
+    uintptr_t hpa = 0;
+    uintptr_t end = 0;
+
+    auto gpa = entry.gpa;
+    auto foreign_gpa = entry.foreign_gpa;
+
+    if (entry.count == 0) {
+        throw std::runtime_error("donate_run: empty run");
+    }
+
+    for (uint64_t i = 0; i < entry.count; i++) {
+
+        // Note:
+        //
+        // The donating domain's EPT is only walked when the run crosses
+        // into a new backing page. If dom0 is mapped with large pages, an
+        // entire run usually resolves with a single walk.
+        //
+
+        if (gpa >= end) {
+            auto [base, from] = vcpu->gpa_to_hpa(gpa);
 
-        if (vcpu->rbx() == self || vcpu->rbx() == vcpu->domid()) {
-            throw std::runtime_error(
-                "domain_op__donate_page: self not supported");
+            hpa = base;
+            end = (gpa & ~((1ULL << from) - 1)) + (1ULL << from);
         }
 
-        auto [hpa, unused] =
-            vcpu->gpa_to_hpa(vcpu->rcx());
+        switch (entry.attr) {
+            case DONATE_RANGE_ATTR_R:
+                dom->map_4k_r(foreign_gpa, hpa);
+                break;
+
+            case DONATE_RANGE_ATTR_RW:
+                dom->map_4k_rw(foreign_gpa, hpa);
+                break;
+
+            case DONATE_RANGE_ATTR_RWE:
+                dom->map_4k_rwe(foreign_gpa, hpa);
+                break;
+
+            case DONATE_RANGE_ATTR_POOL:
+                dom->add_pool_page(hpa);
+                break;
+
+            case DONATE_RANGE_ATTR_COW:
+                dom->map_4k_cow(foreign_gpa, hpa);
+                break;
+
+            default:
+                throw std::runtime_error("donate_run: unsupported attr");
+        }
+
+        hpa += BAREFLANK_PAGE_SIZE;
+        gpa += BAREFLANK_PAGE_SIZE;
+        foreign_gpa += BAREFLANK_PAGE_SIZE;
+    }
+}
+
+void
+domain_op_handler::domain_op__donate_range(vcpu *vcpu) noexcept
+{
+    // TODO:
+    //
+    // Like the single page version, the donated pages are not yet removed
+    // from the current domain.
+    //
+
+    auto dom = foreign_domain(vcpu);
+    auto num = vcpu->rdx();
+
+    if (dom == nullptr || num == 0 || num > DONATE_RANGE_MAX_ENTRIES) {
+        vcpu->set_rax(FAILURE);
+        return;
+    }
+
+    try {
+        auto range =
+            vcpu->map_gpa_4k<struct donate_range_entry>(
+                vcpu->rcx(), num * sizeof(struct donate_range_entry));
+
+        for (const auto &entry : gsl::span(range.get(), num)) {
+            donate_run(vcpu, dom, entry);
+        }
 
-        get_domain(vcpu->rbx())->map_4k_rwe(vcpu->rdx(), hpa);
+        vcpu->set_rax(SUCCESS);
+    }
+    catchall({
+        vcpu->set_rax(FAILURE);
+    })
+}
+
+static uintptr_t
+large_page_hpa(
+    vcpu *vcpu, uintptr_t gpa, uintptr_t foreign_gpa, uintptr_t size)
+{
+    if ((gpa & (size - 1)) != 0 || (foreign_gpa & (size - 1)) != 0) {
+        throw std::runtime_error("large_page_hpa: gpa is not aligned");
+    }
+
+    auto [hpa, from] = vcpu->gpa_to_hpa(gpa);
+
+    if ((hpa & (size - 1)) != 0) {
+        throw std::runtime_error("large_page_hpa: hpa is not aligned");
+    }
+
+    // Note:
+    //
+    // If the donor maps this range with a page that is at least as large
+    // as the page being donated, the range is physically contiguous by
+    // definition. Otherwise, every backing page has to be checked.
+    //
+
+    if ((1ULL << from) < size) {
+        for (uintptr_t off = BAREFLANK_PAGE_SIZE; off < size; off += BAREFLANK_PAGE_SIZE) {
+            auto [next, unused] = vcpu->gpa_to_hpa(gpa + off);
+
+            if (next != hpa + off) {
+                throw std::runtime_error(
+                    "large_page_hpa: range is not physically contiguous");
+            }
+        }
+    }
+
+    return hpa;
+}
+
+void
+domain_op_handler::domain_op__donate_page_2m_rwe(vcpu *vcpu) noexcept
+{
+    auto dom = foreign_domain(vcpu);
+    if (dom == nullptr) {
+        vcpu->set_rax(FAILURE);
+        return;
+    }
+
+    try {
+        auto hpa =
+            large_page_hpa(vcpu, vcpu->rcx(), vcpu->rdx(), ::x64::pd::page_size);
+
+        dom->map_2m_rwe(vcpu->rdx(), hpa);
+        vcpu->set_rax(SUCCESS);
+    }
+    catchall({
+        vcpu->set_rax(FAILURE);
+    })
+}
+
+void
+domain_op_handler::domain_op__reserve_ram(vcpu *vcpu) noexcept
+{
+    auto dom = foreign_domain(vcpu);
+    if (dom == nullptr) {
+        vcpu->set_rax(FAILURE);
+        return;
+    }
+
+    try {
+        dom->reserve_ram(vcpu->rcx(), vcpu->rdx());
+        vcpu->set_rax(SUCCESS);
+    }
+    catchall({
+        vcpu->set_rax(FAILURE);
+    })
+}
+
+void
+domain_op_handler::domain_op__initial_state(vcpu *vcpu) noexcept
+{
+    auto dom = try_get_domain(vcpu->rbx());
+    if (dom == nullptr) {
+        vcpu->set_rax(FAILURE);
+        return;
+    }
+
+    try {
+        auto state =
+            vcpu->map_gpa_4k<struct domain_initial_state>(
+                vcpu->rcx(), sizeof(struct domain_initial_state));
+
+        dom->initial_state(*state.get());
+        vcpu->set_rax(SUCCESS);
+    }
+    catchall({
+        vcpu->set_rax(FAILURE);
+    })
+}
+
+void
+domain_op_handler::domain_op__set_initial_state(vcpu *vcpu) noexcept
+{
+    auto dom = try_get_domain(vcpu->rbx());
+    if (dom == nullptr) {
+        vcpu->set_rax(FAILURE);
+        return;
+    }
+
+    try {
+        auto state =
+            vcpu->map_gpa_4k<struct domain_initial_state>(
+                vcpu->rcx(), sizeof(struct domain_initial_state));
+
+        dom->set_initial_state(*state.get());
         vcpu->set_rax(SUCCESS);
     }
     catchall({
@@ -270,27 +543,27 @@ domain_op_handler::domain_op__donate_page_rwe(vcpu *vcpu)
 
 #define domain_op__reg(reg)                                                     \
     void                                                                        \
-    domain_op_handler::domain_op__ ## reg(vcpu *vcpu)                    \
+    domain_op_handler::domain_op__ ## reg(vcpu *vcpu) noexcept                  \
     {                                                                           \
-        try {                                                                   \
-            vcpu->set_rax(get_domain(vcpu->rbx())->reg());                      \
+        if (auto dom = try_get_domain(vcpu->rbx()); dom != nullptr) {           \
+            vcpu->set_rax(dom->reg());                                          \
+            return;                                                             \
         }                                                                       \
-        catchall({                                                              \
-            vcpu->set_rax(FAILURE);                                             \
-        })                                                                      \
+                                                                                \
+        vcpu->set_rax(FAILURE);                                                 \
     }
 
 #define domain_op__set_reg(reg)                                                 \
     void                                                                        \
-    domain_op_handler::domain_op__set_ ## reg(vcpu *vcpu)                \
+    domain_op_handler::domain_op__set_ ## reg(vcpu *vcpu) noexcept              \
     {                                                                           \
-        try {                                                                   \
-            get_domain(vcpu->rbx())->set_ ## reg(vcpu->rcx());                  \
+        if (auto dom = try_get_domain(vcpu->rbx()); dom != nullptr) {           \
+            dom->set_ ## reg(vcpu->rcx());                                      \
             vcpu->set_rax(SUCCESS);                                             \
+            return;                                                             \
         }                                                                       \
-        catchall({                                                              \
-            vcpu->set_rax(FAILURE);                                             \
-        })                                                                      \
+                                                                                \
+        vcpu->set_rax(FAILURE);                                                 \
     }
 
 domain_op__reg(rax);
@@ -411,156 +684,170 @@ domain_op__set_reg(ldtr_limit);
 domain_op__reg(ldtr_access_rights);
 domain_op__set_reg(ldtr_access_rights);
 
-#define dispatch_case(name)                                                     \
-    case hypercall_enum_domain_op__ ## name:                                    \
-    this->domain_op__ ## name(vcpu);                                            \
-    return true;
+#define dispatch_entry(name)                                                    \
+    {hypercall_enum_domain_op__ ## name, &domain_op_handler::domain_op__ ## name}
 
 bool
 domain_op_handler::dispatch(vcpu *vcpu)
 {
-    if (bfopcode(vcpu->rax()) != hypercall_enum_domain_op) {
-        return false;
-    }
-
-    switch (vcpu->rax()) {
-            dispatch_case(create_domain)
-            dispatch_case(destroy_domain)
-
-            dispatch_case(set_uart)
-            dispatch_case(set_pt_uart)
-            dispatch_case(dump_uart)
-
-            dispatch_case(share_page_r)
-            dispatch_case(share_page_rw)
-            dispatch_case(share_page_rwe)
-            dispatch_case(donate_page_r)
-            dispatch_case(donate_page_rw)
-            dispatch_case(donate_page_rwe)
-
-            dispatch_case(rax);
-            dispatch_case(set_rax);
-            dispatch_case(rbx);
-            dispatch_case(set_rbx);
-            dispatch_case(rcx);
-            dispatch_case(set_rcx);
-            dispatch_case(rdx);
-            dispatch_case(set_rdx);
-            dispatch_case(rbp);
-            dispatch_case(set_rbp);
-            dispatch_case(rsi);
-            dispatch_case(set_rsi);
-            dispatch_case(rdi);
-            dispatch_case(set_rdi);
-            dispatch_case(r08);
-            dispatch_case(set_r08);
-            dispatch_case(r09);
-            dispatch_case(set_r09);
-            dispatch_case(r10);
-            dispatch_case(set_r10);
-            dispatch_case(r11);
-            dispatch_case(set_r11);
-            dispatch_case(r12);
-            dispatch_case(set_r12);
-            dispatch_case(r13);
-            dispatch_case(set_r13);
-            dispatch_case(r14);
-            dispatch_case(set_r14);
-            dispatch_case(r15);
-            dispatch_case(set_r15);
-            dispatch_case(rip);
-            dispatch_case(set_rip);
-            dispatch_case(rsp);
-            dispatch_case(set_rsp);
-            dispatch_case(gdt_base);
-            dispatch_case(set_gdt_base);
-            dispatch_case(gdt_limit);
-            dispatch_case(set_gdt_limit);
-            dispatch_case(idt_base);
-            dispatch_case(set_idt_base);
-            dispatch_case(idt_limit);
-            dispatch_case(set_idt_limit);
-            dispatch_case(cr0);
-            dispatch_case(set_cr0);
-            dispatch_case(cr3);
-            dispatch_case(set_cr3);
-            dispatch_case(cr4);
-            dispatch_case(set_cr4);
-            dispatch_case(ia32_efer);
-            dispatch_case(set_ia32_efer);
-            dispatch_case(ia32_pat);
-            dispatch_case(set_ia32_pat);
-
-            dispatch_case(es_selector);
-            dispatch_case(set_es_selector);
-            dispatch_case(es_base);
-            dispatch_case(set_es_base);
-            dispatch_case(es_limit);
-            dispatch_case(set_es_limit);
-            dispatch_case(es_access_rights);
-            dispatch_case(set_es_access_rights);
-            dispatch_case(cs_selector);
-            dispatch_case(set_cs_selector);
-            dispatch_case(cs_base);
-            dispatch_case(set_cs_base);
-            dispatch_case(cs_limit);
-            dispatch_case(set_cs_limit);
-            dispatch_case(cs_access_rights);
-            dispatch_case(set_cs_access_rights);
-            dispatch_case(ss_selector);
-            dispatch_case(set_ss_selector);
-            dispatch_case(ss_base);
-            dispatch_case(set_ss_base);
-            dispatch_case(ss_limit);
-            dispatch_case(set_ss_limit);
-            dispatch_case(ss_access_rights);
-            dispatch_case(set_ss_access_rights);
-            dispatch_case(ds_selector);
-            dispatch_case(set_ds_selector);
-            dispatch_case(ds_base);
-            dispatch_case(set_ds_base);
-            dispatch_case(ds_limit);
-            dispatch_case(set_ds_limit);
-            dispatch_case(ds_access_rights);
-            dispatch_case(set_ds_access_rights);
-            dispatch_case(fs_selector);
-            dispatch_case(set_fs_selector);
-            dispatch_case(fs_base);
-            dispatch_case(set_fs_base);
-            dispatch_case(fs_limit);
-            dispatch_case(set_fs_limit);
-            dispatch_case(fs_access_rights);
-            dispatch_case(set_fs_access_rights);
-            dispatch_case(gs_selector);
-            dispatch_case(set_gs_selector);
-            dispatch_case(gs_base);
-            dispatch_case(set_gs_base);
-            dispatch_case(gs_limit);
-            dispatch_case(set_gs_limit);
-            dispatch_case(gs_access_rights);
-            dispatch_case(set_gs_access_rights);
-            dispatch_case(tr_selector);
-            dispatch_case(set_tr_selector);
-            dispatch_case(tr_base);
-            dispatch_case(set_tr_base);
-            dispatch_case(tr_limit);
-            dispatch_case(set_tr_limit);
-            dispatch_case(tr_access_rights);
-            dispatch_case(set_tr_access_rights);
-            dispatch_case(ldtr_selector);
-            dispatch_case(set_ldtr_selector);
-            dispatch_case(ldtr_base);
-            dispatch_case(set_ldtr_base);
-            dispatch_case(ldtr_limit);
-            dispatch_case(set_ldtr_limit);
-            dispatch_case(ldtr_access_rights);
-            dispatch_case(set_ldtr_access_rights);
-
-        default:
-            break;
+    // Note:
+    //
+    // The domain opcodes are sparse, so rather than walking a large switch
+    // statement, each opcode is looked up in a table that maps the opcode
+    // to its handler.
+    //
+
+    using handler_t = void (domain_op_handler::*)(vcpu *) noexcept;
+
+    static const std::unordered_map<uint64_t, handler_t> s_handlers = {
+        dispatch_entry(create_domain),
+        dispatch_entry(destroy_domain),
+        dispatch_entry(clone_domain),
+
+        dispatch_entry(set_uart),
+        dispatch_entry(set_pt_uart),
+        dispatch_entry(dump_uart),
+
+        dispatch_entry(set_xsave_policy),
+
+        dispatch_entry(share_page_r),
+        dispatch_entry(share_page_rw),
+        dispatch_entry(share_page_rwe),
+        dispatch_entry(donate_page_r),
+        dispatch_entry(donate_page_rw),
+        dispatch_entry(donate_page_rwe),
+        dispatch_entry(donate_range),
+        dispatch_entry(donate_page_2m_rwe),
+        dispatch_entry(reserve_ram),
+
+        dispatch_entry(initial_state),
+        dispatch_entry(set_initial_state),
+
+        dispatch_entry(rax),
+        dispatch_entry(set_rax),
+        dispatch_entry(rbx),
+        dispatch_entry(set_rbx),
+        dispatch_entry(rcx),
+        dispatch_entry(set_rcx),
+        dispatch_entry(rdx),
+        dispatch_entry(set_rdx),
+        dispatch_entry(rbp),
+        dispatch_entry(set_rbp),
+        dispatch_entry(rsi),
+        dispatch_entry(set_rsi),
+        dispatch_entry(rdi),
+        dispatch_entry(set_rdi),
+        dispatch_entry(r08),
+        dispatch_entry(set_r08),
+        dispatch_entry(r09),
+        dispatch_entry(set_r09),
+        dispatch_entry(r10),
+        dispatch_entry(set_r10),
+        dispatch_entry(r11),
+        dispatch_entry(set_r11),
+        dispatch_entry(r12),
+        dispatch_entry(set_r12),
+        dispatch_entry(r13),
+        dispatch_entry(set_r13),
+        dispatch_entry(r14),
+        dispatch_entry(set_r14),
+        dispatch_entry(r15),
+        dispatch_entry(set_r15),
+        dispatch_entry(rip),
+        dispatch_entry(set_rip),
+        dispatch_entry(rsp),
+        dispatch_entry(set_rsp),
+        dispatch_entry(gdt_base),
+        dispatch_entry(set_gdt_base),
+        dispatch_entry(gdt_limit),
+        dispatch_entry(set_gdt_limit),
+        dispatch_entry(idt_base),
+        dispatch_entry(set_idt_base),
+        dispatch_entry(idt_limit),
+        dispatch_entry(set_idt_limit),
+        dispatch_entry(cr0),
+        dispatch_entry(set_cr0),
+        dispatch_entry(cr3),
+        dispatch_entry(set_cr3),
+        dispatch_entry(cr4),
+        dispatch_entry(set_cr4),
+        dispatch_entry(ia32_efer),
+        dispatch_entry(set_ia32_efer),
+        dispatch_entry(ia32_pat),
+        dispatch_entry(set_ia32_pat),
+
+        dispatch_entry(es_selector),
+        dispatch_entry(set_es_selector),
+        dispatch_entry(es_base),
+        dispatch_entry(set_es_base),
+        dispatch_entry(es_limit),
+        dispatch_entry(set_es_limit),
+        dispatch_entry(es_access_rights),
+        dispatch_entry(set_es_access_rights),
+        dispatch_entry(cs_selector),
+        dispatch_entry(set_cs_selector),
+        dispatch_entry(cs_base),
+        dispatch_entry(set_cs_base),
+        dispatch_entry(cs_limit),
+        dispatch_entry(set_cs_limit),
+        dispatch_entry(cs_access_rights),
+        dispatch_entry(set_cs_access_rights),
+        dispatch_entry(ss_selector),
+        dispatch_entry(set_ss_selector),
+        dispatch_entry(ss_base),
+        dispatch_entry(set_ss_base),
+        dispatch_entry(ss_limit),
+        dispatch_entry(set_ss_limit),
+        dispatch_entry(ss_access_rights),
+        dispatch_entry(set_ss_access_rights),
+        dispatch_entry(ds_selector),
+        dispatch_entry(set_ds_selector),
+        dispatch_entry(ds_base),
+        dispatch_entry(set_ds_base),
+        dispatch_entry(ds_limit),
+        dispatch_entry(set_ds_limit),
+        dispatch_entry(ds_access_rights),
+        dispatch_entry(set_ds_access_rights),
+        dispatch_entry(fs_selector),
+        dispatch_entry(set_fs_selector),
+        dispatch_entry(fs_base),
+        dispatch_entry(set_fs_base),
+        dispatch_entry(fs_limit),
+        dispatch_entry(set_fs_limit),
+        dispatch_entry(fs_access_rights),
+        dispatch_entry(set_fs_access_rights),
+        dispatch_entry(gs_selector),
+        dispatch_entry(set_gs_selector),
+        dispatch_entry(gs_base),
+        dispatch_entry(set_gs_base),
+        dispatch_entry(gs_limit),
+        dispatch_entry(set_gs_limit),
+        dispatch_entry(gs_access_rights),
+        dispatch_entry(set_gs_access_rights),
+        dispatch_entry(tr_selector),
+        dispatch_entry(set_tr_selector),
+        dispatch_entry(tr_base),
+        dispatch_entry(set_tr_base),
+        dispatch_entry(tr_limit),
+        dispatch_entry(set_tr_limit),
+        dispatch_entry(tr_access_rights),
+        dispatch_entry(set_tr_access_rights),
+        dispatch_entry(ldtr_selector),
+        dispatch_entry(set_ldtr_selector),
+        dispatch_entry(ldtr_base),
+        dispatch_entry(set_ldtr_base),
+        dispatch_entry(ldtr_limit),
+        dispatch_entry(set_ldtr_limit),
+        dispatch_entry(ldtr_access_rights),
+        dispatch_entry(set_ldtr_access_rights)
     };
 
-    throw std::runtime_error("unknown domain opcode");
+    if (auto iter = s_handlers.find(vcpu->rax()); iter != s_handlers.end()) {
+        (this->*(iter->second))(vcpu);
+        return true;
+    }
+
+    return false;
 }
 
 }
@@ -25,6 +25,16 @@
 namespace boxy::intel_x64
 {
 
+// Note:
+//
+// An application processor cannot run until the bootstrap processor sends
+// it a SIPI. Until then, the host is told to yield, and this is how long
+// the host waits before it tries again (unless it is kicked by the SIPI).
+// Linux waits on the order of milliseconds between the INIT and the SIPI,
+// so this is not in the way.
+//
+constexpr const uint64_t s_sipi_poll_nsec = 1000000;
+
 run_op_handler::run_op_handler(
     gsl::not_null<vcpu *> vcpu
 ) :
@@ -34,7 +44,56 @@ run_op_handler::run_op_handler(
         return;
     }
 
-    vcpu->add_vmcall_handler({&run_op_handler::dispatch, this});
+    vcpu->add_vmcall_handler(
+        hypercall_enum_run_op, {&run_op_handler::dispatch, this}
+    );
+}
+
+void
+run_op_handler::migrate_child(vcpu *vcpu)
+{
+    using namespace vmcs_n;
+
+    // Note:
+    //
+    // The child's VMCS was last used on a different physical CPU (or has
+    // never been used). The builder releases (i.e., VMCLEAR) the VMCS on the
+    // old physical CPU before the host is allowed to migrate, which means
+    // the child will be launched (and not resumed) on this physical CPU.
+    // What is left is to fix up the portions of the host state that are
+    // specific to the physical CPU, which are taken from the parent's VMCS,
+    // and to make sure that no stale translations from the last time the
+    // child executed on this physical CPU are used.
+    //
+
+    auto tr_selector = host_tr_selector::get();
+    auto tr_base = host_tr_base::get();
+    auto gdtr_base = host_gdtr_base::get();
+    auto idtr_base = host_idtr_base::get();
+
+    m_child_vcpu->set_parent_vcpu(vcpu);
+    m_child_vcpu->load();
+
+    host_tr_selector::set(tr_selector);
+    host_tr_base::set(tr_base);
+    host_gdtr_base::set(gdtr_base);
+    host_idtr_base::set(idtr_base);
+
+    // Note:
+    //
+    // Each vCPU is tagged with its own VPID, so while the child executes on
+    // the same physical CPU, its translations (including the ones tagged
+    // with a PCID) survive the world switches to and from the parent, and
+    // the parent's translations are not visible to the child. Stale
+    // translations from a previous stint on this physical CPU are flushed
+    // here, and a single-context INVVPID flushes all of the child's PCIDs.
+    //
+
+    ::intel_x64::vmx::invept_single_context(ept_pointer::get());
+
+    if (auto vpid = virtual_processor_identifier::get(); vpid != 0) {
+        ::intel_x64::vmx::invvpid_single_context(vpid);
+    }
 }
 
 bool
@@ -51,13 +110,10 @@ run_op_handler::dispatch(vcpu *vcpu)
     //   executing a guest.
     // - Do no assume that the parent vCPU is always the same. It is possible
     //   for the host to change the parent vCPU the next time this is executed.
-    //   If this happens, a VMCS migration must take place.
-    // - This handler should be the first handler to be called. This way, we
-    //   do no end up looping through the vmcall handlers on every interrupt.
-
-    if (bfopcode(vcpu->rax()) != hypercall_enum_run_op) {
-        return false;
-    }
+    //   If this happens, a VMCS migration must take place (see
+    //   migrate_child()).
+    // - The vmcall handler indexes its handlers by opcode, so this handler
+    //   is called directly without looping through any unrelated handlers.
 
     try {
         if (m_child_vcpuid != vcpu->rbx()) {
@@ -65,12 +121,31 @@ run_op_handler::dispatch(vcpu *vcpu)
             m_child_vcpuid = vcpu->rbx();
         }
 
-        m_child_vcpu->set_parent_vcpu(vcpu);
-
         if (m_child_vcpu->is_alive()) {
-            m_child_vcpu->load();
+            if (m_child_vcpu->acknowledge_pause()) {
+                vcpu->set_rax(hypercall_enum_run_op__paused);
+                return true;
+            }
+
+            if (m_child_vcpu->is_waiting_for_sipi()) {
+                vcpu->set_rax((s_sipi_poll_nsec << 4) | hypercall_enum_run_op__yield);
+                return true;
+            }
+
+            if (auto vcpuid = m_child_vcpu->next_kick(); vcpuid != INVALID_VCPUID) {
+                vcpu->set_rax((vcpuid << 4) | hypercall_enum_run_op__kick);
+                return true;
+            }
+
+            if (m_child_vcpu->parent_vcpu() != vcpu) {
+                this->migrate_child(vcpu);
+            }
+            else {
+                m_child_vcpu->load();
+            }
 
             try {
+                m_child_vcpu->inject_pending_ipis();
                 m_child_vcpu->prepare_for_world_switch();
                 m_child_vcpu->run();
             }
@@ -79,6 +154,9 @@ run_op_handler::dispatch(vcpu *vcpu)
                 throw;
             }
         }
+        else {
+            m_child_vcpu->stop();
+        }
 
         vcpu->set_rax(hypercall_enum_run_op__hlt);
     }
@@ -35,15 +35,23 @@ vcpu_op_handler::vcpu_op_handler(
         return;
     }
 
-    vcpu->add_vmcall_handler({&vcpu_op_handler::dispatch, this});
+    vcpu->add_vmcall_handler(
+        hypercall_enum_vcpu_op, {&vcpu_op_handler::dispatch, this}
+    );
 }
 
 void
-vcpu_op_handler::vcpu_op__create_vcpu(vcpu *vcpu)
+vcpu_op_handler::vcpu_op__create_vcpu(vcpu *vcpu) noexcept
 {
+    auto dom = try_get_domain(vcpu->rbx());
+    if (dom == nullptr) {
+        vcpu->set_rax(INVALID_VCPUID);
+        return;
+    }
+
     try {
         vcpu->set_rax(bfvmm::vcpu::generate_vcpuid());
-        g_vcm->create(vcpu->rax(), get_domain(vcpu->rbx()));
+        g_vcm->create(vcpu->rax(), dom);
     }
     catchall({
         vcpu->set_rax(INVALID_VCPUID);
@@ -51,11 +59,56 @@ vcpu_op_handler::vcpu_op__create_vcpu(vcpu *vcpu)
 }
 
 void
-vcpu_op_handler::vcpu_op__kill_vcpu(vcpu *vcpu)
+vcpu_op_handler::vcpu_op__kill_vcpu(vcpu *vcpu) noexcept
+{
+    auto child_vcpu = try_get_vcpu(vcpu->rbx());
+    if (child_vcpu == nullptr) {
+        vcpu->set_rax(FAILURE);
+        return;
+    }
+
+    child_vcpu->kill();
+    vcpu->set_rax(SUCCESS);
+}
+
+void
+vcpu_op_handler::vcpu_op__destroy_vcpu(vcpu *vcpu) noexcept
+{
+    if (try_get_vcpu(vcpu->rbx()) == nullptr) {
+        vcpu->set_rax(FAILURE);
+        return;
+    }
+
+    try {
+        g_vcm->destroy(vcpu->rbx());
+        vcpu->set_rax(SUCCESS);
+    }
+    catchall({
+        vcpu->set_rax(FAILURE);
+    })
+}
+
+void
+vcpu_op_handler::vcpu_op__release_vcpu(vcpu *vcpu) noexcept
 {
+    auto child_vcpu = try_get_vcpu(vcpu->rbx());
+    if (child_vcpu == nullptr) {
+        vcpu->set_rax(FAILURE);
+        return;
+    }
+
+    // Note:
+    //
+    // The parent of a guest vCPU is the host vCPU of the physical CPU that
+    // last ran the guest vCPU, so if the parent is not the caller, the
+    // guest's VMCS is not active on this physical CPU and there is nothing
+    // to release.
+    //
+
     try {
-        auto child_vcpu = get_vcpu(vcpu->rbx());
-        child_vcpu->kill();
+        if (child_vcpu->parent_vcpu() == vcpu) {
+            child_vcpu->clear();
+        }
 
         vcpu->set_rax(SUCCESS);
     }
@@ -65,10 +118,50 @@ vcpu_op_handler::vcpu_op__kill_vcpu(vcpu *vcpu)
 }
 
 void
-vcpu_op_handler::vcpu_op__destroy_vcpu(vcpu *vcpu)
+vcpu_op_handler::vcpu_op__save_vcpu(vcpu *vcpu) noexcept
 {
+    auto child_vcpu = try_get_vcpu(vcpu->rbx());
+    if (child_vcpu == nullptr || child_vcpu->is_dom0()) {
+        vcpu->set_rax(FAILURE);
+        return;
+    }
+
+    // Note:
+    //
+    // A killed vCPU is never run again, and a paused vCPU is not run until
+    // it is resumed (see run_op_handler). Once its thread has stopped (or
+    // has been told that the vCPU is paused), the builder has released its
+    // VMCS, so the VMCS can be loaded on this physical CPU. The lazily
+    // switched state was saved from hardware when the parent was resumed.
+    // The VMCS is released again when we are done, and the vmcall handler
+    // loads the caller's VMCS before returning. A paused vCPU is then
+    // launched (and not resumed) the next time it is run.
+    //
+
+    if (!child_vcpu->is_killed() && !child_vcpu->is_paused()) {
+        vcpu->set_rax(FAILURE);
+        return;
+    }
+
     try {
-        g_vcm->destroy(vcpu->rbx());
+        auto snapshot =
+            vcpu->map_gpa_4k<struct vcpu_snapshot>(
+                vcpu->rcx(), sizeof(struct vcpu_snapshot));
+        auto xsave =
+            vcpu->map_gpa_4k<uint8_t>(
+                vcpu->rdx(), VCPU_SNAPSHOT_XSAVE_SIZE);
+
+        child_vcpu->load();
+
+        try {
+            child_vcpu->save_snapshot(*snapshot.get(), xsave.get());
+        }
+        catch (...) {
+            child_vcpu->clear();
+            throw;
+        }
+
+        child_vcpu->clear();
         vcpu->set_rax(SUCCESS);
     }
     catchall({
@@ -76,13 +169,162 @@ vcpu_op_handler::vcpu_op__destroy_vcpu(vcpu *vcpu)
     })
 }
 
-bool
-vcpu_op_handler::dispatch(vcpu *vcpu)
+void
+vcpu_op_handler::vcpu_op__pause_vcpu(vcpu *vcpu) noexcept
 {
-    if (bfopcode(vcpu->rax()) != hypercall_enum_vcpu_op) {
-        return false;
+    auto child_vcpu = try_get_vcpu(vcpu->rbx());
+    if (child_vcpu == nullptr || child_vcpu->is_dom0()) {
+        vcpu->set_rax(FAILURE);
+        return;
+    }
+
+    child_vcpu->pause();
+    vcpu->set_rax(SUCCESS);
+}
+
+void
+vcpu_op_handler::vcpu_op__resume_vcpu(vcpu *vcpu) noexcept
+{
+    auto child_vcpu = try_get_vcpu(vcpu->rbx());
+    if (child_vcpu == nullptr || child_vcpu->is_dom0()) {
+        vcpu->set_rax(FAILURE);
+        return;
+    }
+
+    child_vcpu->unpause();
+    vcpu->set_rax(SUCCESS);
+}
+
+void
+vcpu_op_handler::vcpu_op__restore_vcpu(vcpu *vcpu) noexcept
+{
+    auto child_vcpu = try_get_vcpu(vcpu->rbx());
+    if (child_vcpu == nullptr || child_vcpu->is_dom0()) {
+        vcpu->set_rax(FAILURE);
+        return;
+    }
+
+    // Note:
+    //
+    // A vCPU that has never been run does not have a parent, and its VMCS
+    // is not active on any physical CPU. Once restored, the VMCS is
+    // released so that the vCPU is launched on whichever physical CPU
+    // runs it first (see run_op_handler::migrate_child).
+    //
+
+    if (child_vcpu->parent_vcpu() != nullptr) {
+        vcpu->set_rax(FAILURE);
+        return;
     }
 
+    try {
+        auto snapshot =
+            vcpu->map_gpa_4k<struct vcpu_snapshot>(
+                vcpu->rcx(), sizeof(struct vcpu_snapshot));
+        auto xsave =
+            vcpu->map_gpa_4k<uint8_t>(
+                vcpu->rdx(), VCPU_SNAPSHOT_XSAVE_SIZE);
+
+        child_vcpu->load();
+
+        try {
+            child_vcpu->restore_snapshot(*snapshot.get(), xsave.get());
+        }
+        catch (...) {
+            child_vcpu->clear();
+            throw;
+        }
+
+        child_vcpu->clear();
+        vcpu->set_rax(SUCCESS);
+    }
+    catchall({
+        vcpu->set_rax(FAILURE);
+    })
+}
+
+void
+vcpu_op_handler::vcpu_op__save_template_vcpu(vcpu *vcpu) noexcept
+{
+    auto child_vcpu = try_get_vcpu(vcpu->rbx());
+    if (child_vcpu == nullptr || child_vcpu->is_dom0()) {
+        vcpu->set_rax(FAILURE);
+        return;
+    }
+
+    // Note:
+    //
+    // Same as vcpu_op__save_vcpu, except that the state is saved in the
+    // template's domain instead of in pages provided by the caller.
+    //
+
+    if (!child_vcpu->is_killed() && !child_vcpu->is_paused()) {
+        vcpu->set_rax(FAILURE);
+        return;
+    }
+
+    try {
+        child_vcpu->load();
+
+        try {
+            child_vcpu->dom()->save_template_vcpu(child_vcpu);
+        }
+        catch (...) {
+            child_vcpu->clear();
+            throw;
+        }
+
+        child_vcpu->clear();
+        vcpu->set_rax(SUCCESS);
+    }
+    catchall({
+        vcpu->set_rax(FAILURE);
+    })
+}
+
+void
+vcpu_op_handler::vcpu_op__restore_template_vcpu(vcpu *vcpu) noexcept
+{
+    auto child_vcpu = try_get_vcpu(vcpu->rbx());
+    if (child_vcpu == nullptr || child_vcpu->is_dom0()) {
+        vcpu->set_rax(FAILURE);
+        return;
+    }
+
+    // Note:
+    //
+    // Same as vcpu_op__restore_vcpu, except that the state is restored from
+    // the copy of the template's vCPU that the clone's domain was given
+    // when it was cloned.
+    //
+
+    if (child_vcpu->parent_vcpu() != nullptr) {
+        vcpu->set_rax(FAILURE);
+        return;
+    }
+
+    try {
+        child_vcpu->load();
+
+        try {
+            child_vcpu->dom()->restore_template_vcpu(child_vcpu);
+        }
+        catch (...) {
+            child_vcpu->clear();
+            throw;
+        }
+
+        child_vcpu->clear();
+        vcpu->set_rax(SUCCESS);
+    }
+    catchall({
+        vcpu->set_rax(FAILURE);
+    })
+}
+
+bool
+vcpu_op_handler::dispatch(vcpu *vcpu)
+{
     switch (vcpu->rax()) {
         case hypercall_enum_vcpu_op__create_vcpu:
             this->vcpu_op__create_vcpu(vcpu);
@@ -96,11 +338,39 @@ vcpu_op_handler::dispatch(vcpu *vcpu)
             this->vcpu_op__destroy_vcpu(vcpu);
             return true;
 
+        case hypercall_enum_vcpu_op__release_vcpu:
+            this->vcpu_op__release_vcpu(vcpu);
+            return true;
+
+        case hypercall_enum_vcpu_op__save_vcpu:
+            this->vcpu_op__save_vcpu(vcpu);
+            return true;
+
+        case hypercall_enum_vcpu_op__restore_vcpu:
+            this->vcpu_op__restore_vcpu(vcpu);
+            return true;
+
+        case hypercall_enum_vcpu_op__pause_vcpu:
+            this->vcpu_op__pause_vcpu(vcpu);
+            return true;
+
+        case hypercall_enum_vcpu_op__resume_vcpu:
+            this->vcpu_op__resume_vcpu(vcpu);
+            return true;
+
+        case hypercall_enum_vcpu_op__save_template_vcpu:
+            this->vcpu_op__save_template_vcpu(vcpu);
+            return true;
+
+        case hypercall_enum_vcpu_op__restore_template_vcpu:
+            this->vcpu_op__restore_template_vcpu(vcpu);
+            return true;
+
         default:
             break;
     };
 
-    throw std::runtime_error("unknown vcpu opcode");
+    return false;
 }
 
 }
@@ -0,0 +1,150 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <bfdebug.h>
+
+#include <hve/arch/intel_x64/vcpu.h>
+#include <hve/arch/intel_x64/vmexit/exit_stats.h>
+
+// -----------------------------------------------------------------------------
+// Implementation
+// -----------------------------------------------------------------------------
+
+namespace boxy::intel_x64
+{
+
+exit_stats_handler::exit_stats_handler(
+    gsl::not_null<vcpu *> vcpu
+) :
+    m_vcpu{vcpu}
+{
+    // Note:
+    //
+    // The exit statistics are only collected when they can be seen (i.e.,
+    // the debug level is high enough for dump() to output them), so that
+    // release builds do not pay for two TSC reads on every exit.
+    //
+
+    if (BFDEBUG_LEVEL < 1) {
+        return;
+    }
+
+    vcpu->add_exit_handler({&exit_stats_handler::exit_stats__on_exit, this});
+    vcpu->add_resume_delegate({&exit_stats_handler::exit_stats__on_world_switch, this});
+}
+
+exit_stats_handler::~exit_stats_handler()
+{
+    try {
+        this->dump();
+    }
+    catchall({
+    })
+}
+
+// -----------------------------------------------------------------------------
+// Exit Stats Functions
+// -----------------------------------------------------------------------------
+
+exit_stats_handler::pending_exit_t &
+exit_stats_handler::pending_exit() noexcept
+{
+    if (m_vcpu->is_dom0()) {
+        return m_pending;
+    }
+
+    return m_vcpu->parent_vcpu()->pending_exit();
+}
+
+void
+exit_stats_handler::dump() const
+{
+    bfdebug_transaction(1, [&](std::string * msg) {
+
+        bfdebug_lnbr(1, msg);
+        bfdebug_info(1, "exit stats", msg);
+        bfdebug_brk1(1, msg);
+
+        bfdebug_subnhex(1, "vcpuid", m_vcpu->id(), msg);
+
+        for (std::size_t i = 0; i < m_stats.size(); i++) {
+            const auto &stats = m_stats.at(i);
+            if (stats.count == 0) {
+                continue;
+            }
+
+            auto reason = "reason " + std::to_string(i);
+
+            bfdebug_subndec(1, (reason + " exits").c_str(), stats.count, msg);
+            bfdebug_subndec(1, (reason + " avg ticks").c_str(), stats.ticks / stats.count, msg);
+        }
+    });
+}
+
+// -----------------------------------------------------------------------------
+// Handlers
+// -----------------------------------------------------------------------------
+
+bool
+exit_stats_handler::exit_stats__on_exit(vcpu_t *vcpu)
+{
+    bfignored(vcpu);
+
+    auto &pending = this->pending_exit();
+
+    pending.owner = this;
+    pending.reason = vmcs_n::exit_reason::basic_exit_reason::get();
+    pending.tsc = ::x64::tsc::get();
+
+    return false;
+}
+
+void
+exit_stats_handler::exit_stats__on_world_switch(vcpu_t *vcpu)
+{
+    bfignored(vcpu);
+
+    // Note:
+    //
+    // The exit is charged to the vCPU that took it, and it is finished
+    // when any vCPU is resumed on this physical CPU. This way, an exit that
+    // ends with a child returning to its parent (or a parent running its
+    // child) includes the cost of the world switch. Exits that are finished
+    // more than once (e.g., prepare_for_world_switch() followed by the resume
+    // delegates) are only counted the first time.
+    //
+
+    auto &pending = this->pending_exit();
+    if (pending.owner == nullptr) {
+        return;
+    }
+
+    if (pending.reason < pending.owner->m_stats.size()) {
+        auto &stats = pending.owner->m_stats.at(pending.reason);
+
+        stats.count++;
+        stats.ticks += ::x64::tsc::get() - pending.tsc;
+    }
+
+    pending.owner = nullptr;
+}
+
+}
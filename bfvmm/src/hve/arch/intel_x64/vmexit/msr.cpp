@@ -29,6 +29,30 @@
     m_vcpu->emulate_rdmsr(a, {&msr_handler::r, this});                         \
     m_vcpu->emulate_wrmsr(a, {&msr_handler::w, this});
 
+// -----------------------------------------------------------------------------
+// Isolated MSRs
+// -----------------------------------------------------------------------------
+
+// Note:
+//
+// The index of each MSR in this list is the slot that is used to store the
+// MSR's value. The kernel_gs_base is saved from hardware when ownership of
+// the hardware changes (see below).
+//
+
+static constexpr const
+std::array<uint32_t, boxy::intel_x64::msr_handler::num_isolated_msrs>
+s_isolated_msrs = {
+    ::x64::msrs::ia32_star::addr,
+    ::x64::msrs::ia32_lstar::addr,
+    ::x64::msrs::ia32_cstar::addr,
+    ::x64::msrs::ia32_fmask::addr,
+    ::x64::msrs::ia32_kernel_gs_base::addr
+};
+
+static constexpr const std::size_t s_kernel_gs_base_slot =
+    s_isolated_msrs.size() - 1;
+
 // -----------------------------------------------------------------------------
 // Implementation
 // -----------------------------------------------------------------------------
@@ -43,7 +67,6 @@ msr_handler::msr_handler(
 {
     using namespace vmcs_n;
 
-    vcpu->add_exit_handler({&msr_handler::isolate_msr__on_exit, this});
     vcpu->add_resume_delegate({&msr_handler::isolate_msr__on_world_switch, this});
 
     if (vcpu->is_domU()) {
@@ -51,13 +74,19 @@ msr_handler::msr_handler(
         vcpu->trap_on_all_wrmsr_accesses();
     }
 
-    this->isolate_msr(::x64::msrs::ia32_star::addr);
-    this->isolate_msr(::x64::msrs::ia32_lstar::addr);
-    this->isolate_msr(::x64::msrs::ia32_cstar::addr);
-    this->isolate_msr(::x64::msrs::ia32_fmask::addr);
-    this->isolate_msr(::x64::msrs::ia32_kernel_gs_base::addr);
+    for (std::size_t i = 0; i < s_isolated_msrs.size(); i++) {
+        vcpu->pass_through_rdmsr_access(s_isolated_msrs[i]);
+        ADD_WRMSR_HANDLER(s_isolated_msrs[i], isolate_msr__on_write);
+
+        if (vcpu->is_dom0()) {
+            m_msrs[i] = ::x64::msrs::get(s_isolated_msrs[i]);
+        }
+    }
 
     if (vcpu->is_dom0()) {
+        m_loaded.owner = this;
+        m_loaded.val = m_msrs;
+
         return;
     }
 
@@ -79,15 +108,14 @@ msr_handler::msr_handler(
 // Isolate MSR Functions
 // -----------------------------------------------------------------------------
 
-void
-msr_handler::isolate_msr(uint32_t msr)
+msr_handler::loaded_msrs_t &
+msr_handler::loaded_msrs() noexcept
 {
-    m_vcpu->pass_through_rdmsr_access(msr);
-    ADD_WRMSR_HANDLER(msr, isolate_msr__on_write);
-
     if (m_vcpu->is_dom0()) {
-        m_msrs[msr] = ::x64::msrs::get(msr);
+        return m_loaded;
     }
+
+    return m_vcpu->parent_vcpu()->loaded_msrs();
 }
 
 void
@@ -139,34 +167,73 @@ msr_handler::isolate_msr__on_world_switch(vcpu_t *vcpu)
     //   There is only one of these MSRs and that is the kernel_gs_base. There
     //   is no way to watch a store to this MSR as swapgs does not trap
     //   (thanks again Intel), and as a result, we treat this MSR just like an
-    //   isolated MSR, but we have to take an added step and save its value on
-    //   every single VM exit.
+    //   isolated MSR, but we have to take an added step and save its value
+    //   from hardware before another vCPU's value is loaded. While a vCPU
+    //   owns the hardware, its saved kernel_gs_base (and the loaded value)
+    //   might be stale.
     //
 
-    for (const auto &msr : m_msrs) {
-        ::x64::msrs::set(msr.first, msr.second);
-    }
-}
-
-bool
-msr_handler::isolate_msr__on_exit(
-    vcpu_t *vcpu)
-{
-    bfignored(vcpu);
-
     // Note:
     //
-    // Note that this function is executed on every exit, so we want to
-    // limit what we are doing here. This is an expensive function to
-    // execute.
+    // This function is called more than once per guest entry (e.g., from
+    // the run_op handler and again from the resume delegate), so each MSR
+    // is only written if the value in hardware is not already correct. If
+    // this vCPU already owns the hardware, only the slots it has written
+    // since the last world switch are written (the loaded kernel_gs_base
+    // cannot be trusted in this case, so these are written unconditionally).
     //
 
-    using namespace ::x64::msrs;
-    using namespace ::intel_x64::vmcs;
+    auto &loaded = this->loaded_msrs();
 
-    m_msrs[ia32_kernel_gs_base::addr] = ia32_kernel_gs_base::get();
+    if (loaded.owner == this) {
+        for (std::size_t i = 0; m_dirty != 0; i++, m_dirty >>= 1) {
+            if ((m_dirty & 1) != 0) {
+                ::x64::msrs::set(s_isolated_msrs[i], m_msrs[i]);
+                loaded.val[i] = m_msrs[i];
+            }
+        }
 
-    return false;
+        return;
+    }
+
+    if (loaded.owner != nullptr) {
+        using namespace ::x64::msrs;
+
+        auto val = ia32_kernel_gs_base::get();
+
+        loaded.owner->m_msrs[s_kernel_gs_base_slot] = val;
+        loaded.val[s_kernel_gs_base_slot] = val;
+    }
+
+    for (std::size_t i = 0; i < s_isolated_msrs.size(); i++) {
+        if (loaded.val[i] != m_msrs[i]) {
+            ::x64::msrs::set(s_isolated_msrs[i], m_msrs[i]);
+            loaded.val[i] = m_msrs[i];
+        }
+    }
+
+    loaded.owner = this;
+    m_dirty = 0;
+}
+
+void
+msr_handler::save_snapshot(struct vcpu_snapshot &snapshot) const noexcept
+{
+    snapshot.star = m_msrs[0];
+    snapshot.lstar = m_msrs[1];
+    snapshot.cstar = m_msrs[2];
+    snapshot.fmask = m_msrs[3];
+    snapshot.kernel_gs_base = m_msrs[s_kernel_gs_base_slot];
+}
+
+void
+msr_handler::restore_snapshot(const struct vcpu_snapshot &snapshot) noexcept
+{
+    m_msrs[0] = snapshot.star;
+    m_msrs[1] = snapshot.lstar;
+    m_msrs[2] = snapshot.cstar;
+    m_msrs[3] = snapshot.fmask;
+    m_msrs[s_kernel_gs_base_slot] = snapshot.kernel_gs_base;
 }
 
 bool
@@ -175,8 +242,16 @@ msr_handler::isolate_msr__on_write(
 {
     bfignored(vcpu);
 
-    m_msrs[info.msr] = info.val;
-    return true;
+    for (std::size_t i = 0; i < s_isolated_msrs.size(); i++) {
+        if (s_isolated_msrs[i] == info.msr) {
+            m_msrs[i] = info.val;
+            m_dirty |= 1ULL << i;
+
+            return true;
+        }
+    }
+
+    return false;
 }
 
 // -----------------------------------------------------------------------------
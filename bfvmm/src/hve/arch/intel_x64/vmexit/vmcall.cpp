@@ -19,9 +19,43 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
+#include <atomic>
+
 #include <hve/arch/intel_x64/vcpu.h>
 #include <hve/arch/intel_x64/vmexit/vmcall.h>
 
+// -----------------------------------------------------------------------------
+// Tokens
+// -----------------------------------------------------------------------------
+
+// Note:
+//
+// Tokens allow a userspace process in dom0 to execute VMCalls directly,
+// without going through a driver. Tokens are registered by a dom0 driver
+// (from CPL0) and are shared by all vCPUs, so the table is lock free. The
+// number of processes using this at any given time is expected to be
+// small, so a fixed size table is used.
+//
+
+constexpr const auto s_max_tokens = 64;
+static std::array<std::atomic<uint64_t>, s_max_tokens> s_tokens{};
+
+static bool
+is_valid_token(uint64_t token) noexcept
+{
+    if (token == 0) {
+        return false;
+    }
+
+    for (const auto &slot : s_tokens) {
+        if (slot.load() == token) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
 namespace boxy::intel_x64
 {
 
@@ -36,6 +70,14 @@ vmcall_handler::vmcall_handler(
         exit_reason::basic_exit_reason::vmcall,
         {&vmcall_handler::handle, this}
     );
+
+    if (vcpu->is_domU()) {
+        return;
+    }
+
+    this->add_handler(
+        hypercall_enum_vmcall_op, {&vmcall_handler::dispatch, this}
+    );
 }
 
 // -----------------------------------------------------------------------------
@@ -44,8 +86,8 @@ vmcall_handler::vmcall_handler(
 
 void
 vmcall_handler::add_handler(
-    const handler_delegate_t &d)
-{ m_handlers.push_back(d); }
+    uint64_t opcode, const handler_delegate_t &d)
+{ m_handlers.at(opcode).push_back(d); }
 
 // -----------------------------------------------------------------------------
 // Handlers
@@ -74,6 +116,84 @@ vmcall_error(gsl::not_null<vcpu *> vcpu, const std::string &str)
     return true;
 }
 
+bool
+vmcall_handler::is_authorized(vcpu *vcpu) const noexcept
+{
+    if (vmcs_n::guest_ss_access_rights::dpl::get() == 0) {
+        return true;
+    }
+
+    return vcpu->is_dom0() && is_valid_token(vcpu->rsi());
+}
+
+void
+vmcall_handler::vmcall_op__add_token(vcpu *vcpu) noexcept
+{
+    auto token = vcpu->rbx();
+
+    if (token != 0) {
+        for (auto &slot : s_tokens) {
+            uint64_t expected = 0;
+
+            if (slot.compare_exchange_strong(expected, token)) {
+                vcpu->set_rax(SUCCESS);
+                return;
+            }
+        }
+    }
+
+    vcpu->set_rax(FAILURE);
+}
+
+void
+vmcall_handler::vmcall_op__remove_token(vcpu *vcpu) noexcept
+{
+    auto token = vcpu->rbx();
+
+    if (token != 0) {
+        for (auto &slot : s_tokens) {
+            uint64_t expected = token;
+
+            if (slot.compare_exchange_strong(expected, 0)) {
+                vcpu->set_rax(SUCCESS);
+                return;
+            }
+        }
+    }
+
+    vcpu->set_rax(FAILURE);
+}
+
+bool
+vmcall_handler::dispatch(vcpu *vcpu)
+{
+    // Note:
+    //
+    // Tokens can only be managed from CPL0. Otherwise, a process with a
+    // token could hand out tokens to other processes.
+    //
+
+    if (vmcs_n::guest_ss_access_rights::dpl::get() != 0) {
+        vcpu->set_rax(FAILURE);
+        return true;
+    }
+
+    switch (vcpu->rax()) {
+        case hypercall_enum_vmcall_op__add_token:
+            this->vmcall_op__add_token(vcpu);
+            return true;
+
+        case hypercall_enum_vmcall_op__remove_token:
+            this->vmcall_op__remove_token(vcpu);
+            return true;
+
+        default:
+            break;
+    };
+
+    return false;
+}
+
 bool
 vmcall_handler::handle(vcpu_t *vcpu)
 {
@@ -83,8 +203,21 @@ vmcall_handler::handle(vcpu_t *vcpu)
 
     vcpu->advance();
 
+    // Note:
+    //
+    // A VMCall always traps, regardless of CPL, so the VMM has to make sure
+    // that a VMCall from userspace is allowed. An unauthorized VMCall is
+    // simply failed (and not reported) so that a userspace process cannot
+    // flood the debug log or halt a domU.
+    //
+
+    if (!this->is_authorized(m_vcpu)) {
+        m_vcpu->set_rax(FAILURE);
+        return true;
+    }
+
     try {
-        for (const auto &d : m_handlers) {
+        for (const auto &d : m_handlers[bfopcode(vcpu->rax())]) {
             if (d(m_vcpu)) {
                 return true;
             }
@@ -0,0 +1,310 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <cstring>
+
+#include <hve/arch/intel_x64/vcpu.h>
+#include <hve/arch/intel_x64/vmexit/xstate.h>
+
+// -----------------------------------------------------------------------------
+// XSAVE Instructions
+// -----------------------------------------------------------------------------
+
+// Note:
+//
+// The XSAVE area is stored in the standard (i.e., not compacted) format, so
+// that the offset of each state component is fixed by the architecture. All
+// of the managed state components fit in the first 2688 bytes, which is why
+// a single page is used. The area must be 64 byte aligned, which a page is.
+//
+
+static constexpr const std::size_t s_mxcsr_offset = 24;
+static constexpr const uint32_t s_mxcsr_default = 0x1F80;
+static constexpr const std::size_t s_xstate_bv_offset = 512;
+static constexpr const std::size_t s_xcomp_bv_offset = 520;
+
+static inline void
+xsaveopt64(void *area, uint64_t rfbm) noexcept
+{
+    __asm__ volatile(
+        "xsaveopt64 (%0)"
+        :
+        : "r"(area), "a"(rfbm & 0xFFFFFFFF), "d"(rfbm >> 32)
+        : "memory"
+    );
+}
+
+static inline void
+xrstor64(const void *area, uint64_t rfbm) noexcept
+{
+    __asm__ volatile(
+        "xrstor64 (%0)"
+        :
+        : "r"(area), "a"(rfbm & 0xFFFFFFFF), "d"(rfbm >> 32)
+        : "memory"
+    );
+}
+
+// -----------------------------------------------------------------------------
+// Implementation
+// -----------------------------------------------------------------------------
+
+namespace boxy::intel_x64
+{
+
+xstate_handler::xstate_handler(
+    gsl::not_null<vcpu *> vcpu
+) :
+    m_vcpu{vcpu}
+{
+    // Note:
+    //
+    // If the extended state cannot be switched, the guest shares the
+    // hardware's x87/SSE state with dom0 (and is never given XSAVE, see
+    // domain::set_xsave_policy), which is how things worked before this
+    // handler existed.
+    //
+
+    if (!is_supported()) {
+        return;
+    }
+
+    m_area = make_page<uint8_t>();
+    std::memset(m_area.get(), 0, BAREFLANK_PAGE_SIZE);
+
+    // Note:
+    //
+    // XRSTOR loads MXCSR from the XSAVE area even if SSE is in its init
+    // state (i.e., XSTATE_BV[1] is 0), so a new vCPU's area needs the reset
+    // value of MXCSR, otherwise the guest starts with all of its SSE
+    // exceptions unmasked.
+    //
+
+    auto mxcsr = s_mxcsr_default;
+    std::memcpy(m_area.get() + s_mxcsr_offset, &mxcsr, sizeof(mxcsr));
+
+    vcpu->add_resume_delegate({&xstate_handler::isolate_xstate__on_world_switch, this});
+    vcpu->add_xsetbv_handler({&xstate_handler::handle_xsetbv, this});
+
+    if (vcpu->is_dom0()) {
+        m_xcr0 = ::intel_x64::xcr0::get();
+
+        m_loaded.owner = this;
+        m_loaded.xcr0 = m_xcr0;
+
+        return;
+    }
+
+    m_xcr0 = 0x3;
+    m_xcr0_mask = vcpu->dom()->xcr0_mask() | 0x3;
+}
+
+bool
+xstate_handler::is_supported() noexcept
+{
+    if (::intel_x64::cr4::osxsave::is_disabled()) {
+        return false;
+    }
+
+    auto [eax, ebx, ecx, edx] = ::x64::cpuid::get(0x0000000D, 0, 1, 0);
+
+    bfignored(ebx);
+    bfignored(ecx);
+    bfignored(edx);
+
+    return (eax & 0x1) != 0;
+}
+
+// -----------------------------------------------------------------------------
+// Isolate Extended State Functions
+// -----------------------------------------------------------------------------
+
+xstate_handler::loaded_xstate_t &
+xstate_handler::loaded_xstate() noexcept
+{
+    if (m_vcpu->is_dom0()) {
+        return m_loaded;
+    }
+
+    return m_vcpu->parent_vcpu()->loaded_xstate();
+}
+
+void
+xstate_handler::save() noexcept
+{ xsaveopt64(m_area.get(), managed_xcr0); }
+
+void
+xstate_handler::restore() noexcept
+{ xrstor64(m_area.get(), managed_xcr0); }
+
+void
+xstate_handler::save_snapshot(
+    struct vcpu_snapshot &snapshot, uint8_t *xsave) const
+{
+    if (m_area == nullptr) {
+        snapshot.xcr0 = 0;
+        std::memset(xsave, 0, VCPU_SNAPSHOT_XSAVE_SIZE);
+
+        return;
+    }
+
+    snapshot.xcr0 = m_xcr0;
+    std::memcpy(xsave, m_area.get(), VCPU_SNAPSHOT_XSAVE_SIZE);
+}
+
+void
+xstate_handler::restore_snapshot(
+    const struct vcpu_snapshot &snapshot, const uint8_t *xsave)
+{
+    // Note:
+    //
+    // An XCR0 of 0 means the snapshot was taken on a CPU that could not
+    // switch the extended state, in which case the new vCPU keeps its
+    // reset state. Otherwise, the XSAVE area comes from dom0, and XRSTOR
+    // faults (in the VMM) if the header or MXCSR are invalid, so these are
+    // checked here. The XCR0 of the snapshot also has to be allowed by
+    // the new domain's XSAVE policy.
+    //
+
+    if (snapshot.xcr0 == 0) {
+        return;
+    }
+
+    if (m_area == nullptr) {
+        throw std::runtime_error("restore_snapshot: xsave not supported");
+    }
+
+    if ((snapshot.xcr0 & ~m_xcr0_mask) != 0 || (snapshot.xcr0 & 0x3) != 0x3) {
+        throw std::runtime_error("restore_snapshot: xcr0 not allowed");
+    }
+
+    uint32_t mxcsr{};
+    uint64_t xstate_bv{};
+    uint64_t xcomp_bv{};
+
+    std::memcpy(&mxcsr, xsave + s_mxcsr_offset, sizeof(mxcsr));
+    std::memcpy(&xstate_bv, xsave + s_xstate_bv_offset, sizeof(xstate_bv));
+    std::memcpy(&xcomp_bv, xsave + s_xcomp_bv_offset, sizeof(xcomp_bv));
+
+    if ((mxcsr & 0xFFFF0000) != 0 ||
+        (xstate_bv & ~snapshot.xcr0) != 0 ||
+        xcomp_bv != 0) {
+        throw std::runtime_error("restore_snapshot: invalid xsave area");
+    }
+
+    m_xcr0 = snapshot.xcr0;
+    std::memcpy(m_area.get(), xsave, VCPU_SNAPSHOT_XSAVE_SIZE);
+}
+
+void
+xstate_handler::isolate_xstate__on_world_switch(vcpu_t *vcpu)
+{
+    bfignored(vcpu);
+
+    // Note:
+    //
+    // Like the isolated MSRs, this function is executed on every world
+    // switch, and more than once per guest entry, so if this vCPU already
+    // owns the hardware, there is nothing to do. This means that VM exits
+    // that are handled without leaving the guest (and dom0 VM exits that
+    // do not run a guest) never touch the extended state.
+    //
+    // When ownership changes, the state of the previous owner is saved using
+    // XSAVEOPT, which is executed while the previous owner's XCR0 is still
+    // loaded. XSAVEOPT does not write state components that are in their
+    // init state (i.e., XINUSE is clear) and clears their XSTATE_BV bits
+    // instead, so that XRSTOR initializes them (which is cheaper than
+    // loading them) the next time the owner executes. If the previous owner
+    // was also the last vCPU restored on this physical CPU, components that
+    // have not been modified since are not written either.
+    //
+    // Only the managed state components are saved and restored. dom0 might
+    // have enabled other state components (e.g., PKRU), but a guest cannot
+    // enable these, and as a result, cannot modify them.
+    //
+
+    if (m_area == nullptr) {
+        return;
+    }
+
+    auto &loaded = this->loaded_xstate();
+
+    if (loaded.owner == this) {
+        return;
+    }
+
+    if (loaded.owner != nullptr) {
+        loaded.owner->save();
+    }
+
+    if (loaded.xcr0 != m_xcr0) {
+        ::intel_x64::xcr0::set(m_xcr0);
+        loaded.xcr0 = m_xcr0;
+    }
+
+    this->restore();
+    loaded.owner = this;
+}
+
+bool
+xstate_handler::handle_xsetbv(
+    vcpu_t *vcpu, bfvmm::intel_x64::xsetbv_handler::info_t &info)
+{
+    if (m_vcpu->is_dom0()) {
+        m_xcr0 = info.val;
+        m_loaded.xcr0 = info.val;
+
+        return true;
+    }
+
+    // Note:
+    //
+    // The guest can only enable the state components that its domain's
+    // XSAVE policy allows. On top of the architectural rules (x87 must be
+    // enabled, AVX needs SSE and AVX-512 needs AVX with all three of its
+    // components), SSE must be enabled as well, as XSAVE would otherwise not
+    // save the guest's XMM registers on a world switch. Every OS that
+    // enables XSAVE also enables SSE, so this is not a problem in practice.
+    //
+
+    auto val = info.val;
+    auto avx512 = val & 0xE0;
+
+    if (vcpu->rcx() != 0 ||
+        (val & ~m_xcr0_mask) != 0 ||
+        (val & 0x3) != 0x3 ||
+        (avx512 != 0 && avx512 != 0xE0) ||
+        (avx512 != 0 && (val & 0x4) == 0)) {
+
+        m_vcpu->inject_exception(13, 0);
+        info.ignore_write = true;
+        info.ignore_advance = true;
+
+        return true;
+    }
+
+    m_xcr0 = val;
+    this->loaded_xstate().xcr0 = val;
+
+    return true;
+}
+
+}
@@ -0,0 +1,102 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <benchmark/benchmark.h>
+#include <hve/arch/intel_x64/virt/vclock_math.h>
+
+using namespace boxy::intel_x64::vclock_math;
+
+// -----------------------------------------------------------------------------
+// Benchmarks
+// -----------------------------------------------------------------------------
+
+// Note:
+//
+// Compares the fixed-point conversion used by the vclock with the
+// Quotient Remainder conversion it replaced. The frequency and the input
+// are hidden from the compiler so that the divides by a constant are not
+// turned into multiplies, which the VMM cannot do either as the frequency
+// is only known at runtime.
+//
+
+static void
+bm_tsc_to_nsec_mul_div(benchmark::State &state)
+{
+    uint64_t freq = 2904000;
+    uint64_t tsc = 0x123456789ABULL;
+
+    benchmark::DoNotOptimize(freq);
+
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(tsc);
+        benchmark::DoNotOptimize(mul_div(tsc, 1000000, freq));
+        tsc += 9973;
+    }
+}
+BENCHMARK(bm_tsc_to_nsec_mul_div);
+
+static void
+bm_tsc_to_nsec_mul_shift(benchmark::State &state)
+{
+    uint64_t mult = tsc_to_nsec_mult(2904000);
+    uint64_t tsc = 0x123456789ABULL;
+
+    benchmark::DoNotOptimize(mult);
+
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(tsc);
+        benchmark::DoNotOptimize(mul_shift(tsc, mult));
+        tsc += 9973;
+    }
+}
+BENCHMARK(bm_tsc_to_nsec_mul_shift);
+
+static void
+bm_nsec_to_tsc_mul_div(benchmark::State &state)
+{
+    uint64_t freq = 2904000;
+    uint64_t nsec = 0x123456789ABULL;
+
+    benchmark::DoNotOptimize(freq);
+
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(nsec);
+        benchmark::DoNotOptimize(mul_div(nsec, freq, 1000000));
+        nsec += 9973;
+    }
+}
+BENCHMARK(bm_nsec_to_tsc_mul_div);
+
+static void
+bm_nsec_to_tsc_mul_shift(benchmark::State &state)
+{
+    uint64_t mult = nsec_to_tsc_mult(2904000);
+    uint64_t nsec = 0x123456789ABULL;
+
+    benchmark::DoNotOptimize(mult);
+
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(nsec);
+        benchmark::DoNotOptimize(mul_shift(nsec, mult));
+        nsec += 9973;
+    }
+}
+BENCHMARK(bm_nsec_to_tsc_mul_shift);
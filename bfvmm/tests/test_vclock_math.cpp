@@ -0,0 +1,151 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <gtest/gtest.h>
+#include <hve/arch/intel_x64/virt/vclock_math.h>
+
+#include <array>
+
+using namespace boxy::intel_x64::vclock_math;
+
+// -----------------------------------------------------------------------------
+// Helpers
+// -----------------------------------------------------------------------------
+
+// Note:
+//
+// TSC frequencies (in kHz) to test with. These include the frequencies
+// that calibrate_tsc_freq_khz() can compute from a crystal clock of 24MHz,
+// 25MHz and 19.2MHz, along with a few that do not divide evenly into a
+// nanosecond.
+//
+
+constexpr const std::array<uint64_t, 8> s_freqs = {
+    19200, 1000000, 1992000, 2400000, 2904000, 3000001, 3696969, 5000000
+};
+
+constexpr const uint64_t s_nsec_per_sec = 1000000000ULL;
+
+static uint64_t
+diff(uint64_t a, uint64_t b)
+{ return a > b ? a - b : b - a; }
+
+// Note:
+//
+// The multiplier is rounded, so it is off by at most 1/2 of 2^-32, and the
+// shift truncates, which is off by at most 1. The error of a conversion is
+// therefore at most 1 + x / 2^33, plus 1 for the truncation of mul_div.
+//
+
+static uint64_t
+max_error(uint64_t x)
+{ return 2 + (x >> (mult_shift + 1)); }
+
+// -----------------------------------------------------------------------------
+// Tests
+// -----------------------------------------------------------------------------
+
+TEST(vclock_math, mul_div)
+{
+    EXPECT_EQ(mul_div(0, 1000000, 2400000), 0U);
+    EXPECT_EQ(mul_div(2400000, 1000000, 2400000), 1000000U);
+    EXPECT_EQ(mul_div(~0ULL, 1, 1), ~0ULL);
+    EXPECT_EQ(mul_div(~0ULL / 1000, 1000, 1000000), (~0ULL / 1000) / 1000);
+}
+
+TEST(vclock_math, mul_shift)
+{
+    EXPECT_EQ(mul_shift(0, 1ULL << mult_shift), 0U);
+    EXPECT_EQ(mul_shift(42, 1ULL << mult_shift), 42U);
+    EXPECT_EQ(mul_shift(~0ULL, 1ULL << mult_shift), ~0ULL);
+    EXPECT_EQ(mul_shift(3, 1ULL << (mult_shift - 1)), 1U);
+}
+
+TEST(vclock_math, tsc_to_nsec_matches_mul_div)
+{
+    for (const auto freq : s_freqs) {
+        auto mult = tsc_to_nsec_mult(freq);
+
+        // Every interval up to the rebase period (one second), sampled
+        // using a stride that is not a multiple of the frequency.
+
+        for (uint64_t tsc = 0; tsc <= freq * 1000; tsc += 9973) {
+            auto expected = mul_div(tsc, 1000000, freq);
+            auto actual = mul_shift(tsc, mult);
+
+            ASSERT_LE(diff(expected, actual), max_error(tsc))
+                << "freq: " << freq << " tsc: " << tsc;
+        }
+    }
+}
+
+TEST(vclock_math, nsec_to_tsc_matches_mul_div)
+{
+    for (const auto freq : s_freqs) {
+        auto mult = nsec_to_tsc_mult(freq);
+
+        for (uint64_t nsec = 0; nsec <= s_nsec_per_sec; nsec += 99991) {
+            auto expected = mul_div(nsec, freq, 1000000);
+            auto actual = mul_shift(nsec, mult);
+
+            ASSERT_LE(diff(expected, actual), max_error(nsec))
+                << "freq: " << freq << " nsec: " << nsec;
+        }
+    }
+}
+
+TEST(vclock_math, error_is_bounded_over_a_rebase_period)
+{
+    // Note:
+    //
+    // The cached wallclock bases are rebased once they are a second old
+    // (see vclock_handler::rebase_wallclock), so this is the largest
+    // conversion done in practice. It must stay within a couple of
+    // nanoseconds.
+    //
+
+    for (const auto freq : s_freqs) {
+        auto tsc = freq * 1000;
+        auto nsec = mul_shift(tsc, tsc_to_nsec_mult(freq));
+
+        EXPECT_LE(diff(nsec, s_nsec_per_sec), 2U) << "freq: " << freq;
+    }
+}
+
+TEST(vclock_math, error_without_rebase)
+{
+    // Note:
+    //
+    // Without a rebase, the error grows with the interval. Over an hour it
+    // is still well under a microsecond, which is why a rebase once a
+    // second is enough to keep the guest and the VMM from drifting.
+    //
+
+    for (const auto freq : s_freqs) {
+        auto tsc = freq * 1000 * 3600;
+
+        auto expected = mul_div(tsc, 1000000, freq);
+        auto actual = mul_shift(tsc, tsc_to_nsec_mult(freq));
+
+        EXPECT_LE(diff(expected, actual), max_error(tsc)) << "freq: " << freq;
+        EXPECT_LT(diff(expected, actual), 1000U) << "freq: " << freq;
+    }
+}